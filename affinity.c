@@ -0,0 +1,290 @@
+/*
+ * affinity - CPU and NUMA placement of BUSE threads
+ *
+ * CPU sets are parsed into a cpu_set_t and applied with the pthread
+ * affinity calls, so no NUMA library is needed: the CPUs of a node and the
+ * node a device hangs off are read from sysfs. Threads started or confined
+ * here are noted in a small table that affinity_report prints once the
+ * server is up; confined threads started after that are printed as they
+ * start.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "affinity.h"
+
+#define MAX_NOTED 1024 // threads remembered for affinity_report
+#define MAX_NODES 64   // NUMA nodes looked at when reporting
+
+struct noted
+{
+    pthread_t thread;
+    char name[64];
+};
+
+static pthread_mutex_t noted_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct noted noted[MAX_NOTED];
+static int nnoted;
+static bool confined; // some thread was given a CPU set
+static bool reported; // affinity_report has run
+static const char *background_cpus; // see affinity_background
+
+/* Parse a list like "0-3,8" into `set`. Returns 0 or -EINVAL. */
+static int parse_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10), last = first;
+        if (end == p)
+            return -EINVAL;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first)
+                return -EINVAL;
+        }
+        if (last >= CPU_SETSIZE)
+            return -EINVAL;
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/* The CPUs of NUMA node `node`. Returns 0, or -ENOENT if there is no such
+ * node. */
+static int node_cpus(int node, cpu_set_t *set)
+{
+    char path[64], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -ENOENT;
+    bool ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+    return ok ? parse_list(list, set) : -ENOENT;
+}
+
+/* Read a number from a sysfs file, or return -1. */
+static int read_int(const char *path)
+{
+    int value = -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%d", &value) != 1)
+        value = -1;
+    fclose(f);
+    return value;
+}
+
+/* The NUMA node `path` is attached to: that of the block device itself,
+ * or, for a file, of the device its file system is on. -1 if the kernel
+ * doesn't say, as for virtual devices and on machines with one node. */
+static int device_node(const char *path)
+{
+    static const char *const where[] = {
+        "device/numa_node",        // a whole disk: the controller
+        "../device/numa_node",     // a partition: its disk's controller
+        "device/device/numa_node", // an NVMe namespace: the PCI function
+    };
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    for (size_t i = 0; i < sizeof(where) / sizeof(where[0]); i++)
+    {
+        char attr[128];
+        snprintf(attr, sizeof(attr), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), where[i]);
+        int node = read_int(attr);
+        if (node >= 0)
+            return node;
+    }
+    return -1;
+}
+
+/* Turn `spec` into a CPU set. Returns 1 if the thread should be confined
+ * to `set`, 0 if it may run anywhere ("near" a device of unknown node), or
+ * a negative errno value. */
+static int resolve(const char *spec, const char *device, cpu_set_t *set)
+{
+    int err;
+    if (strcmp(spec, "near") == 0)
+    {
+        int node = device != NULL ? device_node(device) : -1;
+        if (node < 0)
+            return 0;
+        err = node_cpus(node, set);
+    }
+    else if (strncmp(spec, "node:", 5) == 0)
+    {
+        char *end;
+        long node = strtol(spec + 5, &end, 10);
+        if (end == spec + 5 || *end != '\0' || node < 0)
+            return -EINVAL;
+        err = node_cpus(node, set);
+    }
+    else
+        err = parse_list(spec, set);
+    if (err < 0)
+        return err;
+
+    // drop CPUs this process may not use, as cpusets and taskset restrict it
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        CPU_AND(set, set, &allowed);
+    return CPU_COUNT(set) > 0 ? 1 : -EINVAL;
+}
+
+/* Format `set` as a list like "0-3,8". */
+static void format_list(const cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        if (last == cpu)
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+        else
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+/* Print the CPUs and NUMA nodes `thread` may run on, unless it has exited. */
+static void print_thread(pthread_t thread, const char *name)
+{
+    cpu_set_t set, node;
+    char cpus[256], where[256];
+    size_t len = 0;
+    if (pthread_getaffinity_np(thread, sizeof(set), &set) != 0)
+        return; // it has already exited
+    format_list(&set, cpus, sizeof(cpus));
+    where[0] = '\0';
+    for (int n = 0; n < MAX_NODES && len < sizeof(where); n++)
+    {
+        if (node_cpus(n, &node) != 0)
+            continue;
+        CPU_AND(&node, &node, &set);
+        if (CPU_COUNT(&node) > 0)
+            len += snprintf(where + len, sizeof(where) - len, "%s%d", len ? "," : "", n);
+    }
+    fprintf(stderr, "affinity: %s on CPUs %s (node%s %s)\n", name, cpus, strchr(where, ',') ? "s" : "",
+            len ? where : "unknown");
+}
+
+static void note(pthread_t thread, const char *name, bool pinned)
+{
+    pthread_mutex_lock(&noted_lock);
+    bool late = reported;
+    if (!late && nnoted < MAX_NOTED)
+    {
+        noted[nnoted].thread = thread;
+        snprintf(noted[nnoted].name, sizeof(noted[nnoted].name), "%s", name);
+        nnoted++;
+    }
+    confined |= pinned;
+    pthread_mutex_unlock(&noted_lock);
+    if (late && pinned)
+        print_thread(thread, name);
+}
+
+int affinity_check(const char *spec, bool near_ok)
+{
+    cpu_set_t set;
+    if (strcmp(spec, "near") == 0)
+        return near_ok ? 0 : -EINVAL;
+    int err = resolve(spec, NULL, &set);
+    return err < 0 ? err : 0;
+}
+
+int affinity_thread(pthread_t *thread, const char *spec, const char *device, const char *name,
+                    void *(*start)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    cpu_set_t set;
+    int pinned = 0;
+
+    pthread_attr_init(&attr);
+    if (spec != NULL)
+    {
+        pinned = resolve(spec, device, &set);
+        if (pinned < 0)
+        {
+            pthread_attr_destroy(&attr);
+            return -pinned;
+        }
+        if (pinned)
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int err = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    if (err == 0)
+        note(*thread, name, pinned > 0);
+    return err;
+}
+
+void affinity_background(const char *spec)
+{
+    background_cpus = spec;
+}
+
+int affinity_background_thread(pthread_t *thread, const char *name, void *(*start)(void *), void *arg)
+{
+    return affinity_thread(thread, background_cpus, NULL, name, start, arg);
+}
+
+int affinity_self(const char *spec, const char *name)
+{
+    cpu_set_t set;
+    int pinned = 0;
+    if (spec != NULL)
+    {
+        pinned = resolve(spec, NULL, &set);
+        if (pinned < 0)
+            return pinned;
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            return -err;
+    }
+    note(pthread_self(), name, pinned > 0);
+    return 0;
+}
+
+void affinity_report(void)
+{
+    pthread_mutex_lock(&noted_lock);
+    for (int i = 0; confined && i < nnoted; i++)
+        print_thread(noted[i].thread, noted[i].name);
+    nnoted = 0;
+    confined = false;
+    reported = true;
+    pthread_mutex_unlock(&noted_lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * affinity - CPU and NUMA placement of BUSE threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef AFFINITY_H_INCLUDED
+#define AFFINITY_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Threads are confined to a set of CPUs given as a list like "0-3,8,10-11",
+ * or "node:N" for the CPUs of NUMA node N, or, for a thread serving one
+ * device, "near" for the CPUs of the NUMA node the device is attached to.
+ * A confined thread allocates its scratch memory (arena.c) itself and
+ * touches it first, so with the kernel's default policy it lands on the
+ * thread's node. */
+
+/* 0 if `spec` is a valid CPU set (with "near" only if `near_ok`) that has a
+ * CPU this process may run on, else a negative errno value. */
+int affinity_check(const char *spec, bool near_ok);
+
+/* pthread_create, with the new thread confined to `spec` from its first
+ * instruction unless `spec` is NULL. For "near", `device` is the path of
+ * the device; if its node can't be found, the thread runs anywhere. The
+ * thread is noted as `name` for affinity_report. */
+int affinity_thread(pthread_t *thread, const char *spec, const char *device, const char *name,
+                    void *(*start)(void *), void *arg);
+
+/* Set the CPUs of background threads: destaging, read-ahead, rebuilds,
+ * scrubs and reshapes. Engines give it the set of the server threads;
+ * NULL, the default, lets them run anywhere. */
+void affinity_background(const char *spec);
+
+/* affinity_thread for a background thread, on the CPUs set with
+ * affinity_background. */
+int affinity_background_thread(pthread_t *thread, const char *name, void *(*start)(void *), void *arg);
+
+/* Confine the calling thread to `spec` and note it as `name`. Returns 0 or
+ * a negative errno value. */
+int affinity_self(const char *spec, const char *name);
+
+/* Print which CPUs and NUMA nodes each noted thread may run on, to
+ * stderr, and forget them. Prints nothing if no thread was confined.
+ * Confined threads started afterwards are printed as they start. */
+void affinity_report(void);
+
+#endif /* AFFINITY_H_INCLUDED */
@@ -0,0 +1,98 @@
+/*
+ * arena - per-thread scratch memory for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "member.h"
+
+// a take that didn't fit, freed when its mark is released
+struct arena_spill
+{
+    struct arena_spill *next;
+    void *buf;
+};
+
+static size_t arena_size;   // bytes per thread, set by arena_setup
+static size_t page;         // alignment of every take
+static unsigned long spills; // takes that didn't fit, over all threads
+
+static __thread char *base; // this thread's arena, NULL until first used
+static __thread size_t used;
+static __thread struct arena_spill *spilled; // newest first
+
+void arena_setup(size_t size)
+{
+    long p = sysconf(_SC_PAGESIZE);
+    page = p > 0 ? (size_t)p : 4096;
+    arena_size = (size + page - 1) / page * page;
+}
+
+struct arena_mark arena_mark(void)
+{
+    struct arena_mark m = {used, spilled};
+    return m;
+}
+
+void *arena_take(size_t len)
+{
+    if (page == 0)
+        arena_setup(0);
+    len = (len + page - 1) / page * page;
+    if (base == NULL && arena_size > 0)
+    {
+        base = member_alloc(arena_size); // if this fails, every take spills
+        // fault it in here, on the NUMA node this thread is confined to
+        if (base != NULL)
+            memset(base, 0, arena_size);
+    }
+    if (base != NULL && len <= arena_size - used)
+    {
+        void *p = base + used;
+        used += len;
+        return p;
+    }
+
+    struct arena_spill *s = malloc(sizeof(*s));
+    if (s == NULL)
+        return NULL;
+    s->buf = member_alloc(len);
+    if (s->buf == NULL)
+    {
+        free(s);
+        return NULL;
+    }
+    s->next = spilled;
+    spilled = s;
+    __atomic_add_fetch(&spills, 1, __ATOMIC_RELAXED);
+    return s->buf;
+}
+
+void arena_release(struct arena_mark mark)
+{
+    while (spilled != mark.spill)
+    {
+        struct arena_spill *s = spilled;
+        spilled = s->next;
+        free(s->buf);
+        free(s);
+    }
+    used = mark.used;
+}
+
+void arena_report(void)
+{
+    fprintf(stderr, "Scratch arena: %zu KiB per thread, %lu takes didn't fit.\n", arena_size >> 10,
+            __atomic_load_n(&spills, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,54 @@
+/*
+ * arena - per-thread scratch memory for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+/* Each thread serving requests gets one page-aligned region, sized once at
+ * startup and allocated the first time the thread asks for scratch space.
+ * A request takes its buffers from it and hands them all back when it is
+ * done, so chunks of megabytes need neither the stack nor a malloc per
+ * request:
+ *
+ *     struct arena_mark m = arena_mark();
+ *     char *old = arena_take(block_size), *parity = arena_take(block_size);
+ *     ...
+ *     arena_release(m);
+ *
+ * Marks nest, so a helper may take and release its own buffers while its
+ * caller holds others. */
+struct arena_spill;
+
+struct arena_mark
+{
+    size_t used;
+    struct arena_spill *spill;
+};
+
+/* Size every thread's arena. Call before any thread takes from it. */
+void arena_setup(size_t size);
+
+/* This thread's position, to return to with arena_release. */
+struct arena_mark arena_mark(void);
+
+/* `len` bytes, page aligned (so usable for O_DIRECT), valid until a mark
+ * taken before them is released. A take that doesn't fit in what is left is
+ * allocated separately and freed by the release, so undersizing the arena
+ * only costs speed. Returns NULL if memory runs out. */
+void *arena_take(size_t len);
+
+/* Give back everything taken since `mark`. */
+void arena_release(struct arena_mark mark);
+
+/* Print the arena size and how often takes didn't fit, to stderr. */
+void arena_report(void);
+
+#endif /* ARENA_H_INCLUDED */
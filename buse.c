@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <linux/nbd.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,13 +33,33 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "affinity.h"
+#include "ring.h"
 
 #ifndef BUSE_DEBUG
-#define BUSE_DEBUG (1)
+#define BUSE_DEBUG (0) /* build with -DBUSE_DEBUG=1 to trace every request */
+#endif
+
+/* Older linux/nbd.h headers lack these; the values are fixed by the protocol. */
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#endif
+#ifndef NBD_CMD_WRITE_ZEROES
+#define NBD_CMD_WRITE_ZEROES 6
+#endif
+#ifndef NBD_FLAG_SEND_FUA
+#define NBD_FLAG_SEND_FUA (1 << 3)
+#endif
+#ifndef NBD_CMD_FLAG_FUA
+#define NBD_CMD_FLAG_FUA (1 << 16)
+#endif
+#ifndef NBD_CMD_MASK_COMMAND
+#define NBD_CMD_MASK_COMMAND 0x0000ffff
 #endif
 
 /*
@@ -63,33 +84,38 @@ u_int64_t ntohll(u_int64_t a)
 
 static int read_all(int fd, char *buf, size_t count)
 {
-  int bytes_read;
+  ssize_t bytes_read;
 
   while (count > 0)
   {
     bytes_read = read(fd, buf, count);
-    assert(bytes_read > 0);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
     buf += bytes_read;
     count -= bytes_read;
   }
-  assert(count == 0);
 
   return 0;
 }
 
-static int write_all(int fd, char *buf, size_t count)
+/* Callbacks may return errno values with either sign; NBD wants them
+ * positive and in network byte order. */
+static u_int32_t nbd_error(int err)
 {
-  int bytes_written;
+  return htonl(err < 0 ? -err : err);
+}
 
-  while (count > 0)
-  {
-    bytes_written = write(fd, buf, count);
-    assert(bytes_written > 0);
-    buf += bytes_written;
-    count -= bytes_written;
-  }
-  assert(count == 0);
+/* The device buse_main is serving, for buse_set_size. */
+static int nbd_dev = -1;
 
+int buse_set_size(u_int64_t size)
+{
+  if (nbd_dev == -1)
+    return -ENODEV;
+  if (ioctl(nbd_dev, NBD_SET_SIZE, size) == -1)
+    return -errno;
   return 0;
 }
 
@@ -124,113 +150,697 @@ static int set_sigaction(int sig, const struct sigaction *act)
   return r;
 }
 
-/* Serve userland side of nbd socket. If everything worked ok, return 0. */
-static int serve_nbd(int sk, const struct buse_operations *aop, void *userdata)
+/* Replies are gathered and sent with one writev per batch. */
+#define TX_REPLIES 512          /* two iovecs each keeps a batch within IOV_MAX */
+#define TX_BYTES (8 << 20)      /* read payload held back before sending early */
+
+struct tx_batch
+{
+  struct nbd_reply reply[TX_REPLIES];
+  struct iovec iov[2 * TX_REPLIES];
+  void *data[TX_REPLIES]; /* read payloads, freed once sent */
+  int n;
+  int niov;
+  size_t bytes;
+};
+
+/* Send every iovec, which are advanced past what was sent. */
+static int writev_all(int sk, struct iovec *iov, int niov)
+{
+  while (niov > 0)
+  {
+    ssize_t w = writev(sk, iov, niov);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return -1;
+    /* skip what was sent; a short write can end inside an iovec */
+    while (niov > 0 && (size_t)w >= iov->iov_len)
+    {
+      w -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+static int tx_flush(int sk, struct tx_batch *tx)
+{
+  int err = writev_all(sk, tx->iov, tx->niov);
+
+  for (int i = 0; i < tx->n; i++)
+    free(tx->data[i]);
+  tx->n = 0;
+  tx->niov = 0;
+  tx->bytes = 0;
+  return err;
+}
+
+/* Queue a reply; `data` (len bytes, may be NULL) is owned by the batch. */
+static int tx_reply(int sk, struct tx_batch *tx, const char *handle, u_int32_t error, void *data, u_int32_t len)
+{
+  if ((tx->n == TX_REPLIES || tx->bytes + len > TX_BYTES) && tx_flush(sk, tx) != 0)
+  {
+    free(data);
+    return -1;
+  }
+  struct nbd_reply *reply = &tx->reply[tx->n];
+  reply->magic = htonl(NBD_REPLY_MAGIC);
+  reply->error = error;
+  memcpy(reply->handle, handle, sizeof(reply->handle));
+  tx->iov[tx->niov].iov_base = reply;
+  tx->iov[tx->niov++].iov_len = sizeof(*reply);
+  /* the kernel reads no payload after an error */
+  if (data != NULL && error == 0 && len > 0)
+  {
+    tx->iov[tx->niov].iov_base = data;
+    tx->iov[tx->niov++].iov_len = len;
+    tx->bytes += len;
+  }
+  tx->data[tx->n++] = data;
+  return 0;
+}
+
+static int do_read(const struct buse_operations *aop, void *buf, u_int32_t len, u_int64_t from, u_int32_t flags,
+                   void *userdata)
+{
+  if (aop->read_flags)
+    return aop->read_flags(buf, len, from, flags, userdata);
+  if (aop->read)
+    return aop->read(buf, len, from, userdata);
+  return EPERM; /* If user not specified read operation, return EPERM error */
+}
+
+static int do_write(const struct buse_operations *aop, const void *buf, u_int32_t len, u_int64_t from,
+                    u_int32_t flags, void *userdata)
+{
+  if (aop->write_flags)
+    return aop->write_flags(buf, len, from, flags, userdata);
+  if (aop->write)
+  {
+    int r = aop->write(buf, len, from, userdata);
+    /* FUA is not advertised then, but honour it if it shows up anyway */
+    if (r == 0 && (flags & BUSE_WRITE_FUA) && !(flags & BUSE_SEG_MORE) && aop->flush)
+      r = aop->flush(userdata);
+    return r;
+  }
+  return EPERM; /* If user not specified write operation, return EPERM error */
+}
+
+/* Streaming of requests longer than a segment, through one buffer. */
+struct stream
+{
+  char *buf;
+  u_int32_t size;
+};
+
+/* Bytes of the segment starting at `from`, which ends at the next multiple
+ * of the segment size or with the request. */
+static u_int32_t seg_len(const struct stream *st, u_int64_t from, u_int32_t left)
+{
+  u_int32_t n = st->size - from % st->size;
+  return n < left ? n : left;
+}
+
+/* Write `len` bytes at `from` a segment at a time. The first `avail` bytes
+ * of the payload are already in `buffered`; the rest is received from the
+ * socket one segment at a time. After a failed segment the rest of the
+ * payload is still received, but dropped. Returns the first error from the
+ * program, or sets *sock_err if the socket fails. */
+static int stream_write(int sk, struct stream *st, const struct buse_operations *aop, void *userdata,
+                        const char *buffered, size_t avail, u_int32_t len, u_int64_t from, u_int32_t flags,
+                        int *sock_err)
+{
+  int err = 0;
+
+  for (u_int32_t done = 0; done < len;)
+  {
+    u_int32_t n = seg_len(st, from + done, len - done);
+    const char *data;
+    if (avail >= n)
+    {
+      data = buffered; /* all of it arrived with the request */
+      buffered += n;
+      avail -= n;
+    }
+    else
+    {
+      memcpy(st->buf, buffered, avail);
+      if (read_all(sk, st->buf + avail, n - avail) != 0)
+      {
+        *sock_err = -1;
+        return err;
+      }
+      data = st->buf;
+      avail = 0;
+    }
+    done += n;
+    if (err == 0)
+      err = do_write(aop, data, n, from + done - n, flags | (done < len ? BUSE_SEG_MORE : 0), userdata);
+  }
+  return err;
+}
+
+/* Read `len` bytes at `from` a segment at a time, sending each as soon as it
+ * has been read, so the kernel takes it in while the next one is read. An
+ * error in the first segment is replied to as usual. After that the reply
+ * has started and can't carry an error, so the connection is dropped. The
+ * replies queued in `tx` go out first. Returns -1 with a warning if the
+ * socket fails or the connection has to be dropped. */
+static int stream_read(int sk, struct stream *st, struct tx_batch *tx, const struct buse_operations *aop,
+                       void *userdata, const char *handle, u_int32_t len, u_int64_t from)
+{
+  struct nbd_reply reply;
+
+  if (tx_flush(sk, tx) != 0)
+  {
+    warn("error writing userside of nbd socket");
+    return -1;
+  }
+  for (u_int32_t done = 0; done < len;)
+  {
+    u_int32_t n = seg_len(st, from + done, len - done);
+    int r = do_read(aop, st->buf, n, from + done, done + n < len ? BUSE_SEG_MORE : 0, userdata);
+    if (r != 0 && done == 0)
+    {
+      if (tx_reply(sk, tx, handle, nbd_error(r), NULL, 0) == 0)
+        return 0;
+      warn("error writing userside of nbd socket");
+      return -1;
+    }
+    if (r != 0)
+    {
+      warnx("read of %u bytes at %lu failed after its reply was started; dropping the connection", len, from);
+      return -1;
+    }
+    struct iovec iov[2] = {{&reply, sizeof(reply)}, {st->buf, n}};
+    int niov = 2;
+    if (done == 0)
+    {
+      reply.magic = htonl(NBD_REPLY_MAGIC);
+      reply.error = htonl(0);
+      memcpy(reply.handle, handle, sizeof(reply.handle));
+    }
+    else
+    {
+      iov[0] = iov[1];
+      niov = 1;
+    }
+    if (writev_all(sk, iov, niov) != 0)
+    {
+      warn("error writing userside of nbd socket");
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/* With aop->workers set, the thread reading the socket hands requests to
+ * worker threads through one single-producer ring each, round robin and a
+ * batch at a time, and the workers hand them on, done, to a thread sending
+ * the replies through one multi-producer ring. Requests that can't be
+ * handed out (streamed ones, disconnects, unknown commands) wait until
+ * every reply before them has been sent, then are handled by the reading
+ * thread, which is then the only one writing to the socket. */
+#define POOL_DEPTH 256 /* requests queued per worker */
+#define POOL_BATCH 32  /* requests moved per ring operation */
+
+struct job
 {
+  char handle[8];
+  u_int32_t type;
+  u_int32_t flags;
   u_int64_t from;
   u_int32_t len;
-  ssize_t bytes_read;
-  struct nbd_request request;
-  struct nbd_reply reply;
-  void *chunk;
+  u_int32_t error; /* network byte order */
+  char *data;      /* read or write payload */
+};
 
-  reply.magic = htonl(NBD_REPLY_MAGIC);
-  reply.error = htonl(0);
+struct worker
+{
+  struct pool *pool;
+  struct ring *queue;
+  pthread_t thread;
+  struct job *pending[POOL_BATCH]; /* not handed over yet */
+  int npending;
+};
+
+struct pool
+{
+  const struct buse_operations *aop;
+  void *userdata;
+  int sk;
+  struct worker *worker;
+  int workers;
+  int next; /* the worker the next request goes to */
+  struct ring *done;
+  pthread_t sender;
+  struct tx_batch *tx; /* the sender's replies */
+  unsigned long in_flight; /* handed out, reply not sent yet */
+  pthread_mutex_t lock;    /* for waiting until in_flight drops to 0 */
+  pthread_cond_t idle;
+  int failed; /* the sender couldn't write to the socket */
+};
+
+static void run_job(struct pool *p, struct job *job)
+{
+  const struct buse_operations *aop = p->aop;
+  int r;
 
-  while ((bytes_read = read(sk, &request, sizeof(request))) > 0)
+  switch (job->type)
   {
-    assert(bytes_read == sizeof(request));
-    memcpy(reply.handle, request.handle, sizeof(reply.handle));
-    reply.error = htonl(0);
+  case NBD_CMD_READ:
+    r = do_read(aop, job->data, job->len, job->from, 0, p->userdata);
+    break;
+  case NBD_CMD_WRITE:
+    r = do_write(aop, job->data, job->len, job->from, job->flags, p->userdata);
+    break;
+  case NBD_CMD_FLUSH:
+    r = aop->flush ? aop->flush(p->userdata) : 0;
+    break;
+  case NBD_CMD_TRIM:
+    r = aop->trim ? aop->trim(job->from, job->len, p->userdata) : 0;
+    break;
+  default: /* NBD_CMD_WRITE_ZEROES */
+    r = aop->write_zeroes ? aop->write_zeroes(job->from, job->len, p->userdata) : EPERM;
+  }
+  job->error = nbd_error(r);
+}
 
-    len = ntohl(request.len);
-    from = ntohll(request.from);
-    assert(request.magic == htonl(NBD_REQUEST_MAGIC));
+static void *pool_work(void *arg)
+{
+  struct worker *w = arg;
+  struct job *job[POOL_BATCH];
+  unsigned int n;
 
-    switch (ntohl(request.type))
+  while ((n = ring_wait(w->queue, (void **)job, POOL_BATCH)) > 0)
+  {
+    for (unsigned int i = 0; i < n; i++)
+      run_job(w->pool, job[i]);
+    ring_put(w->pool->done, (void *const *)job, n);
+  }
+  return NULL;
+}
+
+/* Reply to requests as they complete, a batch per writev while they keep
+ * coming. A request only stops counting as in flight once its reply has
+ * been written. */
+static void *pool_send(void *arg)
+{
+  struct pool *p = arg;
+  struct tx_batch *tx = p->tx;
+  struct job *job[POOL_BATCH];
+  unsigned long unsent = 0;
+
+  for (;;)
+  {
+    unsigned int n = ring_dequeue(p->done, (void **)job, POOL_BATCH);
+    if (n == 0)
     {
-      /* I may at some point need to deal with the the fact that the
-       * official nbd server has a maximum buffer size, and divides up
-       * oversized requests into multiple pieces. This applies to reads
-       * and writes.
-       */
-    case NBD_CMD_READ:
-      if (BUSE_DEBUG)
-        fprintf(stderr, "Request for read of size %d on offset %d\n", len, from);
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read)
+      if (tx_flush(p->sk, tx) != 0 && !p->failed)
       {
-        reply.error = aop->read(chunk, len, from, userdata);
+        warn("error writing userside of nbd socket");
+        p->failed = 1;
+        shutdown(p->sk, SHUT_RDWR); /* stops the reading thread too */
       }
-      else
+      if (unsent > 0 && __atomic_sub_fetch(&p->in_flight, unsent, __ATOMIC_ACQ_REL) == 0)
       {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->idle);
+        pthread_mutex_unlock(&p->lock);
       }
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char *)chunk, len);
-
-      free(chunk);
-      break;
-    case NBD_CMD_WRITE:
-      if (BUSE_DEBUG)
-        fprintf(stderr, "Request for write of size %d on offset %d\n", len, from);
-      chunk = malloc(len);
-      read_all(sk, chunk, len);
-      if (aop->write)
+      unsent = 0;
+      n = ring_wait(p->done, (void **)job, POOL_BATCH);
+      if (n == 0)
+        break;
+    }
+    for (unsigned int i = 0; i < n; i++)
+    {
+      int read = job[i]->type == NBD_CMD_READ;
+      if (p->failed)
+        free(job[i]->data);
+      else if (tx_reply(p->sk, tx, job[i]->handle, job[i]->error, read ? job[i]->data : NULL, job[i]->len) != 0)
       {
-        reply.error = aop->write(chunk, len, from, userdata);
+        warn("error writing userside of nbd socket");
+        p->failed = 1;
+        shutdown(p->sk, SHUT_RDWR);
       }
-      else
+      if (!read)
+        free(job[i]->data);
+      free(job[i]);
+    }
+    unsent += n;
+  }
+  return NULL;
+}
+
+static int pool_stop(struct pool *p);
+
+static struct pool *pool_start(int sk, const struct buse_operations *aop, void *userdata)
+{
+  struct pool *p = calloc(1, sizeof(*p));
+  if (p == NULL)
+    return NULL;
+  p->aop = aop;
+  p->userdata = userdata;
+  p->sk = sk;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->idle, NULL);
+  p->worker = calloc(aop->workers, sizeof(*p->worker));
+  p->done = ring_create(POOL_DEPTH * aop->workers, 1);
+  p->tx = calloc(1, sizeof(*p->tx));
+  if (p->worker == NULL || p->done == NULL || p->tx == NULL ||
+      affinity_thread(&p->sender, aop->server_cpus, NULL, "sender", pool_send, p) != 0)
+  {
+    ring_destroy(p->done);
+    free(p->tx);
+    free(p->worker);
+    free(p);
+    return NULL;
+  }
+  for (u_int32_t i = 0; i < aop->workers; i++)
+  {
+    struct worker *w = &p->worker[i];
+    w->pool = p;
+    char name[32];
+    snprintf(name, sizeof(name), "worker %u", i);
+    w->queue = ring_create(POOL_DEPTH, 0);
+    if (w->queue == NULL || affinity_thread(&w->thread, aop->worker_cpus, NULL, name, pool_work, w) != 0)
+    {
+      ring_destroy(w->queue);
+      pool_stop(p);
+      return NULL;
+    }
+    p->workers++;
+  }
+  return p;
+}
+
+/* Hand over the requests gathered for each worker. */
+static void pool_kick(struct pool *p)
+{
+  for (int i = 0; i < p->workers; i++)
+  {
+    struct worker *w = &p->worker[i];
+    if (w->npending > 0)
+      ring_put(w->queue, (void *const *)w->pending, w->npending);
+    w->npending = 0;
+  }
+}
+
+/* Queue a request for the next worker. The first `avail` bytes of a write's
+ * payload are in `buffered`, the rest still in the socket. Returns -1 if
+ * memory runs out or the socket fails. */
+static int pool_submit(struct pool *p, const struct nbd_request *request, u_int32_t type, u_int32_t flags,
+                       u_int64_t from, u_int32_t len, const char *buffered, size_t avail)
+{
+  struct job *job = malloc(sizeof(*job));
+  int data = type == NBD_CMD_READ || type == NBD_CMD_WRITE;
+
+  if (job == NULL)
+    return -1;
+  memcpy(job->handle, request->handle, sizeof(job->handle));
+  job->type = type;
+  job->flags = flags;
+  job->from = from;
+  job->len = len;
+  job->data = data ? malloc(len > 0 ? len : 1) : NULL;
+  if (data && job->data == NULL)
+  {
+    free(job);
+    return -1;
+  }
+  if (type == NBD_CMD_WRITE)
+  {
+    memcpy(job->data, buffered, avail);
+    if (avail < len && read_all(p->sk, job->data + avail, len - avail) != 0)
+    {
+      free(job->data);
+      free(job);
+      return -1;
+    }
+  }
+
+  struct worker *w = &p->worker[p->next];
+  p->next = (p->next + 1) % p->workers;
+  __atomic_add_fetch(&p->in_flight, 1, __ATOMIC_RELAXED);
+  w->pending[w->npending++] = job;
+  if (w->npending == POOL_BATCH)
+    pool_kick(p);
+  return 0;
+}
+
+/* Hand over what is gathered and wait until every reply has been sent. */
+static void pool_drain(struct pool *p)
+{
+  pool_kick(p);
+  pthread_mutex_lock(&p->lock);
+  while (__atomic_load_n(&p->in_flight, __ATOMIC_ACQUIRE) > 0)
+    pthread_cond_wait(&p->idle, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Finish what was handed out and stop the threads. Returns -1 if replies
+ * couldn't be sent. */
+static int pool_stop(struct pool *p)
+{
+  pool_kick(p);
+  for (int i = 0; i < p->workers; i++)
+  {
+    ring_close(p->worker[i].queue);
+    pthread_join(p->worker[i].thread, NULL);
+    ring_destroy(p->worker[i].queue);
+  }
+  ring_close(p->done);
+  pthread_join(p->sender, NULL);
+  ring_destroy(p->done);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->idle);
+  int failed = p->failed;
+  free(p->tx);
+  free(p->worker);
+  free(p);
+  return failed ? -1 : 0;
+}
+
+/* Requests are parsed out of a receive buffer filled by as few recv calls as
+ * the kernel allows; every complete request in it is handled before the
+ * replies go out together and the socket is read again. */
+#define RX_BUF_SIZE (1 << 20)
+
+/* Serve userland side of nbd socket. If everything worked ok, return 0. */
+static int serve_nbd(int sk, const struct buse_operations *aop, void *userdata)
+{
+  /* First, so the buffers below are touched first on the server's node. */
+  if (affinity_self(aop->server_cpus, "server") != 0)
+    warnx("failed to confine the server to CPUs %s", aop->server_cpus);
+
+  char *rx = malloc(RX_BUF_SIZE);
+  struct tx_batch *tx = calloc(1, sizeof(*tx));
+  struct stream st = {.size = aop->segment ? aop->segment : RX_BUF_SIZE};
+  size_t head = 0; /* rx[head, tail) holds bytes not yet parsed */
+  size_t tail = 0;
+  int status = EXIT_SUCCESS;
+
+  st.buf = malloc(st.size);
+  if (rx == NULL || tx == NULL || st.buf == NULL)
+  {
+    warn("failed to allocate nbd socket buffers");
+    free(rx);
+    free(tx);
+    free(st.buf);
+    return EXIT_FAILURE;
+  }
+  struct pool *pool = NULL;
+  if (aop->workers > 0 && (pool = pool_start(sk, aop, userdata)) == NULL)
+  {
+    warnx("failed to start %u worker threads", aop->workers);
+    free(rx);
+    free(tx);
+    free(st.buf);
+    return EXIT_FAILURE;
+  }
+  affinity_report();
+
+  for (;;)
+  {
+    while (tail - head >= sizeof(struct nbd_request))
+    {
+      struct nbd_request request;
+      memcpy(&request, rx + head, sizeof(request));
+      assert(request.magic == htonl(NBD_REQUEST_MAGIC));
+
+      u_int32_t len = ntohl(request.len);
+      u_int64_t from = ntohll(request.from);
+      u_int32_t type = ntohl(request.type); /* command flags live in the upper bits */
+      u_int32_t flags = (type & NBD_CMD_FLAG_FUA) ? BUSE_WRITE_FUA : 0;
+      size_t consumed = sizeof(request);
+      size_t avail = 0; /* write payload bytes already in rx */
+      void *chunk = NULL;
+      u_int32_t error = htonl(0);
+      int sock_err = 0;
+
+      if ((type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE)
       {
-        /* If user not specified write operation, return EPERM error */
-        reply.error = htonl(EPERM);
+        avail = tail - head - sizeof(request);
+        if (avail >= len)
+          avail = len;
+        else if (sizeof(request) + len <= RX_BUF_SIZE)
+          break; /* wait for the rest of the payload */
+        /* else larger than the receive buffer: the rest is streamed in */
+        consumed += avail;
       }
-      free(chunk);
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
-      break;
-    case NBD_CMD_DISC:
-      if (BUSE_DEBUG)
-        fprintf(stderr, "Got NBD_CMD_DISC\n");
-      /* Handle a disconnect request. */
-      if (aop->disc)
+      head += consumed;
+
+      if (pool != NULL)
       {
-        aop->disc(userdata);
+        u_int32_t cmd = type & NBD_CMD_MASK_COMMAND;
+        if (((cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) && len <= st.size) || cmd == NBD_CMD_FLUSH ||
+            cmd == NBD_CMD_TRIM || cmd == NBD_CMD_WRITE_ZEROES)
+        {
+          if (pool_submit(pool, &request, cmd, flags, from, len, rx + head - avail, avail) != 0)
+          {
+            warn("error handing a request to the workers");
+            status = EXIT_FAILURE;
+            goto out;
+          }
+          continue;
+        }
+        pool_drain(pool); /* the socket is ours until this one is answered */
       }
-      return EXIT_SUCCESS;
-#ifdef NBD_FLAG_SEND_FLUSH
-    case NBD_CMD_FLUSH:
-      if (BUSE_DEBUG)
-        fprintf(stderr, "Got NBD_CMD_FLUSH\n");
-      if (aop->flush)
+
+      switch (type & NBD_CMD_MASK_COMMAND)
       {
-        reply.error = aop->flush(userdata);
-      }
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
-      break;
+      case NBD_CMD_READ:
+        if (BUSE_DEBUG)
+          fprintf(stderr, "Request for read of size %u on offset %lu\n", len, from);
+        if (len > st.size)
+        {
+          if (stream_read(sk, &st, tx, aop, userdata, request.handle, len, from) != 0 ||
+              (pool != NULL && tx_flush(sk, tx) != 0))
+          {
+            status = EXIT_FAILURE;
+            goto out;
+          }
+          continue; /* replied to already */
+        }
+        chunk = malloc(len);
+        if (chunk == NULL)
+          error = htonl(ENOMEM);
+        else
+          error = nbd_error(do_read(aop, chunk, len, from, 0, userdata));
+        break;
+      case NBD_CMD_WRITE:
+        if (BUSE_DEBUG)
+          fprintf(stderr, "Request for write of size %u on offset %lu\n", len, from);
+        if (len > st.size || avail < len)
+          error = nbd_error(stream_write(sk, &st, aop, userdata, rx + head - avail, avail, len, from, flags,
+                                         &sock_err));
+        else
+          error = nbd_error(do_write(aop, rx + head - avail, len, from, flags, userdata));
+        if (sock_err != 0)
+        {
+          warn("error reading write payload from nbd socket");
+          status = EXIT_FAILURE;
+          goto out;
+        }
+        break;
+      case NBD_CMD_DISC:
+        if (BUSE_DEBUG)
+          fprintf(stderr, "Got NBD_CMD_DISC\n");
+        /* Handle a disconnect request. */
+        if (tx_flush(sk, tx) != 0)
+          status = EXIT_FAILURE;
+        if (aop->disc)
+        {
+          aop->disc(userdata);
+        }
+        goto out;
+#ifdef NBD_FLAG_SEND_FLUSH
+      case NBD_CMD_FLUSH:
+        if (BUSE_DEBUG)
+          fprintf(stderr, "Got NBD_CMD_FLUSH\n");
+        if (aop->flush)
+        {
+          error = nbd_error(aop->flush(userdata));
+        }
+        break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
-    case NBD_CMD_TRIM:
-      if (BUSE_DEBUG)
-        fprintf(stderr, "Got NBD_CMD_TRIM\n");
-      if (aop->trim)
+      case NBD_CMD_TRIM:
+        if (BUSE_DEBUG)
+          fprintf(stderr, "Got NBD_CMD_TRIM\n");
+        if (aop->trim)
+        {
+          error = nbd_error(aop->trim(from, len, userdata));
+        }
+        break;
+#endif
+      case NBD_CMD_WRITE_ZEROES:
+        if (BUSE_DEBUG)
+          fprintf(stderr, "Got NBD_CMD_WRITE_ZEROES\n");
+        if (aop->write_zeroes)
+          error = nbd_error(aop->write_zeroes(from, len, userdata));
+        else
+          error = htonl(EPERM);
+        break;
+      default:
+        warnx("unknown nbd command %u", type & NBD_CMD_MASK_COMMAND);
+        error = htonl(EINVAL);
+      }
+      if (tx_reply(sk, tx, request.handle, error, chunk, len) != 0 || (pool != NULL && tx_flush(sk, tx) != 0))
       {
-        reply.error = aop->trim(from, len, userdata);
+        warn("error writing userside of nbd socket");
+        status = EXIT_FAILURE;
+        goto out;
       }
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
+    }
+
+    if (pool != NULL)
+      pool_kick(pool);
+    /* everything complete is handled; answer before blocking for more */
+    if (tx_flush(sk, tx) != 0)
+    {
+      warn("error writing userside of nbd socket");
+      status = EXIT_FAILURE;
       break;
-#endif
-    default:
-      assert(0);
     }
+    if (head > 0)
+    {
+      memmove(rx, rx + head, tail - head);
+      tail -= head;
+      head = 0;
+    }
+    ssize_t bytes_read = recv(sk, rx + tail, RX_BUF_SIZE - tail, 0);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read < 0)
+    {
+      warn("error reading userside of nbd socket");
+      status = EXIT_FAILURE;
+      break;
+    }
+    if (bytes_read == 0)
+      break; /* the kernel closed the socket */
+    tail += bytes_read;
   }
-  if (bytes_read == -1)
-  {
-    warn("error reading userside of nbd socket");
-    return EXIT_FAILURE;
-  }
-  return EXIT_SUCCESS;
+
+out:
+  if (pool != NULL && pool_stop(pool) != 0)
+    status = EXIT_FAILURE;
+  for (int i = 0; i < tx->n; i++)
+    free(tx->data[i]);
+  free(rx);
+  free(tx);
+  free(st.buf);
+  return status;
 }
 
 int buse_main(const char *dev_file, const struct buse_operations *aop, void *userdata)
@@ -238,6 +848,11 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
   int sp[2];
   int nbd, sk, err, flags;
 
+  /* "fd:N": serve a socket that is already connected to an NBD client,
+   * without the kernel, e.g. to benchmark a program with nbdbench. */
+  if (strncmp(dev_file, "fd:", 3) == 0)
+    return serve_nbd(atoi(dev_file + 3), aop, userdata);
+
   err = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
   assert(!err);
 
@@ -304,6 +919,10 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
 #if defined NBD_FLAG_SEND_FLUSH
       flags |= NBD_FLAG_SEND_FLUSH;
 #endif
+      if (aop->write_zeroes)
+        flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+      if (aop->write_flags)
+        flags |= NBD_FLAG_SEND_FUA;
       if (flags != 0 && ioctl(nbd, NBD_SET_FLAGS, flags) == -1)
       {
         fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, %d) failed.[%s]\n", flags, strerror(errno));
@@ -334,6 +953,7 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
   /* Parent handles termination signals by terminating nbd device. */
   assert(nbd_dev_to_disconnect == -1);
   nbd_dev_to_disconnect = nbd;
+  nbd_dev = nbd;
   struct sigaction act;
   act.sa_handler = disconnect_nbd;
   act.sa_flags = SA_RESTART;
@@ -358,6 +978,7 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
   /* serve NBD socket */
   int status;
   status = serve_nbd(sp[0], aop, userdata);
+  nbd_dev = -1;
   if (close(sp[0]) != 0)
     warn("problem closing server side nbd socket");
   if (status != 0)
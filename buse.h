@@ -7,21 +7,59 @@ extern "C" {
 
 #include <sys/types.h>
 
+  /* Flags passed to write_flags and read_flags. */
+#define BUSE_WRITE_FUA 0x1 /* the write must be durable before it is acknowledged */
+#define BUSE_SEG_MORE 0x2  /* a later segment of the same request follows */
+
+  /* Callbacks return 0 on success or an errno value (either sign). */
   struct buse_operations {
     int (*read)(void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     int (*write)(const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     void (*disc)(void *userdata);
     int (*flush)(void *userdata);
     int (*trim)(u_int64_t from, u_int32_t len, void *userdata);
+    int (*write_zeroes)(u_int64_t from, u_int32_t len, void *userdata);
+    /* Used instead of write when set; forced unit access is only advertised
+     * to the kernel if it is. */
+    int (*write_flags)(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata);
+    /* Used instead of read when set. */
+    int (*read_flags)(void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata);
 
     // either set size, OR set both blksize and size_blocks
     u_int64_t size;
     u_int32_t blksize;
     u_int64_t size_blocks;
+
+    /* Reads and writes longer than this are streamed: the callbacks get them
+     * in segments cut at multiples of it on the device, and each segment is
+     * sent to or received from the kernel as it is handled, so memory use
+     * doesn't grow with the request. 0 means 1 MiB. A multiple of the stripe
+     * size keeps full-stripe writes whole. */
+    u_int32_t segment;
+
+    /* Handle requests on this many threads at once; 0 handles them one at a
+     * time on the thread serving the socket. The thread reading the socket
+     * hands requests to the workers through lock-free rings and another
+     * thread sends the replies as they complete, so the callbacks must be
+     * safe to call concurrently. Streamed requests wait for the others to
+     * finish, and so does disc. */
+    u_int32_t workers;
+
+    /* CPU sets (see affinity.h) for the threads reading and answering the
+     * socket, and for the workers; NULL lets them run anywhere. Workers
+     * without a set of their own share the socket threads' CPUs. */
+    const char *server_cpus;
+    const char *worker_cpus;
   };
 
+  /* Serve the NBD device `dev_file`, or with "fd:N" an NBD client already
+   * connected to socket N (no handshake; requests and simple replies only). */
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
 
+  /* Resize the device while buse_main is serving it, for example after the
+   * storage behind it has grown. Returns 0 or a negative errno value. */
+  int buse_set_size(u_int64_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,22 +17,133 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "buse.h"
 
+/* Sparse store: the disk is split into fixed-size extents reached through a
+ * two-level table, dir[] -> leaf -> extent. Leaves and extents are allocated
+ * on first write, unallocated extents read as zeros and trimmed extents are
+ * freed, so the disk can be sized far beyond physical memory. */
+#define LEAF_BITS 9
+#define LEAF_ENTRIES (1UL << LEAF_BITS)
+
+static char ***dir;             /* dir[i] is a leaf of LEAF_ENTRIES extents, or NULL */
+static u_int16_t *leaf_used;    /* allocated extents per leaf */
+static u_int64_t dir_entries;
+static unsigned int extent_shift;
+static u_int64_t extent_size;
+static u_int64_t mem_used;      /* bytes of extents allocated */
+static u_int64_t mem_cap;       /* allocation cap in bytes, 0 for none */
+
+/* Optional arena extents are carved from, backed by huge pages when the
+ * system has them. Freed extents are kept on a list linked through their
+ * first word. */
+static char *arena;
+static u_int64_t arena_size;
+static u_int64_t arena_next;
+static char *arena_free;
+
+static int arena_init(u_int64_t size)
+{
+  arena_size = size;
+#ifdef MAP_HUGETLB
+  arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (arena != MAP_FAILED)
+    return 0;
+#endif
+  /* no hugetlb pool; fall back to transparent huge pages */
+  arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena == MAP_FAILED)
+    return -1;
+#ifdef MADV_HUGEPAGE
+  madvise(arena, size, MADV_HUGEPAGE);
+#endif
+  return 0;
+}
+
+static char *extent_alloc(void)
+{
+  char *ext = NULL;
+
+  if (mem_cap && mem_used + extent_size > mem_cap)
+    return NULL;
+  if (arena) {
+    if (arena_free) {
+      ext = arena_free;
+      arena_free = *(char **)ext;
+    } else if (arena_next + extent_size <= arena_size) {
+      ext = arena + arena_next;
+      arena_next += extent_size;
+    }
+  } else if (posix_memalign((void **)&ext, 4096, extent_size) != 0) {
+    ext = NULL;
+  }
+  if (ext)
+    mem_used += extent_size;
+  return ext;
+}
+
+static void extent_free(char *ext)
+{
+  mem_used -= extent_size;
+  if (arena) {
+    *(char **)ext = arena_free;
+    arena_free = ext;
+  } else {
+    free(ext);
+  }
+}
+
+/* Return the table slot for extent `idx`, creating its leaf if asked to. */
+static char **extent_slot(u_int64_t idx, int create)
+{
+  char **leaf = dir[idx >> LEAF_BITS];
+
+  if (leaf == NULL) {
+    if (!create)
+      return NULL;
+    leaf = calloc(LEAF_ENTRIES, sizeof(char *));
+    if (leaf == NULL)
+      return NULL;
+    dir[idx >> LEAF_BITS] = leaf;
+  }
+  return &leaf[idx & (LEAF_ENTRIES - 1)];
+}
+
+static int is_zero(const char *p, u_int32_t len)
+{
+  return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
 /* BUSE callbacks */
-static void *data;
 
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "R - %lu, %u\n", offset, len);
-  memcpy(buf, (char *)data + offset, len);
+  while (len > 0) {
+    u_int64_t in = offset & (extent_size - 1);
+    u_int32_t n = extent_size - in < len ? extent_size - in : len;
+    char **slot = extent_slot(offset >> extent_shift, 0);
+    if (slot == NULL || *slot == NULL)
+      memset(buf, 0, n);
+    else
+      memcpy(buf, *slot + in, n);
+    buf = (char *)buf + n;
+    offset += n;
+    len -= n;
+  }
   return 0;
 }
 
@@ -40,14 +151,47 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
 {
   if (*(int *)userdata)
     fprintf(stderr, "W - %lu, %u\n", offset, len);
-  memcpy((char *)data + offset, buf, len);
+  while (len > 0) {
+    u_int64_t idx = offset >> extent_shift;
+    u_int64_t in = offset & (extent_size - 1);
+    u_int32_t n = extent_size - in < len ? extent_size - in : len;
+    /* writing zeros to a hole leaves it a hole, without even a leaf */
+    int zero = is_zero(buf, n);
+    char **slot = extent_slot(idx, !zero);
+    if (slot == NULL) {
+      if (!zero)
+        return -ENOMEM;
+    } else if (*slot == NULL) {
+      if (!zero) {
+        *slot = extent_alloc();
+        if (*slot == NULL) {
+          if (leaf_used[idx >> LEAF_BITS] == 0) {
+            free(dir[idx >> LEAF_BITS]);
+            dir[idx >> LEAF_BITS] = NULL;
+          }
+          return -ENOSPC;
+        }
+        leaf_used[idx >> LEAF_BITS]++;
+        if (n < extent_size)
+          memset(*slot, 0, extent_size);
+        memcpy(*slot + in, buf, n);
+      }
+    } else {
+      memcpy(*slot + in, buf, n);
+    }
+    buf = (const char *)buf + n;
+    offset += n;
+    len -= n;
+  }
   return 0;
 }
 
 static void xmp_disc(void *userdata)
 {
-  if (*(int *)userdata)
+  if (*(int *)userdata) {
     fprintf(stderr, "Received a disconnect request.\n");
+    fprintf(stderr, "%llu bytes of extents allocated.\n", (unsigned long long)mem_used);
+  }
 }
 
 static int xmp_flush(void *userdata)
@@ -61,6 +205,27 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "T - %lu, %u\n", from, len);
+  while (len > 0) {
+    u_int64_t idx = from >> extent_shift;
+    u_int64_t in = from & (extent_size - 1);
+    u_int32_t n = extent_size - in < len ? extent_size - in : len;
+    char **slot = extent_slot(idx, 0);
+    if (slot != NULL && *slot != NULL) {
+      if (n == extent_size) {
+        /* whole extent trimmed: give its memory back */
+        extent_free(*slot);
+        *slot = NULL;
+        if (--leaf_used[idx >> LEAF_BITS] == 0) {
+          free(dir[idx >> LEAF_BITS]);
+          dir[idx >> LEAF_BITS] = NULL;
+        }
+      } else {
+        memset(*slot + in, 0, n);
+      }
+    }
+    from += n;
+    len -= n;
+  }
   return 0;
 }
 
@@ -68,6 +233,9 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 
 static struct argp_option options[] = {
   {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+  {"extent-size", 'e', "SIZE", 0, "Allocation unit of the sparse store, a power of two (default 64K)", 0},
+  {"max-memory", 'M', "SIZE", 0, "Cap on memory allocated for data; writes beyond it fail with ENOSPC", 0},
+  {"hugepages", 'H', 0, 0, "Carve extents from a huge page arena (sized by --max-memory, else SIZE)", 0},
   {0},
 };
 
@@ -75,6 +243,9 @@ struct arguments {
   unsigned long long size;
   char * device;
   int verbose;
+  unsigned long long extent_size;
+  unsigned long long max_memory;
+  int hugepages;
 };
 
 static unsigned long long strtoull_with_prefix(const char * str, char * * end) {
@@ -92,6 +263,10 @@ static unsigned long long strtoull_with_prefix(const char * str, char * * end) {
       v *= 1024 * 1024 * 1024;
       *end += 1;
       break;
+    case 'T':
+      v *= 1024ULL * 1024 * 1024 * 1024;
+      *end += 1;
+      break;
   }
   return v;
 }
@@ -107,6 +282,25 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       arguments->verbose = 1;
       break;
 
+    case 'e':
+      arguments->extent_size = strtoull_with_prefix(arg, &endptr);
+      if (*endptr != '\0' || arguments->extent_size < 512 ||
+          (arguments->extent_size & (arguments->extent_size - 1)) != 0) {
+        argp_error(state, "extent size must be a power of two of at least 512");
+      }
+      break;
+
+    case 'M':
+      arguments->max_memory = strtoull_with_prefix(arg, &endptr);
+      if (*endptr != '\0') {
+        argp_error(state, "max memory must be an integer");
+      }
+      break;
+
+    case 'H':
+      arguments->hugepages = 1;
+      break;
+
     case ARGP_KEY_ARG:
       switch (state->arg_num) {
 
@@ -146,13 +340,15 @@ static struct argp argp = {
   .parser = parse_opt,
   .args_doc = "SIZE DEVICE",
   .doc = "BUSE virtual block device that stores its content in memory.\n"
-         "`SIZE` accepts suffixes K, M, G. `DEVICE` is path to block device, for example \"/dev/nbd0\".",
+         "Memory is allocated sparsely, an extent at a time, on first write.\n"
+         "`SIZE` accepts suffixes K, M, G, T. `DEVICE` is path to block device, for example \"/dev/nbd0\".",
 };
 
 
 int main(int argc, char *argv[]) {
   struct arguments arguments = {
     .verbose = 0,
+    .extent_size = 64 * 1024,
   };
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
@@ -165,8 +361,17 @@ int main(int argc, char *argv[]) {
     .size = arguments.size,
   };
 
-  data = malloc(aop.size);
-  if (data == NULL) err(EXIT_FAILURE, "failed to alloc space for data");
+  extent_size = arguments.extent_size;
+  for (extent_shift = 0; (1ULL << extent_shift) < extent_size; extent_shift++)
+    ;
+  mem_cap = arguments.max_memory;
+  dir_entries = ((aop.size + extent_size - 1) / extent_size + LEAF_ENTRIES - 1) / LEAF_ENTRIES;
+  dir = calloc(dir_entries, sizeof(*dir));
+  leaf_used = calloc(dir_entries, sizeof(*leaf_used));
+  if (dir == NULL || leaf_used == NULL) err(EXIT_FAILURE, "failed to alloc extent table");
+  if (arguments.hugepages &&
+      arena_init((mem_cap ? mem_cap : aop.size) / extent_size * extent_size) != 0)
+    err(EXIT_FAILURE, "failed to map huge page arena");
 
   return buse_main(arguments.device, &aop, (void *)&arguments.verbose);
 }
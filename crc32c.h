@@ -0,0 +1,21 @@
+/*
+ * crc32c - CRC-32C (Castagnoli) checksums
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef CRC32C_H_INCLUDED
+#define CRC32C_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Extend `crc` (0 to start) over `len` bytes; crc32c(0, "123456789", 9) is
+ * 0xe3069283. Uses the SSE4.2 crc32 instruction when the CPU has it and a
+ * table-driven slicing-by-8 loop otherwise. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H_INCLUDED */
@@ -0,0 +1,97 @@
+/*
+ * ecbench - erasure code throughput
+ *
+ * Times encoding and decoding with erasure.c for a range of k data + m
+ * parity layouts: decoding one lost data fragment and m of them, from
+ * cached matrices, and building the matrix for a new erasure pattern.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "erasure.h"
+
+#define FRAG_BYTES (64 * 1024) // bytes per fragment, a typical chunk
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Data MB/s of decoding the fragments in `erased`, or of encoding if 0. */
+static double run(struct ec_code *c, int k, char **frag, uint32_t erased, long stripes)
+{
+    uint64_t start = now_ns();
+    for (long s = 0; s < stripes; s++)
+    {
+        if (erased == 0)
+            ec_encode(c, frag, frag + k, FRAG_BYTES);
+        else
+            ec_decode(c, frag, erased, erased, FRAG_BYTES);
+    }
+    return (double)stripes * k * FRAG_BYTES / 1e6 / ((now_ns() - start) / 1e9);
+}
+
+/* Microseconds to build the decode matrix for an erasure pattern not seen
+ * before: the first decode of each pattern of m data fragments. */
+static double invert_us(struct ec_code *c, int k, int m, char **frag)
+{
+    int n = 0;
+    uint64_t start = now_ns();
+    for (int first = 0; first + m <= k && n < 64; first++, n++)
+        ec_decode(c, frag, ((1U << m) - 1) << first, 1U << first, 1);
+    return n > 0 ? (now_ns() - start) / 1e3 / n : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long mb = argc > 1 ? atol(argv[1]) : 256;
+    static const int layouts[][2] = {{2, 1}, {4, 1}, {4, 2}, {6, 2}, {6, 3}, {8, 2}, {8, 3}, {10, 4}, {12, 4}, {8, 8}};
+
+    if (mb < 1)
+    {
+        fprintf(stderr, "usage: %s [MB] (of data per measurement)\n", argv[0]);
+        return 1;
+    }
+    printf("%d KiB fragments, %s\n", FRAG_BYTES / 1024, ec_isa());
+    printf("%3s %3s %12s %12s %12s %10s\n", "k", "m", "encode MB/s", "decode1 MB/s", "decodem MB/s", "invert us");
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+    {
+        int k = layouts[l][0], m = layouts[l][1];
+        struct ec_code *c = ec_create(k, m);
+        char *frag[EC_MAX_FRAGS];
+        if (c == NULL)
+            return 1;
+        for (int i = 0; i < k + m; i++)
+        {
+            frag[i] = malloc(FRAG_BYTES);
+            if (frag[i] == NULL)
+                return 1;
+            for (int b = 0; b < FRAG_BYTES; b++)
+                frag[i][b] = rand();
+        }
+        long stripes = (mb << 20) / ((long)k * FRAG_BYTES);
+        if (stripes < 1)
+            stripes = 1;
+        double inv = invert_us(c, k, m, frag);
+        double enc = run(c, k, frag, 0, stripes);
+        double dec1 = run(c, k, frag, 1, stripes);
+        double decm = run(c, k, frag, m <= k ? (1U << m) - 1 : (1U << k) - 1, stripes);
+        printf("%3d %3d %12.0f %12.0f %12.0f %10.1f\n", k, m, enc, dec1, decm, inv);
+        for (int i = 0; i < k + m; i++)
+            free(frag[i]);
+        ec_destroy(c);
+    }
+    return 0;
+}
@@ -0,0 +1,515 @@
+/*
+ * erasure - Reed-Solomon erasure coding over GF(2^8) for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erasure.h"
+#include "xor.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#define POLY 0x11d        // x^8 + x^4 + x^3 + x^2 + 1, for which 2 generates the field
+#define SLAB 4096         // bytes of each fragment combined at a time, so the outputs stay in L1
+#define DECODE_CACHE 64   // inverted matrices kept, one per erasure pattern
+#define TABLE 32          // bytes of nibble tables per coefficient
+
+static uint8_t gf_exp[510];
+static uint8_t gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init(void)
+{
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= POLY;
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+/* Products of `c` with every low nibble, then every high nibble: a byte's
+ * product is the XOR of one entry from each half, which a shuffle
+ * instruction looks up for a whole vector at once. */
+static void gf_table(uint8_t c, uint8_t *t)
+{
+    for (int x = 0; x < 16; x++)
+    {
+        t[x] = gf_mul(c, x);
+        t[16 + x] = gf_mul(c, x << 4);
+    }
+}
+
+static void mul_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *t, size_t len, bool add)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t p = t[src[i] & 15] ^ t[16 + (src[i] >> 4)];
+        dst[i] = add ? dst[i] ^ p : p;
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("ssse3")))
+static void mul_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *t, size_t len, bool add)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *)t);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(t + 16));
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        if (add)
+            p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), p);
+    }
+    mul_scalar(dst + i, src + i, t, len - i, add);
+}
+
+__attribute__((target("avx2")))
+static void mul_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *t, size_t len, bool add)
+{
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t + 16)));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+                                     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        if (add)
+            p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), p);
+    }
+    mul_scalar(dst + i, src + i, t, len - i, add);
+}
+#endif
+
+/* 2 for AVX2, 1 for SSSE3, 0 for neither. */
+static int isa_level(void)
+{
+    static int level = -1; // unknown until the first call; racing callers agree
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__atomic_load_n(&level, __ATOMIC_RELAXED) < 0)
+        __atomic_store_n(&level, __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0,
+                         __ATOMIC_RELAXED);
+#else
+    level = 0;
+#endif
+    return __atomic_load_n(&level, __ATOMIC_RELAXED);
+}
+
+const char *ec_isa(void)
+{
+    static const char *names[] = {"scalar", "ssse3", "avx2"};
+    return names[isa_level()];
+}
+
+/* dst = t * src, or dst ^= t * src with `add`. */
+static void mul_region(char *dst, const char *src, const uint8_t *t, size_t len, bool add)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    int level = isa_level();
+    if (level == 2)
+        mul_avx2((uint8_t *)dst, (const uint8_t *)src, t, len, add);
+    else if (level == 1)
+        mul_ssse3((uint8_t *)dst, (const uint8_t *)src, t, len, add);
+    else
+#endif
+        mul_scalar((uint8_t *)dst, (const uint8_t *)src, t, len, add);
+}
+
+/* Rows of coefficients, each combining k source fragments into one output. */
+struct rows
+{
+    int n;
+    uint8_t *coef;   // n x k
+    uint8_t *tables; // n x k x TABLE
+    bool *ones;      // whether row r is all ones, i.e. a plain XOR
+};
+
+/* The inverse for one erasure pattern: rows turning its sources into each
+ * erased fragment, in index order. */
+struct decoder
+{
+    uint32_t erased;
+    uint32_t sources;
+    int refs;      // decodes using it; it is only evicted at 0
+    uint64_t used; // for evicting the least recently used
+    struct rows rows;
+};
+
+struct ec_code
+{
+    int k, m;
+    uint8_t *gen; // (k + m) x k generator matrix; the first k rows are the identity
+    struct rows parity;
+    pthread_mutex_t lock; // protects the decode cache
+    struct decoder *cache[DECODE_CACHE];
+    uint64_t clock;
+    uint64_t hits, misses;
+};
+
+static int rows_init(struct rows *r, int n, int k)
+{
+    r->n = n;
+    r->coef = malloc((size_t)n * k);
+    r->tables = malloc((size_t)n * k * TABLE);
+    r->ones = malloc(n * sizeof(bool));
+    return r->coef == NULL || r->tables == NULL || r->ones == NULL ? -ENOMEM : 0;
+}
+
+/* Build the nibble tables once r->coef is filled in. */
+static void rows_tables(struct rows *r, int k)
+{
+    for (int j = 0; j < r->n; j++)
+    {
+        r->ones[j] = true;
+        for (int i = 0; i < k; i++)
+        {
+            gf_table(r->coef[j * k + i], r->tables + ((size_t)j * k + i) * TABLE);
+            r->ones[j] &= r->coef[j * k + i] == 1;
+        }
+    }
+}
+
+static void rows_free(struct rows *r)
+{
+    free(r->coef);
+    free(r->tables);
+    free(r->ones);
+}
+
+/* out[j] = row j applied to src[0..k-1], for the rows whose out[j] isn't
+ * NULL. Works through the fragments a slab at a time so each output slab is
+ * built up in cache from all k sources. */
+static void rows_apply(const struct rows *r, int k, char **src, char **out, size_t len)
+{
+    for (size_t off = 0; off < len; off += SLAB)
+    {
+        size_t n = len - off < SLAB ? len - off : SLAB;
+        for (int j = 0; j < r->n; j++)
+        {
+            if (out[j] == NULL)
+                continue;
+            if (r->ones[j])
+            {
+                memcpy(out[j] + off, src[0] + off, n);
+                for (int i = 1; i < k; i++)
+                    xor_into(out[j] + off, src[i] + off, n);
+                continue;
+            }
+            for (int i = 0; i < k; i++)
+                mul_region(out[j] + off, src[i] + off, r->tables + ((size_t)j * k + i) * TABLE, n, i > 0);
+        }
+    }
+}
+
+struct ec_code *ec_create(int k, int m)
+{
+    if (k < 1 || m < 1 || k + m > EC_MAX_FRAGS)
+        return NULL;
+    pthread_once(&gf_once, gf_init);
+    struct ec_code *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->k = k;
+    c->m = m;
+    c->gen = calloc((size_t)(k + m) * k, 1);
+    if (c->gen == NULL || rows_init(&c->parity, m, k) != 0)
+    {
+        ec_destroy(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+
+    // Cauchy rows 1 / (x_j + y_i) with x_j = k + j and y_i = i, all distinct,
+    // so every square submatrix is invertible and any k fragments decode.
+    // Scaling column i by x_0 + y_i keeps that and makes row 0 all ones.
+    for (int i = 0; i < k; i++)
+        c->gen[i * k + i] = 1;
+    for (int j = 0; j < m; j++)
+    {
+        for (int i = 0; i < k; i++)
+        {
+            uint8_t cauchy = gf_inv((k + j) ^ i);
+            uint8_t scale = (k ^ i);
+            c->parity.coef[j * k + i] = c->gen[(k + j) * k + i] = gf_mul(cauchy, scale);
+        }
+    }
+    rows_tables(&c->parity, k);
+    return c;
+}
+
+void ec_destroy(struct ec_code *c)
+{
+    if (c == NULL)
+        return;
+    for (int i = 0; i < DECODE_CACHE; i++)
+    {
+        if (c->cache[i] != NULL)
+        {
+            rows_free(&c->cache[i]->rows);
+            free(c->cache[i]);
+        }
+    }
+    if (c->gen != NULL)
+        pthread_mutex_destroy(&c->lock);
+    rows_free(&c->parity);
+    free(c->gen);
+    free(c);
+}
+
+void ec_encode(struct ec_code *c, char **data, char **parity, size_t len)
+{
+    rows_apply(&c->parity, c->k, data, parity, len);
+}
+
+void ec_update(struct ec_code *c, int d, const char *delta, char **parity, size_t len)
+{
+    for (int j = 0; j < c->m; j++)
+    {
+        if (parity[j] == NULL)
+            continue;
+        if (c->parity.coef[j * c->k + d] == 1)
+            xor_into(parity[j], delta, len);
+        else
+            mul_region(parity[j], delta, c->parity.tables + ((size_t)j * c->k + d) * TABLE, len, true);
+    }
+}
+
+uint32_t ec_sources(struct ec_code *c, uint32_t erased)
+{
+    uint32_t sources = 0;
+    for (int i = 0, n = 0; i < c->k + c->m && n < c->k; i++)
+    {
+        if (!(erased & (1U << i)))
+        {
+            sources |= 1U << i;
+            n++;
+        }
+    }
+    return sources;
+}
+
+/* Invert the k x k matrix `a` into `inv` by Gauss-Jordan elimination; `a`
+ * is destroyed. Returns false if it is singular, which a Cauchy code never
+ * produces. */
+static bool invert(uint8_t *a, uint8_t *inv, int k)
+{
+    memset(inv, 0, (size_t)k * k);
+    for (int i = 0; i < k; i++)
+        inv[i * k + i] = 1;
+    for (int col = 0; col < k; col++)
+    {
+        int p = col;
+        while (p < k && a[p * k + col] == 0)
+            p++;
+        if (p == k)
+            return false;
+        for (int i = 0; p != col && i < k; i++)
+        {
+            uint8_t t = a[p * k + i];
+            a[p * k + i] = a[col * k + i];
+            a[col * k + i] = t;
+            t = inv[p * k + i];
+            inv[p * k + i] = inv[col * k + i];
+            inv[col * k + i] = t;
+        }
+        uint8_t s = gf_inv(a[col * k + col]);
+        for (int i = 0; i < k; i++)
+        {
+            a[col * k + i] = gf_mul(a[col * k + i], s);
+            inv[col * k + i] = gf_mul(inv[col * k + i], s);
+        }
+        for (int r = 0; r < k; r++)
+        {
+            uint8_t f = a[r * k + col];
+            if (r == col || f == 0)
+                continue;
+            for (int i = 0; i < k; i++)
+            {
+                a[r * k + i] ^= gf_mul(f, a[col * k + i]);
+                inv[r * k + i] ^= gf_mul(f, inv[col * k + i]);
+            }
+        }
+    }
+    return true;
+}
+
+/* The decoder for `erased`: row e of the generator times the inverse of the
+ * sources' rows gives erased fragment e straight from the sources, whether
+ * it holds data or parity. */
+static struct decoder *decoder_build(struct ec_code *c, uint32_t erased)
+{
+    int k = c->k;
+    int n = __builtin_popcount(erased);
+    struct decoder *d = calloc(1, sizeof(*d));
+    uint8_t *a = malloc((size_t)k * k);
+    uint8_t *inv = malloc((size_t)k * k);
+    bool ok = d != NULL && a != NULL && inv != NULL && rows_init(&d->rows, n, k) == 0;
+
+    if (ok)
+    {
+        d->erased = erased;
+        d->sources = ec_sources(c, erased);
+        for (int i = 0, r = 0; i < k + c->m; i++)
+        {
+            if (d->sources & (1U << i))
+                memcpy(a + (size_t)r++ * k, c->gen + (size_t)i * k, k);
+        }
+        ok = invert(a, inv, k);
+    }
+    for (int e = 0, r = 0; ok && e < k + c->m; e++)
+    {
+        if (!(erased & (1U << e)))
+            continue;
+        for (int i = 0; i < k; i++)
+        {
+            uint8_t sum = 0;
+            for (int j = 0; j < k; j++)
+                sum ^= gf_mul(c->gen[e * k + j], inv[j * k + i]);
+            d->rows.coef[r * k + i] = sum;
+        }
+        r++;
+    }
+    free(a);
+    free(inv);
+    if (!ok)
+    {
+        if (d != NULL)
+            rows_free(&d->rows);
+        free(d);
+        return NULL;
+    }
+    rows_tables(&d->rows, k);
+    return d;
+}
+
+/* Find or build the decoder for `erased` and take a reference to it. */
+static struct decoder *decoder_get(struct ec_code *c, uint32_t erased)
+{
+    pthread_mutex_lock(&c->lock);
+    int victim = -1;
+    for (int i = 0; i < DECODE_CACHE; i++)
+    {
+        struct decoder *d = c->cache[i];
+        if (d != NULL && d->erased == erased)
+        {
+            d->refs++;
+            d->used = ++c->clock;
+            c->hits++;
+            pthread_mutex_unlock(&c->lock);
+            return d;
+        }
+        // prefer an empty slot, then the least recently used idle one
+        if (victim >= 0 && c->cache[victim] == NULL)
+            continue;
+        if (d == NULL || (d->refs == 0 && (victim < 0 || d->used < c->cache[victim]->used)))
+            victim = i;
+    }
+    c->misses++;
+    struct decoder *d = decoder_build(c, erased);
+    if (d != NULL)
+    {
+        d->refs = 1;
+        d->used = ++c->clock;
+        if (victim >= 0)
+        {
+            if (c->cache[victim] != NULL)
+            {
+                rows_free(&c->cache[victim]->rows);
+                free(c->cache[victim]);
+            }
+            c->cache[victim] = d;
+        }
+        else
+        {
+            d->refs = -1; // every entry is in use: not cached, freed after this decode
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return d;
+}
+
+static void decoder_put(struct ec_code *c, struct decoder *d)
+{
+    if (d->refs < 0)
+    {
+        rows_free(&d->rows);
+        free(d);
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    d->refs--;
+    pthread_mutex_unlock(&c->lock);
+}
+
+int ec_decode(struct ec_code *c, char **frag, uint32_t erased, uint32_t want, size_t len)
+{
+    int k = c->k;
+    erased &= (k + c->m < 32 ? 1U << (k + c->m) : 0) - 1;
+    want &= erased;
+    if (__builtin_popcount(erased) > c->m)
+        return -EIO;
+    if (want == 0)
+        return 0;
+    struct decoder *d = decoder_get(c, erased);
+    if (d == NULL)
+        return -ENOMEM;
+
+    char *src[EC_MAX_FRAGS];
+    char *out[EC_MAX_FRAGS];
+    for (int i = 0, n = 0, r = 0; i < k + c->m; i++)
+    {
+        if (d->sources & (1U << i))
+            src[n++] = frag[i];
+        if (erased & (1U << i))
+            out[r++] = (want & (1U << i)) ? frag[i] : NULL;
+    }
+    rows_apply(&d->rows, k, src, out, len);
+    decoder_put(c, d);
+    return 0;
+}
+
+void ec_report(struct ec_code *c)
+{
+    pthread_mutex_lock(&c->lock);
+    int cached = 0;
+    for (int i = 0; i < DECODE_CACHE; i++)
+        cached += c->cache[i] != NULL;
+    fprintf(stderr, "Erasure code %d+%d (%s): %d decode matrices cached, %lu hits, %lu misses.\n", c->k, c->m,
+            ec_isa(), cached, c->hits, c->misses);
+    pthread_mutex_unlock(&c->lock);
+}
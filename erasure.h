@@ -0,0 +1,54 @@
+/*
+ * erasure - Reed-Solomon erasure coding over GF(2^8) for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef ERASURE_H_INCLUDED
+#define ERASURE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EC_MAX_FRAGS 32 // data plus parity fragments per stripe
+
+/* A systematic k+m code: fragments 0..k-1 are the data, k..k+m-1 parity
+ * computed from a Cauchy matrix, scaled so that the first parity fragment is
+ * the plain XOR of the data (m = 1 is RAID4). Any k of the k+m fragments
+ * recover the others. All functions are safe to call concurrently. */
+struct ec_code;
+
+/* Returns NULL if k or m is zero, k + m exceeds EC_MAX_FRAGS, or memory runs
+ * out. */
+struct ec_code *ec_create(int k, int m);
+void ec_destroy(struct ec_code *c);
+
+/* parity[j] = sum of coefficient (j, i) times data[i], for `len` bytes of
+ * each fragment. Buffers may have any alignment. */
+void ec_encode(struct ec_code *c, char **data, char **parity, size_t len);
+
+/* Data fragment `d` changed by `delta` (old XOR new): fold the change into
+ * each parity fragment that isn't NULL, without reading the other data. */
+void ec_update(struct ec_code *c, int d, const char *delta, char **parity, size_t len);
+
+/* The fragments decoding relies on when those in the mask `erased` are
+ * lost: the first k that aren't. Fragments not in the result need not be
+ * read. */
+uint32_t ec_sources(struct ec_code *c, uint32_t erased);
+
+/* Recompute the fragments in `want`, a subset of `erased`, into frag[], from
+ * the fragments ec_sources(erased) lists. The inverted matrix for each
+ * erasure pattern is built once and cached. Returns 0, or -EIO if more than
+ * m fragments are erased, or -ENOMEM. */
+int ec_decode(struct ec_code *c, char **frag, uint32_t erased, uint32_t want, size_t len);
+
+/* Print the instruction set used and decode matrix cache hits to stderr. */
+void ec_report(struct ec_code *c);
+
+/* "avx2", "ssse3" or "scalar": what the region multiply runs on here. */
+const char *ec_isa(void);
+
+#endif /* ERASURE_H_INCLUDED */
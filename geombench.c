@@ -0,0 +1,109 @@
+/*
+ * geombench - cost of mapping requests onto RAID members
+ *
+ * Times geom_map() against the per-chunk division loop the engines used
+ * before, for a few member counts, chunk sizes and request sizes, at random
+ * offsets across a 16 TiB array.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "geometry.h"
+
+#define NOFFSETS 4096
+#define ARRAY_BYTES (16ULL << 40)
+
+static struct geom_extent ext[4096];
+static uint64_t offsets[NOFFSETS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The loop raid4 used: two 64-bit divisions and a modulo per chunk. */
+static size_t map_div(uint32_t ndata, uint32_t chunk, uint64_t offset, uint32_t len)
+{
+    size_t k = 0;
+    for (uint32_t done = 0; done < len; k++)
+    {
+        uint64_t i = (offset + done) / chunk;
+        uint64_t offsetInBlock = (offset + done) % chunk;
+        ext[k].member = i % ndata;
+        ext[k].offset = i / ndata * chunk + offsetInBlock;
+        ext[k].stripe = i / ndata;
+        ext[k].buf = done;
+        ext[k].len = len - done > chunk - offsetInBlock ? chunk - offsetInBlock : len - done;
+        done += ext[k].len;
+    }
+    return k;
+}
+
+/* Nanoseconds per request, and a sum over the extents so none of the work
+ * can be optimized away. */
+static double run(const struct geometry *g, bool use_geom, uint32_t len, long reqs, uint64_t *sum)
+{
+    uint64_t start = now_ns();
+    for (long r = 0; r < reqs; r++)
+    {
+        uint64_t off = offsets[r % NOFFSETS];
+        size_t n = use_geom ? geom_map(g, off, len, ext, sizeof(ext) / sizeof(ext[0]))
+                            : map_div(g->ndata, g->chunk, off, len);
+        *sum += ext[n - 1].offset + ext[n - 1].member;
+    }
+    return (double)(now_ns() - start) / reqs;
+}
+
+int main(int argc, char *argv[])
+{
+    long reqs = argc > 1 ? atol(argv[1]) : 1000000;
+    static const uint32_t ndatas[] = {2, 3, 4, 7};
+    static const uint32_t chunks[] = {4096, 65536, 12288, 196608};
+    static const uint32_t lens[] = {4096, 65536, 1 << 20};
+    uint64_t sum = 0;
+
+    if (reqs < 256)
+    {
+        fprintf(stderr, "usage: %s [REQUESTS] (at least 256)\n", argv[0]);
+        return 1;
+    }
+    srand(1);
+    for (int i = 0; i < NOFFSETS; i++)
+        offsets[i] = (((uint64_t)rand() << 31) ^ (uint64_t)rand()) % (ARRAY_BYTES - (1 << 20)) / 512 * 512;
+
+    printf("%5s %7s %8s %8s %10s %10s %8s\n", "ndata", "chunk", "request", "extents", "div ns", "geom ns", "speedup");
+    for (size_t a = 0; a < sizeof(ndatas) / sizeof(ndatas[0]); a++)
+    {
+        for (size_t b = 0; b < sizeof(chunks) / sizeof(chunks[0]); b++)
+        {
+            struct geometry g;
+            geom_init(&g, ndatas[a], chunks[b]);
+            for (size_t c = 0; c < sizeof(lens) / sizeof(lens[0]); c++)
+            {
+                double extents = 0;
+                for (int i = 0; i < NOFFSETS; i++)
+                    extents += geom_count(&g, offsets[i], lens[c]);
+                long n = reqs / (lens[c] / 4096); // about the same number of extents per row
+                double div = run(&g, false, lens[c], n, &sum);
+                double fast = run(&g, true, lens[c], n, &sum);
+                printf("%5u %7u %8u %8.1f %10.1f %10.1f %7.2fx\n", ndatas[a], chunks[b], lens[c],
+                       extents / NOFFSETS, div, fast, div / fast);
+            }
+        }
+    }
+    fprintf(stderr, "(checksum %lu)\n", sum);
+    return 0;
+}
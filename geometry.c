@@ -0,0 +1,85 @@
+/*
+ * geometry - stripe address mapping for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+
+#include "geometry.h"
+
+void geom_div_init(struct geom_div *v, uint64_t d)
+{
+    v->d = d;
+    v->shift = -1;
+    v->magic = 0;
+    if ((d & (d - 1)) == 0)
+        v->shift = __builtin_ctzll(d);
+    else
+        v->magic = UINT64_MAX / d; // floor(2^64 / d), as d does not divide 2^64
+}
+
+int geom_init(struct geometry *g, uint32_t ndata, uint32_t chunk)
+{
+    if (ndata == 0 || chunk == 0)
+        return -EINVAL;
+    g->ndata = ndata;
+    g->chunk = chunk;
+    g->stripe_size = (uint64_t)ndata * chunk;
+    geom_div_init(&g->by_chunk, chunk);
+    geom_div_init(&g->by_ndata, ndata);
+    return 0;
+}
+
+size_t geom_map(const struct geometry *g, uint64_t offset, uint32_t len, struct geom_extent *ext, size_t max)
+{
+    if (len == 0)
+        return 0;
+
+    uint64_t in_chunk, member;
+    uint64_t i = geom_divmod(&g->by_chunk, offset, &in_chunk);
+    uint64_t stripe = geom_divmod(&g->by_ndata, i, &member);
+    uint32_t done = 0;
+    size_t k;
+
+    // only the first extent can start inside a chunk; after it, step chunk
+    // by chunk without dividing again
+    for (k = 0; done < len; k++)
+    {
+        uint32_t bytes = g->chunk - in_chunk < len - done ? g->chunk - in_chunk : len - done;
+        if (k < max)
+        {
+            ext[k].offset = stripe * g->chunk + in_chunk;
+            ext[k].stripe = stripe;
+            ext[k].buf = done;
+            ext[k].len = bytes;
+            ext[k].member = member;
+        }
+        done += bytes;
+        in_chunk = 0;
+        if (++member == g->ndata)
+        {
+            member = 0;
+            stripe++;
+        }
+    }
+    return k;
+}
+
+size_t geom_map_split(const struct geometry *lo, const struct geometry *hi, uint64_t split,
+                      uint64_t offset, uint32_t len, struct geom_extent *ext, size_t max)
+{
+    uint32_t below = offset >= split ? 0 : split - offset < len ? split - offset : len;
+    size_t n = geom_map(lo, offset, below, ext, max);
+    size_t skip = n < max ? n : max;
+    size_t m = geom_map(hi, offset + below, len - below, ext + skip, max - skip);
+
+    for (size_t k = skip; k < n + m && k < max; k++)
+        ext[k].buf += below; // geom_map counted from the start of the upper part
+    return n + m;
+}
@@ -0,0 +1,100 @@
+/*
+ * geometry - stripe address mapping for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef GEOMETRY_H_INCLUDED
+#define GEOMETRY_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Division by a constant fixed at startup: a shift for powers of two, else a
+ * multiply by the reciprocal and one correction step. Exact for any 64-bit
+ * dividend. */
+struct geom_div
+{
+    uint64_t d;
+    uint64_t magic; // floor(2^64 / d); unused when shift >= 0
+    int shift;      // log2(d) if d is a power of two, else -1
+};
+
+/* Array data is cut into chunks of `chunk` bytes, dealt round-robin to
+ * `ndata` data members: chunk i lives on member i % ndata at byte
+ * (i / ndata) * chunk. Parity, if any, is the engine's business. */
+struct geometry
+{
+    uint32_t ndata;
+    uint32_t chunk;
+    uint64_t stripe_size; // ndata * chunk
+    struct geom_div by_chunk;
+    struct geom_div by_ndata;
+};
+
+/* A piece of a request that lies within one chunk. */
+struct geom_extent
+{
+    uint64_t offset; // byte offset on the member
+    uint64_t stripe; // stripe number, for stripe locks
+    uint32_t buf;    // offset into the request buffer
+    uint32_t len;
+    uint32_t member; // data member index, 0 .. ndata - 1
+};
+
+void geom_div_init(struct geom_div *v, uint64_t d);
+
+/* n / v->d, storing n % v->d in *rem. */
+static inline uint64_t geom_divmod(const struct geom_div *v, uint64_t n, uint64_t *rem)
+{
+    if (v->shift >= 0)
+    {
+        *rem = n & (v->d - 1);
+        return n >> v->shift;
+    }
+    __extension__ typedef unsigned __int128 u128;
+    uint64_t q = (uint64_t)(((u128)n * v->magic) >> 64); // floor(n / d) or one less
+    uint64_t r = n - q * v->d;
+    if (r >= v->d)
+    {
+        q++;
+        r -= v->d;
+    }
+    *rem = r;
+    return q;
+}
+
+/* Set up the mapping for `ndata` data members and `chunk`-byte chunks.
+ * Returns 0, or -EINVAL if either is zero. */
+int geom_init(struct geometry *g, uint32_t ndata, uint32_t chunk);
+
+/* Number of extents [offset, offset + len) maps to: the chunks it touches. */
+static inline size_t geom_count(const struct geometry *g, uint64_t offset, uint32_t len)
+{
+    uint64_t r0, r1;
+    if (len == 0)
+        return 0;
+    return geom_divmod(&g->by_chunk, offset + len - 1, &r1) - geom_divmod(&g->by_chunk, offset, &r0) + 1;
+}
+
+/* Split [offset, offset + len) of the array into per-chunk extents, in array
+ * order, writing at most `max`. Returns the number of extents the range
+ * needs, which is more than `max` if `ext` was too small. */
+size_t geom_map(const struct geometry *g, uint64_t offset, uint32_t len, struct geom_extent *ext, size_t max);
+
+/* As geom_map(), but with bytes below `split` mapped through `lo` and the
+ * rest through `hi`, for an array that is partly in each layout. */
+size_t geom_map_split(const struct geometry *lo, const struct geometry *hi, uint64_t split,
+                      uint64_t offset, uint32_t len, struct geom_extent *ext, size_t max);
+
+static inline size_t geom_count_split(const struct geometry *lo, const struct geometry *hi, uint64_t split,
+                                      uint64_t offset, uint32_t len)
+{
+    uint32_t below = offset >= split ? 0 : split - offset < len ? split - offset : len;
+    return geom_count(lo, offset, below) + geom_count(hi, offset + below, len - below);
+}
+
+#endif /* GEOMETRY_H_INCLUDED */
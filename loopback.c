@@ -20,87 +20,110 @@
 #define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
-#include <assert.h>
-#include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
-#include <sys/mount.h>
+#include <string.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "member.h"
 
-static int fd;
+/* The physical device. All I/O is positional (no shared file offset) and
+ * keeps no other state, so every callback is safe to run concurrently. */
+static struct member dev;
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage: loopback <phyical device> <virtual device>\n");
+    fprintf(stderr, "Usage: loopback [-d|-m] <phyical device> <virtual device>\n"
+                    "  -d  open the physical device with O_DIRECT\n"
+                    "  -m  map the physical device with mmap and serve requests from the mapping\n");
 }
 
 static int loopback_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
-    int bytes_read;
     (void)(userdata);
 
-    lseek64(fd, offset, SEEK_SET);
-    while (len > 0) {
-        bytes_read = read(fd, buf, len);
-        assert(bytes_read > 0);
-        len -= bytes_read;
-        buf = (char *) buf + bytes_read;
-    }
+    ssize_t r = member_pread(&dev, buf, len, offset);
+    if (r < 0)
+        return r;
+    return r == (ssize_t)len ? 0 : -EIO;
+}
+
+static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata)
+{
+    (void)(userdata);
 
-    return 0;
+    ssize_t r = member_pwrite2(&dev, buf, len, offset, (flags & BUSE_WRITE_FUA) ? MEMBER_WRITE_DSYNC : 0);
+    if (r < 0)
+        return r;
+    return r == (ssize_t)len ? 0 : -EIO;
 }
 
-static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+static int loopback_flush(void *userdata)
 {
-    int bytes_written;
     (void)(userdata);
 
-    lseek64(fd, offset, SEEK_SET);
-    while (len > 0) {
-        bytes_written = write(fd, buf, len);
-        assert(bytes_written > 0);
-        len -= bytes_written;
-        buf = (char *) buf + bytes_written;
-    }
+    return member_flush(&dev, 1);
+}
+
+static int loopback_trim(u_int64_t from, u_int32_t len, void *userdata)
+{
+    (void)(userdata);
 
-    return 0;
+    return member_trim(&dev, from, len);
+}
+
+static int loopback_write_zeroes(u_int64_t from, u_int32_t len, void *userdata)
+{
+    (void)(userdata);
+
+    return member_write_zeroes(&dev, from, len);
 }
 
 static struct buse_operations bop = {
     .read = loopback_read,
-    .write = loopback_write
+    .write_flags = loopback_write,
+    .flush = loopback_flush,
+    .trim = loopback_trim,
+    .write_zeroes = loopback_write_zeroes
 };
 
 int main(int argc, char *argv[])
 {
-    struct stat buf;
+    int flags = 0;
+    int opt;
     int err;
-    int64_t size;
 
-    if (argc != 3) {
+    while ((opt = getopt(argc, argv, "dm")) != -1) {
+        switch (opt) {
+        case 'd':
+            flags |= MEMBER_DIRECT;
+            break;
+        case 'm':
+            flags |= MEMBER_MMAP;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind != 2 || flags == (MEMBER_DIRECT | MEMBER_MMAP)) {
         usage();
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR|O_LARGEFILE);
-    assert(fd != -1);
-
-    /* Let's verify that this file is actually a block device. We could support
-     * regular files, too, but we don't need to right now. */
-    fstat(fd, &buf);
-    assert(S_ISBLK(buf.st_mode));
-
-    /* Figure out the size of the underlying block device. */
-    err = ioctl(fd, BLKGETSIZE64, &size);
-    assert(err != -1);
-    (void)err;
-    fprintf(stderr, "The size of this device is %ld bytes.\n", size);
-    bop.size = size;
+    /* Block devices and regular files (disk images) are both served. */
+    err = member_open(&dev, argv[optind], flags);
+    if (err < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+        return -1;
+    }
+    fprintf(stderr, "The size of this device is %lu bytes.\n", dev.size);
+    bop.size = dev.size;
 
-    buse_main(argv[2], &bop, NULL);
+    err = buse_main(argv[optind + 1], &bop, NULL);
+    member_close(&dev);
 
-    return 0;
+    return err;
 }
@@ -0,0 +1,1660 @@
+/*
+ * member - I/O helpers for the devices underlying a BUSE RAID
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "crc32c.h"
+#include "member.h"
+
+#define IOV_BATCH 64 // iovecs handed to the kernel per preadv/pwritev call
+
+static unsigned int max_align = 512; // largest alignment of any opened member
+static const char *io_cpus;          // CPU set for the I/O workers, see member_cpus
+
+#define FLUSHERS 8 // member arrays whose flushes are collapsed
+
+/* Flush collapsing, per member array. Any flush of the array that starts
+ * after a caller arrives covers every write that caller could have seen
+ * complete. */
+struct flusher
+{
+    struct member *m; // the array, NULL while the slot is unused
+    int n;
+    bool running;
+    uint64_t started;   // generation of the last flush started
+    uint64_t completed; // generation of the last flush finished
+    int result;         // of the last flush finished
+};
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER; // protects flushers
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static struct flusher flushers[FLUSHERS];
+
+#define SCHED_MAX_BYTES (1024 * 1024) // largest merged request
+#define SCHED_MAX_IOV 1024             // iovecs in a merged request
+#define SCHED_DEPTH 32                 // queue depth at which the window is cut short
+
+struct member_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct member_io *head; // pending requests, sorted by offset
+    int depth;
+    uint64_t pos;           // where the last dispatch ended, for the elevator
+    uint64_t window_ns;
+    uint64_t deadline_ns;
+    bool stop;
+
+    uint64_t submitted;
+    uint64_t dispatched; // vectored calls made; submitted - dispatched were merged
+    uint64_t depth_sum;  // queue depth seen by each submission
+    int depth_max;
+    uint64_t expired;    // requests served out of order by the deadline
+
+    int nthreads;
+    pthread_t threads[];
+};
+
+/* Checksums. The data area is followed by a CSUM_BLOCK header and then the
+ * table, one CRC32C per MEMBER_CSUM_UNIT of data. The table is kept in
+ * memory and written back a CSUM_BLOCK at a time after the data it covers. */
+
+#define CSUM_BLOCK 4096                   // header size and table write granularity
+#define CSUM_PER_BLOCK (CSUM_BLOCK / 4)   // table entries per block
+#define CSUM_LOCKS 64
+#define CSUM_MAGIC "BUSECRC1"
+
+static const char zeros[MEMBER_CSUM_UNIT];
+
+struct csum_header
+{
+    char magic[8];
+    uint32_t unit;
+    uint32_t crc; // of the header with this field zero
+    uint64_t data_size;
+};
+
+struct member_csum
+{
+    uint64_t data_size;
+    uint64_t nunits;
+    uint64_t meta_off;  // header offset; the table follows it
+    uint32_t *table;    // in-memory copy, whole blocks
+    // writes hold the lock of every table block they update, so the data,
+    // the readback of partial units and the table write stay together
+    pthread_mutex_t locks[CSUM_LOCKS];
+    uint64_t verified;   // units; updated atomically
+    uint64_t mismatches;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Find the alignment O_DIRECT requires: the logical sector size for block
+ * devices, the file system block size (a safe upper bound) for files. */
+static unsigned int detect_align(int fd)
+{
+    struct stat st;
+    int lbs;
+
+    if (fstat(fd, &st) != 0)
+        return 4096;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &lbs) == 0 && lbs > 0)
+        return lbs;
+    if (st.st_blksize > 0)
+        return st.st_blksize;
+    return 4096;
+}
+
+int member_open(struct member *m, const char *path, int flags)
+{
+    int oflags = O_RDWR | O_LARGEFILE;
+    struct stat st;
+
+    if (flags & MEMBER_DIRECT)
+        oflags |= O_DIRECT;
+
+    m->path = path;
+    m->flags = flags;
+    m->fd = open(path, oflags);
+    if (m->fd < 0)
+        return -errno;
+
+    off_t size = lseek(m->fd, 0, SEEK_END); // used to find device size by seeking to end
+    if (size < 0 || fstat(m->fd, &st) != 0)
+    {
+        int e = errno;
+        close(m->fd);
+        m->fd = -1;
+        return -e;
+    }
+    m->size = size;
+    m->blkdev = S_ISBLK(st.st_mode);
+    m->align = (flags & MEMBER_DIRECT) ? detect_align(m->fd) : 1;
+    if (m->align > max_align)
+        max_align = m->align;
+    m->map = NULL;
+    m->dirty_lo = UINT64_MAX;
+    m->dirty_hi = 0;
+    m->written = 1; // the page cache may hold writes from before we opened it
+    m->queue = NULL;
+    m->csum = NULL;
+    m->max_errors = 0;
+    m->timeout_ms = 0;
+    m->errors = 0;
+    m->failed = 0;
+    pthread_mutex_init(&m->lock, NULL);
+    for (int i = 0; i < MEMBER_EDGE_LOCKS; i++)
+        pthread_mutex_init(&m->edge_locks[i], NULL);
+
+    if (flags & MEMBER_MMAP)
+    {
+        if ((flags & MEMBER_DIRECT) || size == 0)
+        {
+            close(m->fd);
+            m->fd = -1;
+            return -EINVAL;
+        }
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+        if (p == MAP_FAILED)
+        {
+            int e = errno;
+            close(m->fd);
+            m->fd = -1;
+            return -e;
+        }
+        m->map = p;
+#ifdef MADV_HUGEPAGE
+        madvise(m->map, size, MADV_HUGEPAGE); // best effort: only shmem/tmpfs and some file systems honour it
+#endif
+    }
+    return 0;
+}
+
+void member_set_missing(struct member *m)
+{
+    m->fd = -1;
+    m->path = NULL;
+    m->size = 0;
+    m->align = 1;
+    m->flags = 0;
+    m->blkdev = 0;
+    m->map = NULL;
+    m->written = 0;
+    m->queue = NULL;
+    m->csum = NULL;
+    m->max_errors = 0;
+    m->timeout_ms = 0;
+    m->errors = 0;
+    m->failed = 1;
+}
+
+void member_health(struct member *m, unsigned int max_errors, unsigned int timeout_ms)
+{
+    m->max_errors = max_errors;
+    m->timeout_ms = timeout_ms;
+}
+
+bool member_failed(struct member *m)
+{
+    return __atomic_load_n(&m->failed, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Count an error against `m`, failing it at once if `fatal` or else once it
+ * has had too many. */
+static void note_error(struct member *m, bool fatal, const char *what)
+{
+    unsigned int n = __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+    if ((fatal || n >= m->max_errors) && !__atomic_exchange_n(&m->failed, 1, __ATOMIC_ACQ_REL))
+        fprintf(stderr, "%s: failed after %u error%s (last: %s)\n", m->path, n, n == 1 ? "" : "s", what);
+}
+
+#define LAT_DECAY 4096 // halve the histogram after this many samples
+#define LAT_MIN_SAMPLES 64
+
+/* Quarter-octave bucket of a latency: 1 us and below in bucket 0, 16 s and
+ * above in the top one. */
+static int lat_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    if (us <= 1)
+        return 0;
+    int octave = 63 - __builtin_clzll(us);
+    int quarter = octave >= 2 ? (us >> (octave - 2)) & 3 : 0;
+    int b = octave * 4 + quarter;
+    return b < MEMBER_LAT_BUCKETS ? b : MEMBER_LAT_BUCKETS - 1;
+}
+
+/* Upper bound of bucket `b` in ns. */
+static uint64_t lat_bound(int b)
+{
+    int octave = b / 4;
+    uint64_t us = (1ULL << octave) + (((1ULL << octave) * (b % 4 + 1)) >> 2);
+    return us * 1000;
+}
+
+static void note_latency(struct member *m, uint64_t ns)
+{
+    __atomic_add_fetch(&m->lat[lat_bucket(ns)], 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&m->lat_samples, 1, __ATOMIC_RELAXED) % LAT_DECAY == 0)
+    {
+        // age out old samples so the percentile follows the device
+        for (int i = 0; i < MEMBER_LAT_BUCKETS; i++)
+            __atomic_store_n(&m->lat[i], __atomic_load_n(&m->lat[i], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t member_read_p95(struct member *m)
+{
+    unsigned int counts[MEMBER_LAT_BUCKETS];
+    uint64_t total = 0;
+    if (__atomic_load_n(&m->lat_samples, __ATOMIC_RELAXED) < LAT_MIN_SAMPLES)
+        return 0;
+    for (int i = 0; i < MEMBER_LAT_BUCKETS; i++)
+        total += counts[i] = __atomic_load_n(&m->lat[i], __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    for (int i = 0; i < MEMBER_LAT_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen * 100 >= total * 95)
+            return lat_bound(i);
+    }
+    return 0;
+}
+
+/* Account for the result `r` of an `op` (MEMBER_IO_*) issued at `start`.
+ * Checksum mismatches and running out of memory are not the device's fault. */
+static ssize_t note_result(struct member *m, int op, ssize_t r, uint64_t start)
+{
+    static const char *const names[] = {"read", "write", "sync"};
+    char what[64];
+
+    if (op == MEMBER_IO_READ && r >= 0)
+        note_latency(m, now_ns() - start);
+    if (m->max_errors == 0)
+        return r;
+    if (r < 0 && r != -EBADMSG && r != -ENOMEM)
+    {
+        snprintf(what, sizeof(what), "%s: %s", names[op], strerror(-r));
+        note_error(m, op != MEMBER_IO_READ, what);
+    }
+    else if (m->timeout_ms > 0 && now_ns() - start > m->timeout_ms * 1000000ULL)
+    {
+        snprintf(what, sizeof(what), "%s took %lu ms", names[op], (now_ns() - start) / 1000000);
+        note_error(m, false, what);
+    }
+    return r;
+}
+
+static void member_stop(struct member *m)
+{
+    struct member_queue *q = m->queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; i++)
+        pthread_join(q->threads[i], NULL);
+    free(q);
+    m->queue = NULL;
+}
+
+void member_close(struct member *m)
+{
+    member_stop(m);
+    if (m->csum != NULL)
+        free(m->csum->table);
+    free(m->csum);
+    m->csum = NULL;
+    if (m->map != NULL)
+        munmap(m->map, m->size);
+    m->map = NULL;
+    if (m->fd != -1)
+        close(m->fd);
+    m->fd = -1;
+}
+
+void *member_alloc(size_t len)
+{
+    size_t align = max_align;
+    long page = sysconf(_SC_PAGESIZE);
+    void *p;
+
+    if (page > 0 && (size_t)page > align)
+        align = page;
+    len = (len + align - 1) / align * align;
+    if (len == 0)
+        len = align;
+    if (posix_memalign(&p, align, len) != 0)
+        return NULL;
+    return p;
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+static int iov_aligned(const struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    if (m->align <= 1)
+        return 1;
+    if (offset % m->align != 0)
+        return 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if ((uintptr_t)iov[i].iov_base % m->align != 0 || iov[i].iov_len % m->align != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int no_rwf_dsync; // set once pwritev2(RWF_DSYNC) turns out to be unsupported
+
+/* Positional vectored transfer that keeps going after short transfers.
+ * Reads stop early at end of file; returns bytes moved or -errno. Writes
+ * with `dsync` set are durable on return. */
+static ssize_t rw_full(int fd, const struct iovec *iov, int iovcnt, uint64_t offset, int write, int dsync)
+{
+    size_t total = iov_total(iov, iovcnt);
+    size_t done = 0;
+    size_t skip = 0; // bytes of iov[0] already transferred
+
+    while (done < total)
+    {
+        struct iovec batch[IOV_BATCH];
+        int n = 0;
+
+        for (int i = 0; i < iovcnt && n < IOV_BATCH; i++)
+        {
+            batch[n].iov_base = (char *)iov[i].iov_base + (i == 0 ? skip : 0);
+            batch[n].iov_len = iov[i].iov_len - (i == 0 ? skip : 0);
+            n++;
+        }
+        ssize_t r;
+        if (!write)
+            r = preadv(fd, batch, n, offset + done);
+        else if (dsync && !__atomic_load_n(&no_rwf_dsync, __ATOMIC_RELAXED))
+            r = pwritev2(fd, batch, n, offset + done, RWF_DSYNC);
+        else
+            r = pwritev(fd, batch, n, offset + done);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (dsync && (errno == EOPNOTSUPP || errno == ENOSYS) && !no_rwf_dsync)
+            {
+                __atomic_store_n(&no_rwf_dsync, 1, __ATOMIC_RELAXED);
+                continue; // retry as a plain write, synced below
+            }
+            return -errno;
+        }
+        if (r == 0)
+        {
+            if (write)
+                return -EIO;
+            break; // end of file
+        }
+        done += r;
+        // advance past the iovecs that are now complete
+        skip += r;
+        while (iovcnt > 0 && skip >= iov[0].iov_len)
+        {
+            skip -= iov[0].iov_len;
+            iov++;
+            iovcnt--;
+        }
+    }
+    if (write && dsync && __atomic_load_n(&no_rwf_dsync, __ATOMIC_RELAXED) && fdatasync(fd) != 0)
+        return -errno;
+    return done;
+}
+
+static void note_dirty(struct member *m, uint64_t lo, uint64_t hi)
+{
+    pthread_mutex_lock(&m->lock);
+    if (lo < m->dirty_lo)
+        m->dirty_lo = lo;
+    if (hi > m->dirty_hi)
+        m->dirty_hi = hi;
+    pthread_mutex_unlock(&m->lock);
+}
+
+static ssize_t raw_preadv(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    size_t len = iov_total(iov, iovcnt);
+
+    if (m->fd == -1)
+        return -EIO;
+    if (m->map != NULL)
+    {
+        if (offset >= m->size)
+            return 0;
+        if (len > m->size - offset)
+            len = m->size - offset;
+        size_t done = 0;
+        for (int i = 0; i < iovcnt && done < len; i++)
+        {
+            size_t n = iov[i].iov_len < len - done ? iov[i].iov_len : len - done;
+            memcpy(iov[i].iov_base, m->map + offset + done, n);
+            done += n;
+        }
+        return len;
+    }
+    if (iov_aligned(m, iov, iovcnt, offset))
+        return rw_full(m->fd, iov, iovcnt, offset, 0, 0);
+
+    // widen to whole logical blocks and read through a bounce buffer
+    uint64_t lo = offset / m->align * m->align;
+    uint64_t hi = (offset + len + m->align - 1) / m->align * m->align;
+    struct iovec biov = {member_alloc(hi - lo), hi - lo};
+    if (biov.iov_base == NULL)
+        return -ENOMEM;
+
+    ssize_t r = rw_full(m->fd, &biov, 1, lo, 0, 0);
+    if (r >= 0)
+    {
+        size_t head = offset - lo;
+        r = (size_t)r > head ? (size_t)r - head : 0;
+        if ((size_t)r > len)
+            r = len;
+        size_t done = 0;
+        for (int i = 0; i < iovcnt && done < (size_t)r; i++)
+        {
+            size_t n = iov[i].iov_len < r - done ? iov[i].iov_len : r - done;
+            memcpy(iov[i].iov_base, (char *)biov.iov_base + head + done, n);
+            done += n;
+        }
+    }
+    free(biov.iov_base);
+    return r;
+}
+
+#define EDGE_SPAN (256 << 10) // bytes of the member per edge lock, the locks taken round robin
+
+/* Take or release the edge locks of the bytes [lo, hi), lower index first.
+ * A write that read-modify-writes partial O_DIRECT blocks holds them from
+ * the read to the write, and every other O_DIRECT write for its write, so
+ * no write puts back a block another has changed in the meantime. */
+static void edge_lock(struct member *m, uint64_t lo, uint64_t hi, bool lock)
+{
+    unsigned int mask = 0;
+    for (uint64_t s = lo / EDGE_SPAN; s <= (hi - 1) / EDGE_SPAN && s < lo / EDGE_SPAN + MEMBER_EDGE_LOCKS; s++)
+        mask |= 1u << (s % MEMBER_EDGE_LOCKS);
+    for (int i = 0; i < MEMBER_EDGE_LOCKS; i++)
+    {
+        if (!(mask & (1u << i)))
+            continue;
+        if (lock)
+            pthread_mutex_lock(&m->edge_locks[i]);
+        else
+            pthread_mutex_unlock(&m->edge_locks[i]);
+    }
+}
+
+static ssize_t raw_pwritev2(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset, int flags)
+{
+    size_t len = iov_total(iov, iovcnt);
+    int dsync = (flags & MEMBER_WRITE_DSYNC) != 0;
+
+    if (m->fd == -1)
+        return -EIO;
+    __atomic_store_n(&m->written, 1, __ATOMIC_RELEASE);
+    if (m->map != NULL)
+    {
+        if (offset > m->size || len > m->size - offset)
+            return -ENOSPC; // a mapping can't grow the member
+        size_t done = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(m->map + offset + done, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+        if (dsync)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            uint64_t lo = offset / page * page;
+            if (msync(m->map + lo, offset + len - lo, MS_SYNC) != 0)
+                return -errno;
+            return len;
+        }
+        note_dirty(m, offset, offset + len);
+        return len;
+    }
+    if (iov_aligned(m, iov, iovcnt, offset))
+    {
+        if (m->align <= 1 || len == 0)
+            return rw_full(m->fd, iov, iovcnt, offset, 1, dsync);
+        edge_lock(m, offset, offset + len, true);
+        ssize_t r = rw_full(m->fd, iov, iovcnt, offset, 1, dsync);
+        edge_lock(m, offset, offset + len, false);
+        return r;
+    }
+
+    uint64_t lo = offset / m->align * m->align;
+    uint64_t hi = (offset + len + m->align - 1) / m->align * m->align;
+    struct iovec biov = {member_alloc(hi - lo), hi - lo};
+    char *bounce = biov.iov_base;
+    if (bounce == NULL)
+        return -ENOMEM;
+
+    // read-modify-write the partially covered first and last logical blocks,
+    // keeping other writes to them out until ours is down
+    ssize_t r = 0;
+    memset(bounce, 0, hi - lo);
+    edge_lock(m, lo, hi, true);
+    if (offset != lo)
+    {
+        struct iovec edge = {bounce, m->align};
+        r = rw_full(m->fd, &edge, 1, lo, 0, 0);
+    }
+    if (r >= 0 && (offset + len) % m->align != 0 && (hi - m->align != lo || offset == lo))
+    {
+        struct iovec edge = {bounce + (hi - lo - m->align), m->align};
+        r = rw_full(m->fd, &edge, 1, hi - m->align, 0, 0);
+    }
+    if (r >= 0)
+    {
+        size_t done = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(bounce + (offset - lo) + done, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+        r = rw_full(m->fd, &biov, 1, lo, 1, dsync);
+        if (r >= 0)
+            r = len;
+    }
+    edge_lock(m, lo, hi, false);
+    free(bounce);
+    return r;
+}
+
+static ssize_t raw_pread(struct member *m, void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {buf, len};
+    return raw_preadv(m, &iov, 1, offset);
+}
+
+static ssize_t raw_pwrite(struct member *m, const void *buf, size_t len, uint64_t offset, int flags)
+{
+    struct iovec iov = {(void *)buf, len};
+    return raw_pwritev2(m, &iov, 1, offset, flags);
+}
+
+static uint64_t csum_meta_off(uint64_t data_size)
+{
+    return (data_size + CSUM_BLOCK - 1) / CSUM_BLOCK * CSUM_BLOCK;
+}
+
+static uint64_t csum_table_bytes(uint64_t nunits)
+{
+    return (nunits * 4 + CSUM_BLOCK - 1) / CSUM_BLOCK * CSUM_BLOCK;
+}
+
+static uint64_t csum_nunits(uint64_t data_size)
+{
+    return (data_size + MEMBER_CSUM_UNIT - 1) / MEMBER_CSUM_UNIT;
+}
+
+uint64_t member_csum_capacity(uint64_t size)
+{
+    if (size < 2 * CSUM_BLOCK + MEMBER_CSUM_UNIT)
+        return 0;
+    uint64_t d = (size - 2 * CSUM_BLOCK) / (MEMBER_CSUM_UNIT + 4) * MEMBER_CSUM_UNIT;
+    while (d > 0 && csum_meta_off(d) + CSUM_BLOCK + csum_table_bytes(csum_nunits(d)) > size)
+        d -= MEMBER_CSUM_UNIT;
+    return d;
+}
+
+static uint32_t header_crc(struct csum_header h)
+{
+    h.crc = 0;
+    return crc32c(0, &h, sizeof(h));
+}
+
+/* Compute the table from the data, then write it and a header naming the
+ * layout. Used when a member is formatted with checksums. */
+static int csum_build(struct member *m, struct member_csum *c)
+{
+    size_t chunk = 1024 * 1024;
+    char *buf = member_alloc(chunk);
+    char *hb = member_alloc(CSUM_BLOCK);
+    int err = 0;
+
+    if (buf == NULL || hb == NULL)
+        err = -ENOMEM;
+    fprintf(stderr, "%s: computing checksums...\n", m->path);
+    for (uint64_t pos = 0; err == 0 && pos < c->data_size; pos += chunk)
+    {
+        size_t n = c->data_size - pos < chunk ? c->data_size - pos : chunk;
+        ssize_t r = raw_pread(m, buf, n, pos);
+        if (r != (ssize_t)n)
+        {
+            err = r < 0 ? r : -EIO;
+            break;
+        }
+        for (size_t k = 0; k < n; k += MEMBER_CSUM_UNIT)
+        {
+            size_t u = n - k < MEMBER_CSUM_UNIT ? n - k : MEMBER_CSUM_UNIT;
+            c->table[(pos + k) / MEMBER_CSUM_UNIT] = crc32c(0, buf + k, u);
+        }
+    }
+    uint64_t tbytes = csum_table_bytes(c->nunits);
+    if (err == 0 && raw_pwrite(m, c->table, tbytes, c->meta_off + CSUM_BLOCK, 0) != (ssize_t)tbytes)
+        err = -EIO;
+    if (err == 0)
+    {
+        // the header goes last, once the table it vouches for is in place
+        struct csum_header h = {CSUM_MAGIC, MEMBER_CSUM_UNIT, 0, c->data_size};
+        h.crc = header_crc(h);
+        memset(hb, 0, CSUM_BLOCK);
+        memcpy(hb, &h, sizeof(h));
+        if (member_sync(m) != 0 || raw_pwrite(m, hb, CSUM_BLOCK, c->meta_off, MEMBER_WRITE_DSYNC) != CSUM_BLOCK)
+            err = -EIO;
+    }
+    free(hb);
+    free(buf);
+    return err;
+}
+
+int member_csum_enable(struct member *m, uint64_t data_size, bool format)
+{
+    if (m->fd == -1 || m->csum != NULL)
+        return 0;
+    struct member_csum *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return -ENOMEM;
+    c->data_size = data_size;
+    c->nunits = csum_nunits(data_size);
+    c->meta_off = csum_meta_off(data_size);
+    uint64_t tbytes = csum_table_bytes(c->nunits);
+    if (c->meta_off + CSUM_BLOCK + tbytes > m->size)
+    {
+        free(c);
+        return -ENOSPC;
+    }
+    c->table = member_alloc(tbytes);
+    char *hb = member_alloc(CSUM_BLOCK);
+    if (c->table == NULL || hb == NULL)
+    {
+        free(hb);
+        free(c->table);
+        free(c);
+        return -ENOMEM;
+    }
+    memset(c->table, 0, tbytes);
+    for (int i = 0; i < CSUM_LOCKS; i++)
+        pthread_mutex_init(&c->locks[i], NULL);
+
+    struct csum_header h;
+    int err = 0;
+    if (raw_pread(m, hb, CSUM_BLOCK, c->meta_off) == CSUM_BLOCK)
+        memcpy(&h, hb, sizeof(h));
+    else
+        memset(&h, 0, sizeof(h));
+    free(hb);
+    if (memcmp(h.magic, CSUM_MAGIC, sizeof(h.magic)) == 0 && h.unit == MEMBER_CSUM_UNIT &&
+        h.data_size == data_size && h.crc == header_crc(h))
+    {
+        if (raw_pread(m, c->table, tbytes, c->meta_off + CSUM_BLOCK) != (ssize_t)tbytes)
+            err = -EIO;
+    }
+    else if (format)
+    {
+        err = csum_build(m, c);
+    }
+    else
+    {
+        err = -ENODATA; // the tail may hold data rather than a table
+    }
+    if (err != 0)
+    {
+        free(c->table);
+        free(c);
+        return err;
+    }
+    m->csum = c;
+    return 0;
+}
+
+/* Walks an iovec array as one byte stream. */
+struct iov_cursor
+{
+    const struct iovec *iov;
+    int iovcnt;
+    size_t skip; // bytes of iov[0] already consumed
+};
+
+static uint32_t cursor_crc(struct iov_cursor *cur, size_t len)
+{
+    uint32_t crc = 0;
+
+    while (len > 0 && cur->iovcnt > 0)
+    {
+        size_t n = cur->iov->iov_len - cur->skip;
+        if (n > len)
+            n = len;
+        crc = crc32c(crc, (const char *)cur->iov->iov_base + cur->skip, n);
+        len -= n;
+        cur->skip += n;
+        if (cur->skip == cur->iov->iov_len)
+        {
+            cur->iov++;
+            cur->iovcnt--;
+            cur->skip = 0;
+        }
+    }
+    return crc;
+}
+
+static size_t unit_len(const struct member_csum *c, uint64_t u)
+{
+    uint64_t start = u * MEMBER_CSUM_UNIT;
+    return c->data_size - start < MEMBER_CSUM_UNIT ? c->data_size - start : MEMBER_CSUM_UNIT;
+}
+
+/* Check units [u0, u1] against data starting at the cursor. */
+static int csum_verify(struct member *m, struct iov_cursor *cur, uint64_t u0, uint64_t u1)
+{
+    struct member_csum *c = m->csum;
+
+    for (uint64_t u = u0; u <= u1; u++)
+    {
+        if (cursor_crc(cur, unit_len(c, u)) != __atomic_load_n(&c->table[u], __ATOMIC_RELAXED))
+        {
+            __atomic_fetch_add(&c->mismatches, 1, __ATOMIC_RELAXED);
+            fprintf(stderr, "%s: checksum mismatch at offset %lu\n", m->path, u * MEMBER_CSUM_UNIT);
+            return -EBADMSG;
+        }
+    }
+    __atomic_fetch_add(&c->verified, u1 - u0 + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static ssize_t csum_preadv(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct member_csum *c = m->csum;
+    size_t len = iov_total(iov, iovcnt);
+
+    if (len == 0 || offset + len > c->data_size)
+        return raw_preadv(m, iov, iovcnt, offset);
+    uint64_t u0 = offset / MEMBER_CSUM_UNIT;
+    uint64_t u1 = (offset + len - 1) / MEMBER_CSUM_UNIT;
+    uint64_t lo = u0 * MEMBER_CSUM_UNIT;
+    uint64_t hi = lo;
+    for (uint64_t u = u0; u <= u1; u++)
+        hi += unit_len(c, u);
+
+    if (lo == offset && hi == offset + len)
+    {
+        ssize_t r = raw_preadv(m, iov, iovcnt, offset);
+        if (r != (ssize_t)len)
+            return r;
+        struct iov_cursor cur = {iov, iovcnt, 0};
+        int err = csum_verify(m, &cur, u0, u1);
+        return err != 0 ? err : r;
+    }
+
+    // whole units are needed to check the partial ones at either end
+    struct iovec biov = {member_alloc(hi - lo), hi - lo};
+    if (biov.iov_base == NULL)
+        return -ENOMEM;
+    ssize_t r = raw_preadv(m, &biov, 1, lo);
+    if (r == (ssize_t)(hi - lo))
+    {
+        struct iov_cursor cur = {&biov, 1, 0};
+        r = csum_verify(m, &cur, u0, u1);
+        size_t done = 0;
+        for (int i = 0; r == 0 && i < iovcnt; i++)
+        {
+            memcpy(iov[i].iov_base, (char *)biov.iov_base + (offset - lo) + done, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+        if (r == 0)
+            r = len;
+    }
+    else if (r >= 0)
+    {
+        r = -EIO;
+    }
+    free(biov.iov_base);
+    return r;
+}
+
+/* Take or release the locks of the table blocks covering units [u0, u1], in
+ * index order. */
+static void csum_lock(struct member_csum *c, uint64_t u0, uint64_t u1, bool lock)
+{
+    uint64_t mask = 0;
+    for (uint64_t b = u0 / CSUM_PER_BLOCK; b <= u1 / CSUM_PER_BLOCK && b < u0 / CSUM_PER_BLOCK + CSUM_LOCKS; b++)
+        mask |= 1ULL << (b % CSUM_LOCKS);
+    for (int i = 0; i < CSUM_LOCKS; i++)
+    {
+        if (!(mask & (1ULL << i)))
+            continue;
+        if (lock)
+            pthread_mutex_lock(&c->locks[i]);
+        else
+            pthread_mutex_unlock(&c->locks[i]);
+    }
+}
+
+/* A write's partially covered first and last units. Their other bytes are
+ * read and checked before the write, so the new checksum doesn't vouch for
+ * data that was already corrupt. */
+struct csum_edges
+{
+    uint64_t unit[2];
+    char *buf[2]; // NULL if that end is unit-aligned
+};
+
+static bool unit_covered(const struct member_csum *c, uint64_t u, uint64_t offset, size_t len)
+{
+    uint64_t start = u * MEMBER_CSUM_UNIT;
+    return start >= offset && start + unit_len(c, u) <= offset + len;
+}
+
+static void edges_free(struct csum_edges *e)
+{
+    free(e->buf[0]);
+    free(e->buf[1]);
+}
+
+static int edges_read(struct member *m, struct csum_edges *e, uint64_t offset, size_t len)
+{
+    struct member_csum *c = m->csum;
+
+    e->unit[0] = offset / MEMBER_CSUM_UNIT;
+    e->unit[1] = (offset + len - 1) / MEMBER_CSUM_UNIT;
+    e->buf[0] = e->buf[1] = NULL;
+    for (int k = 0; k < 2; k++)
+    {
+        uint64_t u = e->unit[k];
+        if (unit_covered(c, u, offset, len) || (k == 1 && u == e->unit[0]))
+            continue;
+        size_t n = unit_len(c, u);
+        struct iovec iov = {member_alloc(MEMBER_CSUM_UNIT), n};
+        e->buf[k] = iov.iov_base;
+        if (iov.iov_base == NULL)
+        {
+            edges_free(e);
+            return -ENOMEM;
+        }
+        if (raw_preadv(m, &iov, 1, u * MEMBER_CSUM_UNIT) != (ssize_t)n)
+        {
+            edges_free(e);
+            return -EIO;
+        }
+        struct iov_cursor cur = {&iov, 1, 0};
+        int err = csum_verify(m, &cur, u, u);
+        if (err != 0)
+        {
+            edges_free(e);
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Copy the next `len` bytes at the cursor to `dst` (zeros if there's no
+ * cursor). */
+static void cursor_copy(struct iov_cursor *cur, char *dst, size_t len)
+{
+    while (len > 0 && cur->iovcnt > 0)
+    {
+        size_t n = cur->iov->iov_len - cur->skip;
+        if (n > len)
+            n = len;
+        memcpy(dst, (const char *)cur->iov->iov_base + cur->skip, n);
+        dst += n;
+        len -= n;
+        cur->skip += n;
+        if (cur->skip == cur->iov->iov_len)
+        {
+            cur->iov++;
+            cur->iovcnt--;
+            cur->skip = 0;
+        }
+    }
+    memset(dst, 0, len);
+}
+
+/* Recompute the checksums of [offset, offset + len) once it has been written
+ * with `iov` (NULL for zeros), and write the table blocks they live in.
+ * Called with the locks held. */
+static int csum_update(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset, size_t len,
+                       struct csum_edges *e, int flags)
+{
+    struct member_csum *c = m->csum;
+    struct iov_cursor cur = {iov, iov != NULL ? iovcnt : 0, 0};
+
+    for (uint64_t u = e->unit[0]; u <= e->unit[1]; u++)
+    {
+        uint64_t start = u * MEMBER_CSUM_UNIT;
+        size_t n = unit_len(c, u);
+        uint32_t crc;
+        if (unit_covered(c, u, offset, len))
+        {
+            crc = iov != NULL ? cursor_crc(&cur, n) : crc32c(0, zeros, n);
+        }
+        else
+        {
+            // patch the new bytes into the unit as it was read beforehand
+            char *buf = e->buf[u == e->unit[0] ? 0 : 1];
+            uint64_t from = start > offset ? start : offset;
+            uint64_t to = start + n < offset + len ? start + n : offset + len;
+            cursor_copy(&cur, buf + (from - start), to - from);
+            crc = crc32c(0, buf, n);
+        }
+        __atomic_store_n(&c->table[u], crc, __ATOMIC_RELAXED);
+    }
+
+    uint64_t b0 = e->unit[0] / CSUM_PER_BLOCK;
+    uint64_t b1 = e->unit[1] / CSUM_PER_BLOCK;
+    size_t n = (b1 - b0 + 1) * CSUM_BLOCK;
+    if (raw_pwrite(m, c->table + b0 * CSUM_PER_BLOCK, n, c->meta_off + CSUM_BLOCK + b0 * CSUM_BLOCK,
+                   flags) != (ssize_t)n)
+        return -EIO;
+    return 0;
+}
+
+static ssize_t csum_pwritev2(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset, int flags)
+{
+    struct member_csum *c = m->csum;
+    size_t len = iov_total(iov, iovcnt);
+    struct csum_edges e;
+
+    if (len == 0 || offset + len > c->data_size)
+        return raw_pwritev2(m, iov, iovcnt, offset, flags);
+    uint64_t u0 = offset / MEMBER_CSUM_UNIT;
+    uint64_t u1 = (offset + len - 1) / MEMBER_CSUM_UNIT;
+    csum_lock(c, u0, u1, true);
+    ssize_t r = edges_read(m, &e, offset, len);
+    if (r == 0)
+    {
+        r = raw_pwritev2(m, iov, iovcnt, offset, flags);
+        if (r == (ssize_t)len)
+        {
+            int err = csum_update(m, iov, iovcnt, offset, len, &e, flags);
+            if (err != 0)
+                r = err;
+        }
+        edges_free(&e);
+    }
+    csum_lock(c, u0, u1, false);
+    return r;
+}
+
+ssize_t member_preadv(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    if (member_failed(m))
+        return -EIO;
+    uint64_t start = m->timeout_ms > 0 ? now_ns() : 0;
+    ssize_t r = m->csum != NULL ? csum_preadv(m, iov, iovcnt, offset) : raw_preadv(m, iov, iovcnt, offset);
+    return note_result(m, MEMBER_IO_READ, r, start);
+}
+
+ssize_t member_pwritev2(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset, int flags)
+{
+    if (member_failed(m))
+        return -EIO;
+    uint64_t start = m->timeout_ms > 0 ? now_ns() : 0;
+    ssize_t r = m->csum != NULL ? csum_pwritev2(m, iov, iovcnt, offset, flags)
+                                : raw_pwritev2(m, iov, iovcnt, offset, flags);
+    return note_result(m, MEMBER_IO_WRITE, r, start);
+}
+
+ssize_t member_pwritev(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    return member_pwritev2(m, iov, iovcnt, offset, 0);
+}
+
+ssize_t member_pread(struct member *m, void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {buf, len};
+    return member_preadv(m, &iov, 1, offset);
+}
+
+ssize_t member_pwrite(struct member *m, const void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {(void *)buf, len};
+    return member_pwritev(m, &iov, 1, offset);
+}
+
+ssize_t member_pwrite2(struct member *m, const void *buf, size_t len, uint64_t offset, int flags)
+{
+    struct iovec iov = {(void *)buf, len};
+    return member_pwritev2(m, &iov, 1, offset, flags);
+}
+
+static int raw_sync(struct member *m)
+{
+    // clear before syncing, so a write racing with the sync marks it again
+    if (!__atomic_exchange_n(&m->written, 0, __ATOMIC_ACQ_REL))
+        return 0;
+    if (m->map != NULL)
+    {
+        pthread_mutex_lock(&m->lock);
+        uint64_t lo = m->dirty_lo;
+        uint64_t hi = m->dirty_hi;
+        m->dirty_lo = UINT64_MAX;
+        m->dirty_hi = 0;
+        pthread_mutex_unlock(&m->lock);
+        if (lo >= hi)
+            return 0; // nothing written since the last sync
+        // msync wants a page-aligned start
+        long page = sysconf(_SC_PAGESIZE);
+        lo = lo / page * page;
+        if (msync(m->map + lo, hi - lo, MS_SYNC) != 0)
+        {
+            int e = errno;
+            note_dirty(m, lo, hi); // still dirty; retry on the next sync
+            __atomic_store_n(&m->written, 1, __ATOMIC_RELEASE);
+            return -e;
+        }
+        return 0;
+    }
+    if (fdatasync(m->fd) != 0)
+    {
+        int e = errno;
+        __atomic_store_n(&m->written, 1, __ATOMIC_RELEASE);
+        return -e;
+    }
+    return 0;
+}
+
+int member_sync(struct member *m)
+{
+    if (m->fd == -1)
+        return 0;
+    if (member_failed(m))
+        return -EIO;
+    uint64_t start = m->timeout_ms > 0 ? now_ns() : 0;
+    return note_result(m, MEMBER_IO_SYNC, raw_sync(m), start);
+}
+
+/* Sync the written members in parallel: one inline, the rest on their I/O
+ * workers, which are started the first time they are needed. */
+static int flush_members(struct member *m, int n)
+{
+    struct member_io io[n];
+    struct member_batch batch;
+    int self = -1;
+
+    member_batch_init(&batch);
+    for (int i = 0; i < n; i++)
+    {
+        if (member_failed(&m[i]) || !__atomic_load_n(&m[i].written, __ATOMIC_ACQUIRE))
+            continue;
+        if (self < 0)
+        {
+            self = i;
+            continue;
+        }
+        member_start(&m[i], 1); // on failure member_submit runs the sync inline
+        io[i].op = MEMBER_IO_SYNC;
+        io[i].flags = 0;
+        io[i].iov = NULL;
+        io[i].iovcnt = 0;
+        io[i].offset = 0;
+        member_submit(&m[i], &io[i], &batch);
+    }
+    int err = self >= 0 ? member_sync(&m[self]) : 0;
+    int err2 = member_batch_wait(&batch);
+    return err != 0 ? err : err2;
+}
+
+int member_flush(struct member *m, int n)
+{
+    pthread_mutex_lock(&flush_lock);
+    struct flusher *f = NULL;
+    for (int i = 0; i < FLUSHERS && f == NULL; i++)
+    {
+        if (flushers[i].m == m && flushers[i].n == n)
+            f = &flushers[i];
+    }
+    for (int i = 0; i < FLUSHERS && f == NULL; i++)
+    {
+        if (flushers[i].m == NULL)
+        {
+            f = &flushers[i];
+            f->m = m;
+            f->n = n;
+        }
+    }
+    if (f == NULL)
+    {
+        pthread_mutex_unlock(&flush_lock);
+        return flush_members(m, n); // too many arrays to keep track of
+    }
+
+    uint64_t target = f->started + 1;
+    while (f->completed < target)
+    {
+        if (f->running)
+        {
+            pthread_cond_wait(&flush_done, &flush_lock);
+            continue;
+        }
+        f->running = true;
+        uint64_t gen = ++f->started;
+        pthread_mutex_unlock(&flush_lock);
+
+        int r = flush_members(m, n);
+
+        pthread_mutex_lock(&flush_lock);
+        f->running = false;
+        f->completed = gen;
+        f->result = r;
+        pthread_cond_broadcast(&flush_done);
+    }
+    int r = f->result;
+    pthread_mutex_unlock(&flush_lock);
+    return r;
+}
+
+int member_trim(struct member *m, uint64_t offset, uint64_t len)
+{
+    if (member_failed(m))
+        return -EIO;
+    if (m->csum != NULL)
+        return member_write_zeroes(m, offset, len);
+    __atomic_store_n(&m->written, 1, __ATOMIC_RELEASE);
+    if (m->blkdev)
+    {
+        uint64_t range[2] = {offset, len};
+        if (ioctl(m->fd, BLKDISCARD, range) != 0)
+            return -errno;
+        return 0;
+    }
+    if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) != 0)
+        return -errno;
+    return 0;
+}
+
+static int zero_range(struct member *m, uint64_t offset, uint64_t len)
+{
+    __atomic_store_n(&m->written, 1, __ATOMIC_RELEASE);
+    if (m->blkdev)
+    {
+        uint64_t range[2] = {offset, len};
+        if (ioctl(m->fd, BLKZEROOUT, range) == 0)
+            return 0;
+    }
+    else
+    {
+        if (fallocate(m->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            return 0;
+        // a punched hole reads back as zeros too
+        if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOTTY)
+        return -errno;
+
+    // no offload available: write zeros
+    size_t chunk = len < 1024 * 1024 ? len : 1024 * 1024;
+    char *zero = member_alloc(chunk);
+    if (zero == NULL)
+        return -ENOMEM;
+    memset(zero, 0, chunk);
+    ssize_t r = 0;
+    for (uint64_t done = 0; done < len && r >= 0; done += chunk)
+    {
+        size_t n = len - done < chunk ? len - done : chunk;
+        r = raw_pwrite(m, zero, n, offset + done, 0);
+    }
+    free(zero);
+    return r < 0 ? r : 0;
+}
+
+int member_write_zeroes(struct member *m, uint64_t offset, uint64_t len)
+{
+    struct member_csum *c = m->csum;
+
+    if (member_failed(m))
+        return -EIO;
+    if (c == NULL || len == 0 || offset + len > c->data_size)
+        return zero_range(m, offset, len);
+    uint64_t u0 = offset / MEMBER_CSUM_UNIT;
+    uint64_t u1 = (offset + len - 1) / MEMBER_CSUM_UNIT;
+    struct csum_edges e;
+    csum_lock(c, u0, u1, true);
+    int r = edges_read(m, &e, offset, len);
+    if (r == 0)
+    {
+        r = zero_range(m, offset, len);
+        if (r == 0)
+            r = csum_update(m, NULL, 0, offset, len, &e, 0);
+        edges_free(&e);
+    }
+    csum_lock(c, u0, u1, false);
+    return r;
+}
+
+void member_advise(struct member *m, int advice)
+{
+    if (m->fd == -1)
+        return;
+    if (m->map != NULL)
+    {
+        switch (advice)
+        {
+        case MEMBER_ADV_SEQUENTIAL:
+            madvise(m->map, m->size, MADV_SEQUENTIAL);
+            break;
+        case MEMBER_ADV_RANDOM:
+            madvise(m->map, m->size, MADV_RANDOM);
+            break;
+        default:
+            madvise(m->map, m->size, MADV_NORMAL);
+        }
+    }
+    else
+    {
+        switch (advice)
+        {
+        case MEMBER_ADV_SEQUENTIAL:
+            posix_fadvise(m->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            break;
+        case MEMBER_ADV_RANDOM:
+            posix_fadvise(m->fd, 0, 0, POSIX_FADV_RANDOM);
+            break;
+        default:
+            posix_fadvise(m->fd, 0, 0, POSIX_FADV_NORMAL);
+        }
+    }
+}
+
+int member_parse_advice(const char *s)
+{
+    if (strcmp(s, "normal") == 0)
+        return MEMBER_ADV_NORMAL;
+    if (strcmp(s, "sequential") == 0)
+        return MEMBER_ADV_SEQUENTIAL;
+    if (strcmp(s, "random") == 0)
+        return MEMBER_ADV_RANDOM;
+    return -1;
+}
+
+static void io_execute(struct member *m, struct member_io *io)
+{
+    size_t len = iov_total(io->iov, io->iovcnt);
+
+    switch (io->op)
+    {
+    case MEMBER_IO_READ:
+        io->result = member_preadv(m, io->iov, io->iovcnt, io->offset);
+        break;
+    case MEMBER_IO_WRITE:
+        io->result = member_pwritev2(m, io->iov, io->iovcnt, io->offset, io->flags);
+        break;
+    default:
+        io->result = member_sync(m);
+        len = 0;
+    }
+    if (io->result >= 0 && (size_t)io->result != len)
+        io->result = -EIO; // short transfer
+}
+
+static void io_complete(struct member_io *io)
+{
+    struct member_batch *b = io->batch;
+    void *abandoned = NULL;
+
+    pthread_mutex_lock(&b->lock);
+    if (io->result < 0 && b->error == 0)
+        b->error = io->result;
+    __atomic_store_n(&io->done, 1, __ATOMIC_RELEASE);
+    if (--b->pending == 0)
+        abandoned = b->abandoned;
+    pthread_cond_broadcast(&b->done);
+    pthread_mutex_unlock(&b->lock);
+    free(abandoned); // nobody waits for this batch any more
+}
+
+/* The next request to dispatch: the oldest if it has passed its deadline,
+ * otherwise the first at or after where the last dispatch ended, wrapping
+ * around to the lowest offset. Called with the queue lock held. */
+static struct member_io *sched_pick(struct member_queue *q, uint64_t now)
+{
+    struct member_io *oldest = q->head;
+    struct member_io *next = NULL;
+
+    for (struct member_io *io = q->head; io != NULL; io = io->next)
+    {
+        if (io->queued < oldest->queued)
+            oldest = io;
+        if (next == NULL && io->offset >= q->pos)
+            next = io;
+    }
+    if (q->deadline_ns > 0 && now - oldest->queued >= q->deadline_ns && oldest != next)
+    {
+        q->expired++;
+        return oldest;
+    }
+    return next != NULL ? next : q->head;
+}
+
+/* Unlink `first` and the requests after it that continue it on the member,
+ * chaining them through ->next. Returns how many were taken. */
+static int sched_take(struct member_queue *q, struct member_io *first)
+{
+    struct member_io **p = &q->head;
+    while (*p != first)
+        p = &(*p)->next;
+    *p = first->next;
+
+    int count = 1;
+    size_t bytes = iov_total(first->iov, first->iovcnt);
+    int iovcnt = first->iovcnt;
+    struct member_io *tail = first;
+    while (first->op != MEMBER_IO_SYNC && *p != NULL)
+    {
+        struct member_io *io = *p;
+        size_t len = iov_total(io->iov, io->iovcnt);
+        if (io->op != first->op || io->flags != first->flags || io->offset != first->offset + bytes ||
+            bytes + len > SCHED_MAX_BYTES || iovcnt + io->iovcnt > SCHED_MAX_IOV)
+            break;
+        *p = io->next;
+        tail->next = io;
+        tail = io;
+        bytes += len;
+        iovcnt += io->iovcnt;
+        count++;
+    }
+    tail->next = NULL;
+    q->depth -= count;
+    q->pos = first->offset + bytes;
+    return count;
+}
+
+/* Run a chain of contiguous requests as one vectored call and hand each its
+ * share of the result. */
+static void run_execute(struct member *m, struct member_io *first, int count)
+{
+    if (count == 1)
+    {
+        io_execute(m, first);
+        return;
+    }
+
+    int iovcnt = 0;
+    for (struct member_io *io = first; io != NULL; io = io->next)
+        iovcnt += io->iovcnt;
+    struct iovec *iov = malloc(iovcnt * sizeof(*iov));
+    if (iov == NULL)
+    {
+        for (struct member_io *io = first; io != NULL; io = io->next)
+            io_execute(m, io);
+        return;
+    }
+    int n = 0;
+    for (struct member_io *io = first; io != NULL; io = io->next)
+    {
+        memcpy(&iov[n], io->iov, io->iovcnt * sizeof(*iov));
+        n += io->iovcnt;
+    }
+
+    ssize_t r = first->op == MEMBER_IO_READ ? member_preadv(m, iov, iovcnt, first->offset)
+                                            : member_pwritev2(m, iov, iovcnt, first->offset, first->flags);
+    for (struct member_io *io = first; io != NULL; io = io->next)
+    {
+        size_t len = iov_total(io->iov, io->iovcnt);
+        if (r < 0)
+        {
+            io->result = r;
+            continue;
+        }
+        size_t got = (size_t)r < len ? (size_t)r : len;
+        io->result = got == len ? (ssize_t)len : -EIO; // short transfer
+        r -= got;
+    }
+    free(iov);
+}
+
+static void *member_worker(void *arg)
+{
+    struct member *m = arg;
+    struct member_queue *q = m->queue;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;)
+    {
+        while (q->head == NULL && !q->stop)
+            pthread_cond_wait(&q->work, &q->lock);
+        if (q->head == NULL)
+            break; // stopping and drained
+
+        uint64_t now = now_ns();
+        if (q->window_ns > 0 && !q->stop && q->depth < SCHED_DEPTH)
+        {
+            // hold the batch open until its oldest request has waited a window
+            uint64_t oldest = UINT64_MAX;
+            for (struct member_io *io = q->head; io != NULL; io = io->next)
+                oldest = io->queued < oldest ? io->queued : oldest;
+            if (now < oldest + q->window_ns)
+            {
+                uint64_t until = oldest + q->window_ns;
+                struct timespec ts = {until / 1000000000, until % 1000000000};
+                pthread_cond_timedwait(&q->work, &q->lock, &ts);
+                continue;
+            }
+        }
+
+        struct member_io *first = sched_pick(q, now);
+        int count = sched_take(q, first);
+        q->dispatched++;
+        pthread_mutex_unlock(&q->lock);
+
+        run_execute(m, first, count);
+        while (first != NULL)
+        {
+            struct member_io *next = first->next; // io_complete may free it
+            io_complete(first);
+            first = next;
+        }
+
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+int member_start(struct member *m, int nthreads)
+{
+    if (m->fd == -1 || m->queue != NULL)
+        return 0;
+
+    struct member_queue *q = calloc(1, sizeof(*q) + nthreads * sizeof(pthread_t));
+    if (q == NULL)
+        return -ENOMEM;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, &attr);
+    pthread_condattr_destroy(&attr);
+    m->queue = q;
+    char name[64];
+    snprintf(name, sizeof(name), "%s I/O", m->path);
+    for (int i = 0; i < nthreads; i++)
+    {
+        int e = affinity_thread(&q->threads[i], io_cpus, m->path, name, member_worker, m);
+        if (e != 0)
+        {
+            member_stop(m);
+            return -e;
+        }
+        q->nthreads++;
+    }
+    return 0;
+}
+
+void member_cpus(const char *spec)
+{
+    io_cpus = spec;
+}
+
+void member_sched(struct member *m, unsigned int window_us, unsigned int deadline_us)
+{
+    struct member_queue *q = m->queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_lock(&q->lock);
+    q->window_ns = window_us * 1000ULL;
+    q->deadline_ns = deadline_us * 1000ULL;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void member_report(struct member *m)
+{
+    struct member_queue *q = m->queue;
+    struct member_csum *c = m->csum;
+
+    if (q != NULL)
+    {
+        pthread_mutex_lock(&q->lock);
+        fprintf(stderr, "%s: %lu requests in %lu calls (%.1f%% merged), queue depth avg %.1f max %d, %lu past deadline\n",
+                m->path, q->submitted, q->dispatched,
+                q->submitted ? 100.0 * (q->submitted - q->dispatched) / q->submitted : 0.0,
+                q->submitted ? (double)q->depth_sum / q->submitted : 0.0, q->depth_max, q->expired);
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (c != NULL)
+        fprintf(stderr, "%s: %lu checksums verified, %lu mismatches\n", m->path,
+                __atomic_load_n(&c->verified, __ATOMIC_RELAXED), __atomic_load_n(&c->mismatches, __ATOMIC_RELAXED));
+    unsigned int errors = __atomic_load_n(&m->errors, __ATOMIC_RELAXED);
+    if (m->fd != -1 && (errors > 0 || member_failed(m)))
+        fprintf(stderr, "%s: %u errors%s\n", m->path, errors, member_failed(m) ? ", failed" : "");
+}
+
+void member_batch_init(struct member_batch *b)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->done, &attr);
+    pthread_condattr_destroy(&attr);
+    b->pending = 0;
+    b->error = 0;
+    b->abandoned = NULL;
+}
+
+void member_submit(struct member *m, struct member_io *io, struct member_batch *b)
+{
+    struct member_queue *q = m->queue;
+
+    io->batch = b;
+    io->next = NULL;
+    io->done = 0;
+    pthread_mutex_lock(&b->lock);
+    b->pending++;
+    pthread_mutex_unlock(&b->lock);
+
+    if (q == NULL)
+    {
+        io_execute(m, io);
+        io_complete(io);
+        return;
+    }
+    io->queued = now_ns();
+    pthread_mutex_lock(&q->lock);
+    // keep the queue sorted by offset, first come first served among equals
+    struct member_io **p = &q->head;
+    while (*p != NULL && (*p)->offset <= io->offset)
+        p = &(*p)->next;
+    io->next = *p;
+    *p = io;
+    q->depth++;
+    q->submitted++;
+    q->depth_sum += q->depth;
+    if (q->depth > q->depth_max)
+        q->depth_max = q->depth;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int member_batch_wait(struct member_batch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    while (b->pending > 0)
+        pthread_cond_wait(&b->done, &b->lock);
+    int error = b->error;
+    b->error = 0;
+    pthread_mutex_unlock(&b->lock);
+    return error;
+}
+
+int member_batch_wait_some(struct member_batch *b, int pending, uint64_t timeout_ns)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ns / 1000000000;
+    ts.tv_nsec += timeout_ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    int r = 0;
+    pthread_mutex_lock(&b->lock);
+    while (b->pending > pending && r == 0)
+        r = timeout_ns > 0 ? pthread_cond_timedwait(&b->done, &b->lock, &ts) : pthread_cond_wait(&b->done, &b->lock);
+    r = b->pending > pending ? -ETIMEDOUT : 0;
+    pthread_mutex_unlock(&b->lock);
+    return r;
+}
+
+bool member_io_done(struct member_io *io)
+{
+    return __atomic_load_n(&io->done, __ATOMIC_ACQUIRE);
+}
+
+void member_batch_abandon(struct member_batch *b, void *mem)
+{
+    pthread_mutex_lock(&b->lock);
+    bool idle = b->pending == 0;
+    if (!idle)
+        b->abandoned = mem;
+    pthread_mutex_unlock(&b->lock);
+    if (idle)
+        free(mem);
+}
@@ -0,0 +1,223 @@
+/*
+ * member - I/O helpers for the devices underlying a BUSE RAID
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef MEMBER_H_INCLUDED
+#define MEMBER_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define MEMBER_DIRECT 0x1 // open with O_DIRECT, bypassing the host page cache
+#define MEMBER_MMAP 0x2   // map the whole member MAP_SHARED and serve I/O with memcpy
+
+// operations for asynchronous requests
+#define MEMBER_IO_READ 0
+#define MEMBER_IO_WRITE 1
+#define MEMBER_IO_SYNC 2
+
+// flags for member_pwritev2()
+#define MEMBER_WRITE_DSYNC 0x1 // the data is durable when the write returns (forced unit access)
+
+#define MEMBER_CSUM_UNIT 4096 // bytes of data covered by each checksum
+
+#define MEMBER_LAT_BUCKETS 96 // read latency histogram: quarter octaves from 1 us
+
+// access pattern hints for member_advise()
+#define MEMBER_ADV_NORMAL 0
+#define MEMBER_ADV_SEQUENTIAL 1
+#define MEMBER_ADV_RANDOM 2
+
+#define MEMBER_EDGE_LOCKS 16 // locks serializing O_DIRECT writes with read-modify-writes of partial blocks
+
+struct member
+{
+    int fd;             // -1 if the member is missing
+    const char *path;   // path the member was opened from
+    uint64_t size;      // size in bytes
+    unsigned int align; // required alignment of offsets, lengths and buffers (logical block size)
+    int flags;          // MEMBER_* flags the member was opened with
+    int blkdev;         // true for block devices, false for regular files
+    char *map;          // whole-member mapping in MEMBER_MMAP mode, else NULL
+    uint64_t dirty_lo;  // byte range of the mapping written since the last sync
+    uint64_t dirty_hi;
+    pthread_mutex_t lock; // protects the dirty range
+    pthread_mutex_t edge_locks[MEMBER_EDGE_LOCKS]; // by range of the member, see edge_lock
+    int written;          // set by writes, cleared by syncs; accessed atomically
+    struct member_queue *queue; // I/O worker threads, NULL if not started
+    struct member_csum *csum;   // per-unit checksums, NULL if not enabled
+    unsigned int max_errors;    // errors tolerated before the member is failed, 0 to never fail it
+    unsigned int timeout_ms;    // requests slower than this count as errors, 0 for no limit
+    unsigned int errors;        // accessed atomically
+    int failed;                 // set once the member is failed; accessed atomically
+    unsigned int lat[MEMBER_LAT_BUCKETS]; // recent read latencies, halved now and then; accessed atomically
+    unsigned int lat_samples;
+};
+
+struct member_batch;
+
+/* An asynchronous request. The submitter owns it (and its iovecs) until the
+ * batch it was submitted with has been waited for. */
+struct member_io
+{
+    int op;                     // MEMBER_IO_*
+    int flags;                  // MEMBER_WRITE_* for writes
+    const struct iovec *iov;
+    int iovcnt;
+    uint64_t offset;
+    ssize_t result;             // bytes transferred or -errno
+    struct member_batch *batch;
+    struct member_io *next;     // queue link
+    uint64_t queued;            // submission time, for the scheduler's deadline
+    int done;                   // set when complete; see member_io_done()
+};
+
+/* Requests a submitter waits for together. */
+struct member_batch
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+    int error; // first -errno of the batch; a short transfer counts as -EIO
+    void *abandoned; // freed when the last request completes
+};
+
+/* All I/O functions are positional and may be called concurrently from
+ * several threads on the same member. With MEMBER_DIRECT, writes that only
+ * partly cover a logical block read-modify-write it under a lock, so
+ * concurrent writes to different bytes of one block all land. */
+
+/* Open `path` as a RAID member. Returns 0, or -errno with m->fd == -1. */
+int member_open(struct member *m, const char *path, int flags);
+
+/* Mark `m` as missing (used for "MISSING" devices on the command line). */
+void member_set_missing(struct member *m);
+
+/* Fail the member when it misbehaves. Reads that fail, other than on a
+ * checksum mismatch, and requests that take longer than `timeout_ms` (0 for
+ * no limit) count as errors, and the member is failed once `max_errors` have
+ * been counted or as soon as a write or sync fails. Off by default. */
+void member_health(struct member *m, unsigned int max_errors, unsigned int timeout_ms);
+
+/* Whether the member is missing or has been failed. I/O on a failed member
+ * returns -EIO at once without touching the device, and member_flush()
+ * skips it. */
+bool member_failed(struct member *m);
+
+/* Stops the member's I/O workers, if any. */
+void member_close(struct member *m);
+
+/* Start `nthreads` worker threads serving member_submit() requests. Queued
+ * requests are dispatched in offset order, and reads or writes that are
+ * contiguous on the member are merged into one vectored call. */
+int member_start(struct member *m, int nthreads);
+
+/* Confine the worker threads of members started from now on to the CPU set
+ * `spec` (see affinity.h), where "near" means the CPUs of the NUMA node each
+ * member's device is attached to. NULL, the default, lets them run
+ * anywhere. */
+void member_cpus(const char *spec);
+
+/* Tune the scheduler of a started member: hold dispatches back up to
+ * `window_us` so more requests can queue up and merge, and serve any request
+ * that has waited `deadline_us` (0 for no limit) ahead of the elevator. */
+void member_sched(struct member *m, unsigned int window_us, unsigned int deadline_us);
+
+/* Print the scheduler's queue depth and merge statistics, checksum counts
+ * and errors to stderr. */
+void member_report(struct member *m);
+
+void member_batch_init(struct member_batch *b);
+
+/* Queue `io` on the member's workers, or run it inline if none were
+ * started. Completion is counted in `b`. */
+void member_submit(struct member *m, struct member_io *io, struct member_batch *b);
+
+/* Wait for everything submitted with `b`. Returns 0 or the batch's first
+ * error; the batch may then be reused. */
+int member_batch_wait(struct member_batch *b);
+
+/* Wait until at most `pending` requests of `b` are still in flight, for up
+ * to `timeout_ns` (0 for no limit). Returns 0, or -ETIMEDOUT. */
+int member_batch_wait_some(struct member_batch *b, int pending, uint64_t timeout_ns);
+
+/* Whether `io` has completed; its result may be read once it has. */
+bool member_io_done(struct member_io *io);
+
+/* Give up on the requests of `b` still in flight: `mem`, which must hold
+ * the batch, the requests and their buffers, is freed once they complete.
+ * Neither may be touched afterwards. */
+void member_batch_abandon(struct member_batch *b, void *mem);
+
+/* The 95th percentile of the member's recent read latencies in ns, or 0
+ * until enough reads have been timed. */
+uint64_t member_read_p95(struct member *m);
+
+/* Allocate a scratch buffer that is suitably aligned for I/O on any opened
+ * member. `len` is rounded up to the alignment. Release with free(). */
+void *member_alloc(size_t len);
+
+/* Transfer exactly `len` bytes unless end of file is hit. Unaligned requests
+ * on O_DIRECT members go through an aligned bounce buffer. Return the number
+ * of bytes transferred or -errno. */
+ssize_t member_pread(struct member *m, void *buf, size_t len, uint64_t offset);
+ssize_t member_pwrite(struct member *m, const void *buf, size_t len, uint64_t offset);
+ssize_t member_preadv(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset);
+ssize_t member_pwritev(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+/* Writes taking MEMBER_WRITE_* flags. MEMBER_WRITE_DSYNC uses
+ * pwritev2(RWF_DSYNC), falling back to a write followed by fdatasync. */
+ssize_t member_pwrite2(struct member *m, const void *buf, size_t len, uint64_t offset, int flags);
+ssize_t member_pwritev2(struct member *m, const struct iovec *iov, int iovcnt, uint64_t offset, int flags);
+
+/* Bytes of data a member of `size` bytes can hold with checksums for them
+ * stored at its end. */
+uint64_t member_csum_capacity(uint64_t size);
+
+/* Protect the first `data_size` bytes of `m` with CRC32C checksums, one per
+ * MEMBER_CSUM_UNIT, stored in a table after the data. The table and a header
+ * describing it are written when the member is formatted: only with
+ * `format` is a table computed from the data and written over whatever
+ * follows it, which shrinks the space left for data. Without `format`, a
+ * member whose header is missing or describes another layout returns
+ * -ENODATA and is left untouched. Afterwards reads whose data doesn't match
+ * return -EBADMSG, and so do writes that cover only part of a unit whose
+ * other bytes don't; rewriting whole units repairs them. Returns 0 or
+ * -errno. */
+int member_csum_enable(struct member *m, uint64_t data_size, bool format);
+
+/* Make completed writes durable. Returns 0 or -errno. A member that has not
+ * been written since its last sync is skipped. In MEMBER_MMAP mode only the
+ * range dirtied since the last sync is written back. */
+int member_sync(struct member *m);
+
+/* Sync the `n` members of an array concurrently and wait for all of them.
+ * Concurrent callers flushing the same array share a flush that started
+ * after they arrived.
+ * Returns 0 or the first -errno. */
+int member_flush(struct member *m, int n);
+
+/* Discard a range (BLKDISCARD, or punch a hole in a file). With checksums
+ * enabled the range is zeroed instead, so its checksums stay known. Returns 0
+ * or -errno. */
+int member_trim(struct member *m, uint64_t offset, uint64_t len);
+
+/* Make a range read back as zeros, offloading to BLKZEROOUT or fallocate
+ * when possible and writing zeros otherwise. Returns 0 or -errno. */
+int member_write_zeroes(struct member *m, uint64_t offset, uint64_t len);
+
+/* Tell the kernel how the member will be accessed (MEMBER_ADV_*). */
+void member_advise(struct member *m, int advice);
+
+/* Parse "normal", "sequential" or "random". Returns MEMBER_ADV_* or -1. */
+int member_parse_advice(const char *s);
+
+#endif /* MEMBER_H_INCLUDED */
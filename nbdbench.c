@@ -0,0 +1,324 @@
+/*
+ * nbdbench - sequential throughput of a BUSE program over NBD, per chunk size
+ *
+ * Starts the program once per chunk size, serving NBD on one end of a
+ * socket pair ("fd:N" in place of the device) instead of the kernel, and
+ * acts as the NBD client on the other end: it writes the given span
+ * sequentially (or with -R, each request once in random order) with a few
+ * requests in flight, flushes, reads it back and checks what comes back.
+ * No nbd module or root is needed, so the numbers are the program's, not
+ * the kernel's. The time the program took to start serving is reported
+ * too, which is what initializing or rebuilding an array at startup costs.
+ *
+ *     nbdbench [-v] [-R] [-s MB] [-r KB] [-q DEPTH] [-c CHUNK,...] PROGRAM ARG...
+ *
+ * In ARG..., CHUNK is replaced by the chunk size and NBD by the socket, e.g.
+ *
+ *     nbdbench ./raid4 CHUNK NBD d0 d1 d2 d3
+ *
+ * The program's own output is discarded unless -v is given.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/nbd.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_FD 3 // where the program finds its end of the socket
+#define MAX_DEPTH 64
+#define MAX_ARGS 64
+
+static const uint32_t default_chunks[] = {4096, 65536, 262144, 1048576, 4194304};
+static bool verbose; // let the program's output through
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int send_request(int sk, uint32_t type, uint64_t from, uint32_t len, const void *data)
+{
+    struct nbd_request req;
+    req.magic = htonl(NBD_REQUEST_MAGIC);
+    req.type = htonl(type);
+    memcpy(req.handle, &from, sizeof(req.handle));
+    req.from = htobe64(from);
+    req.len = htonl(len);
+    if (write_all(sk, &req, sizeof(req)) != 0)
+        return -1;
+    return data != NULL ? write_all(sk, data, len) : 0;
+}
+
+/* Read a reply and, for a read, its data. Replies come in request order. */
+static int recv_reply(int sk, void *data, uint32_t len)
+{
+    struct nbd_reply reply;
+    if (read_all(sk, &reply, sizeof(reply)) != 0 || ntohl(reply.magic) != NBD_REPLY_MAGIC)
+        return -1;
+    if (reply.error != 0)
+    {
+        fprintf(stderr, "request failed: %s\n", strerror(ntohl(reply.error)));
+        return -1;
+    }
+    return data != NULL ? read_all(sk, data, len) : 0;
+}
+
+/* Stamp each 512 bytes of a request with its offset, so misplaced data shows. */
+static void fill(char *buf, uint32_t len, uint64_t from)
+{
+    for (uint32_t i = 0; i < len; i += 512)
+    {
+        uint64_t off = from + i;
+        memcpy(buf + i, &off, sizeof(off));
+    }
+}
+
+static bool check(const char *buf, uint32_t len, uint64_t from)
+{
+    for (uint32_t i = 0; i < len; i += 512)
+    {
+        uint64_t off;
+        memcpy(&off, buf + i, sizeof(off));
+        if (off != from + i)
+            return false;
+    }
+    return true;
+}
+
+/* Write or read back [0, span) in requests of `req` bytes, `depth` at a
+ * time, in order or, given `order`, in that order of requests. Returns
+ * MB/s, or a negative value on failure. */
+static double pass(int sk, bool write, uint64_t span, uint32_t req, int depth, char **buf, const uint32_t *order)
+{
+    uint64_t n = span / req, sent = 0, done = 0;
+    bool ok = true;
+    uint64_t start = now_ns();
+    while (done < n)
+    {
+        while (sent < n && sent - done < (uint64_t)depth)
+        {
+            uint64_t from = (order != NULL ? order[sent] : sent) * req;
+            char *b = buf[sent % depth];
+            if (write)
+                fill(b, req, from);
+            if (send_request(sk, write ? NBD_CMD_WRITE : NBD_CMD_READ, from, req, write ? b : NULL) != 0)
+                return -1;
+            sent++;
+        }
+        uint64_t from = (order != NULL ? order[done] : done) * req;
+        char *b = buf[done % depth];
+        if (recv_reply(sk, write ? NULL : b, req) != 0)
+            return -1;
+        if (!write && !check(b, req, from))
+            ok = false;
+        done++;
+    }
+    if (write && (send_request(sk, NBD_CMD_FLUSH, 0, 0, NULL) != 0 || recv_reply(sk, NULL, 0) != 0))
+        return -1;
+    double mbs = span / 1e6 / ((now_ns() - start) / 1e9);
+    if (!ok)
+    {
+        fprintf(stderr, "data read back doesn't match what was written\n");
+        return -1;
+    }
+    return mbs;
+}
+
+/* A random order of the n requests of a pass, the same every run. */
+static uint32_t *shuffle(uint64_t n, unsigned int seed)
+{
+    uint32_t *order = malloc(n * sizeof(*order));
+    if (order == NULL)
+        return NULL;
+    srand(seed);
+    for (uint64_t i = 0; i < n; i++)
+        order[i] = i;
+    for (uint64_t i = n - 1; i > 0; i--)
+    {
+        uint64_t j = ((uint64_t)rand() * RAND_MAX + rand()) % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    return order;
+}
+
+/* Run the program with `chunk` and measure it. */
+static int run(char **args, int nargs, uint32_t chunk, uint64_t span, uint32_t req, int depth, char **buf,
+               bool random)
+{
+    char chunk_arg[16], nbd_arg[16];
+    char *argv[MAX_ARGS + 1];
+    int sp[2];
+
+    snprintf(chunk_arg, sizeof(chunk_arg), "%u", chunk);
+    snprintf(nbd_arg, sizeof(nbd_arg), "fd:%d", SERVER_FD);
+    for (int i = 0; i < nargs; i++)
+        argv[i] = strcmp(args[i], "CHUNK") == 0 ? chunk_arg : strcmp(args[i], "NBD") == 0 ? nbd_arg : args[i];
+    argv[nargs] = NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0)
+        return -1;
+
+    uint64_t t0 = now_ns();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        close(sp[0]);
+        dup2(sp[1], SERVER_FD);
+        if (null >= 0 && !verbose)
+        {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(sp[1]);
+    if (pid < 0)
+    {
+        close(sp[0]);
+        return -1;
+    }
+
+    // a first read returns once the program is serving, whatever it did at startup
+    double wr = -1, rd = -1, up = 0;
+    uint32_t *worder = random ? shuffle(span / req, 1) : NULL;
+    uint32_t *rorder = random ? shuffle(span / req, 2) : NULL;
+    if ((!random || (worder != NULL && rorder != NULL)) && send_request(sp[0], NBD_CMD_READ, 0, 512, NULL) == 0 &&
+        recv_reply(sp[0], buf[0], 512) == 0)
+    {
+        up = (now_ns() - t0) / 1e9;
+        wr = pass(sp[0], true, span, req, depth, buf, worder);
+        if (wr >= 0)
+            rd = pass(sp[0], false, span, req, depth, buf, rorder);
+    }
+    free(worder);
+    free(rorder);
+    send_request(sp[0], NBD_CMD_DISC, 0, 0, NULL);
+    close(sp[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (wr < 0 || rd < 0)
+    {
+        fprintf(stderr, "%s failed with %u byte chunks (exit status %d)\n", argv[0], chunk,
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return -1;
+    }
+    printf("%10u %12.0f %12.0f %10.3f\n", chunk, wr, rd, up);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t span = 256 << 20;
+    uint32_t req = 1 << 20;
+    int depth = 4;
+    uint32_t chunks[32];
+    int nchunks = 0;
+    bool random = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+vRs:r:q:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = true;
+            break;
+        case 'R':
+            random = true;
+            break;
+        case 's':
+            span = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'r':
+            req = strtoul(optarg, NULL, 10) << 10;
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'c':
+            for (char *c = strtok(optarg, ","); c != NULL && nchunks < 32; c = strtok(NULL, ","))
+                chunks[nchunks++] = strtoul(c, NULL, 10);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind >= argc || argc - optind > MAX_ARGS || req == 0 || req > (64U << 20) || depth < 1 || depth > MAX_DEPTH || span < req ||
+        span / req > UINT32_MAX)
+    {
+        fprintf(stderr, "usage: %s [-v] [-R] [-s MB] [-r KB] [-q DEPTH] [-c CHUNK,...] PROGRAM ARG...\n"
+                        "  ARG... may use CHUNK for the chunk size and NBD for the device\n", argv[0]);
+        return 1;
+    }
+    if (nchunks == 0)
+    {
+        nchunks = sizeof(default_chunks) / sizeof(default_chunks[0]);
+        memcpy(chunks, default_chunks, sizeof(default_chunks));
+    }
+    span = span / req * req;
+    signal(SIGPIPE, SIG_IGN);
+
+    char *buf[MAX_DEPTH];
+    for (int i = 0; i < depth; i++)
+    {
+        buf[i] = malloc(req);
+        if (buf[i] == NULL)
+            return 1;
+    }
+    printf("%s: %lu MiB, %u KiB %s requests, %d in flight\n", argv[optind], span >> 20, req >> 10,
+           random ? "random" : "sequential", depth);
+    printf("%10s %12s %12s %10s\n", "chunk", "write MB/s", "read MB/s", "startup s");
+    int status = 0;
+    for (int c = 0; c < nchunks; c++)
+    {
+        if (run(argv + optind, argc - optind, chunks[c], span, req, depth, buf, random) != 0)
+            status = 1;
+    }
+    return status;
+}
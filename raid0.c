@@ -26,93 +26,201 @@
 #include <assert.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "arena.h"
 #include "buse.h"
+#include "geometry.h"
+#include "member.h"
+#include "readahead.h"
+#include "reshape.h"
+#include "wbcache.h"
+
+#define SCHED_DEADLINE_US 20000 // longest a queued chunk may be passed over by the elevator
+#define SEGMENT_BYTES (1024 * 1024) // large requests are handed over in segments of about this much
+#define MAX_WORKERS 64 // most request threads --workers may start
+#define RESHAPE_BATCH_BYTES (8 * 1024 * 1024) // array data moved per reshape step
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
-int dev_fd[2];             // file descriptors for two underlying block devices that make up the RAID
+struct member dev[16];     // underlying block devices that make up the RAID
+int dev_fd_size;           // number of devices
 int block_size;            // NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
 uint64_t raid_device_size; // size of raid device in bytes
+uint64_t member_size;      // bytes used on each device (smallest device, truncated to block size)
+struct geometry geom;      // chunk i lives on dev[i % dev_fd_size]
+struct geometry geom_old;  // layout without the last device, while growing onto it
 bool verbose = false;      // set to true by -v option for debug output
 bool degraded = false;     // true if we're missing a device
 
-int ok_dev = -1;      // index of dev_fd that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
+int ok_dev = -1;      // index of dev that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 
 int last_read_dev = 0; // used to interleave reading between the two devices
 
-static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+struct readahead *ra; // sequential read-ahead, NULL unless enabled with -r
+struct wbcache *cache; // write-back cache, NULL unless enabled with -c
+struct reshape *reshape; // online restriping onto the last device, NULL unless growing with -g
+
+/* Read-ahead fill: one vectored read per device covering `count` whole
+ * stripes, issued to all devices in parallel. */
+static int raid0_fill(uint64_t stripe, uint32_t count, char *buf, void *ctx)
+{
+    UNUSED(ctx);
+    struct arena_mark mark = arena_mark();
+    struct iovec *iov = arena_take(dev_fd_size * count * sizeof(*iov));
+    struct member_io io[16];
+    struct member_batch batch;
+    if (iov == NULL)
+        return -ENOMEM;
+
+    member_batch_init(&batch);
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        for (uint32_t j = 0; j < count; j++)
+        {
+            iov[d * count + j].iov_base = buf + ((uint64_t)j * dev_fd_size + d) * block_size;
+            iov[d * count + j].iov_len = block_size;
+        }
+        io[d].op = MEMBER_IO_READ;
+        io[d].flags = 0;
+        io[d].iov = &iov[d * count];
+        io[d].iovcnt = count;
+        io[d].offset = stripe * block_size;
+        member_submit(&dev[d], &io[d], &batch);
+    }
+    int err = member_batch_wait(&batch);
+    arena_release(mark);
+    return err;
+}
+
+/* Split [offset, offset + len) into its chunks and submit them all before
+ * waiting, so each device's scheduler sees the whole request at once. Bytes
+ * from `split` on are still in the old layout. */
+static int raid_io_split(uint64_t split, int op, char *buf, u_int32_t len, u_int64_t offset, int wflags)
+{
+    size_t n = geom_count_split(&geom, &geom_old, split, offset, len);
+    struct arena_mark mark = arena_mark();
+    struct member_io *io = arena_take(n * (sizeof(*io) + sizeof(struct iovec) + sizeof(struct geom_extent)));
+    struct iovec *iov = (struct iovec *)(io + n);
+    struct geom_extent *ext = (struct geom_extent *)(iov + n);
+    struct member_batch batch;
+    if (io == NULL)
+        return -ENOMEM;
+
+    geom_map_split(&geom, &geom_old, split, offset, len, ext, n);
+    member_batch_init(&batch);
+    for (size_t k = 0; k < n; k++)
+    {
+        iov[k].iov_base = buf + ext[k].buf;
+        iov[k].iov_len = ext[k].len;
+        io[k].op = op;
+        io[k].flags = wflags;
+        io[k].iov = &iov[k];
+        io[k].iovcnt = 1;
+        io[k].offset = ext[k].offset;
+        member_submit(&dev[ext[k].member], &io[k], &batch);
+    }
+    int err = member_batch_wait(&batch);
+    arena_release(mark);
+    return err;
+}
+
+static int raid_io(int op, char *buf, u_int32_t len, u_int64_t offset, int wflags)
+{
+    if (reshape == NULL)
+        return raid_io_split(UINT64_MAX, op, buf, len, offset, wflags);
+    int ticket;
+    uint64_t split = reshape_enter(reshape, offset, len, &ticket);
+    int err = raid_io_split(split, op, buf, len, offset, wflags);
+    reshape_exit(reshape, ticket);
+    return err;
+}
+
+/* Reshape I/O: the old layout ends where the smaller array did. */
+static int reshape_read_old(void *buf, u_int32_t len, u_int64_t offset, void *ctx)
+{
+    UNUSED(ctx);
+    uint64_t old_size = member_size / block_size * geom_old.stripe_size;
+    uint32_t n = offset >= old_size ? 0 : old_size - offset < len ? old_size - offset : len;
+    memset((char *)buf + n, 0, len - n);
+    return n > 0 ? raid_io_split(0, MEMBER_IO_READ, buf, n, offset, 0) : 0;
+}
+
+static int reshape_write_new(const void *buf, u_int32_t len, u_int64_t offset, void *ctx)
+{
+    UNUSED(ctx);
+    return raid_io_split(UINT64_MAX, MEMBER_IO_WRITE, (char *)buf, len, offset, 0);
+}
+
+static int reshape_sync(void *ctx)
+{
+    UNUSED(ctx);
+    return member_flush(dev, dev_fd_size);
+}
+
+static void reshape_done(void *ctx)
+{
+    UNUSED(ctx);
+    uint64_t size = member_size * dev_fd_size;
+    __atomic_store_n(&raid_device_size, size, __ATOMIC_RELEASE);
+    int r = buse_set_size(size);
+    if (r != 0)
+        fprintf(stderr, "Can't grow the RAID device to %lu bytes: %s\n", size, strerror(-r));
+    else
+        fprintf(stderr, "RAID device grown to %lu bytes.\n", size);
+}
+
+/* Uncached read; the write-back cache calls this for what it doesn't hold. */
+static int raid_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
     UNUSED(userdata);
+    if (ra != NULL && ra_read(ra, buf, len, offset))
+        return 0;
+    return raid_io(MEMBER_IO_READ, buf, len, offset, 0);
+}
+
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
     if (verbose)
         fprintf(stderr, "R - %lu, %u\n", offset, len);
 
     // raid 0 read
-    long started = offset / block_size;
-    long ended = (offset + len) / block_size;
-    long offsetInBlock = offset % block_size;
-    if (verbose)
-        fprintf(stderr, "started: %ld, ended: %ld\n", started, ended);
-    if (offset + len > raid_device_size)
+    if (offset + len > __atomic_load_n(&raid_device_size, __ATOMIC_ACQUIRE))
     {
         fprintf(stderr, "Read request exceeds device size.\n");
         return -EIO;
     }
-    long bytesRead = 0;
-    for (long i = started; i < ended; i++)
-    {
-        // if i % 2 == 0, read from dev_fd[0], else read from dev_fd[1]
-        long bytesToRead = len - bytesRead > block_size ? block_size : len - bytesRead;
-        if (i % 2 == 0)
-        {
+    if (cache != NULL)
+        return wbc_read(cache, buf, len, offset);
+    return raid_read(buf, len, offset, userdata);
+}
 
-            long rd = pread(dev_fd[0], (char *)buf + bytesRead, bytesToRead, i / 2 * block_size);
-            bytesRead += rd;
-        }
-        else
-        {
-            long rd = pread(dev_fd[1], (char *)buf + bytesRead, bytesToRead, i / 2 * block_size);
-            bytesRead += rd;
-        }
-    }
+/* Uncached write; called from the destage threads when the cache is on. */
+static int raid_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata)
+{
+    UNUSED(userdata);
+    int wflags = (flags & BUSE_WRITE_FUA) ? MEMBER_WRITE_DSYNC : 0; // FUA: sync just the chunks written
+    int err = raid_io(MEMBER_IO_WRITE, (char *)buf, len, offset, wflags);
+    if (ra != NULL)
+        ra_invalidate(ra, offset, len);
 
-    return 0;
+    return err;
 }
 
-static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata)
 {
-    UNUSED(userdata);
     if (verbose)
-        fprintf(stderr, "W - %lu, %u\n", offset, len);
+        fprintf(stderr, "W%s - %lu, %u\n", (flags & BUSE_WRITE_FUA) ? " FUA" : "", offset, len);
 
     // raid 0 write
-    long started = offset / block_size;
-    long ended = (offset + len) / block_size;
-    long offsetInBlock = offset % block_size;
-    if (offset + len > raid_device_size)
+    if (offset + len > __atomic_load_n(&raid_device_size, __ATOMIC_ACQUIRE))
     {
         fprintf(stderr, "Write request exceeds device size.\n");
         return -EIO;
     }
-
-    long bytesWrite = 0;
-    for (long i = started; i < ended; i++)
-    {
-        // if i % 2 == 0, write to dev_fd[0], else write to dev_fd[1]
-        long bytesToWrite = len - bytesWrite > block_size ? block_size : len - bytesWrite;
-        if (i % 2 == 0)
-        {
-            long wd = pwrite(dev_fd[0], (char *)buf + bytesWrite, bytesToWrite, i / 2 * block_size);
-            bytesWrite += wd;
-        }
-        else
-        {
-            long wd = pwrite(dev_fd[1], (char *)buf + bytesWrite, bytesToWrite, i / 2 * block_size);
-            bytesWrite += wd;
-        }
-    }
-
-    return 0;
+    if (cache != NULL)
+        return wbc_write(cache, buf, len, offset, flags);
+    return raid_write(buf, len, offset, flags, userdata);
 }
 
 static int xmp_flush(void *userdata)
@@ -120,14 +228,11 @@ static int xmp_flush(void *userdata)
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a flush request.\n");
-    for (int i = 0; i < 2; i++)
-    {
-        if (dev_fd[i] != -1)
-        {                     // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
-        }
-    }
-    return 0;
+    int err = 0;
+    if (cache != NULL)
+        err = wbc_flush(cache); // everything acknowledged so far must reach the devices first
+    int r = member_flush(dev, dev_fd_size); // sync every device written since the last flush, in parallel
+    return err != 0 ? err : r;
 }
 
 static void xmp_disc(void *userdata)
@@ -135,7 +240,19 @@ static void xmp_disc(void *userdata)
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a disconnect request.\n");
-    // disconnect is a no-op for us
+    if (cache != NULL)
+        wbc_flush(cache);
+    if (reshape != NULL)
+        reshape_destroy(reshape); // picks up from its checkpoint next time
+    reshape = NULL;
+    if (verbose && ra != NULL)
+        ra_report(ra);
+    for (int i = 0; verbose && i < dev_fd_size; i++)
+        member_report(&dev[i]);
+    if (verbose && cache != NULL)
+        wbc_report(cache);
+    if (verbose)
+        arena_report();
 }
 
 /*
@@ -151,17 +268,53 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
 
 /* argument parsing using argp */
 
+enum
+{
+    OPT_GROW_RATE = 0x100, // long-only options
+    OPT_WORKERS,
+    OPT_CPUS,
+    OPT_WORKER_CPUS,
+    OPT_IO_CPUS,
+};
+
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"direct", 'd', 0, 0, "Open devices with O_DIRECT, bypassing the host page cache", 0},
+    {"mmap", 'm', 0, 0, "Map file-backed devices with mmap and serve I/O from the mapping", 0},
+    {"access", 'a', "PATTERN", 0, "Hint the expected access pattern to the kernel: normal, sequential or random", 0},
+    {"readahead", 'r', "MB", 0, "Detect sequential reads and prefetch whole stripes into up to MB megabytes of buffers", 0},
+    {"cache", 'c', "MB", 0, "Absorb writes in a write-back cache of MB megabytes, destaged in the background and on flush", 0},
+    {"dirty-ratio", 'w', "PERCENT", 0, "Start destaging once PERCENT of the write-back cache is dirty (default 50)", 0},
+    {"sched", 's', "USEC", 0, "Queue chunk I/O per device, sorted by offset, merging contiguous chunks; hold dispatches up to USEC microseconds to batch more", 0},
+    {"grow", 'g', "CHECKPOINT", 0, "The last DEVICE is new: restripe onto it in the background while serving, keeping progress in the file CHECKPOINT, then grow the RAID device", 0},
+    {"grow-rate", OPT_GROW_RATE, "MB", 0, "Limit restriping to MB megabytes per second", 0},
+    {"workers", OPT_WORKERS, "N", 0, "Serve up to N requests at once, each on its own thread (default 0: one at a time)", 0},
+    {"cpus", OPT_CPUS, "SET", 0, "Run the threads reading and answering the NBD socket, and background ones such as destaging and rebuilds, on the CPUs in SET: a list like 0-3,8, or node:N for the CPUs of NUMA node N", 0},
+    {"worker-cpus", OPT_WORKER_CPUS, "SET", 0, "Run the --workers threads on the CPUs in SET (default: those of --cpus)", 0},
+    {"io-cpus", OPT_IO_CPUS, "SET", 0, "Run each device's I/O threads on the CPUs in SET, or with near on those of the NUMA node the device is attached to; starts the threads if nothing else does", 0},
     {0},
 };
 
 struct arguments
 {
     uint32_t block_size;
-    char *device[2];
+    char *device[16];
     char *raid_device;
     int verbose;
+    int num_devices;
+    int member_flags; // MEMBER_* flags used to open devices
+    int access;       // MEMBER_ADV_* hint for the devices
+    unsigned long readahead; // read-ahead buffer budget in MB, 0 for none
+    unsigned long cache;     // write-back cache size in MB, 0 for none
+    int dirty_ratio;         // percentage of the cache allowed to be dirty before destaging
+    bool sched;              // queue device I/O through the per-device scheduler
+    unsigned long sched_window; // microseconds the scheduler waits to batch requests
+    char *grow;                 // reshape checkpoint file when adding the last device
+    unsigned long grow_rate;    // reshape rate limit in MB/s, 0 for none
+    unsigned long workers;      // request threads, 0 to serve requests one at a time
+    char *cpus;                 // CPU set of the socket threads, NULL for any
+    char *worker_cpus;          // CPU set of the request threads, NULL for --cpus
+    char *io_cpus;              // CPU set or "near" for device I/O threads
 };
 
 /* Parse a single option. */
@@ -176,6 +329,66 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'v':
         arguments->verbose = 1;
         break;
+    case 'd':
+        arguments->member_flags |= MEMBER_DIRECT;
+        break;
+    case 'm':
+        arguments->member_flags |= MEMBER_MMAP;
+        break;
+    case 'a':
+        arguments->access = member_parse_advice(arg);
+        if (arguments->access < 0)
+            argp_error(state, "PATTERN must be normal, sequential or random");
+        break;
+    case 'r':
+        arguments->readahead = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case 'c':
+        arguments->cache = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case 'w':
+        arguments->dirty_ratio = strtol(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->dirty_ratio < 1 || arguments->dirty_ratio > 100)
+            argp_error(state, "PERCENT must be between 1 and 100");
+        break;
+    case 's':
+        arguments->sched = true;
+        arguments->sched_window = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "USEC must be an integer");
+        break;
+    case 'g':
+        arguments->grow = arg;
+        break;
+    case OPT_GROW_RATE:
+        arguments->grow_rate = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case OPT_WORKERS:
+        arguments->workers = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->workers > MAX_WORKERS)
+            argp_error(state, "N must be an integer of at most %d", MAX_WORKERS);
+        break;
+    case OPT_CPUS:
+        arguments->cpus = arg;
+        if (affinity_check(arg, false) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+        break;
+    case OPT_WORKER_CPUS:
+        arguments->worker_cpus = arg;
+        if (affinity_check(arg, false) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+        break;
+    case OPT_IO_CPUS:
+        arguments->io_cpus = arg;
+        if (affinity_check(arg, true) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, node:N or near");
+        break;
 
     case ARGP_KEY_ARG:
         switch (state->arg_num)
@@ -194,26 +407,32 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
             arguments->raid_device = arg;
             break;
 
-        case 2:
-            arguments->device[0] = arg;
-            break;
-
-        case 3:
-            arguments->device[1] = arg;
-            break;
-
         default:
-            /* Too many arguments. */
-            return ARGP_ERR_UNKNOWN;
+            if (state->arg_num >= 18)
+            {
+                /* Too many arguments. */
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->device[state->arg_num - 2] = arg;
+            break;
         }
         break;
 
     case ARGP_KEY_END:
-        if (state->arg_num < 3)
+        if ((arguments->member_flags & MEMBER_DIRECT) && (arguments->member_flags & MEMBER_MMAP))
+        {
+            argp_error(state, "--direct and --mmap can't be combined");
+        }
+        if (arguments->grow != NULL && (arguments->readahead > 0 || arguments->cache > 0))
+        {
+            argp_error(state, "--grow can't be combined with --readahead or --cache");
+        }
+        if (state->arg_num < 4 || (arguments->grow != NULL && state->arg_num < 5))
         {
             warnx("not enough arguments");
             argp_usage(state);
         }
+        arguments->num_devices = state->arg_num - 2;
         break;
 
     default:
@@ -225,8 +444,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 static struct argp argp = {
     .options = options,
     .parser = parse_opt,
-    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2",
-    .doc = "BUSE implementation of RAID0 for two devices.\n"
+    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2 [DEVICE...]",
+    .doc = "BUSE implementation of RAID0 for up to 16 devices.\n"
            "`BLOCKSIZE` is an integer number of bytes. "
            "\n\n"
            "`RAIDDEVICE` is a path to an NBD block device, for example \"/dev/nbd0\"."
@@ -237,12 +456,13 @@ int main(int argc, char *argv[])
 {
     struct arguments arguments = {
         .verbose = 0,
+        .dirty_ratio = 50,
     };
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
     struct buse_operations bop = {
         .read = xmp_read,
-        .write = xmp_write,
+        .write_flags = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
         // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
@@ -250,20 +470,105 @@ int main(int argc, char *argv[])
 
     verbose = arguments.verbose;
     block_size = arguments.block_size;
+    dev_fd_size = arguments.num_devices;
+    if (geom_init(&geom, dev_fd_size, block_size) != 0 || geom_init(&geom_old, dev_fd_size - 1, block_size) != 0)
+        errx(EXIT_FAILURE, "BLOCKSIZE must be positive");
 
     raid_device_size = 0; // will be detected from the drives available
     ok_dev = -1;
-    dev_fd[0] = open(arguments.device[0], O_RDWR);
-    dev_fd[1] = open(arguments.device[1], O_RDWR);
-    long fd0_size = lseek(dev_fd[0], 0, SEEK_END);
-    long fd1_size = lseek(dev_fd[1], 0, SEEK_END);
-    raid_device_size = 2 * (fd0_size < fd1_size ? fd0_size : fd1_size); // RAID0 size is the smaller of the two drives
-
-    raid_device_size = raid_device_size / block_size * block_size; // divide+mult to truncate to block size
+    int old_devs = arguments.grow != NULL ? dev_fd_size - 1 : dev_fd_size; // devices holding data so far
+    for (int i = 0; i < dev_fd_size; i++)
+    {
+        int r = member_open(&dev[i], arguments.device[i], arguments.member_flags);
+        if (r < 0)
+        {
+            fprintf(stderr, "%s: %s\n", arguments.device[i], strerror(-r));
+            exit(1);
+        }
+        member_advise(&dev[i], arguments.access);
+        if (i < old_devs && (member_size == 0 || dev[i].size < member_size))
+            member_size = dev[i].size; // RAID0 size is set by the smallest drive
+    }
+    member_size = member_size / block_size * block_size; // divide+mult to truncate to block size
+    if (old_devs < dev_fd_size && dev[dev_fd_size - 1].size < member_size)
+    {
+        fprintf(stderr, "ERROR: %s is smaller than the other devices (%lu bytes needed).\n",
+                dev[dev_fd_size - 1].path, member_size);
+        exit(1);
+    }
+    raid_device_size = member_size * dev_fd_size;
+    if (arguments.grow != NULL)
+    {
+        struct reshape_ops ops = {.read_old = reshape_read_old, .write_new = reshape_write_new,
+                                  .sync = reshape_sync, .done = reshape_done};
+        reshape = reshape_create(arguments.grow, geom_old.stripe_size, geom.stripe_size, raid_device_size,
+                                 RESHAPE_BATCH_BYTES, arguments.grow_rate, &ops, NULL);
+        if (reshape == NULL)
+            exit(1);
+        if (reshape_position(reshape) == raid_device_size)
+        {
+            fprintf(stderr, "Reshape onto %s already finished.\n", dev[dev_fd_size - 1].path);
+            reshape_destroy(reshape);
+            reshape = NULL;
+        }
+        else
+        {
+            raid_device_size = member_size * old_devs; // grown once the reshape is done
+        }
+    }
     bop.size = raid_device_size;                                   // tell BUSE how big our block device is
-    bop.blksize = block_size;                                      // tell BUSE our block size
-    bop.size_blocks = raid_device_size / block_size;               // tell BUSE our block count
+    bop.blksize = block_size % 4096 == 0 ? 4096 : 512;             // sector size, whatever the chunk size
+    bop.size_blocks = raid_device_size / bop.blksize;              // tell BUSE our block count
+    bop.segment = (SEGMENT_BYTES + geom.stripe_size - 1) / geom.stripe_size * geom.stripe_size;
+    bop.workers = arguments.workers;
+    bop.server_cpus = arguments.cpus;
+    bop.worker_cpus = arguments.worker_cpus;
+    // enough for the I/O descriptors of a request of one segment; two
+    // layouts while growing can add a chunk
+    arena_setup((bop.segment / block_size + 3) *
+                (sizeof(struct member_io) + sizeof(struct iovec) + sizeof(struct geom_extent)));
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
 
+    member_cpus(arguments.io_cpus);
+    affinity_background(arguments.cpus);
+    if (arguments.readahead > 0 || arguments.sched || arguments.io_cpus != NULL)
+    {
+        for (int i = 0; i < dev_fd_size; i++)
+        {
+            if (member_start(&dev[i], 1) != 0)
+            {
+                fprintf(stderr, "Failed to start I/O thread for %s.\n", arguments.device[i]);
+                exit(1);
+            }
+            member_sched(&dev[i], arguments.sched_window, SCHED_DEADLINE_US);
+        }
+    }
+    if (arguments.readahead > 0)
+    {
+        ra = ra_create(geom.stripe_size, member_size / block_size, arguments.readahead << 20, raid0_fill, NULL);
+        if (ra == NULL)
+        {
+            fprintf(stderr, "Failed to set up read-ahead.\n");
+            exit(1);
+        }
+    }
+    if (arguments.cache > 0)
+    {
+        struct wbc_ops ops = {.read = raid_read, .write = raid_write};
+        cache = wbc_create(geom.stripe_size, member_size / block_size, arguments.cache << 20,
+                           arguments.dirty_ratio, 2, &ops, NULL);
+        if (cache == NULL)
+        {
+            fprintf(stderr, "Failed to set up the write-back cache (block size must be a multiple of 512).\n");
+            exit(1);
+        }
+    }
+
+    if (reshape != NULL && reshape_start(reshape) != 0)
+    {
+        fprintf(stderr, "Failed to start the reshape thread.\n");
+        exit(1);
+    }
+
     return buse_main(arguments.raid_device, &bop, NULL);
 }
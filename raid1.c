@@ -25,72 +25,428 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
+#include "affinity.h"
+#include "arena.h"
 #include "buse.h"
+#include "member.h"
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
-int dev_fd[2]; // file descriptors for two underlying block devices that make up the RAID
+#define MAX_SPARES 8
+#define MAX_ERRORS 8 // default errors before a device is failed
+#define IO_TIMEOUT_MS 30000 // default time after which a request counts as an error
+#define MAX_WORKERS 64 // most request threads --workers may start
+#define REBUILD_STEP (1024 * 1024) // bytes copied onto a spare at a time
+#define HEDGE_MIN_US 500 // never hedge a read sooner than this
+
+struct member dev[2 + MAX_SPARES]; // the two underlying block devices that make up the RAID, then hot spares
+int nspares; // hot spares, from dev[2] on
+int mirror_slot[2] = {0, 1}; // dev[] index serving each mirror; a rebuilt spare takes over a failed one
 int block_size;  //NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
 uint64_t raid_device_size; // size of raid device in bytes
 bool verbose = false;  // set to true by -v option for debug output
 bool degraded = false; // true if we're missing a device
 
-int ok_dev = -1; // index of dev_fd that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
+int ok_dev = -1; // index of dev that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 
 int last_read_dev = 0; // used to interleave reading between the two devices
 
+bool checksum = false; // per-unit checksums enabled with -k
+bool hedge = false; // hedged reads enabled with --hedge
+uint64_t hedged_reads, hedge_wins; // accessed atomically
+
+// failing over when a mirror fails: we carry on with the other one while a
+// thread copies it onto a hot spare. Writes hold the lock, and also go to
+// the spare below what has been copied.
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+struct {
+    pthread_t thread;
+    bool started;
+    bool running;
+    bool stop;
+    int spare;       // dev[] index being copied onto, -1 for none
+    uint64_t done;   // bytes copied so far
+    uint64_t lo, hi; // range being copied right now
+    bool touched;    // a write hit [lo, hi) meanwhile: copy it again
+    bool lost;       // both mirrors failed
+} failover = {.spare = -1};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The device serving mirror `i` (0 or 1). */
+static struct member *mirror(int i) {
+    return &dev[__atomic_load_n(&mirror_slot[i], __ATOMIC_ACQUIRE)];
+}
+
+static void rebuild_start(void);
+
+/* Called with state_lock held after an I/O error. If a mirror has just
+ * failed, carry on with the other and start copying it onto a hot spare; a
+ * spare that fails is dropped for the next one. Returns false once both
+ * mirrors have failed, else the request may be tried again. */
+static bool check_failed(void) {
+    int s = failover.spare;
+    if (degraded && s >= 0 && member_failed(&dev[s])) {
+        failover.spare = -1;
+        failover.done = 0;
+        fprintf(stderr, "Spare %s failed; dropped.\n", dev[s].path);
+    }
+    for (int i=0; i<2; i++) {
+        if (!member_failed(mirror(i)) || (degraded && i != ok_dev))
+            continue;
+        if (degraded) {
+            if (!failover.lost)
+                fprintf(stderr, "ERROR: %s failed too; no copy of the data is left.\n", mirror(i)->path);
+            failover.lost = true;
+            continue;
+        }
+        ok_dev = (i+1) % 2;
+        __atomic_store_n(&degraded, true, __ATOMIC_RELEASE);
+        fprintf(stderr, "DEGRADED: %s failed; running on %s alone.\n", mirror(i)->path, mirror(ok_dev)->path);
+        rebuild_start();
+    }
+    return !failover.lost;
+}
+
+/* A hot spare to copy onto, or -1 if none is left. */
+static int next_spare(void) {
+    for (int k=2; k<2+nspares; k++)
+        if (k != mirror_slot[0] && k != mirror_slot[1] && !member_failed(&dev[k]))
+            return k;
+    return -1;
+}
+
+/* Copy the surviving mirror onto a spare, which then replaces the failed
+ * one. Steps are copied without the lock; writes that land in a step while
+ * it is copied make it go again. */
+static void *rebuild_thread(void *arg) {
+    UNUSED(arg);
+    char *buf = member_alloc(REBUILD_STEP);
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&state_lock);
+    int bad = (ok_dev+1) % 2;
+    const char *failed = mirror(bad)->path ? mirror(bad)->path : "the missing device";
+    while (buf != NULL && !failover.stop && !failover.lost) {
+        int s = failover.spare;
+        if (s < 0) {
+            if ((s = next_spare()) < 0) {
+                fprintf(stderr, "rebuild: no hot spare left; staying degraded\n");
+                break;
+            }
+            fprintf(stderr, "rebuild: copying %s onto spare %s\n", mirror(ok_dev)->path, dev[s].path);
+            failover.spare = s;
+            failover.done = 0;
+            start = now_ns();
+        }
+        uint64_t pos = failover.done;
+        if (pos == raid_device_size) {
+            __atomic_store_n(&mirror_slot[bad], s, __ATOMIC_RELEASE);
+            __atomic_store_n(&degraded, false, __ATOMIC_RELEASE);
+            failover.spare = -1;
+            double secs = (now_ns() - start) / 1e9;
+            fprintf(stderr, "rebuild: done in %.1f s (%.1f MB/s); %s replaces %s from now on\n", secs,
+                    secs > 0 ? raid_device_size / secs / (1 << 20) : 0.0, dev[s].path, failed);
+            break;
+        }
+        uint32_t n = raid_device_size - pos < REBUILD_STEP ? raid_device_size - pos : REBUILD_STEP;
+        failover.lo = pos;
+        failover.hi = pos + n;
+        failover.touched = false;
+        pthread_mutex_unlock(&state_lock);
+        int err = 0;
+        if (member_pread(mirror(ok_dev), buf, n, pos) != (ssize_t)n || member_pwrite(&dev[s], buf, n, pos) != (ssize_t)n)
+            err = -EIO;
+        pthread_mutex_lock(&state_lock);
+        failover.lo = failover.hi = 0;
+        if (err == 0 && !failover.touched)
+            failover.done = pos + n;
+        else if (err != 0 && (!check_failed() || failover.spare == s)) {
+            fprintf(stderr, "rebuild: failed at offset %lu; staying degraded\n", pos);
+            break;
+        }
+    }
+    failover.running = false;
+    pthread_mutex_unlock(&state_lock);
+    free(buf);
+    return NULL;
+}
+
+/* Start copying onto a spare if there is one. Called with state_lock held. */
+static void rebuild_start(void) {
+    if (failover.running || failover.stop || next_spare() < 0)
+        return;
+    if (failover.started)
+        pthread_join(failover.thread, NULL); // the last rebuild, which has finished
+    failover.started = false;
+    int r = affinity_background_thread(&failover.thread, "rebuild", rebuild_thread, NULL);
+    if (r != 0)
+        fprintf(stderr, "rebuild: can't start: %s\n", strerror(r));
+    else
+        failover.started = failover.running = true;
+}
+
+/* Stop the rebuild; an unfinished one starts over next time. */
+static void rebuild_stop(void) {
+    pthread_mutex_lock(&state_lock);
+    failover.stop = true;
+    bool started = failover.started;
+    pthread_mutex_unlock(&state_lock);
+    if (started)
+        pthread_join(failover.thread, NULL);
+}
+
+/* Copy the checksum units covering [offset, offset+len) from the other
+ * mirror over `bad`, whose copy failed its checksum. Whole units are
+ * rewritten so the repaired copy verifies again. Called with state_lock
+ * held, so no write is halfway through either mirror. */
+static int repair(int bad, u_int64_t offset, u_int32_t len) {
+    int good = (bad+1) % 2;
+    if (degraded)
+        return -EIO; // nothing to repair it from
+    uint64_t lo = offset / MEMBER_CSUM_UNIT * MEMBER_CSUM_UNIT;
+    uint64_t hi = (offset + len + MEMBER_CSUM_UNIT - 1) / MEMBER_CSUM_UNIT * MEMBER_CSUM_UNIT;
+    if (hi > raid_device_size)
+        hi = raid_device_size;
+    struct arena_mark mark = arena_mark();
+    char *tmp = arena_take(hi - lo);
+    int err = 0;
+    if (tmp == NULL ||
+        member_pread(mirror(good), tmp, hi - lo, lo) != (ssize_t)(hi - lo) ||
+        member_pwrite(mirror(bad), tmp, hi - lo, lo) != (ssize_t)(hi - lo))
+        err = -EIO;
+    arena_release(mark);
+    if (err == 0)
+        fprintf(stderr, "Repaired %s at %lu, %lu bytes, from %s.\n", mirror(bad)->path, lo, hi - lo, mirror(good)->path);
+    else
+        fprintf(stderr, "Failed to repair %s at %lu.\n", mirror(bad)->path, lo);
+    return err;
+}
+
+/* A read from mirror `bad` failed with `err`: serve it from the other mirror,
+ * and repair the first copy if it failed its checksum. If `bad` has failed
+ * for good, go degraded. */
+static int read_other(char *buf, u_int32_t len, u_int64_t offset, int bad, ssize_t err) {
+    int good = (bad+1) % 2;
+    if (err == -EBADMSG) {
+        // a read that overlapped a write can see the new data with the old
+        // checksum: look again with writes held off before repairing
+        int res = -EIO;
+        pthread_mutex_lock(&state_lock);
+        if (member_pread(mirror(bad), buf, len, offset) == (ssize_t)len)
+            res = 0;
+        else if ((!degraded || good == ok_dev) &&
+                 member_pread(mirror(good), buf, len, offset) == (ssize_t)len) {
+            repair(bad, offset, len);
+            res = 0;
+        }
+        pthread_mutex_unlock(&state_lock);
+        return res;
+    }
+    pthread_mutex_lock(&state_lock);
+    check_failed();
+    pthread_mutex_unlock(&state_lock);
+    if (degraded && good != ok_dev)
+        return -EIO;
+    if (member_pread(mirror(good), buf, len, offset) != (ssize_t)len)
+        return -EIO;
+    return 0;
+}
+
+/* A hedged read: both mirrors' requests and the buffers they read into,
+ * which outlive the call if the slower one is abandoned. */
+struct hedge {
+    struct member_batch batch;
+    struct member_io io[2];
+    struct iovec iov[2];
+};
+
+/* How long a read from `m` may take before it is hedged: the mirror's recent
+ * 95th percentile, or 0 until that is known. */
+static uint64_t hedge_delay(struct member *m) {
+    uint64_t p95 = member_read_p95(m);
+    if (p95 == 0)
+        return 0;
+    return p95 > HEDGE_MIN_US * 1000ULL ? p95 : HEDGE_MIN_US * 1000ULL;
+}
+
+static void hedge_submit(struct hedge *h, int i, char *data, u_int32_t len, u_int64_t offset) {
+    h->iov[i].iov_base = data;
+    h->iov[i].iov_len = len;
+    h->io[i].op = MEMBER_IO_READ;
+    h->io[i].flags = 0;
+    h->io[i].iov = &h->iov[i];
+    h->io[i].iovcnt = 1;
+    h->io[i].offset = offset;
+    member_submit(mirror(i), &h->io[i], &h->batch);
+}
+
+/* Read from mirror `first`; if it takes longer than it usually does, ask the
+ * other mirror too and take whichever good copy comes back first. */
+static int read_hedged(char *buf, u_int32_t len, u_int64_t offset, int first) {
+    int other = (first+1) % 2;
+    size_t own = (len + 63) / 64 * 64;
+    char *mem = member_alloc(2 * own + sizeof(struct hedge));
+    if (mem == NULL)
+        return -ENOMEM;
+    struct hedge *h = (struct hedge *)(mem + 2 * own);
+    memset(h, 0, sizeof(*h)); // io[other] reads as not done unless it is hedged
+    member_batch_init(&h->batch);
+    hedge_submit(h, first, mem, len, offset);
+    uint64_t delay = hedge_delay(mirror(first));
+    if (delay > 0 && member_batch_wait_some(&h->batch, 0, delay) != 0) {
+        hedge_submit(h, other, mem + own, len, offset);
+        __atomic_add_fetch(&hedged_reads, 1, __ATOMIC_RELAXED);
+        member_batch_wait_some(&h->batch, 1, 0);
+    }
+    int use = first;
+    while (!member_io_done(&h->io[first])) {
+        if (member_io_done(&h->io[other]) && h->io[other].result == (ssize_t)len) {
+            use = other; // only the hedge has answered
+            __atomic_add_fetch(&hedge_wins, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        member_batch_wait(&h->batch); // the hedge failed: wait for the first after all
+    }
+    if (use == first && h->io[first].result != (ssize_t)len) {
+        ssize_t err = h->io[first].result;
+        member_batch_wait(&h->batch);
+        free(mem);
+        return read_other(buf, len, offset, first, err);
+    }
+    memcpy(buf, h->iov[use].iov_base, len);
+    member_batch_abandon(&h->batch, mem); // freed once the slower read finishes
+    return 0;
+}
+
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "R - %lu, %u\n", offset, len);
     
-    if (degraded) {
+    if (__atomic_load_n(&degraded, __ATOMIC_ACQUIRE)) {
         // read from surviving drive
-        pread(dev_fd[ok_dev], buf, len, offset);
-    } else {
-        // read from one of the two drives (we dont care which)
-        last_read_dev = (last_read_dev+1) % 2; // alternate which device we do the read from
-        pread(dev_fd[last_read_dev], buf, len, offset);
+        ssize_t r = member_pread(mirror(ok_dev), buf, len, offset);
+        if (r == -EBADMSG) {
+            // perhaps a write raced the read: look again with writes held off
+            pthread_mutex_lock(&state_lock);
+            r = member_pread(mirror(ok_dev), buf, len, offset);
+            pthread_mutex_unlock(&state_lock);
+        }
+        if (r != (ssize_t)len && r != -EBADMSG) {
+            pthread_mutex_lock(&state_lock);
+            check_failed();
+            pthread_mutex_unlock(&state_lock);
+        }
+        return r == (ssize_t)len ? 0 : -EIO;
+    }
+    uint64_t mid = (offset + len/2) / MEMBER_CSUM_UNIT * MEMBER_CSUM_UNIT;
+    if (checksum && mid > offset) {
+        // read half from each drive at once; each drive's I/O thread checks
+        // its half while the other half is still being read
+        struct iovec iov[2] = {{buf, mid - offset}, {(char *)buf + (mid - offset), offset + len - mid}};
+        struct member_io io[2];
+        struct member_batch batch;
+        member_batch_init(&batch);
+        for (int i=0; i<2; i++) {
+            io[i].op = MEMBER_IO_READ;
+            io[i].flags = 0;
+            io[i].iov = &iov[i];
+            io[i].iovcnt = 1;
+            io[i].offset = i == 0 ? offset : mid;
+            member_submit(mirror(i), &io[i], &batch);
+        }
+        member_batch_wait(&batch);
+        for (int i=0; i<2; i++) {
+            if (io[i].result != (ssize_t)iov[i].iov_len &&
+                read_other(iov[i].iov_base, iov[i].iov_len, io[i].offset, i, io[i].result) != 0)
+                return -EIO;
+        }
+        return 0;
     }
+    // read from one of the two drives (we dont care which)
+    int d = __atomic_fetch_add(&last_read_dev, 1, __ATOMIC_RELAXED) & 1; // alternate which device we do the read from
+    if (hedge)
+        return read_hedged(buf, len, offset, d);
+    ssize_t r = member_pread(mirror(d), buf, len, offset);
+    if (r != (ssize_t)len)
+        return read_other(buf, len, offset, d, r);
     return 0;
 }
 
-static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
-    UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "W - %lu, %u\n", offset, len);
-    
+/* Write to both mirrors, or while degraded to the surviving one and the
+ * part of a spare already copied. Called with state_lock held. */
+static int write_mirrors(const void *buf, u_int32_t len, u_int64_t offset, int wflags) {
     if (degraded) {
         // write to surviving drive
-        pwrite(dev_fd[ok_dev], buf, len, offset); // write to ok drive only
+        if (member_pwrite2(mirror(ok_dev), buf, len, offset, wflags) != (ssize_t)len) // write to ok drive only
+            return -EIO;
+        int s = failover.spare;
+        if (s >= 0 && offset < failover.done) {
+            uint32_t n = failover.done - offset < len ? failover.done - offset : len;
+            if (member_pwrite2(&dev[s], buf, n, offset, wflags) != (ssize_t)n)
+                return -EIO;
+        }
+        if (offset < failover.hi && offset + len > failover.lo)
+            failover.touched = true; // the copy in progress may have missed this
     } else {
         // write to both drives
         for (int i=0; i<2; i++) {
-            pwrite(dev_fd[i], buf, len, offset); 
+            ssize_t r = member_pwrite2(mirror(i), buf, len, offset, wflags);
+            if (r == -EBADMSG && repair(i, offset, len) == 0)
+                r = member_pwrite2(mirror(i), buf, len, offset, wflags); // the rest of a partly written unit was corrupt
+            if (r != (ssize_t)len)
+                return r == -EBADMSG ? -EBADMSG : -EIO;
         }
     }
     return 0;
 }
 
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata) {
+    UNUSED(userdata);
+    if (verbose)
+        fprintf(stderr, "W%s - %lu, %u\n", (flags & BUSE_WRITE_FUA) ? " FUA" : "", offset, len);
+    int wflags = (flags & BUSE_WRITE_FUA) ? MEMBER_WRITE_DSYNC : 0; // FUA: sync just this write on each drive
+    
+    pthread_mutex_lock(&state_lock);
+    int err = write_mirrors(buf, len, offset, wflags);
+    if (err == -EIO && check_failed())
+        err = write_mirrors(buf, len, offset, wflags); // again, without a drive that has just failed
+    pthread_mutex_unlock(&state_lock);
+    return err != 0 ? -EIO : 0;
+}
+
 static int xmp_flush(void *userdata) {
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a flush request.\n");
-    for (int i=0; i<2; i++) {
-        if (dev_fd[i] != -1) { // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
-        }
+    int err = member_flush(dev, 2 + nspares); // sync the devices written since the last flush, in parallel; skips failed devices
+    if (err != 0) {
+        pthread_mutex_lock(&state_lock);
+        bool retry = check_failed();
+        pthread_mutex_unlock(&state_lock);
+        if (retry)
+            err = member_flush(dev, 2 + nspares); // without a device that has just failed
     }
-    return 0;
+    return err;
 }
 
 static void xmp_disc(void *userdata) {
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a disconnect request.\n");
-    // disconnect is a no-op for us
+    rebuild_stop();
+    for (int i=0; verbose && i<2+nspares; i++)
+        member_report(&dev[i]);
+    if (verbose && hedge)
+        fprintf(stderr, "Hedged %lu reads; the other device answered first %lu times.\n", hedged_reads, hedge_wins);
 }
 
 /*
@@ -106,8 +462,33 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
 
 /* argument parsing using argp */
 
+enum {
+    OPT_SPARE = 0x100,
+    OPT_MAX_ERRORS,
+    OPT_IO_TIMEOUT,
+    OPT_HEDGE,
+    OPT_WORKERS,
+    OPT_CPUS,
+    OPT_WORKER_CPUS,
+    OPT_IO_CPUS,
+    OPT_FORMAT_CHECKSUMS,
+};
+
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"direct", 'd', 0, 0, "Open devices with O_DIRECT, bypassing the host page cache", 0},
+    {"mmap", 'm', 0, 0, "Map file-backed devices with mmap and serve I/O from the mapping", 0},
+    {"access", 'a', "PATTERN", 0, "Hint the expected access pattern to the kernel: normal, sequential or random", 0},
+    {"checksum", 'k', 0, 0, "Keep a CRC32C checksum per 4 KiB at the end of each device; reads that fail it are served from the other device, which is copied back", 0},
+    {"format-checksums", OPT_FORMAT_CHECKSUMS, 0, 0, "With -k, write a new checksum table over the end of each device, where data would be lost; needed once, on devices that have none", 0},
+    {"spare", OPT_SPARE, "DEVICE", 0, "Keep DEVICE as a hot spare: when a device fails, the other is copied onto it in the background (may be repeated)", 0},
+    {"max-errors", OPT_MAX_ERRORS, "N", 0, "Fail a device after N read errors or timeouts, or at its first write error (default 8, 0 never fails one)", 0},
+    {"hedge", OPT_HEDGE, 0, 0, "Also read from the other device when a read takes longer than its device's recent 95th percentile", 0},
+    {"io-timeout", OPT_IO_TIMEOUT, "MS", 0, "Count a device request that takes longer than MS milliseconds as an error (default 30000, 0 for no limit)", 0},
+    {"workers", OPT_WORKERS, "N", 0, "Serve up to N requests at once, each on its own thread (default 0: one at a time)", 0},
+    {"cpus", OPT_CPUS, "SET", 0, "Run the threads reading and answering the NBD socket, and background ones such as destaging and rebuilds, on the CPUs in SET: a list like 0-3,8, or node:N for the CPUs of NUMA node N", 0},
+    {"worker-cpus", OPT_WORKER_CPUS, "SET", 0, "Run the --workers threads on the CPUs in SET (default: those of --cpus)", 0},
+    {"io-cpus", OPT_IO_CPUS, "SET", 0, "Run each device's I/O threads on the CPUs in SET, or with near on those of the NUMA node the device is attached to; starts the threads if nothing else does", 0},
     {0},
 };
 
@@ -116,6 +497,18 @@ struct arguments {
     char* device[2];
     char* raid_device;
     int verbose;
+    int member_flags; // MEMBER_* flags used to open devices
+    int access;       // MEMBER_ADV_* hint for the devices
+    bool checksum;    // verify reads against per-unit checksums
+    bool format_checksums; // write new checksum tables
+    char *spare[MAX_SPARES];
+    int nspares;
+    unsigned int max_errors; // errors before a device is failed
+    unsigned int io_timeout; // milliseconds before a request counts as an error
+    unsigned int workers;    // request threads, 0 to serve requests one at a time
+    char *cpus;              // CPU set of the socket threads, NULL for any
+    char *worker_cpus;       // CPU set of the request threads, NULL for --cpus
+    char *io_cpus;           // CPU set or "near" for device I/O threads
 };
 
 /* Parse a single option. */
@@ -129,6 +522,62 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
+        case 'd':
+            arguments->member_flags |= MEMBER_DIRECT;
+            break;
+        case 'm':
+            arguments->member_flags |= MEMBER_MMAP;
+            break;
+        case 'a':
+            arguments->access = member_parse_advice(arg);
+            if (arguments->access < 0)
+                argp_error(state, "PATTERN must be normal, sequential or random");
+            break;
+        case 'k':
+            arguments->checksum = true;
+            break;
+        case OPT_FORMAT_CHECKSUMS:
+            arguments->format_checksums = true;
+            break;
+        case OPT_HEDGE:
+            hedge = true;
+            break;
+        case OPT_SPARE:
+            if (arguments->nspares == MAX_SPARES)
+                argp_error(state, "at most %d spares", MAX_SPARES);
+            arguments->spare[arguments->nspares++] = arg;
+            break;
+        case OPT_MAX_ERRORS:
+            arguments->max_errors = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0')
+                argp_error(state, "N must be an integer");
+            break;
+        case OPT_IO_TIMEOUT:
+            arguments->io_timeout = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0')
+                argp_error(state, "MS must be an integer");
+            break;
+        case OPT_WORKERS:
+            arguments->workers = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || arguments->workers > MAX_WORKERS)
+                argp_error(state, "N must be an integer of at most %d", MAX_WORKERS);
+            break;
+        case OPT_CPUS:
+            arguments->cpus = arg;
+            if (affinity_check(arg, false) != 0)
+                argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+            break;
+        case OPT_WORKER_CPUS:
+            arguments->worker_cpus = arg;
+            if (affinity_check(arg, false) != 0)
+                argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+            break;
+        case OPT_IO_CPUS:
+            arguments->io_cpus = arg;
+            if (affinity_check(arg, true) != 0)
+                argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, node:N or near");
+            break;
+
         case ARGP_KEY_ARG:
             switch (state->arg_num) {
 
@@ -159,6 +608,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             break;
 
         case ARGP_KEY_END:
+            if ((arguments->member_flags & MEMBER_DIRECT) && (arguments->member_flags & MEMBER_MMAP)) {
+                argp_error(state, "--direct and --mmap can't be combined");
+            }
             if (state->arg_num < 3) {
                 warnx("not enough arguments");
                 argp_usage(state);
@@ -189,42 +641,53 @@ static struct argp argp = {
 static int do_raid_rebuild() {
     // target drive index is: rebuild_dev
     int source_dev = (rebuild_dev+1)%2; // the other one
-    char buf[block_size]; 
-    lseek(dev_fd[source_dev],0,SEEK_SET);
-    lseek(dev_fd[rebuild_dev],0,SEEK_SET);
+    char *buf = member_alloc(block_size);
+    if (buf == NULL) {
+        perror("rebuild_alloc");
+        return -1;
+    }
     
     // simple block copy
+    int ret = 0;
     for (uint64_t cursor=0; cursor<raid_device_size; cursor+=block_size) {
         int r;
-        r = read(dev_fd[source_dev],buf,block_size);
+        r = member_pread(&dev[source_dev],buf,block_size,cursor);
         if (r<0) {
-            perror("rebuild_read");
-            return -1;
+            fprintf(stderr, "rebuild_read: %s\n", strerror(-r));
+            ret = -1;
+            goto out;
         } else if (r != block_size) {
             fprintf(stderr, "rebuild_read: short read (%d bytes), offset=%zu\n", r, cursor);
-            return 1;
+            ret = 1;
+            goto out;
         }
-        r = write(dev_fd[rebuild_dev],buf,block_size);
+        r = member_pwrite(&dev[rebuild_dev],buf,block_size,cursor);
         if (r<0) {
-            perror("rebuild_write");
-            return -1;
+            fprintf(stderr, "rebuild_write: %s\n", strerror(-r));
+            ret = -1;
+            goto out;
         } else if (r != block_size) {
             fprintf(stderr, "rebuild_write: short write (%d bytes), offset=%zu\n", r, cursor);
-            return 1;
+            ret = 1;
+            goto out;
         }
     }
-    return 0;
+out:
+    free(buf);
+    return ret;
 }
 
 int main(int argc, char *argv[]) {
     struct arguments arguments = {
         .verbose = 0,
+        .max_errors = MAX_ERRORS,
+        .io_timeout = IO_TIMEOUT_MS,
     };
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
     
     struct buse_operations bop = {
         .read = xmp_read,
-        .write = xmp_write,
+        .write_flags = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
         // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
@@ -240,7 +703,7 @@ int main(int argc, char *argv[]) {
         char* dev_path = arguments.device[i];
         if (strcmp(dev_path,"MISSING")==0) {
             degraded = true;
-            dev_fd[i] = -1;
+            member_set_missing(&dev[i]);
             fprintf(stderr, "DEGRADED: Device number %d is missing!\n", i);
         } else {
             if (dev_path[0] == '+') { // RAID rebuild mode!!
@@ -254,12 +717,13 @@ int main(int argc, char *argv[]) {
                 rebuild_needed = true;
             }
             ok_dev = i;
-            dev_fd[i] = open(dev_path,O_RDWR);
-            if (dev_fd[i] < 0) {
-                perror(dev_path);
+            int r = member_open(&dev[i], dev_path, arguments.member_flags);
+            if (r < 0) {
+                fprintf(stderr, "%s: %s\n", dev_path, strerror(-r));
                 exit(1);
             }
-            uint64_t size = lseek(dev_fd[i],0,SEEK_END); // used to find device size by seeking to end
+            member_advise(&dev[i], arguments.access);
+            uint64_t size = dev[i].size;
             fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
             if (raid_device_size==0 || size<raid_device_size) {
                 raid_device_size = size; // raid_device_size is minimum size of available devices
@@ -267,8 +731,54 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    checksum = arguments.checksum;
+    if (checksum)
+        raid_device_size = member_csum_capacity(raid_device_size); // the checksums live after the data
     raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
     bop.size = raid_device_size; // tell BUSE how big our block device is
+    bop.workers = arguments.workers;
+    bop.server_cpus = arguments.cpus;
+    bop.worker_cpus = arguments.worker_cpus;
+    arena_setup((1 << 20) + 2 * MEMBER_CSUM_UNIT); // repairing the units under a request of up to 1 MiB
+    nspares = arguments.nspares;
+    for (int i=2; i<2+nspares; i++) {
+        const char *dev_path = arguments.spare[i-2];
+        int r = member_open(&dev[i], dev_path, arguments.member_flags);
+        if (r < 0) {
+            fprintf(stderr, "%s: %s\n", dev_path, strerror(-r));
+            exit(1);
+        }
+        member_advise(&dev[i], arguments.access);
+        uint64_t usable = checksum ? member_csum_capacity(dev[i].size) : dev[i].size;
+        if (usable < raid_device_size) {
+            fprintf(stderr, "ERROR: Spare '%s' is smaller than the array.\n", dev_path);
+            exit(1);
+        }
+        fprintf(stderr, "Got spare '%s', size %ld bytes.\n", dev_path, dev[i].size);
+    }
+    member_cpus(arguments.io_cpus);
+    affinity_background(arguments.cpus);
+    for (int i=0; checksum && i<2+nspares; i++) {
+        // spares and the device being rebuilt hold nothing worth keeping
+        bool format = arguments.format_checksums || i >= 2 || i == rebuild_dev;
+        int r = member_csum_enable(&dev[i], raid_device_size, format);
+        if (r == 0)
+            r = member_start(&dev[i], 1);
+        if (r == -ENODATA) {
+            fprintf(stderr, "%s has no checksum table; --format-checksums writes one over the end of the device\n", dev[i].path);
+            exit(1);
+        } else if (r != 0) {
+            fprintf(stderr, "%s: can't set up checksums: %s\n", dev[i].path, strerror(-r));
+            exit(1);
+        }
+    }
+    for (int i=0; (hedge || arguments.io_cpus != NULL) && !checksum && i<2+nspares; i++) {
+        // hedging needs reads that can be waited for with a time limit
+        if (dev[i].fd >= 0 && member_start(&dev[i], 1) != 0) {
+            fprintf(stderr, "Failed to start I/O thread for %s.\n", dev[i].path);
+            exit(1);
+        }
+    }
     if (rebuild_needed) {
         if (degraded) {
             fprintf(stderr, "ERROR: Can't rebuild from a missing device (i.e., you can't combine MISSING and '+').\n");
@@ -285,6 +795,13 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "ERROR: No functioning devices found. Aborting.\n");
         exit(1);
     }
+    for (int i=0; i<2+nspares; i++)
+        member_health(&dev[i], arguments.max_errors, arguments.io_timeout);
+    if (degraded) {
+        pthread_mutex_lock(&state_lock);
+        rebuild_start(); // copy onto a spare in place of the missing device
+        pthread_mutex_unlock(&state_lock);
+    }
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
     
     return buse_main(arguments.raid_device, &bop, NULL);
@@ -25,150 +25,1329 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
+#include "affinity.h"
+#include "arena.h"
 #include "buse.h"
+#include "geometry.h"
+#include "member.h"
+#include "readahead.h"
+#include "reshape.h"
+#include "wbcache.h"
+#include "ssdcache.h"
+#include "xor.h"
+
+#define SCHED_DEADLINE_US 20000 // longest a queued chunk may be passed over by the elevator
+#define SEGMENT_BYTES (1024 * 1024) // large requests are handed over in segments of about this much
+#define MAX_WORKERS 64 // most request threads --workers may start
+
+#define RESHAPE_BATCH_BYTES (8 * 1024 * 1024) // array data moved per reshape step
+#define SCRUB_BATCH_BYTES (1024 * 1024) // read from each device per scrub step
+#define REBUILD_BATCH_BYTES (1024 * 1024) // rebuilt onto a spare per step
+#define SCRUB_IDLE_MS 100               // quiet time an idle-only scrub waits for
+#define SCRUB_LOG_MAX 16                // mismatches logged individually per pass
+#define MAX_SPARES 8
+#define MAX_ERRORS 8                    // default errors before a device is failed
+#define IO_TIMEOUT_MS 30000             // default time after which a request counts as an error
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
-int dev_fd[16];            // file descriptors for two underlying block devices that make up the RAID
+struct member dev[16 + MAX_SPARES]; // underlying block devices that make up the RAID, then hot spares
 int dev_fd_size;           // number of devices
+int nspares;               // hot spares, from dev[dev_fd_size] on
+int slot[16];              // dev[] index serving each device; a rebuilt spare takes over a failed one
 int block_size;            // NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
-int fail_dev;              // index of the failed device
+int fail_dev;              // index of the failed device while degraded
 int parity_dev = -1;       // index of the parity device
 uint64_t raid_device_size; // size of raid device in bytes
+uint64_t member_size;      // bytes used on each device (smallest device, truncated to block size)
+struct geometry geom;      // data chunk i lives on dev[i % (dev_fd_size - 1)]
+struct geometry geom_old;  // layout without the last data device, while growing onto it
 bool verbose = false;      // set to true by -v option for debug output
 bool degraded = false;     // true if we're missing a device
 
-int ok_dev = -1;      // index of dev_fd that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
+int ok_dev = -1;      // index of dev that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 
 int last_read_dev = 0; // used to interleave reading between the two devices
 
-static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+// parity updates are read-modify-write, so writes to a stripe are serialized
+#define STRIPE_LOCKS 64
+pthread_mutex_t stripe_locks[STRIPE_LOCKS];
+
+struct readahead *ra; // sequential read-ahead, NULL unless enabled with -r
+struct wbcache *cache; // write-back cache, NULL unless enabled with -c
+struct ssdcache *ssd; // persistent cache on a fast device, NULL unless enabled with --ssd-cache
+
+// hedged reads: a chunk read that takes longer than its device's recent 95th
+// percentile is rebuilt from the other devices and parity instead
+#define HEDGE_MIN_US 500 // never hedge sooner than this
+bool hedge = false;
+uint64_t hedged_chunks; // accessed atomically
+struct reshape *reshape; // online restriping onto the last data device, NULL unless growing with -g
+
+// background parity scrub; a pass runs at startup with -S, every `interval`
+// seconds after that, and whenever the process gets SIGUSR1
+struct
+{
+    pthread_t thread;
+    int pipe[2];            // SIGUSR1 ('s') and disconnect ('q') wake the thread
+    bool at_start;
+    unsigned long interval; // 0 for no periodic passes
+    unsigned long rate;     // MB/s read across all devices, 0 for unlimited
+    bool idle;              // only scrub while no requests are arriving
+    bool repair;            // rewrite parity that doesn't match the data
+    bool stop;
+} scrub = {.pipe = {-1, -1}};
+uint64_t last_io_ns; // arrival of the latest request, for idle-only scrubbing
+
+// failing over when a device fails: the array goes degraded and a thread
+// rebuilds the device onto a hot spare, which serves the rows rebuilt so far
+struct
+{
+    pthread_mutex_t lock; // serializes failing over
+    pthread_t thread;
+    bool started;
+    bool stop;
+    int spare;     // dev[] index being rebuilt onto, -1 for none
+    uint64_t rows; // member rows rebuilt so far; accessed atomically
+    bool lost;     // a second device failed
+} failover = {.lock = PTHREAD_MUTEX_INITIALIZER, .spare = -1};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static pthread_mutex_t *stripe_lock(uint64_t stripe)
+{
+    return &stripe_locks[stripe % STRIPE_LOCKS];
+}
+
+/* Whether device `d` has no usable copy of the stripe at `blockOffset`: the
+ * array is degraded without it and no spare has been rebuilt that far. */
+static bool lost(int d, uint64_t blockOffset)
+{
+    if (!__atomic_load_n(&degraded, __ATOMIC_ACQUIRE) || d != __atomic_load_n(&fail_dev, __ATOMIC_RELAXED))
+        return false;
+    return __atomic_load_n(&failover.spare, __ATOMIC_ACQUIRE) < 0 ||
+           blockOffset / block_size >= __atomic_load_n(&failover.rows, __ATOMIC_ACQUIRE);
+}
+
+/* The member serving device `d` at `blockOffset`: while degraded, a spare
+ * stands in for the failed device in the rows it has rebuilt. */
+static struct member *member_at(int d, uint64_t blockOffset)
+{
+    if (__atomic_load_n(&degraded, __ATOMIC_ACQUIRE) && d == __atomic_load_n(&fail_dev, __ATOMIC_RELAXED))
+    {
+        int s = __atomic_load_n(&failover.spare, __ATOMIC_ACQUIRE);
+        if (s >= 0 && blockOffset / block_size < __atomic_load_n(&failover.rows, __ATOMIC_ACQUIRE))
+            return &dev[s];
+    }
+    return &dev[__atomic_load_n(&slot[d], __ATOMIC_ACQUIRE)];
+}
+
+static void rebuild_start(void);
+
+/* Called after an I/O error. If a device has just failed, carry on degraded
+ * without it and start rebuilding onto a hot spare; a spare that fails is
+ * dropped for the next one. Returns false once a second device has failed,
+ * else the request may be tried again. */
+static bool check_failed(void)
+{
+    pthread_mutex_lock(&failover.lock);
+    int s = failover.spare;
+    if (degraded && s >= 0 && member_failed(&dev[s]))
+    {
+        // its rows are rebuilt from parity again, onto the next spare
+        __atomic_store_n(&failover.rows, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&failover.spare, -1, __ATOMIC_RELEASE);
+        fprintf(stderr, "Spare %s failed; dropped.\n", dev[s].path);
+    }
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if (!member_failed(&dev[slot[d]]) || (degraded && d == fail_dev))
+            continue;
+        if (degraded)
+        {
+            if (!failover.lost)
+                fprintf(stderr, "ERROR: %s failed while degraded; stripes can't be rebuilt.\n", dev[slot[d]].path);
+            failover.lost = true;
+            continue;
+        }
+        __atomic_store_n(&failover.spare, -1, __ATOMIC_RELEASE);
+        __atomic_store_n(&failover.rows, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&fail_dev, d, __ATOMIC_RELAXED);
+        __atomic_store_n(&degraded, true, __ATOMIC_RELEASE);
+        fprintf(stderr, "DEGRADED: %s failed; its data is rebuilt from parity on the fly.\n", dev[slot[d]].path);
+        rebuild_start();
+    }
+    bool ok = !failover.lost;
+    pthread_mutex_unlock(&failover.lock);
+    return ok;
+}
+
+/* Read-ahead fill: one vectored read per data device covering `count` whole
+ * stripes, issued in parallel. Runs on the read-ahead thread, so it uses its
+ * own buffers. A lost data device is rebuilt from parity. */
+static int raid4_fill(uint64_t stripe, uint32_t count, char *buf, void *ctx)
+{
+    UNUSED(ctx);
+    int ndata = dev_fd_size - 1;
+    uint64_t off = stripe * block_size;
+    int missing = fail_dev;
+    // a spare serves whole rows from its start, so if any row is lost the last one is
+    bool rebuild = missing != parity_dev && lost(missing, (stripe + count - 1) * block_size);
+    struct arena_mark mark = arena_mark();
+    struct iovec *iov = arena_take((size_t)ndata * count * sizeof(*iov));
+    struct iovec piov;
+    struct member_io io[16];
+    struct member_batch batch;
+    char *parity = rebuild ? arena_take((size_t)count * block_size) : NULL;
+    if (iov == NULL || (rebuild && parity == NULL))
+    {
+        arena_release(mark);
+        return -ENOMEM;
+    }
+
+    member_batch_init(&batch);
+    for (int d = 0; d < ndata; d++)
+    {
+        if (rebuild && d == missing)
+            continue;
+        for (uint32_t j = 0; j < count; j++)
+        {
+            iov[d * count + j].iov_base = buf + ((uint64_t)j * ndata + d) * block_size;
+            iov[d * count + j].iov_len = block_size;
+        }
+        io[d].op = MEMBER_IO_READ;
+        io[d].flags = 0;
+        io[d].iov = &iov[d * count];
+        io[d].iovcnt = count;
+        io[d].offset = off;
+        member_submit(member_at(d, off), &io[d], &batch);
+    }
+    if (rebuild)
+    {
+        piov.iov_base = parity;
+        piov.iov_len = (size_t)count * block_size;
+        io[parity_dev].op = MEMBER_IO_READ;
+        io[parity_dev].flags = 0;
+        io[parity_dev].iov = &piov;
+        io[parity_dev].iovcnt = 1;
+        io[parity_dev].offset = off;
+        member_submit(member_at(parity_dev, off), &io[parity_dev], &batch);
+    }
+    int err = member_batch_wait(&batch);
+    if (err != 0 && err != -EBADMSG)
+        check_failed();
+
+    if (err == 0 && rebuild)
+    {
+        // missing chunk = parity ^ surviving data chunks
+        for (uint32_t j = 0; j < count; j++)
+        {
+            char *out = buf + ((uint64_t)j * ndata + missing) * block_size;
+            memcpy(out, parity + (uint64_t)j * block_size, block_size);
+            for (int d = 0; d < ndata; d++)
+            {
+                if (d == missing)
+                    continue;
+                xor_into(out, buf + ((uint64_t)j * ndata + d) * block_size, block_size);
+            }
+        }
+    }
+    arena_release(mark);
+    return err;
+}
+
+/* Whether device `d` holds part of the stripe at `blockOffset`: while
+ * growing, the new device only does in stripes already restriped. */
+static bool in_stripe(int d, uint64_t blockOffset)
+{
+    return reshape == NULL || d != dev_fd_size - 2 ||
+           blockOffset / block_size < reshape_position(reshape) / geom.stripe_size;
+}
+
+/* Rebuild `bytes` of device `missing` at `blockOffset` from the other
+ * devices, read all at once. Called with the stripe locked. */
+static int reconstruct(char *out, long bytes, uint64_t blockOffset, int missing)
+{
+    struct arena_mark mark = arena_mark();
+    char *bufs = arena_take((size_t)dev_fd_size * bytes);
+    const void *src[16];
+    struct member_io io[16];
+    struct iovec iov[16];
+    struct member_batch batch;
+    int n = 0;
+    if (bufs == NULL)
+        return -ENOMEM;
+
+    member_batch_init(&batch);
+    for (int j = 0; j < dev_fd_size; j++)
+    {
+        if (j == missing || !in_stripe(j, blockOffset))
+            continue;
+        iov[n].iov_base = bufs + (size_t)n * bytes;
+        iov[n].iov_len = bytes;
+        io[n].op = MEMBER_IO_READ;
+        io[n].flags = 0;
+        io[n].iov = &iov[n];
+        io[n].iovcnt = 1;
+        io[n].offset = blockOffset;
+        member_submit(member_at(j, blockOffset), &io[n], &batch);
+        src[n] = iov[n].iov_base;
+        n++;
+    }
+    int err = member_batch_wait(&batch) == 0 ? 0 : -EIO;
+    if (err == 0)
+        xor_gather(out, src, n, bytes);
+    arena_release(mark);
+    return err;
+}
+
+/* Rewrite the checksum units of device `bad` covering [blockOffset,
+ * blockOffset + bytes) from the other devices, after they failed their
+ * checksum. Whole units within the chunk are rewritten so they verify again;
+ * returns -EIO if the range can't be widened to whole units inside the chunk.
+ * Called with the stripe locked. */
+static int repair_chunk(int bad, uint64_t blockOffset, long bytes)
+{
+    uint64_t chunk = blockOffset / block_size * block_size;
+    uint64_t lo = blockOffset / MEMBER_CSUM_UNIT * MEMBER_CSUM_UNIT;
+    uint64_t hi = (blockOffset + bytes + MEMBER_CSUM_UNIT - 1) / MEMBER_CSUM_UNIT * MEMBER_CSUM_UNIT;
+    if (hi > member_size)
+        hi = member_size;
+    if (lo < chunk || hi > chunk + block_size)
+        return -EIO;
+    char *tmp = member_alloc(hi - lo);
+    int err = tmp == NULL ? -ENOMEM : reconstruct(tmp, hi - lo, lo, bad);
+    if (err == 0 && member_pwrite(member_at(bad, lo), tmp, hi - lo, lo) != (ssize_t)(hi - lo))
+        err = -EIO;
+    free(tmp);
+    if (err == 0)
+        fprintf(stderr, "Repaired %s at %lu, %lu bytes, from parity.\n", member_at(bad, lo)->path, lo, hi - lo);
+    else
+        fprintf(stderr, "Failed to repair %s at %lu.\n", member_at(bad, lo)->path, lo);
+    return err;
+}
+
+/* How long a chunk read from `m` may take before it is hedged: the device's
+ * recent 95th percentile, or 0 until that is known. */
+static uint64_t hedge_delay(struct member *m)
+{
+    uint64_t p95 = member_read_p95(m);
+    if (p95 == 0)
+        return 0;
+    return p95 > HEDGE_MIN_US * 1000ULL ? p95 : HEDGE_MIN_US * 1000ULL;
+}
+
+/* Give the submitted chunk reads as long as the slowest of their devices
+ * usually takes, then rebuild those still outstanding from the other
+ * devices and parity, straight into `buf`. Returns true if they all were,
+ * and marks them in `rebuilt`; their reads are left to finish on their own.
+ * Otherwise everything has been waited for. */
+static bool hedge_stragglers(struct member_batch *batch, struct member_io *io, const struct geom_extent *ext,
+                             size_t n, char *buf, bool *rebuilt)
+{
+    uint64_t delay = 0;
+    for (size_t c = 0; c < n; c++)
+    {
+        uint64_t d = io[c].iov != NULL ? hedge_delay(member_at(ext[c].member, ext[c].offset)) : 0;
+        if (d > delay)
+            delay = d;
+    }
+    if (delay == 0 || member_batch_wait_some(batch, 0, delay) == 0 || degraded)
+    {
+        member_batch_wait(batch);
+        return false;
+    }
+    for (size_t c = 0; c < n; c++)
+    {
+        if (io[c].iov == NULL || member_io_done(&io[c]))
+            continue;
+        pthread_mutex_t *lock = stripe_lock(ext[c].stripe);
+        pthread_mutex_lock(lock);
+        int err = reconstruct(buf + ext[c].buf, ext[c].len, ext[c].offset, ext[c].member);
+        pthread_mutex_unlock(lock);
+        if (err != 0)
+        {
+            memset(rebuilt, 0, n * sizeof(*rebuilt));
+            member_batch_wait(batch);
+            return false;
+        }
+        rebuilt[c] = true;
+        __atomic_add_fetch(&hedged_chunks, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+/* Lock every stripe lock covering `count` stripes from `stripe`, in index
+ * order so that writers holding several can't deadlock. */
+static void stripe_lock_range(uint64_t stripe, uint64_t count, bool lock)
+{
+    uint64_t mask = 0;
+    for (uint64_t s = stripe; s < stripe + count && s < stripe + STRIPE_LOCKS; s++)
+        mask |= 1ULL << (s % STRIPE_LOCKS);
+    for (int b = 0; b < STRIPE_LOCKS; b++)
+    {
+        if (mask & (1ULL << b))
+        {
+            if (lock)
+                pthread_mutex_lock(&stripe_locks[b]);
+            else
+                pthread_mutex_unlock(&stripe_locks[b]);
+        }
+    }
+}
+
+/* Read [offset, offset + len), in the old layout from `split` on. Chunks on
+ * working devices are all submitted before waiting, so each device's
+ * scheduler sees the whole request; chunks of a lost device are rebuilt
+ * inline meanwhile, and so are chunks that fail to read afterwards. With
+ * hedged reads, devices read into a buffer of our own, which a straggler
+ * may still be filling after we have returned. */
+static int read_split(uint64_t split, void *buf, u_int32_t len, u_int64_t offset)
+{
+    size_t n = geom_count_split(&geom, &geom_old, split, offset, len);
+    size_t own = hedge ? (len + 63) / 64 * 64 : 0;
+    size_t size = own + sizeof(struct member_batch) +
+                  n * (sizeof(struct member_io) + sizeof(struct iovec) + sizeof(struct geom_extent) + sizeof(bool));
+    struct arena_mark mark = arena_mark();
+    char *mem = hedge ? member_alloc(size) : arena_take(size); // a straggler may outlive the request
+    if (mem == NULL)
+        return -ENOMEM;
+    struct member_batch *batch = (struct member_batch *)(mem + own);
+    struct member_io *io = (struct member_io *)(batch + 1);
+    struct iovec *iov = (struct iovec *)(io + n);
+    struct geom_extent *ext = (struct geom_extent *)(iov + n);
+    bool *rebuilt = (bool *)(ext + n);
+    int err = 0;
+
+    geom_map_split(&geom, &geom_old, split, offset, len, ext, n);
+    member_batch_init(batch);
+    memset(rebuilt, 0, n * sizeof(*rebuilt));
+    for (size_t c = 0; c < n; c++)
+    {
+        char *out = (char *)buf + ext[c].buf;
+        if (!lost(ext[c].member, ext[c].offset))
+        {
+            iov[c].iov_base = hedge ? mem + ext[c].buf : out;
+            iov[c].iov_len = ext[c].len;
+            io[c].op = MEMBER_IO_READ;
+            io[c].flags = 0;
+            io[c].iov = &iov[c];
+            io[c].iovcnt = 1;
+            io[c].offset = ext[c].offset;
+            member_submit(member_at(ext[c].member, ext[c].offset), &io[c], batch);
+            continue;
+        }
+        io[c].iov = NULL; // rebuilt here rather than submitted
+        if (err != 0)
+            continue;
+
+        // read from surviving drives
+        pthread_mutex_t *lock = stripe_lock(ext[c].stripe);
+        pthread_mutex_lock(lock);
+        err = reconstruct(out, ext[c].len, ext[c].offset, ext[c].member);
+        pthread_mutex_unlock(lock);
+    }
+    bool abandon = false;
+    if (!hedge)
+        member_batch_wait(batch);
+    else if (err == 0)
+        abandon = hedge_stragglers(batch, io, ext, n, buf, rebuilt);
+    else
+        member_batch_wait(batch);
+    for (size_t c = 0; hedge && c < n; c++)
+    {
+        if (io[c].iov == NULL || rebuilt[c])
+            continue;
+        iov[c].iov_base = (char *)buf + ext[c].buf;
+        memcpy(iov[c].iov_base, mem + ext[c].buf, ext[c].len);
+    }
+
+    // rebuild chunks that couldn't be read, or failed their checksum, from
+    // the other devices; that fails if another device is lost too
+    bool checked = false;
+    for (size_t c = 0; err == 0 && c < n; c++)
+    {
+        if (io[c].iov == NULL || rebuilt[c] || io[c].result == (ssize_t)iov[c].iov_len)
+            continue;
+        if (!checked && io[c].result != -EBADMSG)
+        {
+            check_failed(); // go degraded if the device has failed
+            checked = true;
+        }
+        int driveToRead = ext[c].member;
+        pthread_mutex_t *lock = stripe_lock(ext[c].stripe);
+        pthread_mutex_lock(lock);
+        if (io[c].result == -EBADMSG &&
+            member_pread(member_at(driveToRead, io[c].offset), iov[c].iov_base, iov[c].iov_len, io[c].offset) ==
+                (ssize_t)iov[c].iov_len)
+        {
+            pthread_mutex_unlock(lock);
+            continue; // merged with a chunk that failed, but fine on its own
+        }
+        err = reconstruct(iov[c].iov_base, iov[c].iov_len, io[c].offset, driveToRead);
+        if (err == 0 && io[c].result == -EBADMSG)
+            repair_chunk(driveToRead, io[c].offset, iov[c].iov_len);
+        pthread_mutex_unlock(lock);
+    }
+    if (abandon)
+        member_batch_abandon(batch, mem);
+    else if (hedge)
+        free(mem);
+    arena_release(mark);
+    return err;
+}
+
+/* Index of row `r`, device `d` in read_degraded's tables: device by device,
+ * so each device's pieces are one iovec array. */
+static size_t row_cell(uint64_t rows, uint64_t r, int d)
+{
+    return (size_t)d * rows + r;
+}
+
+/* Read [offset, offset + len) while degraded. The whole request is planned
+ * first: each device gets one vectored read spanning every stripe the
+ * request needs from it, with chunks the request wants whole read straight
+ * into `buf` and the rest (parity, chunks wanted in part) into scratch. Each
+ * lost chunk is then rebuilt from the rest of its stripe in one pass. If a
+ * read fails, the request is read again chunk by chunk. */
+static int read_degraded(void *buf, u_int32_t len, u_int64_t offset)
+{
+    int missing = __atomic_load_n(&fail_dev, __ATOMIC_RELAXED);
+    size_t n = geom_count(&geom, offset, len);
+    struct arena_mark mark = arena_mark();
+    struct geom_extent *ext = arena_take(n * sizeof(*ext));
+    if (n == 0 || ext == NULL)
+    {
+        arena_release(mark);
+        return n == 0 ? 0 : -ENOMEM;
+    }
+    geom_map(&geom, offset, len, ext, n);
+    uint64_t first = ext[0].stripe;
+    uint64_t rows = ext[n - 1].stripe - first + 1;
+    size_t cells = rows * dev_fd_size; // a chunk of every row, device by device
+
+    long *at = arena_take(cells * (sizeof(long) + sizeof(struct iovec) + sizeof(char *) + sizeof(uint64_t)) + rows);
+    struct iovec *iov = (struct iovec *)(at + cells);
+    char **piece = (char **)(iov + cells); // where each chunk's read lands
+    uint64_t *start = (uint64_t *)(piece + cells); // and the device offset it starts at
+    bool *gone = (bool *)(start + cells); // rows whose lost chunk the request wants
+    if (at == NULL)
+    {
+        arena_release(mark);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < cells; i++)
+        at[i] = -1; // the extent the request has in each chunk, or none
+    for (size_t c = 0; c < n; c++)
+        at[row_cell(rows, ext[c].stripe - first, ext[c].member)] = c;
+    bool any = false;
+    for (uint64_t r = 0; r < rows; r++)
+    {
+        // decided once: a spare may rebuild more rows meanwhile
+        long c = at[row_cell(rows, r, missing)];
+        gone[r] = c >= 0 && lost(missing, ext[c].offset);
+        any |= gone[r];
+    }
+    if (!any)
+    {
+        arena_release(mark);
+        return read_split(UINT64_MAX, buf, len, offset);
+    }
+
+    // each device reads the span covering its wanted chunks and, if it
+    // survives, the ranges of the lost chunks, cut into a piece per row
+    uint64_t lo[16], hi[16];
+    size_t scratch = 0;
+    char *next = NULL;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1 && scratch > 0 && (next = arena_take(scratch)) == NULL)
+        {
+            arena_release(mark);
+            return -ENOMEM;
+        }
+        for (int d = 0; d < dev_fd_size; d++)
+        {
+            lo[d] = UINT64_MAX;
+            hi[d] = 0;
+            for (uint64_t r = 0; r < rows; r++)
+            {
+                // its own chunk, unless lost, and the range of a lost chunk to rebuild
+                long want[2] = {d == missing && gone[r] ? -1 : at[row_cell(rows, r, d)],
+                                d == missing || !gone[r] ? -1 : at[row_cell(rows, r, missing)]};
+                for (int w = 0; w < 2; w++)
+                {
+                    if (want[w] < 0)
+                        continue;
+                    const struct geom_extent *e = &ext[want[w]];
+                    lo[d] = e->offset < lo[d] ? e->offset : lo[d];
+                    hi[d] = e->offset + e->len > hi[d] ? e->offset + e->len : hi[d];
+                }
+            }
+            for (uint64_t off = lo[d]; off < hi[d];)
+            {
+                uint64_t end = (off / block_size + 1) * block_size;
+                end = end < hi[d] ? end : hi[d];
+                size_t cell = row_cell(rows, off / block_size - first, d);
+                long c = at[cell];
+                bool direct = c >= 0 && ext[c].offset == off && ext[c].offset + ext[c].len == end;
+                if (pass == 0 && !direct)
+                    scratch += end - off;
+                if (pass == 1)
+                {
+                    piece[cell] = direct ? (char *)buf + ext[c].buf : next;
+                    start[cell] = off;
+                    iov[cell].iov_base = piece[cell];
+                    iov[cell].iov_len = end - off;
+                    next += direct ? 0 : end - off;
+                }
+                off = end;
+            }
+        }
+    }
+
+    struct member_io io[16];
+    struct member_batch batch;
+    stripe_lock_range(first, rows, true);
+    member_batch_init(&batch);
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if (lo[d] >= hi[d])
+            continue;
+        io[d].op = MEMBER_IO_READ;
+        io[d].flags = 0;
+        io[d].iov = &iov[row_cell(rows, lo[d] / block_size - first, d)];
+        io[d].iovcnt = (hi[d] - 1) / block_size - lo[d] / block_size + 1;
+        io[d].offset = lo[d];
+        // for the lost device, only rows a spare has rebuilt, which come first
+        member_submit(member_at(d, lo[d]), &io[d], &batch);
+    }
+    if (member_batch_wait(&batch) != 0)
+    {
+        stripe_lock_range(first, rows, false);
+        arena_release(mark);
+        check_failed(); // go degraded if a device has just failed
+        return read_split(UINT64_MAX, buf, len, offset);
+    }
+
+    for (uint64_t r = 0; r < rows; r++)
+    {
+        if (!gone[r])
+            continue;
+        const struct geom_extent *e = &ext[at[row_cell(rows, r, missing)]];
+        const void *src[16];
+        int k = 0;
+        for (int d = 0; d < dev_fd_size; d++)
+        {
+            if (d != missing)
+                src[k++] = piece[row_cell(rows, r, d)] + (e->offset - start[row_cell(rows, r, d)]);
+        }
+        xor_gather((char *)buf + e->buf, src, k, e->len);
+    }
+    stripe_lock_range(first, rows, false);
+
+    // chunks wanted in part were read into scratch with the rest of their row
+    for (size_t c = 0; c < n; c++)
+    {
+        size_t cell = row_cell(rows, ext[c].stripe - first, ext[c].member);
+        if (!((int)ext[c].member == missing && gone[ext[c].stripe - first]) && piece[cell] != (char *)buf + ext[c].buf)
+            memcpy((char *)buf + ext[c].buf, piece[cell] + (ext[c].offset - start[cell]), ext[c].len);
+    }
+    arena_release(mark);
+    return 0;
+}
+
+/* Uncached read; the write-back cache calls this for what it doesn't hold. */
+static int raid_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
     UNUSED(userdata);
+    if (ra != NULL && ra_read(ra, buf, len, offset))
+        return 0;
+    if (reshape == NULL && __atomic_load_n(&degraded, __ATOMIC_ACQUIRE))
+        return read_degraded(buf, len, offset);
+    if (reshape == NULL)
+        return read_split(UINT64_MAX, buf, len, offset);
+    int ticket;
+    uint64_t split = reshape_enter(reshape, offset, len, &ticket);
+    int err = read_split(split, buf, len, offset);
+    reshape_exit(reshape, ticket);
+    return err;
+}
+
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    __atomic_store_n(&last_io_ns, now_ns(), __ATOMIC_RELAXED);
     if (verbose)
         fprintf(stderr, "R - %lu, %u\n", offset, len);
 
-    long started = offset / block_size;
-    long ended = (offset + len) / block_size;
-    if (offset + len > raid_device_size)
+    if (offset + len > __atomic_load_n(&raid_device_size, __ATOMIC_ACQUIRE))
     {
         fprintf(stderr, "Read request exceeds device size.\n");
         return -EIO;
     }
-    long bytesRead = 0;
+    if (cache != NULL)
+        return wbc_read(cache, buf, len, offset);
+    if (ssd != NULL)
+        return ssc_read(ssd, buf, len, offset);
+    return raid_read(buf, len, offset, userdata);
+}
+
+/* Write `count` whole stripes of layout `g`: parity comes from the new data
+ * alone, so nothing has to be read, and every chunk is submitted before
+ * waiting so the devices write in parallel and their schedulers can merge
+ * each device's chunks into one call. If a device fails meanwhile, the
+ * stripes are written again without it. */
+static int write_full_stripes(const struct geometry *g, const char *in, uint64_t stripe, uint64_t count, int wflags)
+{
+    int ndata = g->ndata;
+    uint64_t stripeSize = g->stripe_size;
+    struct arena_mark mark = arena_mark();
+    struct member_io *io = arena_take(count * (ndata + 1) * (sizeof(*io) + sizeof(struct iovec)));
+    struct iovec *iov = (struct iovec *)(io + count * (ndata + 1));
+    char *parity = arena_take(count * block_size);
+    struct member_batch batch;
+    if (io == NULL || parity == NULL)
+    {
+        arena_release(mark);
+        return -ENOMEM;
+    }
 
-    for (long i = started; i < ended; i++)
+    for (uint64_t s = 0; s < count; s++)
     {
-        int driveToRead = i % (dev_fd_size - 1);
-        int blockToRead = i / (dev_fd_size - 1) * block_size;
-        long rd;
-        long bytesToRead = len - bytesRead > block_size ? block_size : len - bytesRead;
-        if (degraded && driveToRead == fail_dev)
+        char *p = parity + s * block_size;
+        memcpy(p, in + s * stripeSize, block_size);
+        for (int d = 1; d < ndata; d++)
         {
-            char readBuf[bytesToRead];
-            memset(readBuf, 0, bytesToRead);
-            // read from surviving drives
-            memset((char *)buf + bytesRead, 0, bytesToRead);
-            for (int j = 0; j < dev_fd_size; j++)
+            xor_into(p, in + s * stripeSize + (uint64_t)d * block_size, block_size);
+        }
+    }
+
+    stripe_lock_range(stripe, count, true);
+    member_batch_init(&batch);
+    int err;
+    for (int attempt = 0;; attempt++)
+    {
+        for (uint64_t s = 0; s < count; s++)
+        {
+            uint64_t off = (stripe + s) * block_size;
+            for (int j = 0; j <= ndata; j++)
             {
-                if (j != fail_dev)
-                {
-                    pread(dev_fd[j], readBuf, bytesToRead, blockToRead);
-                    for (int k = 0; k < bytesToRead; k++)
-                    {
-                        ((char *)buf)[k + bytesRead] = ((char *)buf)[k + bytesRead] ^ readBuf[k];
-                    }
-                }
+                int d = j < ndata ? j : parity_dev;
+                if (lost(d, off))
+                    continue; // the others still get consistent data and parity
+                uint64_t k = s * (ndata + 1) + j;
+                iov[k].iov_base = d == parity_dev ? parity + s * block_size : (char *)in + s * stripeSize + (uint64_t)d * block_size;
+                iov[k].iov_len = block_size;
+                io[k].op = MEMBER_IO_WRITE;
+                io[k].flags = wflags;
+                io[k].iov = &iov[k];
+                io[k].iovcnt = 1;
+                io[k].offset = off;
+                member_submit(member_at(d, off), &io[k], &batch);
             }
-            rd = bytesToRead;
         }
-        else
+        err = member_batch_wait(&batch);
+        if (err == 0 || attempt > 0 || !check_failed())
+            break;
+    }
+    stripe_lock_range(stripe, count, false);
+    arena_release(mark);
+    return err;
+}
+
+/* Submit up to two chunk requests to different devices and wait for both. */
+static int rw_pair(int op, int wflags, int d0, void *b0, int d1, void *b1, long len, uint64_t off)
+{
+    struct iovec iov[2] = {{b0, len}, {b1, len}};
+    struct member_io io[2];
+    int devs[2] = {d0, d1};
+    struct member_batch batch;
+
+    member_batch_init(&batch);
+    for (int j = 0; j < 2; j++)
+    {
+        if (devs[j] < 0)
+            continue;
+        io[j].op = op;
+        io[j].flags = wflags;
+        io[j].iov = &iov[j];
+        io[j].iovcnt = 1;
+        io[j].offset = off;
+        member_submit(member_at(devs[j], off), &io[j], &batch);
+    }
+    return member_batch_wait(&batch);
+}
+
+/* Write `bytesToWrite` of device `driveToWrite` at `blockToWrite` and update
+ * the parity: from the old data and parity, or with `reconstructWrite` from
+ * the other data devices, which doesn't read the chunk or the parity. Called
+ * with the stripe locked. */
+static int write_chunk(int driveToWrite, uint64_t blockToWrite, long bytesToWrite, const char *in, int wflags,
+                       bool reconstructWrite)
+{
+    struct arena_mark mark = arena_mark();
+    char *oldBlock = arena_take(bytesToWrite);
+    char *parityBlock = arena_take(bytesToWrite);
+    char *readBuf = arena_take(bytesToWrite);
+    int err = oldBlock == NULL || parityBlock == NULL || readBuf == NULL ? -ENOMEM : 0;
+    bool dataLost = lost(driveToWrite, blockToWrite);
+    if (err == 0 && (dataLost || reconstructWrite))
+    {
+        // new parity is the new value xor the other data drives; with the
+        // drive lost, only the parity is written
+        memcpy(parityBlock, in, bytesToWrite);
+        for (int j = 0; err == 0 && j < dev_fd_size; j++)
         {
-            rd = pread(dev_fd[driveToRead], (char *)buf + bytesRead, bytesToRead, blockToRead);
+            if (j != driveToWrite && j != parity_dev && in_stripe(j, blockToWrite))
+            {
+                if (member_pread(member_at(j, blockToWrite), readBuf, bytesToWrite, blockToWrite) != bytesToWrite)
+                    err = -EIO;
+                else
+                    xor_into(parityBlock, readBuf, bytesToWrite);
+            }
         }
-        bytesRead += rd;
+        if (err == 0)
+            err = rw_pair(MEMBER_IO_WRITE, wflags, dataLost ? -1 : driveToWrite, (void *)in,
+                          lost(parity_dev, blockToWrite) ? -1 : parity_dev, parityBlock, bytesToWrite, blockToWrite);
+        arena_release(mark);
+        return err;
     }
 
-    return 0;
+    bool updateParity = !lost(parity_dev, blockToWrite);
+    // get old value of the block and the parity to be updated, both at once
+    if (err == 0 && updateParity)
+        err = rw_pair(MEMBER_IO_READ, 0, driveToWrite, oldBlock, parity_dev, parityBlock, bytesToWrite, blockToWrite);
+    if (err == -EBADMSG && !degraded)
+    {
+        // one of them failed its checksum: rebuild it from the rest, then read again
+        int bad = member_pread(member_at(driveToWrite, blockToWrite), oldBlock, bytesToWrite, blockToWrite) == -EBADMSG ? driveToWrite : parity_dev;
+        if (repair_chunk(bad, blockToWrite, bytesToWrite) == 0)
+            err = rw_pair(MEMBER_IO_READ, 0, driveToWrite, oldBlock, parity_dev, parityBlock, bytesToWrite, blockToWrite);
+    }
+
+    // xor old value with new value
+    if (err == 0 && updateParity)
+    {
+        xor_into(parityBlock, oldBlock, bytesToWrite);
+        xor_into(parityBlock, in, bytesToWrite);
+    }
+    // write the data and the new parity together
+    if (err == 0)
+        err = rw_pair(MEMBER_IO_WRITE, wflags, driveToWrite, (void *)in, updateParity ? parity_dev : -1,
+                      parityBlock, bytesToWrite, blockToWrite);
+    arena_release(mark);
+    return err;
 }
 
-static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+/* Write [offset, offset + len), in the old layout from `split` on. */
+static int write_split(uint64_t split, const void *buf, u_int32_t len, u_int64_t offset, int wflags)
+{
+    struct arena_mark mark = arena_mark();
+    size_t n = geom_count_split(&geom, &geom_old, split, offset, len);
+    struct geom_extent *ext = arena_take(n * sizeof(*ext));
+    int err = 0;
+    if (ext == NULL)
+        return -ENOMEM;
+    geom_map_split(&geom, &geom_old, split, offset, len, ext, n);
+    uint32_t below = offset >= split ? 0 : split - offset < len ? split - offset : len; // bytes in the new layout
+
+    for (size_t k = 0; err == 0 && k < n; k++)
+    {
+        // the request may start or end in the middle of a block
+        int driveToWrite = ext[k].member;
+        uint64_t blockToWrite = ext[k].offset;
+        long bytesToWrite = ext[k].len;
+        const char *in = (const char *)buf + ext[k].buf;
+        const struct geometry *g = ext[k].buf < below ? &geom : &geom_old;
+        uint32_t left = (ext[k].buf < below ? below : len) - ext[k].buf; // in this layout
+        if (driveToWrite == 0 && ext[k].len == g->chunk && left >= g->stripe_size)
+        {
+            // every whole stripe left in the request goes out in one batch
+            uint64_t count = left / g->stripe_size;
+            err = write_full_stripes(g, in, ext[k].stripe, count, wflags);
+            k += count * g->ndata - 1;
+            continue;
+        }
+        pthread_mutex_t *lock = stripe_lock(ext[k].stripe);
+        pthread_mutex_lock(lock);
+        err = write_chunk(driveToWrite, blockToWrite, bytesToWrite, in, wflags, false);
+        for (int retry = 0; retry < 2 && err != 0 && err != -EBADMSG && check_failed(); retry++)
+        {
+            // a device can't be read or has failed: write again without
+            // reading the old data, or without the device
+            err = write_chunk(driveToWrite, blockToWrite, bytesToWrite, in, wflags, true);
+        }
+        pthread_mutex_unlock(lock);
+    }
+    arena_release(mark);
+    return err;
+}
+
+/* Uncached write; called from the destage threads when the cache is on. */
+static int raid_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata)
 {
     UNUSED(userdata);
-    long started = offset / block_size;
-    long ended = (offset + len) / block_size;
-    if (offset + len > raid_device_size)
+    int wflags = (flags & BUSE_WRITE_FUA) ? MEMBER_WRITE_DSYNC : 0; // FUA: sync just the data and parity chunks written
+    int err;
+    if (reshape == NULL)
+    {
+        err = write_split(UINT64_MAX, buf, len, offset, wflags);
+    }
+    else
+    {
+        int ticket;
+        uint64_t split = reshape_enter(reshape, offset, len, &ticket);
+        err = write_split(split, buf, len, offset, wflags);
+        reshape_exit(reshape, ticket);
+    }
+    if (ra != NULL)
+        ra_invalidate(ra, offset, len);
+
+    return err;
+}
+
+/* Reshape I/O: the old layout ends where the smaller array did. */
+static int reshape_read_old(void *buf, u_int32_t len, u_int64_t offset, void *ctx)
+{
+    UNUSED(ctx);
+    uint64_t old_size = member_size / block_size * geom_old.stripe_size;
+    uint32_t n = offset >= old_size ? 0 : old_size - offset < len ? old_size - offset : len;
+    memset((char *)buf + n, 0, len - n);
+    return n > 0 ? read_split(0, buf, n, offset) : 0;
+}
+
+static int reshape_write_new(const void *buf, u_int32_t len, u_int64_t offset, void *ctx)
+{
+    UNUSED(ctx);
+    return write_full_stripes(&geom, buf, offset / geom.stripe_size, len / geom.stripe_size, 0);
+}
+
+static int reshape_sync(void *ctx)
+{
+    UNUSED(ctx);
+    return member_flush(dev, dev_fd_size);
+}
+
+static void reshape_done(void *ctx)
+{
+    UNUSED(ctx);
+    uint64_t size = member_size * (dev_fd_size - 1);
+    __atomic_store_n(&raid_device_size, size, __ATOMIC_RELEASE);
+    int r = buse_set_size(size);
+    if (r != 0)
+        fprintf(stderr, "Can't grow the RAID device to %lu bytes: %s\n", size, strerror(-r));
+    else
+        fprintf(stderr, "RAID device grown to %lu bytes.\n", size);
+}
+
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata)
+{
+    __atomic_store_n(&last_io_ns, now_ns(), __ATOMIC_RELAXED);
+    if (offset + len > __atomic_load_n(&raid_device_size, __ATOMIC_ACQUIRE))
     {
         fprintf(stderr, "Write request exceeds device size.\n");
         return -EIO;
     }
-    long bytesWritten = 0;
     if (verbose)
-        fprintf(stderr, "W - %lu, %u\n", offset, len);
+        fprintf(stderr, "W%s - %lu, %u\n", (flags & BUSE_WRITE_FUA) ? " FUA" : "", offset, len);
+    if (cache != NULL)
+        return wbc_write(cache, buf, len, offset, flags);
+    if (ssd != NULL)
+        return ssc_write(ssd, buf, len, offset, flags);
+    return raid_write(buf, len, offset, flags, userdata);
+}
+
+static void scrub_signal(int sig)
+{
+    UNUSED(sig);
+    char c = 's';
+    ssize_t r = write(scrub.pipe[1], &c, 1); // nonblocking; a full pipe already has a pass pending
+    UNUSED(r);
+}
+
+/* Sleep up to `ms` milliseconds (-1 for ever) or until woken. Returns true
+ * if a pass was requested; sets scrub.stop if the thread should exit. */
+static bool scrub_sleep(int ms)
+{
+    struct pollfd p = {.fd = scrub.pipe[0], .events = POLLIN};
+    char c;
+
+    if (poll(&p, 1, ms) <= 0 || read(scrub.pipe[0], &c, 1) != 1)
+        return false;
+    if (c == 'q')
+        scrub.stop = true;
+    return c == 's';
+}
 
-    for (long i = started; i < ended; i++)
+/* Read stripe `stripe` into column `s` of the step buffer one chunk at a
+ * time, after the step's read failed. A chunk that fails its checksum is
+ * rebuilt from the others with --scrub-repair (-EAGAIN: repaired, the stripe
+ * can be checked), else -EBADMSG. -EIO if it can't be read. */
+static int scrub_stripe(char *buf, size_t len, uint64_t s, uint64_t stripe)
+{
+    uint64_t off = stripe * block_size;
+    int bad = -1;
+
+    for (int d = 0; d < dev_fd_size; d++)
     {
-        int driveToWrite = i % (dev_fd_size - 1);
-        int blockToWrite = i / (dev_fd_size - 1) * block_size;
-        long bytesToWrite = len - bytesWritten > block_size ? block_size : len - bytesWritten;
-        if (degraded && driveToWrite == fail_dev)
+        ssize_t r = member_pread(member_at(d, off), buf + d * len + s * block_size, block_size, off);
+        if (r == -EBADMSG && bad < 0)
+            bad = d;
+        else if (r != block_size)
+            return -EIO;
+    }
+    if (bad < 0)
+        return 0;
+    fprintf(stderr, "scrub: %s fails its checksum in stripe %lu\n", member_at(bad, off)->path, stripe);
+    if (!scrub.repair)
+        return -EBADMSG;
+    if (repair_chunk(bad, off, block_size) != 0 ||
+        member_pread(member_at(bad, off), buf + bad * len + s * block_size, block_size, off) != block_size)
+        return -EIO;
+    return -EAGAIN;
+}
+
+/* Verify (and with --scrub-repair, fix) the parity of every stripe. Each step
+ * reads SCRUB_BATCH_BYTES from every device in parallel with the step's
+ * stripes locked, so writes to them wait but the rest of the array doesn't. */
+static void scrub_pass(void)
+{
+    uint64_t nstripes = member_size / block_size;
+    uint64_t batch = SCRUB_BATCH_BYTES / block_size > 0 ? SCRUB_BATCH_BYTES / block_size : 1;
+    char *buf = member_alloc((uint64_t)dev_fd_size * batch * block_size);
+    char *syndrome = member_alloc(block_size);
+    struct iovec iov[16];
+    struct member_io io[16];
+    struct member_batch b;
+    uint64_t checked = 0, mismatched = 0, repaired = 0, unreadable = 0, corrupt = 0;
+    uint64_t start = now_ns();
+
+    if (degraded)
+    {
+        fprintf(stderr, "scrub: skipped, the array is degraded\n");
+        goto out;
+    }
+    if (reshape != NULL && reshape_position(reshape) < member_size * (dev_fd_size - 1))
+    {
+        fprintf(stderr, "scrub: skipped, the array is being reshaped\n");
+        goto out;
+    }
+    if (buf == NULL || syndrome == NULL)
+    {
+        fprintf(stderr, "scrub: out of memory\n");
+        goto out;
+    }
+    fprintf(stderr, "scrub: started%s\n", scrub.repair ? ", repairing" : "");
+
+    for (uint64_t stripe = 0; stripe < nstripes;)
+    {
+        scrub_sleep(0); // notice a disconnect between steps
+        if (scrub.stop)
+            break;
+        if (scrub.idle)
+        {
+            uint64_t quiet = (now_ns() - __atomic_load_n(&last_io_ns, __ATOMIC_RELAXED)) / 1000000;
+            if (quiet < SCRUB_IDLE_MS)
+            {
+                scrub_sleep(SCRUB_IDLE_MS - quiet);
+                continue;
+            }
+        }
+        uint64_t step = nstripes - stripe < batch ? nstripes - stripe : batch;
+        uint64_t count = step; // stripes read successfully
+        size_t len = step * block_size;
+
+        stripe_lock_range(stripe, step, true);
+        member_batch_init(&b);
+        for (int d = 0; d < dev_fd_size; d++)
+        {
+            iov[d].iov_base = buf + d * len;
+            iov[d].iov_len = len;
+            io[d].op = MEMBER_IO_READ;
+            io[d].flags = 0;
+            io[d].iov = &iov[d];
+            io[d].iovcnt = 1;
+            io[d].offset = stripe * block_size;
+            member_submit(member_at(d, stripe * block_size), &io[d], &b);
+        }
+        int err = member_batch_wait(&b);
+        if (err != 0 && err != -EBADMSG)
+            check_failed(); // a device may have just failed
+        if (degraded)
         {
-            // only need to update the parity
-            char parityBlock[bytesToWrite];
-            memset(parityBlock, 0, bytesToWrite);
-            for (int j = 0; j < dev_fd_size; j++)
+            stripe_lock_range(stripe, step, false);
+            fprintf(stderr, "scrub: the array is degraded\n");
+            break;
+        }
+        bool retry = err != 0;
+        for (uint64_t s = 0; s < step; s++)
+        {
+            if (retry)
             {
-                if (j != fail_dev && j != parity_dev)
+                // read this stripe's chunks one at a time to find the bad one
+                int r = scrub_stripe(buf, len, s, stripe + s);
+                if (r == -EBADMSG || r == -EAGAIN)
+                    corrupt++;
+                if (r == -EAGAIN)
+                    repaired++;
+                else if (r != 0)
                 {
-                    char readBuf[bytesToWrite];
-                    pread(dev_fd[j], readBuf, bytesToWrite, blockToWrite);
-                    for (int k = 0; k < bytesToWrite; k++)
-                    {
-                        parityBlock[k] = parityBlock[k] ^ readBuf[k];
-                    }
+                    if (r == -EIO)
+                        unreadable++;
+                    count--;
+                    continue;
                 }
             }
-            // xor the newvalue with the parity
-            for (int j = 0; j < bytesToWrite; j++)
+            // data chunks XOR parity is all zero when the stripe is consistent
+            memcpy(syndrome, buf + s * block_size, block_size);
+            for (int d = 1; d < dev_fd_size; d++)
+                xor_into(syndrome, buf + d * len + s * block_size, block_size);
+            if (xor_is_zero(syndrome, block_size))
+                continue;
+            mismatched++;
+            if (mismatched <= SCRUB_LOG_MAX)
+                fprintf(stderr, "scrub: parity mismatch in stripe %lu\n", stripe + s);
+            if (scrub.repair)
             {
-                parityBlock[j] = parityBlock[j] ^ ((char *)buf)[bytesWritten + j];
+                char *parity = buf + parity_dev * len + s * block_size;
+                xor_into(parity, syndrome, block_size); // now the XOR of the data chunks
+                if (member_pwrite(member_at(parity_dev, 0), parity, block_size, (stripe + s) * block_size) == block_size)
+                    repaired++;
+                else
+                    fprintf(stderr, "scrub: failed to rewrite parity of stripe %lu\n", stripe + s);
             }
-            // write new parity
-            long parityWr = pwrite(dev_fd[parity_dev], parityBlock, bytesToWrite, blockToWrite);
-            bytesWritten += bytesToWrite;
         }
-        else
+        stripe_lock_range(stripe, step, false);
+        checked += count;
+        stripe += step;
+
+        if (scrub.rate > 0)
+        {
+            // hold the average at the rate: sleep until the bytes read so far are due
+            uint64_t due = stripe * block_size * dev_fd_size * 1000 / (scrub.rate << 20);
+            uint64_t elapsed = (now_ns() - start) / 1000000;
+            if (due > elapsed)
+                scrub_sleep(due - elapsed);
+        }
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+    fprintf(stderr, "scrub: %s after %lu stripes in %.1f s (%.1f MB/s): %lu mismatched, %lu failed checksums, %lu repaired, %lu unreadable\n",
+            scrub.stop || degraded ? "stopped" : "done", checked, secs,
+            secs > 0 ? checked * block_size * dev_fd_size / secs / (1 << 20) : 0.0,
+            mismatched, corrupt, repaired, unreadable);
+out:
+    free(syndrome);
+    free(buf);
+}
+
+static void *scrub_thread(void *arg)
+{
+    UNUSED(arg);
+    bool run = scrub.at_start;
+    int timeout = scrub.interval > 0 ? (scrub.interval < INT32_MAX / 1000 ? (int)scrub.interval * 1000 : INT32_MAX) : -1;
+
+    while (!scrub.stop)
+    {
+        if (run)
+            scrub_pass(); // may have seen the stop request itself
+        if (!scrub.stop)
+            run = scrub_sleep(timeout) || scrub.interval > 0;
+    }
+    return NULL;
+}
+
+/* Start the scrub thread and route SIGUSR1 to it. */
+static int scrub_start(void)
+{
+    struct sigaction act = {.sa_handler = scrub_signal, .sa_flags = SA_RESTART};
+
+    if (pipe2(scrub.pipe, O_NONBLOCK) != 0)
+        return -errno;
+    sigemptyset(&act.sa_mask);
+    if (sigaction(SIGUSR1, &act, NULL) != 0)
+        return -errno;
+    int e = affinity_background_thread(&scrub.thread, "scrub", scrub_thread, NULL);
+    if (e != 0)
+    {
+        signal(SIGUSR1, SIG_DFL);
+        return -e;
+    }
+    return 0;
+}
+
+static void scrub_stop(void)
+{
+    char c = 'q';
+
+    if (scrub.pipe[1] < 0)
+        return;
+    signal(SIGUSR1, SIG_DFL);
+    if (write(scrub.pipe[1], &c, 1) != 1)
+        warn("scrub_stop");
+    pthread_join(scrub.thread, NULL);
+    close(scrub.pipe[0]);
+    close(scrub.pipe[1]);
+    scrub.pipe[0] = scrub.pipe[1] = -1;
+}
+
+/* The next working spare that isn't already serving a device, or -1. */
+static int next_spare(void)
+{
+    for (int k = dev_fd_size; k < dev_fd_size + nspares; k++)
+    {
+        bool used = false;
+        for (int d = 0; d < dev_fd_size; d++)
+            used |= slot[d] == k;
+        if (!used && !member_failed(&dev[k]))
+            return k;
+    }
+    return -1;
+}
+
+/* Rebuild the failed device onto hot spares a step of rows at a time, with
+ * the step's stripes locked. The spare serves each step's rows as soon as
+ * they are written, and takes the failed device's place once it holds all
+ * of them. */
+static void *rebuild_thread(void *arg)
+{
+    UNUSED(arg);
+    uint64_t nrows = member_size / block_size;
+    uint64_t batch = REBUILD_BATCH_BYTES / block_size > 0 ? REBUILD_BATCH_BYTES / block_size : 1;
+    char *buf = member_alloc((uint64_t)dev_fd_size * batch * block_size);
+    struct iovec iov[16];
+    struct member_io io[16];
+    struct member_batch b;
+    uint64_t start = now_ns();
+
+    if (buf == NULL)
+    {
+        fprintf(stderr, "rebuild: out of memory\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&failover.lock);
+    int missing = fail_dev;
+    const char *failed = dev[slot[missing]].path != NULL ? dev[slot[missing]].path : "the missing device";
+    while (!failover.stop && !failover.lost)
+    {
+        int s = failover.spare;
+        if (s < 0)
         {
-            // update parity first
-            // get old value of the block to be updated
-            char oldBlock[block_size];
-            if (!degraded || fail_dev != parity_dev)
+            if ((s = next_spare()) < 0)
             {
-                pread(dev_fd[driveToWrite], oldBlock, block_size, blockToWrite);
+                fprintf(stderr, "rebuild: no hot spare left; staying degraded\n");
+                break;
             }
+            fprintf(stderr, "rebuild: rebuilding %s onto spare %s\n", failed, dev[s].path);
+            __atomic_store_n(&failover.spare, s, __ATOMIC_RELEASE);
+            start = now_ns();
+        }
+        uint64_t row = failover.rows;
+        if (row == nrows)
+        {
+            // the spare holds everything now: it becomes the device
+            __atomic_store_n(&slot[missing], s, __ATOMIC_RELEASE);
+            __atomic_store_n(&degraded, false, __ATOMIC_RELEASE);
+            double secs = (now_ns() - start) / 1e9;
+            fprintf(stderr, "rebuild: done in %.1f s (%.1f MB/s); %s replaces %s from now on\n", secs,
+                    secs > 0 ? member_size / secs / (1 << 20) : 0.0, dev[s].path, failed);
+            break;
+        }
+        pthread_mutex_unlock(&failover.lock);
 
-            long wr = pwrite(dev_fd[driveToWrite], (char *)buf + bytesWritten, bytesToWrite, blockToWrite);
-
-            // update parity
-            // xor old value with new value
-            if (!degraded || fail_dev != parity_dev)
+        uint64_t step = nrows - row < batch ? nrows - row : batch;
+        size_t len = step * block_size;
+        uint64_t off = row * block_size;
+        char *out = buf + missing * len;
+        stripe_lock_range(row, step, true);
+        member_batch_init(&b);
+        for (int d = 0; d < dev_fd_size; d++)
+        {
+            if (d == missing)
+                continue;
+            iov[d].iov_base = buf + d * len;
+            iov[d].iov_len = len;
+            io[d].op = MEMBER_IO_READ;
+            io[d].flags = 0;
+            io[d].iov = &iov[d];
+            io[d].iovcnt = 1;
+            io[d].offset = off;
+            member_submit(member_at(d, off), &io[d], &b);
+        }
+        int err = member_batch_wait(&b);
+        if (err == 0)
+        {
+            memset(out, 0, len);
+            for (int d = 0; d < dev_fd_size; d++)
             {
-                char parityBlock[block_size];
-                pread(dev_fd[parity_dev], parityBlock, block_size, blockToWrite);
-                for (int i = 0; i < bytesToWrite; i++)
-                {
-                    parityBlock[i] = parityBlock[i] ^ oldBlock[i] ^ ((char *)buf)[i + bytesWritten];
-                }
-                // write new parity
-                long parityWr = pwrite(dev_fd[parity_dev], parityBlock, block_size, blockToWrite);
+                if (d != missing)
+                    xor_into(out, buf + d * len, len);
             }
-            bytesWritten += wr;
+            if (member_pwrite(&dev[s], out, len, off) != (ssize_t)len)
+                err = -EIO;
+        }
+        if (err == 0)
+            __atomic_store_n(&failover.rows, row + step, __ATOMIC_RELEASE);
+        stripe_lock_range(row, step, false);
+
+        if (err != 0)
+            check_failed(); // drops the spare if it was the one that failed
+        pthread_mutex_lock(&failover.lock);
+        if (err != 0 && failover.spare == s)
+        {
+            fprintf(stderr, "rebuild: failed at offset %lu: %s; staying degraded\n", off, strerror(-err));
+            break;
         }
     }
+    pthread_mutex_unlock(&failover.lock);
+    free(buf);
+    return NULL;
+}
 
-    return 0;
+/* Start rebuilding onto a spare, if there is one. Called with
+ * failover.lock held. */
+static void rebuild_start(void)
+{
+    if (nspares == 0)
+        return;
+    if (failover.started)
+        pthread_join(failover.thread, NULL); // the last rebuild finished, or we wouldn't have been healthy
+    int e = affinity_background_thread(&failover.thread, "rebuild", rebuild_thread, NULL);
+    failover.started = e == 0;
+    if (e != 0)
+        fprintf(stderr, "Failed to start the rebuild thread: %s\n", strerror(e));
+}
+
+static void rebuild_stop(void)
+{
+    pthread_mutex_lock(&failover.lock);
+    failover.stop = true;
+    bool started = failover.started;
+    failover.started = false;
+    pthread_mutex_unlock(&failover.lock);
+    if (started)
+        pthread_join(failover.thread, NULL); // an unfinished rebuild starts over next time
+}
+
+/* Sync every device written since the last flush, in parallel. */
+static int raid_sync(void *userdata)
+{
+    UNUSED(userdata);
+    int r = member_flush(dev, dev_fd_size + nspares);
+    if (r != 0 && check_failed())
+        r = member_flush(dev, dev_fd_size + nspares); // without a device that has just failed
+    return r;
 }
 
 static int xmp_flush(void *userdata)
@@ -176,14 +1355,13 @@ static int xmp_flush(void *userdata)
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a flush request.\n");
-    for (int i = 0; i < 2; i++)
-    {
-        if (dev_fd[i] != -1)
-        {                     // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
-        }
-    }
-    return 0;
+    int err = 0;
+    if (cache != NULL)
+        err = wbc_flush(cache); // everything acknowledged so far must reach the devices first
+    if (ssd != NULL)
+        err = ssc_flush(ssd); // the log holds what hasn't been destaged
+    int r = raid_sync(NULL);
+    return err != 0 ? err : r;
 }
 
 static void xmp_disc(void *userdata)
@@ -191,7 +1369,27 @@ static void xmp_disc(void *userdata)
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a disconnect request.\n");
-    // disconnect is a no-op for us
+    if (cache != NULL)
+        wbc_flush(cache);
+    if (ssd != NULL && ssc_drain(ssd) != 0)
+        fprintf(stderr, "The SSD cache couldn't be destaged; it is replayed at the next start.\n");
+    scrub_stop();
+    rebuild_stop();
+    if (reshape != NULL)
+        reshape_destroy(reshape); // picks up from its checkpoint next time
+    reshape = NULL;
+    if (verbose && ra != NULL)
+        ra_report(ra);
+    for (int i = 0; verbose && i < dev_fd_size + nspares; i++)
+        member_report(&dev[i]);
+    if (verbose && cache != NULL)
+        wbc_report(cache);
+    if (verbose && ssd != NULL)
+        ssc_report(ssd);
+    if (verbose && hedge)
+        fprintf(stderr, "Hedged %lu chunk reads by rebuilding them from parity.\n", hedged_chunks);
+    if (verbose)
+        arena_report();
 }
 
 /*
@@ -207,9 +1405,51 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
 
 /* argument parsing using argp */
 
+enum
+{
+    OPT_SCRUB_REPAIR = 0x100, // long-only options
+    OPT_SCRUB_RATE,
+    OPT_SCRUB_IDLE,
+    OPT_GROW_RATE,
+    OPT_SPARE,
+    OPT_MAX_ERRORS,
+    OPT_IO_TIMEOUT,
+    OPT_SSD_CACHE,
+    OPT_HEDGE,
+    OPT_WORKERS,
+    OPT_CPUS,
+    OPT_WORKER_CPUS,
+    OPT_IO_CPUS,
+    OPT_FORMAT_CHECKSUMS,
+};
+
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
     {"init", 'i', 0, 0, "Initialize the RAID", 0},
+    {"direct", 'd', 0, 0, "Open devices with O_DIRECT, bypassing the host page cache", 0},
+    {"mmap", 'm', 0, 0, "Map file-backed devices with mmap and serve I/O from the mapping", 0},
+    {"access", 'a', "PATTERN", 0, "Hint the expected access pattern to the kernel: normal, sequential or random", 0},
+    {"readahead", 'r', "MB", 0, "Detect sequential reads and prefetch whole stripes into up to MB megabytes of buffers", 0},
+    {"cache", 'c', "MB", 0, "Absorb writes in a write-back cache of MB megabytes, destaged in the background and on flush", 0},
+    {"dirty-ratio", 'w', "PERCENT", 0, "Start destaging once PERCENT of the write-back cache is dirty, or of the SSD cache's log is in use (default 50)", 0},
+    {"hedge", OPT_HEDGE, 0, 0, "Rebuild a chunk from parity when its device takes longer than its recent 95th percentile to read it", 0},
+    {"ssd-cache", OPT_SSD_CACHE, "DEVICE", 0, "Log writes to a persistent cache on DEVICE (an SSD or a file), serve reads from it and destage to the array in sorted batches", 0},
+    {"sched", 's', "USEC", 0, "Queue chunk I/O per device, sorted by offset, merging contiguous chunks; hold dispatches up to USEC microseconds to batch more", 0},
+    {"checksum", 'k', 0, 0, "Keep a CRC32C checksum per 4 KiB at the end of each device; data that fails it is rebuilt from parity and rewritten", 0},
+    {"format-checksums", OPT_FORMAT_CHECKSUMS, 0, 0, "With -k, write a new checksum table over the end of each device, where data would be lost; needed once, on devices that have none (implied by -i)", 0},
+    {"scrub", 'S', "SECONDS", OPTION_ARG_OPTIONAL, "Verify parity in the background at startup, then every SECONDS if given (SIGUSR1 also starts a pass)", 0},
+    {"scrub-repair", OPT_SCRUB_REPAIR, 0, 0, "Rewrite parity that doesn't match the data when scrubbing", 0},
+    {"scrub-rate", OPT_SCRUB_RATE, "MB", 0, "Limit scrubbing to MB megabytes per second read across all devices", 0},
+    {"scrub-idle", OPT_SCRUB_IDLE, 0, 0, "Only scrub while no requests have arrived for 100 ms", 0},
+    {"grow", 'g', "CHECKPOINT", 0, "The last data DEVICE (before the parity DEVICE) is new: restripe onto it in the background while serving, keeping progress in the file CHECKPOINT, then grow the RAID device", 0},
+    {"grow-rate", OPT_GROW_RATE, "MB", 0, "Limit restriping to MB megabytes per second", 0},
+    {"spare", OPT_SPARE, "DEVICE", 0, "Keep DEVICE as a hot spare: when a device fails, its data is rebuilt onto it in the background (may be repeated)", 0},
+    {"max-errors", OPT_MAX_ERRORS, "N", 0, "Fail a device after N read errors or timeouts, or at its first write error (default 8, 0 never fails one)", 0},
+    {"io-timeout", OPT_IO_TIMEOUT, "MS", 0, "Count a device request that takes longer than MS milliseconds as an error (default 30000, 0 for no limit)", 0},
+    {"workers", OPT_WORKERS, "N", 0, "Serve up to N requests at once, each on its own thread (default 0: one at a time)", 0},
+    {"cpus", OPT_CPUS, "SET", 0, "Run the threads reading and answering the NBD socket, and background ones such as destaging and rebuilds, on the CPUs in SET: a list like 0-3,8, or node:N for the CPUs of NUMA node N", 0},
+    {"worker-cpus", OPT_WORKER_CPUS, "SET", 0, "Run the --workers threads on the CPUs in SET (default: those of --cpus)", 0},
+    {"io-cpus", OPT_IO_CPUS, "SET", 0, "Run each device's I/O threads on the CPUs in SET, or with near on those of the NUMA node the device is attached to; starts the threads if nothing else does", 0},
     {0},
 };
 
@@ -221,6 +1461,26 @@ struct arguments
     int verbose;
     int num_devices;
     bool need_init;
+    int member_flags; // MEMBER_* flags used to open devices
+    int access;       // MEMBER_ADV_* hint for the devices
+    unsigned long readahead; // read-ahead buffer budget in MB, 0 for none
+    unsigned long cache;     // write-back cache size in MB, 0 for none
+    int dirty_ratio;         // percentage of the cache allowed to be dirty before destaging
+    char *ssd_cache;         // cache device, NULL for none
+    bool sched;              // queue device I/O through the per-device scheduler
+    unsigned long sched_window; // microseconds the scheduler waits to batch requests
+    bool checksum;           // verify reads against per-unit checksums
+    bool format_checksums;   // write new checksum tables
+    char *grow;              // reshape checkpoint file when adding the last data device
+    unsigned long grow_rate; // reshape rate limit in MB/s, 0 for none
+    char *spare[MAX_SPARES]; // hot spares
+    int num_spares;
+    unsigned long max_errors; // errors before a device is failed, 0 for never
+    unsigned long io_timeout; // milliseconds before a device request counts as an error, 0 for no limit
+    unsigned long workers;    // request threads, 0 to serve requests one at a time
+    char *cpus;               // CPU set of the socket threads, NULL for any
+    char *worker_cpus;        // CPU set of the request threads, NULL for --cpus
+    char *io_cpus;            // CPU set or "near" for device I/O threads
 };
 
 /* Parse a single option. */
@@ -238,6 +1498,113 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'i':
         arguments->need_init = true;
         break;
+    case 'd':
+        arguments->member_flags |= MEMBER_DIRECT;
+        break;
+    case 'm':
+        arguments->member_flags |= MEMBER_MMAP;
+        break;
+    case 'a':
+        arguments->access = member_parse_advice(arg);
+        if (arguments->access < 0)
+            argp_error(state, "PATTERN must be normal, sequential or random");
+        break;
+    case 'r':
+        arguments->readahead = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case 'c':
+        arguments->cache = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case OPT_HEDGE:
+        hedge = true;
+        break;
+    case OPT_SSD_CACHE:
+        arguments->ssd_cache = arg;
+        break;
+    case 'w':
+        arguments->dirty_ratio = strtol(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->dirty_ratio < 1 || arguments->dirty_ratio > 100)
+            argp_error(state, "PERCENT must be between 1 and 100");
+        break;
+    case 'S':
+        scrub.at_start = true;
+        if (arg != NULL)
+        {
+            scrub.interval = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0')
+                argp_error(state, "SECONDS must be an integer");
+        }
+        break;
+    case 'k':
+        arguments->checksum = true;
+        break;
+    case OPT_FORMAT_CHECKSUMS:
+        arguments->format_checksums = true;
+        break;
+    case OPT_SCRUB_REPAIR:
+        scrub.repair = true;
+        break;
+    case OPT_SCRUB_RATE:
+        scrub.rate = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case OPT_SCRUB_IDLE:
+        scrub.idle = true;
+        break;
+    case 'g':
+        arguments->grow = arg;
+        break;
+    case OPT_GROW_RATE:
+        arguments->grow_rate = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "MB must be an integer");
+        break;
+    case OPT_SPARE:
+        if (arguments->num_spares == MAX_SPARES)
+            argp_error(state, "at most %d spares", MAX_SPARES);
+        arguments->spare[arguments->num_spares++] = arg;
+        break;
+    case OPT_MAX_ERRORS:
+        arguments->max_errors = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->max_errors > UINT32_MAX)
+            argp_error(state, "N must be an integer");
+        break;
+    case OPT_IO_TIMEOUT:
+        arguments->io_timeout = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->io_timeout > UINT32_MAX)
+            argp_error(state, "MS must be an integer");
+        break;
+    case OPT_WORKERS:
+        arguments->workers = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->workers > MAX_WORKERS)
+            argp_error(state, "N must be an integer of at most %d", MAX_WORKERS);
+        break;
+    case OPT_CPUS:
+        arguments->cpus = arg;
+        if (affinity_check(arg, false) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+        break;
+    case OPT_WORKER_CPUS:
+        arguments->worker_cpus = arg;
+        if (affinity_check(arg, false) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+        break;
+    case OPT_IO_CPUS:
+        arguments->io_cpus = arg;
+        if (affinity_check(arg, true) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, node:N or near");
+        break;
+    case 's':
+        arguments->sched = true;
+        arguments->sched_window = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "USEC must be an integer");
+        break;
 
     case ARGP_KEY_ARG:
         switch (state->arg_num)
@@ -313,7 +1680,23 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         break;
 
     case ARGP_KEY_END:
-        if (state->arg_num < 5)
+        if ((arguments->member_flags & MEMBER_DIRECT) && (arguments->member_flags & MEMBER_MMAP))
+        {
+            argp_error(state, "--direct and --mmap can't be combined");
+        }
+        if (arguments->grow != NULL && (arguments->readahead > 0 || arguments->cache > 0 || arguments->need_init))
+        {
+            argp_error(state, "--grow can't be combined with --readahead, --cache or --init");
+        }
+        if (arguments->grow != NULL && arguments->num_spares > 0)
+        {
+            argp_error(state, "--grow can't be combined with --spare");
+        }
+        if (arguments->ssd_cache != NULL && (arguments->cache > 0 || arguments->grow != NULL))
+        {
+            argp_error(state, "--ssd-cache can't be combined with --cache or --grow");
+        }
+        if (state->arg_num < 5 || (arguments->grow != NULL && state->arg_num < 6))
         {
             warnx("not enough arguments");
             argp_usage(state);
@@ -370,42 +1753,58 @@ static int do_raid_rebuild()
     // rebuild the rebuild_dev
     // compute the original data from the other drives based on the parity
     // write the data to the rebuild_dev
-    char buf[block_size];
-    char readBuf[block_size];
+    struct arena_mark mark = arena_mark();
+    char *buf = arena_take(block_size);
+    char *readBuf = arena_take(block_size);
+    int err = buf == NULL || readBuf == NULL ? -1 : 0;
+    if (err != 0)
+        perror("rebuild_alloc");
     fprintf(stdout, "Rebuilding...\n");
-    memset(buf, 0, block_size);
 
-    for (uint64_t cursor = 0; cursor < raid_device_size / block_size; cursor += block_size)
+    for (uint64_t cursor = 0; err == 0 && cursor < member_size; cursor += block_size)
     {
-        for (int i = 0; i < dev_fd_size; i++)
+        memset(buf, 0, block_size);
+        for (int i = 0; err == 0 && i < dev_fd_size; i++)
         {
             if (i != rebuild_dev)
             {
-                pread(dev_fd[i], readBuf, block_size, cursor);
-                for (int j = 0; j < block_size; j++)
+                if (member_pread(&dev[i], readBuf, block_size, cursor) != block_size)
                 {
-                    buf[j] = buf[j] ^ readBuf[j];
+                    fprintf(stderr, "rebuild_read: device %d, offset=%zu\n", i, cursor);
+                    err = -1;
+                    break;
                 }
+                xor_into(buf, readBuf, block_size);
             }
         }
-        pwrite(dev_fd[rebuild_dev], buf, block_size, cursor);
-        printProgressBar(cursor + block_size, raid_device_size / block_size);
+        if (err == 0 && member_pwrite(&dev[rebuild_dev], buf, block_size, cursor) != block_size)
+        {
+            fprintf(stderr, "rebuild_write: offset=%zu\n", cursor);
+            err = -1;
+        }
+        if (err == 0)
+            printProgressBar(cursor + block_size, member_size);
     }
-    printf("\n"); // Print a new line after the progress bar is complete
+    if (err == 0)
+        printf("\n"); // Print a new line after the progress bar is complete
 
-    return 0;
+    arena_release(mark);
+    return err;
 }
 
 int main(int argc, char *argv[])
 {
     struct arguments arguments = {
         .verbose = 0,
+        .dirty_ratio = 50,
+        .max_errors = MAX_ERRORS,
+        .io_timeout = IO_TIMEOUT_MS,
     };
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
     struct buse_operations bop = {
         .read = xmp_read,
-        .write = xmp_write,
+        .write_flags = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
         // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
@@ -417,6 +1816,9 @@ int main(int argc, char *argv[])
     verbose = arguments.verbose;
     block_size = arguments.block_size;
     dev_fd_size = arguments.num_devices;
+    if (geom_init(&geom, dev_fd_size - 1, block_size) != 0 || geom_init(&geom_old, dev_fd_size - 2, block_size) != 0)
+        errx(EXIT_FAILURE, "BLOCKSIZE must be positive");
+    int grow_dev = arguments.grow != NULL ? dev_fd_size - 2 : -1; // new data device, not yet in the array
 
     raid_device_size = 0; // will be detected from the drives available
     fail_dev = -1;
@@ -434,7 +1836,7 @@ int main(int argc, char *argv[])
             }
             degraded = true;
             fail_dev = i;
-            dev_fd[i] = -1;
+            member_set_missing(&dev[i]);
             fprintf(stderr, "DEGRADED: Device number %d is missing!\n", i);
         }
         else
@@ -452,25 +1854,114 @@ int main(int argc, char *argv[])
                 rebuild_needed = true;
             }
 
-            dev_fd[i] = open(dev_path, O_RDWR);
-            if (dev_fd[i] < 0)
+            int r = member_open(&dev[i], dev_path, arguments.member_flags);
+            if (r < 0)
             {
-                perror(dev_path);
+                fprintf(stderr, "%s: %s\n", dev_path, strerror(-r));
                 exit(1);
             }
-            uint64_t size = lseek(dev_fd[i], 0, SEEK_END); // used to find device size by seeking to end
+            member_advise(&dev[i], arguments.access);
+            uint64_t size = dev[i].size;
             fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
-            if (raid_device_size == 0 || size < raid_device_size)
+            if (i != grow_dev && (member_size == 0 || size < member_size))
             {
-                raid_device_size = size * (dev_fd_size - 1); // we'll use the smallest device size as the RAID size
+                member_size = size; // we'll use the smallest device size as the RAID size
             }
         }
     }
+    if (grow_dev >= 0)
+    {
+        if (degraded || rebuild_needed)
+        {
+            fprintf(stderr, "ERROR: Can't grow an array with a MISSING or '+' device.\n");
+            exit(1);
+        }
+        if (dev[grow_dev].size < member_size)
+        {
+            fprintf(stderr, "ERROR: %s is smaller than the other devices (%lu bytes needed).\n",
+                    dev[grow_dev].path, member_size);
+            exit(1);
+        }
+    }
 
-    raid_device_size = raid_device_size / block_size * block_size; // divide+mult to truncate to block size
+    if (arguments.checksum)
+        member_size = member_csum_capacity(member_size); // the checksums live after the data
+    member_size = member_size / block_size * block_size;  // divide+mult to truncate to block size
+    raid_device_size = member_size * (dev_fd_size - 1);
+    for (int i = 0; i < dev_fd_size; i++)
+        slot[i] = i;
+    nspares = arguments.num_spares;
+    for (int i = dev_fd_size; i < dev_fd_size + nspares; i++)
+    {
+        const char *path = arguments.spare[i - dev_fd_size];
+        int r = member_open(&dev[i], path, arguments.member_flags);
+        if (r < 0)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(-r));
+            exit(1);
+        }
+        member_advise(&dev[i], arguments.access);
+        fprintf(stderr, "Got spare '%s', size %ld bytes.\n", path, dev[i].size);
+        if ((arguments.checksum ? member_csum_capacity(dev[i].size) : dev[i].size) < member_size)
+        {
+            fprintf(stderr, "ERROR: spare %s is smaller than the devices.\n", path);
+            exit(1);
+        }
+    }
     bop.size = raid_device_size;                                   // tell BUSE how big our block device is
-    bop.blksize = block_size;                                      // tell BUSE our block size
-    bop.size_blocks = raid_device_size / block_size;               // tell BUSE our block count
+    bop.blksize = block_size % 4096 == 0 ? 4096 : 512;             // sector size, whatever the chunk size
+    bop.size_blocks = raid_device_size / bop.blksize;              // tell BUSE our block count
+    bop.segment = (SEGMENT_BYTES + geom.stripe_size - 1) / geom.stripe_size * geom.stripe_size; // big requests arrive in whole stripes
+    bop.workers = arguments.workers;
+    bop.server_cpus = arguments.cpus;
+    bop.worker_cpus = arguments.worker_cpus;
+    for (int i = 0; i < STRIPE_LOCKS; i++)
+        pthread_mutex_init(&stripe_locks[i], NULL);
+    // enough for a request of one segment: its chunks' I/O descriptors and
+    // parity for its whole stripes, plus a stripe's worth of chunks at either
+    // end for partial stripes and degraded reads
+    arena_setup((bop.segment / block_size + 2) * dev_fd_size *
+                    (sizeof(struct member_io) + sizeof(struct iovec) + sizeof(struct geom_extent) + 32) +
+                bop.segment / (dev_fd_size - 1) + (2 * (size_t)dev_fd_size + 2) * block_size + 8 * 4096 +
+                (arguments.ssd_cache != NULL ? bop.segment + 3 * 4096 : 0)); // and an SSD cache log record
+    for (int i = 0; arguments.checksum && i < dev_fd_size + nspares; i++)
+    {
+        // spares and the device being rebuilt hold nothing worth keeping
+        bool format = arguments.format_checksums || arguments.need_init || i >= dev_fd_size || i == rebuild_dev;
+        int r = member_csum_enable(&dev[i], member_size, format);
+        if (r == -ENODATA)
+        {
+            fprintf(stderr, "%s has no checksum table; --format-checksums writes one over the end of the device\n",
+                    dev[i].path);
+            exit(1);
+        }
+        if (r != 0)
+        {
+            fprintf(stderr, "%s: can't set up checksums: %s\n", dev[i].path, strerror(-r));
+            exit(1);
+        }
+    }
+    if (grow_dev >= 0)
+    {
+        struct reshape_ops ops = {.read_old = reshape_read_old, .write_new = reshape_write_new,
+                                  .sync = reshape_sync, .done = reshape_done};
+        reshape = reshape_create(arguments.grow, geom_old.stripe_size, geom.stripe_size, raid_device_size,
+                                 RESHAPE_BATCH_BYTES, arguments.grow_rate, &ops, NULL);
+        if (reshape == NULL)
+            exit(1);
+        if (reshape_position(reshape) == raid_device_size)
+        {
+            fprintf(stderr, "Reshape onto %s already finished.\n", dev[grow_dev].path);
+            reshape_destroy(reshape);
+            reshape = NULL;
+        }
+        else
+        {
+            raid_device_size = member_size * (dev_fd_size - 2); // grown once the reshape is done
+            bop.size = raid_device_size;
+            bop.size_blocks = raid_device_size / bop.blksize;
+        }
+    }
     if (rebuild_needed)
     {
         if (degraded)
@@ -500,19 +1991,22 @@ int main(int argc, char *argv[])
         }
         fprintf(stderr, "Initializing RAID parity...\n");
         // write all files to zero
-        char zero[block_size];
+        char *zero = member_alloc(block_size);
+        if (zero == NULL)
+        {
+            perror("init_alloc");
+            exit(1);
+        }
         memset(zero, 0, block_size);
 
-        // Function to print the progress bar
-
-        for (uint64_t cursor = 0; cursor < raid_device_size / block_size; cursor += block_size)
+        for (uint64_t cursor = 0; cursor < member_size; cursor += block_size)
         {
             for (int i = 0; i < dev_fd_size; i++)
             {
-                int r = pwrite(dev_fd[i], zero, block_size, cursor);
+                int r = member_pwrite(&dev[i], zero, block_size, cursor);
                 if (r < 0)
                 {
-                    perror("init_write");
+                    fprintf(stderr, "init_write: %s\n", strerror(-r));
                     return -1;
                 }
                 else if (r != block_size)
@@ -523,9 +2017,72 @@ int main(int argc, char *argv[])
             }
 
             // Print the progress bar
-            printProgressBar(cursor + block_size, raid_device_size / block_size);
+            printProgressBar(cursor + block_size, member_size);
         }
         printf("\n"); // Print a new line after the progress bar is complete
+        free(zero);
+    }
+    for (int i = 0; i < dev_fd_size + nspares; i++)
+        member_health(&dev[i], arguments.max_errors, arguments.io_timeout);
+    member_cpus(arguments.io_cpus);
+    affinity_background(arguments.cpus);
+    if (arguments.readahead > 0 || arguments.sched || scrub.at_start || arguments.checksum || hedge ||
+        arguments.io_cpus != NULL)
+    {
+        for (int i = 0; i < dev_fd_size + nspares; i++)
+        {
+            if (dev[i].fd >= 0 && member_start(&dev[i], 1) != 0)
+            {
+                fprintf(stderr, "Failed to start I/O thread for %s.\n", dev[i].path);
+                exit(1);
+            }
+            member_sched(&dev[i], arguments.sched_window, SCHED_DEADLINE_US);
+        }
+    }
+    if (arguments.readahead > 0)
+    {
+        ra = ra_create((uint64_t)(dev_fd_size - 1) * block_size, member_size / block_size,
+                       arguments.readahead << 20, raid4_fill, NULL);
+        if (ra == NULL)
+        {
+            fprintf(stderr, "Failed to set up read-ahead.\n");
+            exit(1);
+        }
     }
+    if (arguments.cache > 0)
+    {
+        struct wbc_ops ops = {.read = raid_read, .write = raid_write};
+        cache = wbc_create((uint64_t)(dev_fd_size - 1) * block_size, member_size / block_size,
+                           arguments.cache << 20, arguments.dirty_ratio, 2, &ops, NULL);
+        if (cache == NULL)
+        {
+            fprintf(stderr, "Failed to set up the write-back cache (block size must be a multiple of 512).\n");
+            exit(1);
+        }
+    }
+    if (arguments.ssd_cache != NULL)
+    {
+        // replays what an earlier run left undestaged before serving anything
+        struct ssc_ops ops = {.read = raid_read, .write = raid_write, .sync = raid_sync};
+        ssd = ssc_create(arguments.ssd_cache, arguments.member_flags, raid_device_size, arguments.dirty_ratio, &ops,
+                         NULL);
+        if (ssd == NULL)
+            exit(1);
+    }
+    int r = scrub_start();
+    if (r != 0)
+    {
+        fprintf(stderr, "Failed to start the scrub thread: %s\n", strerror(-r));
+        exit(1);
+    }
+    if (reshape != NULL && reshape_start(reshape) != 0)
+    {
+        fprintf(stderr, "Failed to start the reshape thread.\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&failover.lock);
+    if (degraded)
+        rebuild_start(); // onto a spare, if one was given
+    pthread_mutex_unlock(&failover.lock);
     return buse_main(arguments.raid_device, &bop, NULL);
 }
@@ -0,0 +1,835 @@
+/*
+ * Erasure-coded RAID for BUSE: k data devices and m Reed-Solomon parity
+ * devices, any m of which may fail
+ *
+ * Based on the RAID4 example
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <argp.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "affinity.h"
+#include "arena.h"
+#include "buse.h"
+#include "erasure.h"
+#include "geometry.h"
+#include "member.h"
+#include "xor.h"
+
+#define MAX_DEVICES 16
+#define SCHED_DEADLINE_US 20000 // longest a queued chunk may be passed over by the elevator
+#define SEGMENT_BYTES (1024 * 1024) // large requests are handed over in segments of about this much
+#define MAX_WORKERS 64 // most request threads --workers may start
+#define MAX_ERRORS 8            // default errors before a device is failed
+#define IO_TIMEOUT_MS 30000     // default time after which a request counts as an error
+
+#define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
+
+struct member dev[MAX_DEVICES]; // data devices, then parity devices
+int dev_fd_size;           // number of devices
+int ndata;                 // k: devices holding data
+int nparity = 2;           // m: devices holding parity, the last ones
+int block_size;            // chunk each device holds per stripe
+uint64_t raid_device_size; // size of raid device in bytes
+uint64_t member_size;      // bytes used on each device (smallest device, truncated to block size)
+struct geometry geom;      // data chunk i lives on dev[i % ndata]
+struct ec_code *code;      // computes and rebuilds the parity
+bool verbose = false;      // set to true by -v option for debug output
+
+// a stripe's parity is updated read-modify-write, so writes to it are serialized
+#define STRIPE_LOCKS 64
+pthread_mutex_t stripe_locks[STRIPE_LOCKS];
+
+// devices already reported failed; a request fails once more than m are
+pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t failed_mask;
+
+static pthread_mutex_t *stripe_lock(uint64_t stripe)
+{
+    return &stripe_locks[stripe % STRIPE_LOCKS];
+}
+
+/* Devices that are missing or have failed. */
+static uint32_t lost_mask(void)
+{
+    uint32_t mask = 0;
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if (member_failed(&dev[d]))
+            mask |= 1U << d;
+    }
+    return mask;
+}
+
+/* Called after an I/O error: report devices that have just failed. Returns
+ * false once more have failed than the parity can make up for. */
+static bool check_failed(void)
+{
+    pthread_mutex_lock(&fail_lock);
+    uint32_t lost = lost_mask();
+    int left = nparity - __builtin_popcount(lost);
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if (!(lost & ~failed_mask & (1U << d)))
+            continue;
+        if (left >= 0)
+            fprintf(stderr, "DEGRADED: %s failed; %d more device%s can fail.\n", dev[d].path, left,
+                    left == 1 ? "" : "s");
+        else
+            fprintf(stderr, "ERROR: %s failed; more than %d devices are lost, stripes can't be rebuilt.\n",
+                    dev[d].path, nparity);
+    }
+    failed_mask = lost;
+    pthread_mutex_unlock(&fail_lock);
+    return left >= 0;
+}
+
+/* Read `len` bytes at `off` of every device in `mask` into frag[], all at
+ * once. Returns the devices that couldn't be read. */
+static uint32_t read_frags(uint32_t mask, char **frag, long len, uint64_t off)
+{
+    struct member_io io[MAX_DEVICES];
+    struct iovec iov[MAX_DEVICES];
+    struct member_batch batch;
+    uint32_t bad = 0;
+
+    member_batch_init(&batch);
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if (!(mask & (1U << d)))
+            continue;
+        iov[d].iov_base = frag[d];
+        iov[d].iov_len = len;
+        io[d].op = MEMBER_IO_READ;
+        io[d].flags = 0;
+        io[d].iov = &iov[d];
+        io[d].iovcnt = 1;
+        io[d].offset = off;
+        member_submit(&dev[d], &io[d], &batch);
+    }
+    if (member_batch_wait(&batch) == 0)
+        return 0;
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if ((mask & (1U << d)) && io[d].result != len)
+            bad |= 1U << d;
+    }
+    return bad;
+}
+
+/* Write `len` bytes at `off` from frag[] to every device in `mask` that
+ * hasn't failed, all at once. */
+static int write_frags(uint32_t mask, char **frag, long len, uint64_t off, int wflags)
+{
+    struct member_io io[MAX_DEVICES];
+    struct iovec iov[MAX_DEVICES];
+    struct member_batch batch;
+
+    mask &= ~lost_mask(); // the others still get consistent data and parity
+    member_batch_init(&batch);
+    for (int d = 0; d < dev_fd_size; d++)
+    {
+        if (!(mask & (1U << d)))
+            continue;
+        iov[d].iov_base = frag[d];
+        iov[d].iov_len = len;
+        io[d].op = MEMBER_IO_WRITE;
+        io[d].flags = wflags;
+        io[d].iov = &iov[d];
+        io[d].iovcnt = 1;
+        io[d].offset = off;
+        member_submit(&dev[d], &io[d], &batch);
+    }
+    return member_batch_wait(&batch);
+}
+
+/* Rebuild the devices in `want` at [off, off + len) into frag[] from k of
+ * the others, read into frag[] too. Devices that fail meanwhile are left
+ * out and the rest tried again. Called with the stripe locked. */
+static int recover(char **frag, uint32_t want, long len, uint64_t off)
+{
+    uint32_t erased = want | lost_mask();
+    for (;;)
+    {
+        if (__builtin_popcount(erased) > nparity)
+            return -EIO;
+        uint32_t bad = read_frags(ec_sources(code, erased), frag, len, off);
+        if (bad == 0)
+            return ec_decode(code, frag, erased, want, len);
+        check_failed();
+        erased |= bad;
+    }
+}
+
+/* Point frag[] at `len` bytes of scratch per device, taken from this
+ * thread's arena. */
+static int frags_take(char **frag, long len)
+{
+    char *buf = arena_take((size_t)dev_fd_size * len);
+    if (buf == NULL)
+        return -ENOMEM;
+    for (int d = 0; d < dev_fd_size; d++)
+        frag[d] = buf + (size_t)d * len;
+    return 0;
+}
+
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    UNUSED(userdata);
+    if (verbose)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+    if (offset + len > raid_device_size)
+    {
+        fprintf(stderr, "Read request exceeds device size.\n");
+        return -EIO;
+    }
+    struct arena_mark mark = arena_mark();
+    size_t n = geom_count(&geom, offset, len);
+    char *mem = arena_take(n * (sizeof(struct member_io) + sizeof(struct iovec) + sizeof(struct geom_extent)));
+    int err = 0;
+    if (mem == NULL)
+        return -ENOMEM;
+    struct member_io *io = (struct member_io *)mem;
+    struct iovec *iov = (struct iovec *)(io + n);
+    struct geom_extent *ext = (struct geom_extent *)(iov + n);
+    struct member_batch batch;
+
+    // read every chunk on a working device at once, then rebuild the rest
+    geom_map(&geom, offset, len, ext, n);
+    member_batch_init(&batch);
+    for (size_t c = 0; c < n; c++)
+    {
+        iov[c].iov_base = (char *)buf + ext[c].buf;
+        iov[c].iov_len = ext[c].len;
+        io[c].result = -EIO;
+        if (member_failed(&dev[ext[c].member]))
+            continue;
+        io[c].op = MEMBER_IO_READ;
+        io[c].flags = 0;
+        io[c].iov = &iov[c];
+        io[c].iovcnt = 1;
+        io[c].offset = ext[c].offset;
+        member_submit(&dev[ext[c].member], &io[c], &batch);
+    }
+    if (member_batch_wait(&batch) != 0)
+        check_failed(); // go degraded if a device has just failed
+    for (size_t c = 0; err == 0 && c < n; c++)
+    {
+        if (io[c].result == (ssize_t)ext[c].len)
+            continue;
+        struct arena_mark chunk = arena_mark();
+        char *frag[MAX_DEVICES];
+        err = frags_take(frag, ext[c].len);
+        if (err != 0)
+            break;
+        frag[ext[c].member] = iov[c].iov_base;
+        pthread_mutex_t *lock = stripe_lock(ext[c].stripe);
+        pthread_mutex_lock(lock);
+        err = recover(frag, 1U << ext[c].member, ext[c].len, ext[c].offset);
+        pthread_mutex_unlock(lock);
+        arena_release(chunk);
+    }
+    arena_release(mark);
+    return err;
+}
+
+/* Lock every stripe lock covering `count` stripes from `stripe`, in index
+ * order so that writers holding several can't deadlock. */
+static void stripe_lock_range(uint64_t stripe, uint64_t count, bool lock)
+{
+    uint64_t mask = 0;
+    for (uint64_t s = stripe; s < stripe + count && s < stripe + STRIPE_LOCKS; s++)
+        mask |= 1ULL << (s % STRIPE_LOCKS);
+    for (int b = 0; b < STRIPE_LOCKS; b++)
+    {
+        if (mask & (1ULL << b))
+        {
+            if (lock)
+                pthread_mutex_lock(&stripe_locks[b]);
+            else
+                pthread_mutex_unlock(&stripe_locks[b]);
+        }
+    }
+}
+
+/* Write `count` whole stripes: parity is encoded from the new data alone,
+ * so nothing has to be read, and every chunk is submitted before waiting.
+ * If a device fails meanwhile, the stripes are written again without it. */
+static int write_full_stripes(const char *in, uint64_t stripe, uint64_t count, int wflags)
+{
+    uint64_t chunks = count * dev_fd_size;
+    struct arena_mark mark = arena_mark();
+    struct member_io *io = arena_take(chunks * (sizeof(*io) + sizeof(struct iovec)));
+    struct iovec *iov = (struct iovec *)(io + chunks);
+    char *parity = arena_take(count * nparity * block_size);
+    struct member_batch batch;
+    if (io == NULL || parity == NULL)
+    {
+        arena_release(mark);
+        return -ENOMEM;
+    }
+
+    for (uint64_t s = 0; s < count; s++)
+    {
+        char *data[MAX_DEVICES];
+        for (int d = 0; d < ndata; d++)
+            data[d] = (char *)in + s * geom.stripe_size + (uint64_t)d * block_size;
+        for (int j = 0; j < nparity; j++)
+            data[ndata + j] = parity + (s * nparity + j) * block_size;
+        ec_encode(code, data, data + ndata, block_size);
+    }
+
+    stripe_lock_range(stripe, count, true);
+    member_batch_init(&batch);
+    int err;
+    for (int attempt = 0;; attempt++)
+    {
+        uint32_t lost = lost_mask();
+        for (uint64_t s = 0; s < count; s++)
+        {
+            for (int d = 0; d < dev_fd_size; d++)
+            {
+                if (lost & (1U << d))
+                    continue;
+                uint64_t c = s * dev_fd_size + d;
+                iov[c].iov_base = d < ndata ? (char *)in + s * geom.stripe_size + (uint64_t)d * block_size
+                                            : parity + (s * nparity + d - ndata) * block_size;
+                iov[c].iov_len = block_size;
+                io[c].op = MEMBER_IO_WRITE;
+                io[c].flags = wflags;
+                io[c].iov = &iov[c];
+                io[c].iovcnt = 1;
+                io[c].offset = (stripe + s) * block_size;
+                member_submit(&dev[d], &io[c], &batch);
+            }
+        }
+        err = member_batch_wait(&batch);
+        if (err == 0 || attempt > 0 || !check_failed())
+            break;
+    }
+    stripe_lock_range(stripe, count, false);
+    arena_release(mark);
+    return err;
+}
+
+/* Write `len` bytes of data device `d` at `off` and update the parity:
+ * from the old data and parity, folding in the change, or with
+ * `reconstructWrite` by encoding the other data devices' chunks afresh,
+ * which is also done when that reads fewer chunks (k - 1 < m + 1) or the
+ * device has failed. Called with the stripe locked. */
+static int write_chunk(int d, uint64_t off, long len, const char *in, int wflags, bool reconstructWrite)
+{
+    struct arena_mark mark = arena_mark();
+    char *frag[MAX_DEVICES];
+    uint32_t lost = lost_mask();
+    uint32_t parity = ((1U << nparity) - 1) << ndata;
+    int err = frags_take(frag, len);
+    if (err != 0)
+        return err;
+
+    if (reconstructWrite || ndata - 1 < nparity + 1 || (lost & (1U << d)))
+    {
+        // the other data chunks, rebuilt where their devices are lost; the
+        // old chunk of `d` is read into scratch so the rest still decodes
+        uint32_t others = ((1U << ndata) - 1) & ~(1U << d);
+        uint32_t bad = read_frags(others & ~lost, frag, len, off);
+        if (bad != 0)
+            check_failed();
+        uint32_t missing = (others & lost) | bad;
+        if (missing != 0)
+            err = recover(frag, missing, len, off);
+        if (err == 0)
+        {
+            frag[d] = (char *)in;
+            ec_encode(code, frag, frag + ndata, len);
+            err = write_frags((1U << d) | parity, frag, len, off, wflags);
+        }
+        arena_release(mark);
+        return err;
+    }
+
+    // get the old data and parity, all at once
+    if (read_frags((1U << d) | (parity & ~lost), frag, len, off) != 0)
+        err = -EIO;
+    if (err == 0)
+    {
+        xor_into(frag[d], in, len); // the change to the data
+        for (int j = 0; j < nparity; j++)
+        {
+            if (lost & (1U << (ndata + j)))
+                frag[ndata + j] = NULL;
+        }
+        ec_update(code, d, frag[d], frag + ndata, len);
+        frag[d] = (char *)in;
+        err = write_frags((1U << d) | (parity & ~lost), frag, len, off, wflags);
+    }
+    arena_release(mark);
+    return err;
+}
+
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, u_int32_t flags, void *userdata)
+{
+    UNUSED(userdata);
+    if (verbose)
+        fprintf(stderr, "W%s - %lu, %u\n", (flags & BUSE_WRITE_FUA) ? " FUA" : "", offset, len);
+    if (offset + len > raid_device_size)
+    {
+        fprintf(stderr, "Write request exceeds device size.\n");
+        return -EIO;
+    }
+    int wflags = (flags & BUSE_WRITE_FUA) ? MEMBER_WRITE_DSYNC : 0; // FUA: sync just the chunks written
+    struct arena_mark mark = arena_mark();
+    size_t n = geom_count(&geom, offset, len);
+    struct geom_extent *ext = arena_take(n * sizeof(*ext));
+    int err = 0;
+    if (ext == NULL)
+        return -ENOMEM;
+    geom_map(&geom, offset, len, ext, n);
+
+    for (size_t c = 0; err == 0 && c < n; c++)
+    {
+        const char *in = (const char *)buf + ext[c].buf;
+        if (ext[c].member == 0 && ext[c].len == geom.chunk && len - ext[c].buf >= geom.stripe_size)
+        {
+            // every whole stripe left in the request goes out in one batch
+            uint64_t count = (len - ext[c].buf) / geom.stripe_size;
+            err = write_full_stripes(in, ext[c].stripe, count, wflags);
+            c += count * ndata - 1;
+            continue;
+        }
+        pthread_mutex_t *lock = stripe_lock(ext[c].stripe);
+        pthread_mutex_lock(lock);
+        err = write_chunk(ext[c].member, ext[c].offset, ext[c].len, in, wflags, false);
+        for (int retry = 0; retry < 2 && err != 0 && check_failed(); retry++)
+        {
+            // a device can't be read or has failed: write again without
+            // reading the old data, or without the device
+            err = write_chunk(ext[c].member, ext[c].offset, ext[c].len, in, wflags, true);
+        }
+        pthread_mutex_unlock(lock);
+    }
+    arena_release(mark);
+    return err;
+}
+
+static int xmp_flush(void *userdata)
+{
+    UNUSED(userdata);
+    if (verbose)
+        fprintf(stderr, "Received a flush request.\n");
+    int r = member_flush(dev, dev_fd_size);
+    if (r != 0 && check_failed())
+        r = member_flush(dev, dev_fd_size); // without a device that has just failed
+    return r;
+}
+
+static void xmp_disc(void *userdata)
+{
+    UNUSED(userdata);
+    if (verbose)
+        fprintf(stderr, "Received a disconnect request.\n");
+    for (int i = 0; verbose && i < dev_fd_size; i++)
+        member_report(&dev[i]);
+    if (verbose)
+    {
+        ec_report(code);
+        arena_report();
+    }
+}
+
+/* argument parsing using argp */
+
+enum
+{
+    OPT_MAX_ERRORS = 0x100, // long-only options
+    OPT_IO_TIMEOUT,
+    OPT_WORKERS,
+    OPT_CPUS,
+    OPT_WORKER_CPUS,
+    OPT_IO_CPUS,
+};
+
+static struct argp_option options[] = {
+    {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"init", 'i', 0, 0, "Initialize the RAID", 0},
+    {"parity", 'p', "M", 0, "The last M devices hold parity; any M devices may fail (default 2)", 0},
+    {"direct", 'd', 0, 0, "Open devices with O_DIRECT, bypassing the host page cache", 0},
+    {"mmap", 'm', 0, 0, "Map file-backed devices with mmap and serve I/O from the mapping", 0},
+    {"access", 'a', "PATTERN", 0, "Hint the expected access pattern to the kernel: normal, sequential or random", 0},
+    {"sched", 's', "USEC", 0, "Sort each device's queue by offset, merging contiguous chunks; hold dispatches up to USEC microseconds to batch more", 0},
+    {"max-errors", OPT_MAX_ERRORS, "N", 0, "Fail a device after N read errors or timeouts, or at its first write error (default 8, 0 never fails one)", 0},
+    {"io-timeout", OPT_IO_TIMEOUT, "MS", 0, "Count a device request that takes longer than MS milliseconds as an error (default 30000, 0 for no limit)", 0},
+    {"workers", OPT_WORKERS, "N", 0, "Serve up to N requests at once, each on its own thread (default 0: one at a time)", 0},
+    {"cpus", OPT_CPUS, "SET", 0, "Run the threads reading and answering the NBD socket on the CPUs in SET: a list like 0-3,8, or node:N for the CPUs of NUMA node N", 0},
+    {"worker-cpus", OPT_WORKER_CPUS, "SET", 0, "Run the --workers threads on the CPUs in SET (default: those of --cpus)", 0},
+    {"io-cpus", OPT_IO_CPUS, "SET", 0, "Run each device's I/O threads on the CPUs in SET, or with near on those of the NUMA node the device is attached to; starts the threads if nothing else does", 0},
+    {0},
+};
+
+struct arguments
+{
+    uint32_t block_size;
+    char *device[MAX_DEVICES];
+    char *raid_device;
+    int verbose;
+    int num_devices;
+    int parity;
+    bool need_init;
+    int member_flags; // MEMBER_* flags used to open devices
+    int access;       // MEMBER_ADV_* hint for the devices
+    unsigned long sched_window; // microseconds the scheduler waits to batch requests
+    unsigned long max_errors;   // errors before a device is failed, 0 for never
+    unsigned long io_timeout;   // milliseconds before a device request counts as an error, 0 for no limit
+    unsigned long workers;      // request threads, 0 to serve requests one at a time
+    char *cpus;                 // CPU set of the socket threads, NULL for any
+    char *worker_cpus;          // CPU set of the request threads, NULL for --cpus
+    char *io_cpus;              // CPU set or "near" for device I/O threads
+};
+
+/* Parse a single option. */
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    char *endptr;
+
+    switch (key)
+    {
+
+    case 'v':
+        arguments->verbose = 1;
+        break;
+    case 'i':
+        arguments->need_init = true;
+        break;
+    case 'p':
+        arguments->parity = strtol(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->parity < 1 || arguments->parity > MAX_DEVICES - 1)
+            argp_error(state, "M must be between 1 and %d", MAX_DEVICES - 1);
+        break;
+    case 'd':
+        arguments->member_flags |= MEMBER_DIRECT;
+        break;
+    case 'm':
+        arguments->member_flags |= MEMBER_MMAP;
+        break;
+    case 'a':
+        arguments->access = member_parse_advice(arg);
+        if (arguments->access < 0)
+            argp_error(state, "PATTERN must be normal, sequential or random");
+        break;
+    case 's':
+        arguments->sched_window = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0')
+            argp_error(state, "USEC must be an integer");
+        break;
+    case OPT_MAX_ERRORS:
+        arguments->max_errors = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->max_errors > UINT32_MAX)
+            argp_error(state, "N must be an integer");
+        break;
+    case OPT_IO_TIMEOUT:
+        arguments->io_timeout = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->io_timeout > UINT32_MAX)
+            argp_error(state, "MS must be an integer");
+        break;
+    case OPT_WORKERS:
+        arguments->workers = strtoul(arg, &endptr, 10);
+        if (*endptr != '\0' || arguments->workers > MAX_WORKERS)
+            argp_error(state, "N must be an integer of at most %d", MAX_WORKERS);
+        break;
+    case OPT_CPUS:
+        arguments->cpus = arg;
+        if (affinity_check(arg, false) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+        break;
+    case OPT_WORKER_CPUS:
+        arguments->worker_cpus = arg;
+        if (affinity_check(arg, false) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, or node:N");
+        break;
+    case OPT_IO_CPUS:
+        arguments->io_cpus = arg;
+        if (affinity_check(arg, true) != 0)
+            argp_error(state, "SET must be a list of CPUs this process may use, like 0-3,8, node:N or near");
+        break;
+
+    case ARGP_KEY_ARG:
+        if (state->arg_num == 0)
+        {
+            arguments->block_size = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0')
+            {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "SIZE must be an integer");
+            }
+        }
+        else if (state->arg_num == 1)
+        {
+            arguments->raid_device = arg;
+        }
+        else if (state->arg_num - 2 < MAX_DEVICES)
+        {
+            arguments->device[state->arg_num - 2] = arg;
+        }
+        else
+        {
+            /* Too many arguments. */
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+
+    case ARGP_KEY_END:
+        if ((arguments->member_flags & MEMBER_DIRECT) && (arguments->member_flags & MEMBER_MMAP))
+        {
+            argp_error(state, "--direct and --mmap can't be combined");
+        }
+        if (state->arg_num < 2 || (int)state->arg_num - 2 < arguments->parity + 1)
+        {
+            warnx("not enough arguments: %d parity devices need at least one data device", arguments->parity);
+            argp_usage(state);
+        }
+        else
+        {
+            arguments->num_devices = state->arg_num - 2;
+        }
+
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {
+    .options = options,
+    .parser = parse_opt,
+    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2 ...",
+    .doc = "BUSE implementation of erasure-coded RAID for up to 16 devices.\n"
+           "`BLOCKSIZE` is an integer number of bytes each device holds per stripe. "
+           "\n\n"
+           "`RAIDDEVICE` is a path to an NBD block device, for example \"/dev/nbd0\"."
+           "\n\n"
+           "`DEVICE*` is a path to underlying block devices. Normal files can be used too. The last M "
+           "(see --parity) hold Reed-Solomon parity of the others. Up to M `DEVICE`s may be specified as "
+           "\"MISSING\" to run in degraded mode. "
+           "\n\n"
+           "If you prepend '+' to a DEVICE, you are re-adding it as a replacement to the RAID, and we will rebuild it "
+           "from the others. This is synchronous; the rebuild will have to finish before the RAID is started. "};
+
+void printProgressBar(uint64_t current, uint64_t total)
+{
+    const int barWidth = 50;
+    float progress = (float)current / total;
+    int pos = barWidth * progress;
+
+    printf("[");
+    for (int i = 0; i < barWidth; ++i)
+    {
+        if (i < pos)
+            printf("=");
+        else if (i == pos)
+            printf(">");
+        else
+            printf(" ");
+    }
+    printf("] %.2f%%\r", progress * 100);
+    fflush(stdout);
+}
+
+/* Rebuild the devices in `rebuild` from the others, stripe by stripe. */
+static int do_raid_rebuild(uint32_t rebuild)
+{
+    struct arena_mark mark = arena_mark();
+    char *frag[MAX_DEVICES];
+    int err = frags_take(frag, block_size);
+    fprintf(stdout, "Rebuilding...\n");
+    for (uint64_t cursor = 0; err == 0 && cursor < member_size; cursor += block_size)
+    {
+        err = recover(frag, rebuild, block_size, cursor);
+        if (err == 0)
+            err = write_frags(rebuild, frag, block_size, cursor, 0);
+        if (err != 0)
+            fprintf(stderr, "rebuild: offset=%zu: %s\n", cursor, strerror(-err));
+        else
+            printProgressBar(cursor + block_size, member_size);
+    }
+    if (err == 0)
+        printf("\n"); // Print a new line after the progress bar is complete
+    arena_release(mark);
+    return err == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct arguments arguments = {
+        .verbose = 0,
+        .parity = 2,
+        .max_errors = MAX_ERRORS,
+        .io_timeout = IO_TIMEOUT_MS,
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    struct buse_operations bop = {
+        .read = xmp_read,
+        .write_flags = xmp_write,
+        .disc = xmp_disc,
+        .flush = xmp_flush,
+    };
+    for (int i = 0; i < arguments.num_devices; i++)
+    {
+        fprintf(stderr, "Device %d: %s\n", i, arguments.device[i]);
+    }
+    verbose = arguments.verbose;
+    block_size = arguments.block_size;
+    dev_fd_size = arguments.num_devices;
+    nparity = arguments.parity;
+    ndata = dev_fd_size - nparity;
+    if (geom_init(&geom, ndata, block_size) != 0)
+        errx(EXIT_FAILURE, "BLOCKSIZE must be positive");
+    code = ec_create(ndata, nparity);
+    if (code == NULL)
+        errx(EXIT_FAILURE, "can't set up a %d+%d erasure code", ndata, nparity);
+
+    uint32_t rebuild = 0; // devices given with '+'
+    int missing = 0;
+    for (int i = 0; i < dev_fd_size; i++)
+    {
+        char *dev_path = arguments.device[i];
+        if (strcmp(dev_path, "MISSING") == 0)
+        {
+            member_set_missing(&dev[i]);
+            missing++;
+            fprintf(stderr, "DEGRADED: Device number %d is missing!\n", i);
+            continue;
+        }
+        if (dev_path[0] == '+')
+        {
+            dev_path++; // shave off the '+' for the subsequent logic
+            rebuild |= 1U << i;
+        }
+        int r = member_open(&dev[i], dev_path, arguments.member_flags);
+        if (r < 0)
+        {
+            fprintf(stderr, "%s: %s\n", dev_path, strerror(-r));
+            exit(1);
+        }
+        member_advise(&dev[i], arguments.access);
+        uint64_t size = dev[i].size;
+        fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
+        if (member_size == 0 || size < member_size)
+        {
+            member_size = size; // we'll use the smallest device size as the RAID size
+        }
+    }
+    if (missing + __builtin_popcount(rebuild) > nparity)
+    {
+        fprintf(stderr, "ERROR: %d parity devices can make up for at most %d MISSING or '+' devices. Aborting.\n",
+                nparity, nparity);
+        exit(1);
+    }
+    failed_mask = lost_mask();
+
+    member_size = member_size / block_size * block_size; // divide+mult to truncate to block size
+    raid_device_size = member_size * ndata;
+    bop.size = raid_device_size;                     // tell BUSE how big our block device is
+    bop.blksize = block_size % 4096 == 0 ? 4096 : 512; // sector size, whatever the chunk size
+    bop.size_blocks = raid_device_size / bop.blksize;  // tell BUSE our block count
+    bop.segment = (SEGMENT_BYTES + geom.stripe_size - 1) / geom.stripe_size * geom.stripe_size; // big requests arrive in whole stripes
+    bop.workers = arguments.workers;
+    bop.server_cpus = arguments.cpus;
+    bop.worker_cpus = arguments.worker_cpus;
+    for (int i = 0; i < STRIPE_LOCKS; i++)
+        pthread_mutex_init(&stripe_locks[i], NULL);
+    // enough for a request of one segment: its chunks' I/O descriptors,
+    // parity for its whole stripes and a chunk per device for a partial one
+    arena_setup((bop.segment / block_size + 2) * dev_fd_size *
+                    (sizeof(struct member_io) + sizeof(struct iovec) + sizeof(struct geom_extent)) +
+                bop.segment / ndata * nparity + (size_t)dev_fd_size * block_size + 8 * 4096);
+    // every device gets an I/O thread, so a stripe's chunks are transferred
+    // in parallel
+    member_cpus(arguments.io_cpus);
+    for (int i = 0; i < dev_fd_size; i++)
+    {
+        if (dev[i].fd >= 0 && member_start(&dev[i], 1) != 0)
+        {
+            fprintf(stderr, "Failed to start I/O thread for %s.\n", dev[i].path);
+            exit(1);
+        }
+        member_sched(&dev[i], arguments.sched_window, SCHED_DEADLINE_US);
+    }
+    fprintf(stderr, "Erasure code: %d data + %d parity devices (%s).\n", ndata, nparity, ec_isa());
+    if (rebuild != 0)
+    {
+        fprintf(stderr, "Doing RAID rebuild...\n");
+        if (do_raid_rebuild(rebuild) != 0)
+        {
+            // error on rebuild
+            fprintf(stderr, "Rebuild failed, aborting.\n");
+            exit(1);
+        }
+    }
+    fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
+    if (missing > 0)
+    {
+        fprintf(stderr, "RAID is running in degraded mode.\n");
+    }
+    if (arguments.need_init)
+    {
+        if (missing > 0)
+        {
+            fprintf(stderr, "ERROR: Can't initialize a RAID with a missing device. Aborting.\n");
+            exit(1);
+        }
+        // zeroes everywhere are a valid code word, so the parity needs no computing
+        fprintf(stderr, "Initializing RAID parity...\n");
+        char *zero = member_alloc(block_size);
+        if (zero == NULL)
+        {
+            perror("init_alloc");
+            exit(1);
+        }
+        memset(zero, 0, block_size);
+
+        for (uint64_t cursor = 0; cursor < member_size; cursor += block_size)
+        {
+            for (int i = 0; i < dev_fd_size; i++)
+            {
+                int r = member_pwrite(&dev[i], zero, block_size, cursor);
+                if (r < 0)
+                {
+                    fprintf(stderr, "init_write: %s\n", strerror(-r));
+                    return -1;
+                }
+                else if (r != block_size)
+                {
+                    fprintf(stderr, "init_write: short write (%d bytes), offset=%zu\n", r, cursor);
+                    return 1;
+                }
+            }
+
+            // Print the progress bar
+            printProgressBar(cursor + block_size, member_size);
+        }
+        printf("\n"); // Print a new line after the progress bar is complete
+        free(zero);
+    }
+    for (int i = 0; i < dev_fd_size; i++)
+        member_health(&dev[i], arguments.max_errors, arguments.io_timeout);
+    return buse_main(arguments.raid_device, &bop, NULL);
+}
@@ -0,0 +1,358 @@
+/*
+ * readahead - sequential stream detection and stripe prefetch for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "member.h"
+#include "readahead.h"
+
+#define RA_STREAMS 8          // concurrent sequential streams tracked
+#define RA_WINDOWS 32         // prefetch buffers that can exist at once
+#define RA_CONFIRM 2          // adjacent reads before a stream is trusted
+#define RA_MIN_BYTES (128 * 1024)
+
+enum
+{
+    WIN_FREE,
+    WIN_QUEUED,  // waiting for the read-ahead thread
+    WIN_LOADING, // being filled
+    WIN_READY,
+};
+
+struct ra_stream
+{
+    uint64_t next;     // offset a continuing read would start at
+    uint64_t last_use;
+    uint32_t seq;      // adjacent reads seen so far
+    uint32_t window;   // stripes to prefetch at a time; grows while the stream lasts
+    uint64_t ahead;    // first stripe not yet prefetched for this stream
+};
+
+struct ra_window
+{
+    uint64_t first; // first stripe held
+    uint32_t count; // stripes held
+    char *buf;
+    int state;
+    bool stale; // written to while queued or loading; drop when done
+    uint64_t last_use;
+    struct ra_window *next_job;
+};
+
+struct readahead
+{
+    pthread_mutex_t lock;
+    pthread_cond_t job;
+    pthread_cond_t loaded;
+    pthread_t thread;
+    bool stop;
+
+    uint64_t stripe_size;
+    uint64_t nstripes;
+    size_t budget;
+    size_t used;
+    uint32_t min_window;
+    uint32_t max_window;
+    ra_fill_fn fill;
+    void *ctx;
+
+    struct ra_stream streams[RA_STREAMS];
+    struct ra_window windows[RA_WINDOWS];
+    struct ra_window *jobs;
+    struct ra_window *jobs_tail;
+    uint64_t clock;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetched; // stripes loaded
+    uint64_t wasted;     // stripes dropped by writes or failed prefetches
+};
+
+static void window_free(struct readahead *ra, struct ra_window *w)
+{
+    free(w->buf);
+    w->buf = NULL;
+    ra->used -= (size_t)w->count * ra->stripe_size;
+    w->state = WIN_FREE;
+}
+
+static void *ra_thread(void *arg)
+{
+    struct readahead *ra = arg;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;)
+    {
+        while (ra->jobs == NULL && !ra->stop)
+            pthread_cond_wait(&ra->job, &ra->lock);
+        if (ra->stop)
+            break;
+        struct ra_window *w = ra->jobs;
+        ra->jobs = w->next_job;
+        if (ra->jobs == NULL)
+            ra->jobs_tail = NULL;
+        if (w->stale)
+        {
+            ra->wasted += w->count;
+            window_free(ra, w);
+            pthread_cond_broadcast(&ra->loaded);
+            continue;
+        }
+        w->state = WIN_LOADING;
+        pthread_mutex_unlock(&ra->lock);
+
+        int err = ra->fill(w->first, w->count, w->buf, ra->ctx);
+
+        pthread_mutex_lock(&ra->lock);
+        if (err != 0 || w->stale)
+        {
+            ra->wasted += w->count;
+            window_free(ra, w);
+        }
+        else
+        {
+            w->state = WIN_READY;
+            ra->prefetched += w->count;
+        }
+        pthread_cond_broadcast(&ra->loaded);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+struct readahead *ra_create(uint64_t stripe_size, uint64_t nstripes, size_t budget,
+                            ra_fill_fn fill, void *ctx)
+{
+    struct readahead *ra = calloc(1, sizeof(*ra));
+    if (ra == NULL)
+        return NULL;
+
+    ra->stripe_size = stripe_size;
+    ra->nstripes = nstripes;
+    ra->budget = budget;
+    ra->fill = fill;
+    ra->ctx = ctx;
+    ra->min_window = RA_MIN_BYTES / stripe_size > 0 ? RA_MIN_BYTES / stripe_size : 1;
+    // let one stream use up to half the budget so another can still start
+    ra->max_window = budget / 2 / stripe_size;
+    if (ra->max_window < ra->min_window)
+        ra->max_window = ra->min_window;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->job, NULL);
+    pthread_cond_init(&ra->loaded, NULL);
+    if (affinity_background_thread(&ra->thread, "readahead", ra_thread, ra) != 0)
+    {
+        free(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+void ra_destroy(struct readahead *ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->job);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+    for (int i = 0; i < RA_WINDOWS; i++)
+    {
+        if (ra->windows[i].state != WIN_FREE)
+            window_free(ra, &ra->windows[i]);
+    }
+    free(ra);
+}
+
+/* Find a window slot and buffer space for `bytes`, evicting the least
+ * recently used ready windows as needed. Called with the lock held. */
+static struct ra_window *window_alloc(struct readahead *ra, size_t bytes)
+{
+    if (bytes > ra->budget)
+        return NULL;
+    for (;;)
+    {
+        struct ra_window *slot = NULL;
+        struct ra_window *victim = NULL;
+        for (int i = 0; i < RA_WINDOWS; i++)
+        {
+            struct ra_window *w = &ra->windows[i];
+            if (w->state == WIN_FREE && slot == NULL)
+                slot = w;
+            else if (w->state == WIN_READY && (victim == NULL || w->last_use < victim->last_use))
+                victim = w;
+        }
+        if (slot != NULL && ra->used + bytes <= ra->budget)
+        {
+            slot->buf = member_alloc(bytes);
+            if (slot->buf == NULL)
+                return NULL;
+            ra->used += bytes;
+            return slot;
+        }
+        if (victim == NULL)
+            return NULL; // everything is in flight
+        window_free(ra, victim);
+    }
+}
+
+static void prefetch(struct readahead *ra, struct ra_stream *s)
+{
+    if (s->ahead >= ra->nstripes)
+        return;
+    uint32_t count = s->window;
+    if (count > ra->nstripes - s->ahead)
+        count = ra->nstripes - s->ahead;
+
+    struct ra_window *w = window_alloc(ra, (size_t)count * ra->stripe_size);
+    if (w == NULL)
+        return;
+    w->first = s->ahead;
+    w->count = count;
+    w->state = WIN_QUEUED;
+    w->stale = false;
+    w->last_use = ++ra->clock;
+    w->next_job = NULL;
+    if (ra->jobs_tail != NULL)
+        ra->jobs_tail->next_job = w;
+    else
+        ra->jobs = w;
+    ra->jobs_tail = w;
+    pthread_cond_signal(&ra->job);
+
+    s->ahead += count;
+    if (s->window * 2 <= ra->max_window)
+        s->window *= 2;
+    else
+        s->window = ra->max_window;
+}
+
+static struct ra_window *window_find(struct readahead *ra, uint64_t stripe)
+{
+    for (int i = 0; i < RA_WINDOWS; i++)
+    {
+        struct ra_window *w = &ra->windows[i];
+        if (w->state != WIN_FREE && !w->stale && stripe >= w->first && stripe < w->first + w->count)
+            return w;
+    }
+    return NULL;
+}
+
+/* Copy [offset, offset + len) out of ready windows, waiting for queued or
+ * loading ones. Called with the lock held. */
+static bool copy_out(struct readahead *ra, char *buf, uint32_t len, uint64_t offset)
+{
+    uint32_t done = 0;
+
+    while (done < len)
+    {
+        uint64_t pos = offset + done;
+        struct ra_window *w = window_find(ra, pos / ra->stripe_size);
+        if (w == NULL)
+            return false;
+        if (w->state != WIN_READY)
+        {
+            pthread_cond_wait(&ra->loaded, &ra->lock);
+            continue; // look again: it may have been dropped meanwhile
+        }
+        uint64_t start = w->first * ra->stripe_size;
+        uint64_t end = start + (uint64_t)w->count * ra->stripe_size;
+        uint32_t n = end - pos < len - done ? end - pos : len - done;
+        memcpy(buf + done, w->buf + (pos - start), n);
+        w->last_use = ++ra->clock;
+        done += n;
+    }
+    return true;
+}
+
+bool ra_read(struct readahead *ra, void *buf, uint32_t len, uint64_t offset)
+{
+    pthread_mutex_lock(&ra->lock);
+
+    // stream detection: continue an existing stream or recycle the oldest
+    struct ra_stream *s = NULL;
+    struct ra_stream *oldest = &ra->streams[0];
+    for (int i = 0; i < RA_STREAMS; i++)
+    {
+        if (ra->streams[i].seq > 0 && ra->streams[i].next == offset)
+        {
+            s = &ra->streams[i];
+            break;
+        }
+        if (ra->streams[i].last_use < oldest->last_use)
+            oldest = &ra->streams[i];
+    }
+    if (s == NULL)
+    {
+        s = oldest;
+        s->seq = 0;
+        s->window = ra->min_window;
+        s->ahead = 0;
+    }
+    s->seq++;
+    s->next = offset + len;
+    s->last_use = ++ra->clock;
+
+    if (s->seq >= RA_CONFIRM)
+    {
+        // keep at least half a window queued beyond the stripe being read
+        uint64_t cur = (offset + len - 1) / ra->stripe_size;
+        if (s->ahead <= cur)
+            s->ahead = cur + 1;
+        if (s->ahead - cur <= s->window / 2 + 1)
+            prefetch(ra, s);
+    }
+
+    bool hit = copy_out(ra, buf, len, offset);
+    if (hit)
+        ra->hits++;
+    else
+        ra->misses++;
+    pthread_mutex_unlock(&ra->lock);
+    return hit;
+}
+
+void ra_invalidate(struct readahead *ra, uint64_t offset, uint64_t len)
+{
+    if (len == 0)
+        return;
+    uint64_t first = offset / ra->stripe_size;
+    uint64_t last = (offset + len - 1) / ra->stripe_size;
+
+    pthread_mutex_lock(&ra->lock);
+    for (int i = 0; i < RA_WINDOWS; i++)
+    {
+        struct ra_window *w = &ra->windows[i];
+        if (w->state == WIN_FREE || w->first > last || w->first + w->count <= first)
+            continue;
+        if (w->state == WIN_READY)
+        {
+            ra->wasted += w->count;
+            window_free(ra, w);
+        }
+        else
+        {
+            w->stale = true; // the read-ahead thread drops it
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void ra_report(struct readahead *ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    fprintf(stderr, "read-ahead: %lu hits, %lu misses, %lu stripes prefetched, %lu invalidated\n",
+            ra->hits, ra->misses, ra->prefetched, ra->wasted);
+    pthread_mutex_unlock(&ra->lock);
+}
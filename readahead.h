@@ -0,0 +1,44 @@
+/*
+ * readahead - sequential stream detection and stripe prefetch for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef READAHEAD_H_INCLUDED
+#define READAHEAD_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Read `count` whole stripes starting at `stripe` into `buf`, laid out as
+ * array data (count * stripe_size bytes). Called from the read-ahead thread;
+ * it must not touch state the engine's request path uses. Returns 0 or -errno. */
+typedef int (*ra_fill_fn)(uint64_t stripe, uint32_t count, char *buf, void *ctx);
+
+struct readahead;
+
+/* Track up to a few concurrent sequential streams over an array of
+ * `nstripes` stripes of `stripe_size` data bytes, prefetching ahead of them
+ * into at most `budget` bytes of buffers. Returns NULL on failure. */
+struct readahead *ra_create(uint64_t stripe_size, uint64_t nstripes, size_t budget,
+                            ra_fill_fn fill, void *ctx);
+
+/* Feed a read to the stream detector, possibly starting prefetches, and copy
+ * it out of the read-ahead buffer. Returns true if the whole read was served
+ * (waiting for a prefetch already in flight if need be). */
+bool ra_read(struct readahead *ra, void *buf, uint32_t len, uint64_t offset);
+
+/* Drop buffered data for a range that has been written. Call after the write
+ * reached the members; prefetches still in flight are discarded. */
+void ra_invalidate(struct readahead *ra, uint64_t offset, uint64_t len);
+
+/* Print hit/miss counters to stderr. */
+void ra_report(struct readahead *ra);
+
+void ra_destroy(struct readahead *ra);
+
+#endif /* READAHEAD_H_INCLUDED */
@@ -0,0 +1,314 @@
+/*
+ * reshape - online restriping onto an added member for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "member.h"
+#include "reshape.h"
+
+#define RESHAPE_MAGIC "BUSERSH1"
+#define BACKUP_OFFSET 4096 // where a step's data is saved when it overwrites itself
+#define MAX_BATCH (64 << 20)
+
+/* Checkpoint file header. A nonzero backup_len means the step at `pos` was
+ * saved at BACKUP_OFFSET before its new stripes were written. */
+struct rs_header
+{
+    char magic[8];
+    uint64_t old_stripe;
+    uint64_t new_stripe;
+    uint64_t size;
+    uint64_t pos;
+    uint64_t backup_len;
+};
+
+struct reshape
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // step finished, requests drained or stop
+    pthread_t thread;
+    bool started;
+    bool stop;
+
+    int fd; // checkpoint file
+    struct rs_header hdr;
+    uint64_t batch;
+    unsigned long rate_mb;
+    struct reshape_ops ops;
+    void *ctx;
+    char *buf;
+
+    uint64_t pos;   // array bytes in the new layout
+    uint64_t end;   // end of the step being moved, while busy
+    bool busy;
+    int epoch;         // requests count themselves in users[epoch]
+    unsigned users[2]; // requests in flight that use the old layout
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int save_header(struct reshape *rs, uint64_t pos, uint64_t backup_len)
+{
+    rs->hdr.pos = pos;
+    rs->hdr.backup_len = backup_len;
+    errno = 0;
+    if (pwrite(rs->fd, &rs->hdr, sizeof(rs->hdr), 0) != sizeof(rs->hdr) || fdatasync(rs->fd) != 0)
+        return errno != 0 ? -errno : -EIO;
+    return 0;
+}
+
+/* Move [pos, pos + len) to the new layout. Called with the range gated. */
+static int move_step(struct reshape *rs, uint64_t pos, uint32_t len)
+{
+    int err = rs->ops.read_old(rs->buf, len, pos, rs->ctx);
+    if (err != 0)
+        return err;
+    // the step's new stripes land on member rows that may still hold its
+    // old stripes; a crash halfway would lose them, so save them first
+    if ((pos + len) / rs->hdr.new_stripe > pos / rs->hdr.old_stripe)
+    {
+        errno = 0;
+        if (pwrite(rs->fd, rs->buf, len, BACKUP_OFFSET) != (ssize_t)len || fdatasync(rs->fd) != 0)
+            return errno != 0 ? -errno : -EIO;
+        if ((err = save_header(rs, pos, len)) != 0)
+            return err;
+    }
+    if ((err = rs->ops.write_new(rs->buf, len, pos, rs->ctx)) != 0 ||
+        (err = rs->ops.sync(rs->ctx)) != 0)
+        return err;
+    return save_header(rs, pos + len, 0);
+}
+
+struct reshape *reshape_create(const char *checkpoint, uint64_t old_stripe, uint64_t new_stripe, uint64_t size,
+                               size_t batch, unsigned long rate_mb, const struct reshape_ops *ops, void *ctx)
+{
+    struct reshape *rs = calloc(1, sizeof(*rs));
+    if (rs == NULL)
+    {
+        fprintf(stderr, "reshape: out of memory\n");
+        return NULL;
+    }
+    rs->batch = (batch < MAX_BATCH ? batch : MAX_BATCH) / new_stripe * new_stripe;
+    if (rs->batch == 0)
+        rs->batch = new_stripe;
+    rs->rate_mb = rate_mb;
+    rs->ops = *ops;
+    rs->ctx = ctx;
+    pthread_mutex_init(&rs->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rs->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    rs->fd = open(checkpoint, O_RDWR | O_CREAT, 0644);
+    if (rs->fd < 0)
+    {
+        fprintf(stderr, "reshape: %s: %s\n", checkpoint, strerror(errno));
+        free(rs);
+        return NULL;
+    }
+    ssize_t r = pread(rs->fd, &rs->hdr, sizeof(rs->hdr), 0);
+    if (r == 0)
+    {
+        memcpy(rs->hdr.magic, RESHAPE_MAGIC, sizeof(rs->hdr.magic));
+        rs->hdr.old_stripe = old_stripe;
+        rs->hdr.new_stripe = new_stripe;
+        rs->hdr.size = size;
+        int err = save_header(rs, 0, 0);
+        if (err != 0)
+        {
+            fprintf(stderr, "reshape: %s: %s\n", checkpoint, strerror(-err));
+            r = -1;
+        }
+    }
+    else if (r != sizeof(rs->hdr) || memcmp(rs->hdr.magic, RESHAPE_MAGIC, sizeof(rs->hdr.magic)) != 0 ||
+             rs->hdr.old_stripe != old_stripe || rs->hdr.new_stripe != new_stripe || rs->hdr.size != size ||
+             rs->hdr.pos > size || rs->hdr.pos % new_stripe != 0)
+    {
+        fprintf(stderr, "reshape: %s is not a checkpoint for this layout\n", checkpoint);
+        r = -1;
+    }
+    rs->buf = member_alloc(rs->batch);
+    if (r < 0 || rs->buf == NULL)
+    {
+        if (r >= 0)
+            fprintf(stderr, "reshape: out of memory\n");
+        reshape_destroy(rs);
+        return NULL;
+    }
+
+    uint64_t backup_len = rs->hdr.backup_len;
+    if (backup_len > 0)
+    {
+        // a step was interrupted after it may have overwritten itself: its
+        // old stripes can't be trusted, so write the saved copy again
+        int err = 0;
+        if (backup_len > rs->batch || backup_len % new_stripe != 0 ||
+            pread(rs->fd, rs->buf, backup_len, BACKUP_OFFSET) != (ssize_t)backup_len)
+            err = -EIO;
+        if (err == 0 && (err = rs->ops.write_new(rs->buf, backup_len, rs->hdr.pos, ctx)) == 0 &&
+            (err = rs->ops.sync(ctx)) == 0)
+            err = save_header(rs, rs->hdr.pos + backup_len, 0);
+        if (err != 0)
+        {
+            fprintf(stderr, "reshape: can't replay the interrupted step at %lu: %s\n", rs->hdr.pos, strerror(-err));
+            reshape_destroy(rs);
+            return NULL;
+        }
+        fprintf(stderr, "reshape: replayed the interrupted step at %lu\n", rs->hdr.pos - backup_len);
+    }
+    rs->pos = rs->hdr.pos;
+    return rs;
+}
+
+/* Sleep up to `ms` milliseconds, waking early on stop. Called with the lock held. */
+static void rs_sleep(struct reshape *rs, uint64_t ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while (!rs->stop && pthread_cond_timedwait(&rs->cond, &rs->lock, &ts) != ETIMEDOUT)
+        ;
+}
+
+static void *reshape_thread(void *arg)
+{
+    struct reshape *rs = arg;
+    uint64_t start = now_ns();
+    uint64_t first = rs->pos;
+    int err = 0;
+
+    fprintf(stderr, "reshape: moving %lu of %lu bytes to the new layout\n", rs->hdr.size - first, rs->hdr.size);
+    pthread_mutex_lock(&rs->lock);
+    while (!rs->stop && rs->pos < rs->hdr.size)
+    {
+        uint64_t pos = rs->pos;
+        uint32_t len = rs->hdr.size - pos < rs->batch ? rs->hdr.size - pos : rs->batch;
+
+        // hold off requests to the step, and wait out those that may
+        // already be using its old stripes
+        rs->end = pos + len;
+        rs->busy = true;
+        int e = rs->epoch;
+        rs->epoch ^= 1;
+        while (rs->users[e] > 0)
+            pthread_cond_wait(&rs->cond, &rs->lock);
+        pthread_mutex_unlock(&rs->lock);
+
+        err = move_step(rs, pos, len);
+
+        pthread_mutex_lock(&rs->lock);
+        if (err == 0)
+            __atomic_store_n(&rs->pos, pos + len, __ATOMIC_RELEASE);
+        rs->busy = false;
+        pthread_cond_broadcast(&rs->cond);
+        if (err != 0)
+            break;
+
+        if (rs->rate_mb > 0)
+        {
+            // hold the average at the rate: sleep until the bytes moved so far are due
+            uint64_t due = (rs->pos - first) * 1000 / (rs->rate_mb << 20);
+            uint64_t elapsed = (now_ns() - start) / 1000000;
+            if (due > elapsed)
+                rs_sleep(rs, due - elapsed);
+        }
+    }
+    bool done = rs->pos == rs->hdr.size;
+    pthread_mutex_unlock(&rs->lock);
+
+    double secs = (now_ns() - start) / 1e9;
+    if (err != 0)
+        fprintf(stderr, "reshape: failed at %lu: %s; stopped\n", rs->pos, strerror(-err));
+    else
+        fprintf(stderr, "reshape: %s at %lu after %.1f s (%.1f MB/s)\n", done ? "done" : "stopped", rs->pos, secs,
+                secs > 0 ? (rs->pos - first) / secs / (1 << 20) : 0.0);
+    if (done)
+        rs->ops.done(rs->ctx);
+    return NULL;
+}
+
+int reshape_start(struct reshape *rs)
+{
+    int r = affinity_background_thread(&rs->thread, "reshape", reshape_thread, rs);
+    if (r != 0)
+        return -r;
+    rs->started = true;
+    return 0;
+}
+
+uint64_t reshape_position(struct reshape *rs)
+{
+    return __atomic_load_n(&rs->pos, __ATOMIC_ACQUIRE);
+}
+
+uint64_t reshape_enter(struct reshape *rs, uint64_t offset, uint64_t len, int *ticket)
+{
+    *ticket = -1;
+    uint64_t split = __atomic_load_n(&rs->pos, __ATOMIC_ACQUIRE);
+    if (split == rs->hdr.size)
+        return split; // finished: everything is in the new layout for good
+
+    pthread_mutex_lock(&rs->lock);
+    while (rs->busy && offset < rs->end && offset + len > rs->pos)
+        pthread_cond_wait(&rs->cond, &rs->lock);
+    split = rs->pos;
+    if (offset + len > split)
+    {
+        *ticket = rs->epoch;
+        rs->users[rs->epoch]++;
+    }
+    pthread_mutex_unlock(&rs->lock);
+    return split;
+}
+
+void reshape_exit(struct reshape *rs, int ticket)
+{
+    if (ticket < 0)
+        return;
+    pthread_mutex_lock(&rs->lock);
+    if (--rs->users[ticket] == 0)
+        pthread_cond_broadcast(&rs->cond);
+    pthread_mutex_unlock(&rs->lock);
+}
+
+void reshape_destroy(struct reshape *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    rs->stop = true;
+    pthread_cond_broadcast(&rs->cond);
+    pthread_mutex_unlock(&rs->lock);
+    if (rs->started)
+        pthread_join(rs->thread, NULL);
+    close(rs->fd);
+    free(rs->buf);
+    free(rs);
+}
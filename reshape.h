@@ -0,0 +1,60 @@
+/*
+ * reshape - online restriping onto an added member for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef RESHAPE_H_INCLUDED
+#define RESHAPE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The engine's I/O in each layout. Offsets and lengths are array bytes in
+ * whole stripes of the new layout. `read_old` reads through the old layout
+ * and returns zeroes past its end; `write_new` writes whole new stripes,
+ * parity included. `sync` makes what was written durable. All return 0 or
+ * -errno. `done` is called from the reshape thread once everything has been
+ * moved, so the engine can grow the device. */
+struct reshape_ops
+{
+    int (*read_old)(void *buf, uint32_t len, uint64_t offset, void *ctx);
+    int (*write_new)(const void *buf, uint32_t len, uint64_t offset, void *ctx);
+    int (*sync)(void *ctx);
+    void (*done)(void *ctx);
+};
+
+struct reshape;
+
+/* Move an array of `size` bytes (the new layout's capacity) from stripes of
+ * `old_stripe` data bytes to stripes of `new_stripe`, both occupying one
+ * chunk per member. Progress is kept in the file `checkpoint`, which is
+ * created if need be; an existing one must describe the same layout, and a
+ * copy interrupted mid-step is replayed from its backup. Copies are
+ * `batch` bytes at a time (at most 64 MiB), limited to `rate_mb` MB/s if
+ * nonzero. Returns NULL with a message on stderr on failure. */
+struct reshape *reshape_create(const char *checkpoint, uint64_t old_stripe, uint64_t new_stripe, uint64_t size,
+                               size_t batch, unsigned long rate_mb, const struct reshape_ops *ops, void *ctx);
+
+/* Start moving data in the background. Returns 0 or -errno. */
+int reshape_start(struct reshape *rs);
+
+/* Array bytes already in the new layout; everything from here on is still
+ * in the old one. */
+uint64_t reshape_position(struct reshape *rs);
+
+/* Bracket every request. reshape_enter() waits while the range is being
+ * moved and returns the position to split it at: bytes below it use the new
+ * layout, the rest the old one, until the matching reshape_exit(). */
+uint64_t reshape_enter(struct reshape *rs, uint64_t offset, uint64_t len, int *ticket);
+void reshape_exit(struct reshape *rs, int ticket);
+
+/* Stop the reshape thread after the current step; progress is kept in the
+ * checkpoint for next time. */
+void reshape_destroy(struct reshape *rs);
+
+#endif /* RESHAPE_H_INCLUDED */
@@ -0,0 +1,193 @@
+/*
+ * ring - lock-free queues of pointers between BUSE threads
+ *
+ * The producer side keeps a head, where the next producer reserves room,
+ * and a tail, up to which entries are filled in; the consumer keeps one
+ * index of its own. With one producer head and tail move together. With
+ * several, each reserves its entries with a compare-and-swap on the head,
+ * fills them in, then waits for the producers that reserved before it to
+ * publish theirs, so the tail only ever moves past complete entries.
+ * Indices are free-running 32-bit counters, masked to find the entry.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define CACHE_LINE 64
+#define SPIN 256 // polls of an empty ring before going to sleep
+
+struct ring
+{
+    // written by producers
+    uint32_t head __attribute__((aligned(CACHE_LINE)));
+    uint32_t tail;
+    unsigned long wakeups;
+    // written by the consumer
+    uint32_t cons __attribute__((aligned(CACHE_LINE)));
+    // set by the consumer before it sleeps, cleared by the producer waking it
+    uint32_t sleeping __attribute__((aligned(CACHE_LINE)));
+    uint32_t closed;
+    // read-only after setup
+    uint32_t mask __attribute__((aligned(CACHE_LINE)));
+    bool multi;
+    int efd;
+    void *entry[] __attribute__((aligned(CACHE_LINE)));
+};
+
+struct ring *ring_create(unsigned int size, bool multi_producer)
+{
+    uint32_t n = 1;
+    while (n < size && n < (1U << 31))
+        n <<= 1;
+    struct ring *r = aligned_alloc(CACHE_LINE, (sizeof(*r) + n * sizeof(void *) + CACHE_LINE - 1) / CACHE_LINE *
+                                                   CACHE_LINE);
+    if (r == NULL)
+        return NULL;
+    r->head = r->tail = r->cons = 0;
+    r->wakeups = 0;
+    r->sleeping = r->closed = 0;
+    r->mask = n - 1;
+    r->multi = multi_producer;
+    r->efd = eventfd(0, EFD_CLOEXEC);
+    if (r->efd < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void ring_destroy(struct ring *r)
+{
+    if (r == NULL)
+        return;
+    close(r->efd);
+    free(r);
+}
+
+/* After publishing: wake the consumer if it is asleep or about to be. */
+static void wake(struct ring *r)
+{
+    // pairs with the fence in ring_wait: either it sees our entries or we see it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&r->sleeping, 0, __ATOMIC_ACQ_REL))
+    {
+        uint64_t one = 1;
+        __atomic_add_fetch(&r->wakeups, 1, __ATOMIC_RELAXED);
+        while (write(r->efd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+unsigned int ring_enqueue(struct ring *r, void *const *items, unsigned int n)
+{
+    uint32_t size = r->mask + 1;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint32_t next;
+
+    for (;;)
+    {
+        uint32_t room = size - (head - __atomic_load_n(&r->cons, __ATOMIC_ACQUIRE));
+        if (n > room)
+            n = room;
+        if (n == 0)
+            return 0;
+        next = head + n;
+        if (!r->multi)
+        {
+            r->head = next;
+            break;
+        }
+        if (__atomic_compare_exchange_n(&r->head, &head, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+    for (unsigned int i = 0; i < n; i++)
+        r->entry[(head + i) & r->mask] = items[i];
+    // entries are published in reservation order
+    while (r->multi && __atomic_load_n(&r->tail, __ATOMIC_RELAXED) != head)
+        sched_yield();
+    __atomic_store_n(&r->tail, next, __ATOMIC_RELEASE);
+    wake(r);
+    return n;
+}
+
+void ring_put(struct ring *r, void *const *items, unsigned int n)
+{
+    for (;;)
+    {
+        unsigned int done = ring_enqueue(r, items, n);
+        items += done;
+        n -= done;
+        if (n == 0)
+            return;
+        sched_yield();
+    }
+}
+
+unsigned int ring_dequeue(struct ring *r, void **items, unsigned int n)
+{
+    uint32_t cons = r->cons;
+    uint32_t avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - cons;
+    if (n > avail)
+        n = avail;
+    for (unsigned int i = 0; i < n; i++)
+        items[i] = r->entry[(cons + i) & r->mask];
+    if (n > 0)
+        __atomic_store_n(&r->cons, cons + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+unsigned int ring_wait(struct ring *r, void **items, unsigned int n)
+{
+    for (;;)
+    {
+        for (int spin = 0; spin < SPIN; spin++)
+        {
+            unsigned int got = ring_dequeue(r, items, n);
+            if (got > 0)
+                return got;
+            // entries published before the close are visible once it is
+            if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+                return ring_dequeue(r, items, n);
+        }
+        __atomic_store_n(&r->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        unsigned int got = ring_dequeue(r, items, n);
+        if (got == 0 && __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+            got = ring_dequeue(r, items, n);
+        if (got > 0 || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+            return got;
+        }
+        uint64_t count;
+        while (read(r->efd, &count, sizeof(count)) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+void ring_close(struct ring *r)
+{
+    uint64_t one = 1;
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    while (write(r->efd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+unsigned long ring_wakeups(const struct ring *r)
+{
+    return __atomic_load_n(&r->wakeups, __ATOMIC_RELAXED);
+}
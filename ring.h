@@ -0,0 +1,57 @@
+/*
+ * ring - lock-free queues of pointers between BUSE threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdbool.h>
+
+/* A bounded queue of pointers with one consumer and either one producer
+ * (the thread reading the socket handing requests to a worker) or any
+ * number (workers handing completions to the thread sending replies).
+ * Producers and the consumer share nothing but the ring's indices, each on
+ * its own cache line, and move whole batches per update:
+ *
+ *     ring_put(r, req, n);              // producer
+ *     n = ring_wait(r, req, MAX_BATCH);  // consumer
+ *
+ * A consumer that finds the ring empty spins briefly, then sleeps on an
+ * eventfd. Producers only write to it when the consumer has said it is
+ * going to sleep, so a busy consumer costs them no system calls. */
+struct ring;
+
+/* A ring of `size` entries, rounded up to a power of two, for one producer
+ * or, with `multi_producer`, many. Returns NULL if memory or eventfds run
+ * out. */
+struct ring *ring_create(unsigned int size, bool multi_producer);
+
+/* Free a ring no thread is using any more. */
+void ring_destroy(struct ring *r);
+
+/* Add up to `n` items at once, as many as there is room for; returns how
+ * many. */
+unsigned int ring_enqueue(struct ring *r, void *const *items, unsigned int n);
+
+/* Add all `n` items, yielding the CPU while the ring is full. */
+void ring_put(struct ring *r, void *const *items, unsigned int n);
+
+/* Take up to `n` items without waiting; returns how many. Consumer only. */
+unsigned int ring_dequeue(struct ring *r, void **items, unsigned int n);
+
+/* Take between 1 and `n` items, waiting for some if the ring is empty.
+ * Returns 0 once the ring is closed and empty. Consumer only. */
+unsigned int ring_wait(struct ring *r, void **items, unsigned int n);
+
+/* No more items will be added: wake the consumer to drain the ring. */
+void ring_close(struct ring *r);
+
+/* How often producers had to wake the consumer. */
+unsigned long ring_wakeups(const struct ring *r);
+
+#endif /* RING_H_INCLUDED */
@@ -0,0 +1,215 @@
+/*
+ * ringbench - throughput and handoff latency of ring.c
+ *
+ * Passes items from 1, 2, 4 and 8 producer threads to one consumer, one at
+ * a time and in batches, through a ring and, for comparison, through a
+ * queue guarded by a mutex and condition variable. Every item carries the
+ * time it was queued, so the consumer measures how long each handoff took:
+ *
+ *     ringbench [-n MILLIONS] [-s RING-SIZE]
+ *
+ * The wakeup column is the fraction of items after which the consumer had
+ * to be woken from its eventfd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define MAX_PRODUCERS 8
+#define MAX_BATCH 32
+#define SAMPLES (1 << 20) // latencies kept for the percentiles
+
+/* The mutex-protected queue rings replace. */
+struct locked_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty, nonfull;
+    void **entry;
+    uint32_t size, head, tail;
+    bool waiting;
+};
+
+struct run
+{
+    struct ring *ring;          // or
+    struct locked_queue *queue;
+    int producers;
+    int batch;
+    uint64_t per_producer;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void queue_put(struct locked_queue *q, void *const *items, int n)
+{
+    pthread_mutex_lock(&q->lock);
+    for (int i = 0; i < n; i++)
+    {
+        while (q->head - q->tail == q->size)
+        {
+            if (q->waiting)
+                pthread_cond_signal(&q->nonempty);
+            pthread_cond_wait(&q->nonfull, &q->lock);
+        }
+        q->entry[q->head++ % q->size] = items[i];
+    }
+    if (q->waiting)
+        pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int queue_wait(struct locked_queue *q, void **items, int n)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->head == q->tail)
+    {
+        q->waiting = true;
+        pthread_cond_wait(&q->nonempty, &q->lock);
+        q->waiting = false;
+    }
+    int got = 0;
+    while (got < n && q->tail != q->head)
+        items[got++] = q->entry[q->tail++ % q->size];
+    pthread_cond_broadcast(&q->nonfull);
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+static void *produce(void *arg)
+{
+    struct run *r = arg;
+    void *items[MAX_BATCH];
+    for (uint64_t sent = 0; sent < r->per_producer; sent += r->batch)
+    {
+        uint64_t t = now_ns();
+        for (int i = 0; i < r->batch; i++)
+            items[i] = (void *)(uintptr_t)t; // the item is the time it was queued
+        if (r->ring != NULL)
+            ring_put(r->ring, items, r->batch);
+        else
+            queue_put(r->queue, items, r->batch);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Run producers against a consumer on this thread; print a result line. */
+static void measure(const char *kind, struct run *r, uint64_t *lat)
+{
+    pthread_t thread[MAX_PRODUCERS];
+    uint64_t total = r->per_producer * r->producers, got = 0, samples = 0;
+    uint64_t every = total / SAMPLES + 1;
+    void *items[MAX_BATCH];
+
+    uint64_t start = now_ns();
+    for (int p = 0; p < r->producers; p++)
+        pthread_create(&thread[p], NULL, produce, r);
+    while (got < total)
+    {
+        int n = r->ring != NULL ? (int)ring_wait(r->ring, items, MAX_BATCH) : queue_wait(r->queue, items, MAX_BATCH);
+        uint64_t t = now_ns();
+        for (int i = 0; i < n; i++, got++)
+        {
+            if (got % every == 0 && samples < SAMPLES)
+                lat[samples++] = t - (uintptr_t)items[i];
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+    for (int p = 0; p < r->producers; p++)
+        pthread_join(thread[p], NULL);
+    qsort(lat, samples, sizeof(*lat), cmp_u64);
+    printf("%-6s %9d %5d %10.2f %10lu %10lu", kind, r->producers, r->batch, total / secs / 1e6, lat[samples / 2],
+           lat[samples * 99 / 100]);
+    if (r->ring != NULL)
+        printf(" %9.4f\n", (double)ring_wakeups(r->ring) / total);
+    else
+        printf(" %9s\n", "-");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t millions = 4;
+    unsigned int size = 1024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            millions = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            millions = 0;
+        }
+    }
+    if (millions == 0 || size < MAX_BATCH)
+    {
+        fprintf(stderr, "usage: %s [-n MILLIONS] [-s RING-SIZE] (of items per measurement, at least %d entries)\n",
+                argv[0], MAX_BATCH);
+        return 1;
+    }
+
+    uint64_t *lat = malloc(SAMPLES * sizeof(*lat));
+    void **entry = malloc(size * sizeof(*entry));
+    if (lat == NULL || entry == NULL)
+        return 1;
+    printf("%lu million items, %u entries, %ld CPUs\n", millions, size, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-6s %9s %5s %10s %10s %10s %9s\n", "queue", "producers", "batch", "Mops/s", "p50 ns", "p99 ns", "wakeups");
+    static const int producers[] = {1, 2, 4, 8};
+    static const int batches[] = {1, MAX_BATCH};
+    for (size_t p = 0; p < sizeof(producers) / sizeof(producers[0]); p++)
+    {
+        for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+        {
+            struct run r = {.producers = producers[p], .batch = batches[b]};
+            r.per_producer = (millions * 1000000 / r.producers + r.batch - 1) / r.batch * r.batch;
+
+            r.ring = ring_create(size, r.producers > 1);
+            if (r.ring == NULL)
+                return 1;
+            measure(r.producers > 1 ? "mpsc" : "spsc", &r, lat);
+            ring_destroy(r.ring);
+            r.ring = NULL;
+
+            struct locked_queue q = {.entry = entry, .size = size};
+            pthread_mutex_init(&q.lock, NULL);
+            pthread_cond_init(&q.nonempty, NULL);
+            pthread_cond_init(&q.nonfull, NULL);
+            r.queue = &q;
+            measure("mutex", &r, lat);
+            pthread_mutex_destroy(&q.lock);
+            pthread_cond_destroy(&q.nonempty);
+            pthread_cond_destroy(&q.nonfull);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,888 @@
+/*
+ * ssdcache - persistent log-structured cache tier for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "affinity.h"
+#include "arena.h"
+#include "buse.h"
+#include "crc32c.h"
+#include "member.h"
+#include "ssdcache.h"
+
+#define SSC_BLOCK 4096
+#define SSC_MAGIC "BUSESSC1"
+#define SSC_REC_MAGIC "BUSESSCR"
+#define SSC_MAX_REC 256           // data blocks per log record
+#define SSC_BATCH 2048            // data blocks per destage batch
+#define SSC_MIN_SLOTS 1024
+#define SSC_EXPIRE_NS (30ULL * 1000000000) // destage writes older than this
+#define SSC_GHOSTS 4096           // recently missed reads; a second miss promotes
+#define SSC_PROMOTE_MAX (64 * 1024) // larger reads are not promoted
+#define SSC_EDGE_LOCKS 64         // locks serializing writes that fill in partial blocks
+
+#define SLOT_DIRTY (1ULL << 63)     // in slot_lba: not destaged yet
+#define SLOT_NONE (SLOT_DIRTY - 1)  // in slot_lba: holds nothing
+#define INDEX_EMPTY UINT32_MAX
+
+#define REC_CLEAN 1 // promoted by a read: nothing to destage
+
+/* Block 0 of the cache device. The log of records fills the rest; replay
+ * starts at `tail`, the oldest record not destaged yet. */
+struct ssc_super
+{
+    char magic[8];
+    uint64_t size;   // bytes of the array cached
+    uint64_t nslots; // log blocks
+    uint64_t tail;
+    uint64_t tail_seq;
+};
+
+/* The first block of a log record, followed by `n` data blocks holding array
+ * blocks `lba` onwards. The CRC covers the header, with crc = 0, and the data,
+ * so a record torn by a crash ends the replay. */
+struct ssc_rec
+{
+    char magic[8];
+    uint64_t seq;
+    uint64_t lba;
+    uint32_t n;
+    uint32_t flags;
+    uint32_t crc;
+};
+
+/* A record between the tail and the head, not destaged yet. */
+struct ssc_recent
+{
+    uint64_t pos; // log position of its header; slot pos % nslots
+    uint32_t n;
+    uint32_t flags;
+    uint64_t written;
+};
+
+struct ssdcache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // the destage thread waits here
+    pthread_cond_t destaged; // writers and drainers wait here
+    pthread_t thread;
+    bool started;
+    bool stop;
+
+    struct member dev;
+    uint64_t size;
+    uint64_t nslots;
+    struct ssc_ops ops;
+    void *ctx;
+    uint64_t high; // start destaging above this many log blocks in use...
+    uint64_t low;  // ...and keep going down to this many
+
+    // the log runs from tail to head; positions count up for ever and wrap
+    // onto slots modulo nslots. A record never wraps: if it doesn't fit before
+    // the last slot, it starts over at slot 0.
+    uint64_t head;
+    uint64_t head_seq;
+    uint64_t tail;
+    uint64_t tail_seq;
+    struct ssc_recent *recs; // ring of records from tail to head
+    uint64_t nrecs;
+    uint64_t rec_first;
+    uint64_t rec_count;
+
+    // index: array block -> slot, by open addressing on slot numbers; a
+    // slot's array block is in slot_lba, so an entry needs only 4 bytes
+    uint64_t *slot_lba;
+    uint32_t *index;
+    uint64_t imask;
+    int ishift;
+    uint64_t ghosts[SSC_GHOSTS];
+    pthread_mutex_t edge_locks[SSC_EDGE_LOCKS]; // by array block
+
+    char *wbuf; // replay record buffer; requests take theirs from the arena
+    char *sbuf; // superblock buffer
+    uint64_t dirty_blocks;
+    int flushing;  // drainers waiting for the log to empty
+    int starved;   // writers waiting for log space
+    bool draining; // above the high watermark, not yet back to low
+    bool destaging;
+    int error;     // from the last destage, if it failed
+    uint64_t retry_at;
+
+    uint64_t started_ns;
+    uint64_t writes;
+    uint64_t written_bytes;
+    uint64_t read_hits; // reads served entirely from the cache
+    uint64_t read_partial;
+    uint64_t read_misses;
+    uint64_t promoted;  // blocks copied into the cache after repeated misses
+    uint64_t destage_batches;
+    uint64_t destage_writes;
+    uint64_t destaged_bytes;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t slot_off(uint64_t slot)
+{
+    return (1 + slot) * SSC_BLOCK;
+}
+
+static inline uint64_t ihash(struct ssdcache *c, uint64_t lba)
+{
+    return (lba * 0x9e3779b97f4a7c15ULL) >> c->ishift;
+}
+
+/* Where the index entry for `lba` is, or the empty one to put it in. */
+static uint64_t index_find(struct ssdcache *c, uint64_t lba)
+{
+    uint64_t h = ihash(c, lba);
+    while (c->index[h] != INDEX_EMPTY && (c->slot_lba[c->index[h]] & ~SLOT_DIRTY) != lba)
+        h = (h + 1) & c->imask;
+    return h;
+}
+
+static uint32_t lookup(struct ssdcache *c, uint64_t lba)
+{
+    return c->index[index_find(c, lba)];
+}
+
+/* Remove the entry at `h`, moving later entries of its probe run back so
+ * lookups still find them. */
+static void index_remove(struct ssdcache *c, uint64_t h)
+{
+    uint64_t i = h;
+    for (;;)
+    {
+        c->index[i] = INDEX_EMPTY;
+        uint64_t j = i;
+        for (;;)
+        {
+            j = (j + 1) & c->imask;
+            if (c->index[j] == INDEX_EMPTY)
+                return;
+            uint64_t home = ihash(c, c->slot_lba[c->index[j]] & ~SLOT_DIRTY);
+            // the entry at j may move to i unless its home lies in (i, j]
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+                break;
+        }
+        c->index[i] = c->index[j];
+        i = j;
+    }
+}
+
+/* Point `lba` at `slot`; the slot it was in before holds nothing now. */
+static void index_set(struct ssdcache *c, uint64_t lba, uint32_t slot, bool dirty)
+{
+    uint64_t h = index_find(c, lba);
+    uint32_t old = c->index[h];
+    if (old != INDEX_EMPTY)
+    {
+        if (c->slot_lba[old] & SLOT_DIRTY)
+            c->dirty_blocks--;
+        c->slot_lba[old] = SLOT_NONE;
+    }
+    c->index[h] = slot;
+    c->slot_lba[slot] = lba | (dirty ? SLOT_DIRTY : 0);
+    if (dirty)
+        c->dirty_blocks++;
+}
+
+/* Forget what `slot` caches before it is overwritten. Only clean data is
+ * ever found past the head. */
+static void evict(struct ssdcache *c, uint64_t slot)
+{
+    uint64_t lba = c->slot_lba[slot];
+    if (lba == SLOT_NONE)
+        return;
+    uint64_t h = index_find(c, lba & ~SLOT_DIRTY);
+    if (c->index[h] == slot)
+        index_remove(c, h);
+    c->slot_lba[slot] = SLOT_NONE;
+}
+
+static int write_super(struct ssdcache *c, uint64_t tail, uint64_t tail_seq)
+{
+    struct ssc_super *sb = (struct ssc_super *)c->sbuf;
+    memset(c->sbuf, 0, SSC_BLOCK);
+    memcpy(sb->magic, SSC_MAGIC, sizeof(sb->magic));
+    sb->size = c->size;
+    sb->nslots = c->nslots;
+    sb->tail = tail % c->nslots;
+    sb->tail_seq = tail_seq;
+    ssize_t r = member_pwrite(&c->dev, c->sbuf, SSC_BLOCK, 0);
+    if (r != SSC_BLOCK)
+        return r < 0 ? r : -EIO;
+    return member_sync(&c->dev);
+}
+
+static uint32_t rec_crc(struct ssc_rec *h, const char *data, uint32_t n)
+{
+    uint32_t saved = h->crc;
+    h->crc = 0;
+    uint32_t crc = crc32c(0, h, sizeof(*h));
+    h->crc = saved;
+    return crc32c(crc, data, (size_t)n * SSC_BLOCK);
+}
+
+static void ring_push(struct ssdcache *c, uint64_t pos, uint32_t n, uint32_t flags, uint64_t written)
+{
+    struct ssc_recent *r = &c->recs[(c->rec_first + c->rec_count++) % c->nrecs];
+    r->pos = pos;
+    r->n = n;
+    r->flags = flags;
+    r->written = written;
+}
+
+/* Append a record of `n` blocks from array block `lba`, whose data is in
+ * `rec` after a block left for the header. Writers wait for log space;
+ * promotions don't. */
+static int append(struct ssdcache *c, uint64_t lba, uint32_t n, char *rec, uint32_t flags, int wflags)
+{
+    uint64_t need = 1 + n;
+    uint64_t pos;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;)
+    {
+        pos = c->head;
+        if (pos % c->nslots + need > c->nslots)
+            pos += c->nslots - pos % c->nslots; // doesn't fit before the end: start over at slot 0
+        if (pos + need - c->tail <= c->nslots)
+            break;
+        if (flags & REC_CLEAN)
+        {
+            pthread_mutex_unlock(&c->lock);
+            return -ENOSPC;
+        }
+        if (c->error != 0)
+        {
+            // the log is full and can't be destaged
+            int err = c->error;
+            pthread_mutex_unlock(&c->lock);
+            return err;
+        }
+        c->starved++;
+        pthread_cond_broadcast(&c->work);
+        pthread_cond_wait(&c->destaged, &c->lock);
+        c->starved--;
+    }
+    uint64_t old_head = c->head;
+    uint64_t seq = c->head_seq;
+    uint64_t slot = pos % c->nslots;
+    for (uint64_t s = slot; s < slot + need; s++)
+        evict(c, s);
+    c->head = pos + need;
+    c->head_seq++;
+    pthread_mutex_unlock(&c->lock);
+
+    struct ssc_rec *h = (struct ssc_rec *)rec;
+    memset(rec, 0, SSC_BLOCK);
+    memcpy(h->magic, SSC_REC_MAGIC, sizeof(h->magic));
+    h->seq = seq;
+    h->lba = lba;
+    h->n = n;
+    h->flags = flags;
+    h->crc = rec_crc(h, rec + SSC_BLOCK, n);
+    ssize_t r = member_pwrite2(&c->dev, rec, need * SSC_BLOCK, slot_off(slot), wflags);
+
+    pthread_mutex_lock(&c->lock);
+    if (r != (ssize_t)(need * SSC_BLOCK))
+    {
+        // nothing may follow a record that isn't there, or replay would stop
+        // short of it: give its place back
+        c->head = old_head;
+        c->head_seq = seq;
+        pthread_mutex_unlock(&c->lock);
+        fprintf(stderr, "ssdcache: log write failed: %s\n", strerror(r < 0 ? -r : EIO));
+        return r < 0 ? r : -EIO;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        index_set(c, lba + i, slot + 1 + i, !(flags & REC_CLEAN));
+    ring_push(c, pos, n, flags, now_ns());
+    if (c->head - c->tail > c->high && !c->draining)
+    {
+        c->draining = true;
+        pthread_cond_broadcast(&c->work);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* Whether `slot` still caches array block `lba`, after reading it without
+ * the lock: a write going round the log may have evicted and reused it. */
+static bool slot_holds(struct ssdcache *c, uint32_t slot, uint64_t lba)
+{
+    pthread_mutex_lock(&c->lock);
+    bool ok = (c->slot_lba[slot] & ~SLOT_DIRTY) == lba;
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+/* Read array blocks [lba, lba + nblocks) into `buf`, from the cache where it
+ * has them. */
+static int fetch(struct ssdcache *c, char *buf, uint64_t lba, uint32_t nblocks)
+{
+    for (uint32_t i = 0; i < nblocks; i++)
+    {
+        pthread_mutex_lock(&c->lock);
+        uint32_t slot = lookup(c, lba + i);
+        pthread_mutex_unlock(&c->lock);
+        int err;
+        if (slot != INDEX_EMPTY)
+        {
+            ssize_t r = member_pread(&c->dev, buf + (uint64_t)i * SSC_BLOCK, SSC_BLOCK, slot_off(slot));
+            err = r == SSC_BLOCK ? 0 : r < 0 ? r : -EIO;
+            if (err == 0 && !slot_holds(c, slot, lba + i))
+            {
+                i--; // look it up again
+                continue;
+            }
+        }
+        else
+            err = c->ops.read(buf + (uint64_t)i * SSC_BLOCK, SSC_BLOCK, (lba + i) * SSC_BLOCK, c->ctx);
+        if (err != 0)
+            return err;
+    }
+    return 0;
+}
+
+/* Take or release the locks of array blocks `a` and `b`, lower index first. */
+static void edge_lock(struct ssdcache *c, uint64_t a, uint64_t b, bool lock)
+{
+    uint32_t x = a % SSC_EDGE_LOCKS, y = b % SSC_EDGE_LOCKS;
+    uint32_t first = x < y ? x : y, second = x < y ? y : x;
+    if (lock)
+    {
+        pthread_mutex_lock(&c->edge_locks[first]);
+        if (second != first)
+            pthread_mutex_lock(&c->edge_locks[second]);
+    }
+    else
+    {
+        if (second != first)
+            pthread_mutex_unlock(&c->edge_locks[second]);
+        pthread_mutex_unlock(&c->edge_locks[first]);
+    }
+}
+
+int ssc_write(struct ssdcache *c, const void *buf, uint32_t len, uint64_t offset, uint32_t flags)
+{
+    if (len == 0)
+        return 0;
+    int wflags = (flags & BUSE_WRITE_FUA) ? MEMBER_WRITE_DSYNC : 0;
+    uint64_t first = offset / SSC_BLOCK;
+    uint64_t last = (offset + len - 1) / SSC_BLOCK;
+
+    for (uint64_t b = first; b <= last; b += SSC_MAX_REC)
+    {
+        uint32_t n = last - b + 1 < SSC_MAX_REC ? last - b + 1 : SSC_MAX_REC;
+        struct arena_mark mark = arena_mark();
+        char *rec = arena_take((1 + (size_t)n) * SSC_BLOCK);
+        char *data = rec + SSC_BLOCK;
+        uint64_t lo = offset > b * SSC_BLOCK ? offset : b * SSC_BLOCK;
+        uint64_t hi = offset + len < (b + n) * SSC_BLOCK ? offset + len : (b + n) * SSC_BLOCK;
+        bool partial = lo > b * SSC_BLOCK || hi < (b + n) * SSC_BLOCK;
+        int err = 0;
+
+        if (rec == NULL)
+        {
+            arena_release(mark);
+            return -ENOMEM;
+        }
+        // blocks the write only partly covers keep the rest of their data;
+        // writes to other parts of them wait until this one is in the log
+        if (partial)
+            edge_lock(c, b, b + n - 1, true);
+        if (lo > b * SSC_BLOCK)
+            err = fetch(c, data, b, 1);
+        if (err == 0 && hi < (b + n) * SSC_BLOCK && (n > 1 || lo == b * SSC_BLOCK))
+            err = fetch(c, data + (uint64_t)(n - 1) * SSC_BLOCK, b + n - 1, 1);
+        if (err == 0)
+        {
+            memcpy(data + (lo - b * SSC_BLOCK), (const char *)buf + (lo - offset), hi - lo);
+            err = append(c, b, n, rec, 0, wflags);
+        }
+        if (partial)
+            edge_lock(c, b, b + n - 1, false);
+        arena_release(mark);
+        if (err != 0)
+            return err;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->writes++;
+    c->written_bytes += len;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* A read that missed entirely: remember it, and on a second miss copy the
+ * blocks it fully covers into the cache. */
+static void promote(struct ssdcache *c, const char *buf, uint32_t len, uint64_t offset)
+{
+    uint64_t first = (offset + SSC_BLOCK - 1) / SSC_BLOCK;
+    uint64_t end = (offset + len) / SSC_BLOCK;
+    if (len > SSC_PROMOTE_MAX || end <= first)
+        return;
+    pthread_mutex_lock(&c->lock);
+    uint64_t *ghost = &c->ghosts[first % SSC_GHOSTS];
+    bool again = *ghost == first + 1;
+    *ghost = again ? 0 : first + 1; // 0 is empty
+    pthread_mutex_unlock(&c->lock);
+    if (!again)
+        return;
+    struct arena_mark mark = arena_mark();
+    char *rec = arena_take((1 + end - first) * SSC_BLOCK);
+    if (rec != NULL)
+    {
+        memcpy(rec + SSC_BLOCK, buf + (first * SSC_BLOCK - offset), (end - first) * SSC_BLOCK);
+        if (append(c, first, end - first, rec, REC_CLEAN, 0) == 0)
+        {
+            pthread_mutex_lock(&c->lock);
+            c->promoted += end - first;
+            pthread_mutex_unlock(&c->lock);
+        }
+    }
+    arena_release(mark);
+}
+
+int ssc_read(struct ssdcache *c, void *buf, uint32_t len, uint64_t offset)
+{
+    if (len == 0)
+        return 0;
+    uint64_t first = offset / SSC_BLOCK;
+    uint64_t last = (offset + len - 1) / SSC_BLOCK;
+    uint64_t hits = 0;
+
+    for (uint64_t b = first; b <= last; b += SSC_MAX_REC)
+    {
+        uint32_t n = last - b + 1 < SSC_MAX_REC ? last - b + 1 : SSC_MAX_REC;
+        uint64_t lo = offset > b * SSC_BLOCK ? offset : b * SSC_BLOCK;
+        uint64_t hi = offset + len < (b + n) * SSC_BLOCK ? offset + len : (b + n) * SSC_BLOCK;
+        uint32_t slots[SSC_MAX_REC];
+        uint32_t cached;
+
+        // a write going round the log may reuse these slots while we read
+        // them; if one has moved on, read the whole piece again
+    again:
+        cached = 0;
+        pthread_mutex_lock(&c->lock);
+        for (uint32_t i = 0; i < n; i++)
+        {
+            slots[i] = lookup(c, b + i);
+            cached += slots[i] != INDEX_EMPTY;
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        int err = 0;
+        if (cached < n)
+            err = c->ops.read((char *)buf + (lo - offset), hi - lo, lo, c->ctx);
+        for (uint32_t i = 0; i < n && err == 0; i++)
+        {
+            if (slots[i] == INDEX_EMPTY)
+                continue;
+            uint32_t j = i;
+            while (j + 1 < n && slots[j + 1] == slots[j] + 1)
+                j++;
+            // blocks i..j are in consecutive slots: one read
+            uint64_t rlo = lo > (b + i) * SSC_BLOCK ? lo : (b + i) * SSC_BLOCK;
+            uint64_t rhi = hi < (b + j + 1) * SSC_BLOCK ? hi : (b + j + 1) * SSC_BLOCK;
+            ssize_t r = member_pread(&c->dev, (char *)buf + (rlo - offset), rhi - rlo,
+                                     slot_off(slots[i]) + (rlo - (b + i) * SSC_BLOCK));
+            if (r != (ssize_t)(rhi - rlo))
+                err = r < 0 ? r : -EIO;
+            i = j;
+        }
+        if (err != 0)
+            return err;
+        if (cached > 0)
+        {
+            bool moved = false;
+            pthread_mutex_lock(&c->lock);
+            for (uint32_t i = 0; i < n && !moved; i++)
+                moved = slots[i] != INDEX_EMPTY && (c->slot_lba[slots[i]] & ~SLOT_DIRTY) != b + i;
+            pthread_mutex_unlock(&c->lock);
+            if (moved)
+                goto again;
+        }
+        hits += cached;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (hits == last - first + 1)
+        c->read_hits++;
+    else if (hits > 0)
+        c->read_partial++;
+    else
+        c->read_misses++;
+    pthread_mutex_unlock(&c->lock);
+    if (hits == 0)
+        promote(c, buf, len, offset);
+    return 0;
+}
+
+static bool need_destage(struct ssdcache *c)
+{
+    if (c->rec_count == 0 || (c->error != 0 && now_ns() < c->retry_at))
+        return false;
+    return c->flushing > 0 || c->starved > 0 || c->draining ||
+           now_ns() - c->recs[c->rec_first].written > SSC_EXPIRE_NS;
+}
+
+struct ssc_dirty
+{
+    uint64_t lba;
+    uint32_t slot;
+};
+
+static int by_lba(const void *a, const void *b)
+{
+    const struct ssc_dirty *x = a, *y = b;
+    return x->lba < y->lba ? -1 : x->lba > y->lba;
+}
+
+/* Write the dirty blocks of the oldest records to the array, sorted so that
+ * adjacent blocks go out as one large write, then move the tail past them.
+ * Called with the lock held; drops it around the I/O. */
+static void destage_batch(struct ssdcache *c, char *buf, struct ssc_dirty *list)
+{
+    uint64_t nrec = 0, n = 0, end = c->tail;
+    while (nrec < c->rec_count)
+    {
+        struct ssc_recent *r = &c->recs[(c->rec_first + nrec) % c->nrecs];
+        if (nrec > 0 && n + r->n > SSC_BATCH)
+            break;
+        uint64_t slot = r->pos % c->nslots;
+        for (uint32_t i = 0; i < r->n; i++)
+        {
+            uint64_t lba = c->slot_lba[slot + 1 + i];
+            if (lba & SLOT_DIRTY)
+            {
+                list[n].lba = lba & ~SLOT_DIRTY;
+                list[n].slot = slot + 1 + i;
+                n++;
+            }
+        }
+        end = r->pos + 1 + r->n;
+        nrec++;
+    }
+    uint64_t end_seq = c->tail_seq + nrec;
+    c->destaging = true;
+    pthread_mutex_unlock(&c->lock);
+
+    qsort(list, n, sizeof(*list), by_lba);
+    uint64_t writes = 0;
+    int err = 0;
+    for (uint64_t i = 0; i < n && err == 0;)
+    {
+        // read blocks in consecutive slots at once
+        uint64_t j = i + 1;
+        while (j < n && list[j].slot == list[j - 1].slot + 1)
+            j++;
+        ssize_t r = member_pread(&c->dev, buf + i * SSC_BLOCK, (j - i) * SSC_BLOCK, slot_off(list[i].slot));
+        if (r != (ssize_t)((j - i) * SSC_BLOCK))
+            err = r < 0 ? r : -EIO;
+        i = j;
+    }
+    for (uint64_t i = 0; i < n && err == 0;)
+    {
+        uint64_t j = i + 1;
+        while (j < n && list[j].lba == list[j - 1].lba + 1)
+            j++;
+        err = c->ops.write(buf + i * SSC_BLOCK, (j - i) * SSC_BLOCK, list[i].lba * SSC_BLOCK, 0, c->ctx);
+        writes++;
+        i = j;
+    }
+    if (err == 0 && n > 0)
+        err = c->ops.sync(c->ctx);
+    if (err == 0)
+        err = write_super(c, end, end_seq); // only now may the log over them be reused
+
+    pthread_mutex_lock(&c->lock);
+    c->destaging = false;
+    if (err != 0)
+    {
+        fprintf(stderr, "ssdcache: destage failed: %s; retrying in a second\n", strerror(-err));
+        if (c->error == 0)
+            c->error = err;
+        c->retry_at = now_ns() + 1000000000;
+        pthread_cond_broadcast(&c->destaged);
+        return;
+    }
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if (c->slot_lba[list[i].slot] == (list[i].lba | SLOT_DIRTY))
+        {
+            c->slot_lba[list[i].slot] = list[i].lba; // clean; still cached until the log comes round
+            c->dirty_blocks--;
+        }
+    }
+    c->error = 0;
+    c->rec_first = (c->rec_first + nrec) % c->nrecs;
+    c->rec_count -= nrec;
+    c->tail = end;
+    c->tail_seq = end_seq;
+    if (c->head - c->tail <= c->low)
+        c->draining = false;
+    c->destage_batches++;
+    c->destage_writes += writes;
+    c->destaged_bytes += n * SSC_BLOCK;
+    pthread_cond_broadcast(&c->destaged);
+}
+
+static void *destage_thread(void *arg)
+{
+    struct ssdcache *c = arg;
+    char *buf = member_alloc((size_t)SSC_BATCH * SSC_BLOCK);
+    struct ssc_dirty *list = malloc(SSC_BATCH * sizeof(*list));
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop)
+    {
+        if (buf != NULL && list != NULL && need_destage(c))
+        {
+            destage_batch(c, buf, list);
+            continue;
+        }
+        // wake up now and then to notice records that have aged out
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&c->work, &c->lock, &ts);
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(buf);
+    free(list);
+    return NULL;
+}
+
+/* Read the record whose header is at log position `pos` into c->wbuf, if it
+ * is the one numbered `seq` and arrived whole. */
+static bool read_rec(struct ssdcache *c, uint64_t pos, uint64_t seq)
+{
+    struct ssc_rec *h = (struct ssc_rec *)c->wbuf;
+    uint64_t slot = pos % c->nslots;
+    if (member_pread(&c->dev, c->wbuf, SSC_BLOCK, slot_off(slot)) != SSC_BLOCK ||
+        memcmp(h->magic, SSC_REC_MAGIC, sizeof(h->magic)) != 0 || h->seq != seq || h->n == 0 ||
+        h->n > SSC_MAX_REC || slot + 1 + h->n > c->nslots || h->lba + h->n > c->size / SSC_BLOCK)
+        return false;
+    ssize_t len = (ssize_t)h->n * SSC_BLOCK;
+    return member_pread(&c->dev, c->wbuf + SSC_BLOCK, len, slot_off(slot + 1)) == len &&
+           rec_crc(h, c->wbuf + SSC_BLOCK, h->n) == h->crc;
+}
+
+/* Rebuild the index from the records between the tail and the end of the
+ * log, which is the first one missing or torn. */
+static void replay(struct ssdcache *c)
+{
+    struct ssc_rec *h = (struct ssc_rec *)c->wbuf;
+    uint64_t pos = c->tail;
+    uint64_t seq = c->tail_seq;
+    uint64_t dirty = 0;
+
+    for (;;)
+    {
+        if (!read_rec(c, pos, seq))
+        {
+            // a record that didn't fit before the end of the log is at slot 0
+            uint64_t wrapped = pos + c->nslots - pos % c->nslots;
+            if (pos % c->nslots == 0 || wrapped + 2 - c->tail > c->nslots || !read_rec(c, wrapped, seq))
+                break;
+            pos = wrapped;
+        }
+        if (pos + 1 + h->n - c->tail > c->nslots)
+            break;
+        for (uint32_t i = 0; i < h->n; i++)
+            index_set(c, h->lba + i, pos % c->nslots + 1 + i, !(h->flags & REC_CLEAN));
+        ring_push(c, pos, h->n, h->flags, now_ns());
+        if (!(h->flags & REC_CLEAN))
+            dirty += h->n;
+        pos += 1 + h->n;
+        seq++;
+    }
+    c->head = pos;
+    c->head_seq = seq;
+    if (c->rec_count > 0)
+        fprintf(stderr, "ssdcache: replayed %lu records, %lu KiB to destage\n", c->rec_count,
+                c->dirty_blocks * SSC_BLOCK >> 10);
+}
+
+struct ssdcache *ssc_create(const char *path, int flags, uint64_t size, int dirty_pct,
+                            const struct ssc_ops *ops, void *ctx)
+{
+    if (size == 0 || size % SSC_BLOCK != 0)
+    {
+        fprintf(stderr, "ssdcache: the array size must be a multiple of %d\n", SSC_BLOCK);
+        return NULL;
+    }
+    struct ssdcache *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+    {
+        fprintf(stderr, "ssdcache: out of memory\n");
+        return NULL;
+    }
+    int r = member_open(&c->dev, path, flags);
+    if (r < 0)
+    {
+        fprintf(stderr, "ssdcache: %s: %s\n", path, strerror(-r));
+        free(c);
+        return NULL;
+    }
+    c->size = size;
+    c->nslots = c->dev.size / SSC_BLOCK - 1;
+    c->ops = *ops;
+    c->ctx = ctx;
+    c->high = c->nslots / 100 * dirty_pct;
+    c->low = c->high / 2;
+    c->started_ns = now_ns();
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&c->lock, NULL);
+    for (int i = 0; i < SSC_EDGE_LOCKS; i++)
+        pthread_mutex_init(&c->edge_locks[i], NULL);
+    pthread_cond_init(&c->work, &attr);
+    pthread_cond_init(&c->destaged, NULL);
+    pthread_condattr_destroy(&attr);
+    if (c->dev.size / SSC_BLOCK < SSC_MIN_SLOTS + 1 || c->nslots >= INDEX_EMPTY)
+    {
+        fprintf(stderr, "ssdcache: %s must hold between %d and 2^32 blocks of %d bytes\n", path, SSC_MIN_SLOTS + 1,
+                SSC_BLOCK);
+        goto fail;
+    }
+
+    uint64_t nbuckets = 1;
+    c->ishift = 64;
+    while (nbuckets < c->nslots * 2)
+    {
+        nbuckets <<= 1;
+        c->ishift--;
+    }
+    c->imask = nbuckets - 1;
+    c->nrecs = c->nslots / 2 + 1; // a record takes two slots at least
+    c->index = malloc(nbuckets * sizeof(*c->index));
+    c->slot_lba = malloc(c->nslots * sizeof(*c->slot_lba));
+    c->recs = malloc(c->nrecs * sizeof(*c->recs));
+    c->wbuf = member_alloc((1 + SSC_MAX_REC) * SSC_BLOCK);
+    c->sbuf = member_alloc(SSC_BLOCK);
+    if (c->index == NULL || c->slot_lba == NULL || c->recs == NULL || c->wbuf == NULL || c->sbuf == NULL)
+    {
+        fprintf(stderr, "ssdcache: out of memory\n");
+        goto fail;
+    }
+    memset(c->index, 0xff, nbuckets * sizeof(*c->index));
+    for (uint64_t s = 0; s < c->nslots; s++)
+        c->slot_lba[s] = SLOT_NONE;
+
+    struct ssc_super *sb = (struct ssc_super *)c->sbuf;
+    if (member_pread(&c->dev, c->sbuf, SSC_BLOCK, 0) != SSC_BLOCK ||
+        memcmp(sb->magic, SSC_MAGIC, sizeof(sb->magic)) != 0)
+    {
+        fprintf(stderr, "ssdcache: formatting %s, %lu KiB of log\n", path, c->nslots * SSC_BLOCK >> 10);
+        c->tail_seq = 1;
+        if ((r = write_super(c, 0, 1)) != 0)
+        {
+            fprintf(stderr, "ssdcache: %s: %s\n", path, strerror(-r));
+            goto fail;
+        }
+    }
+    else if (sb->size != size || sb->nslots != c->nslots || sb->tail >= c->nslots)
+    {
+        fprintf(stderr, "ssdcache: %s caches a different array; wipe its first block to reuse it\n", path);
+        goto fail;
+    }
+    else
+    {
+        c->tail = sb->tail;
+        c->tail_seq = sb->tail_seq;
+    }
+    replay(c);
+
+    if (affinity_background_thread(&c->thread, "ssdcache destage", destage_thread, c) != 0)
+    {
+        fprintf(stderr, "ssdcache: can't start the destage thread\n");
+        goto fail;
+    }
+    c->started = true;
+    return c;
+
+fail:
+    ssc_destroy(c);
+    return NULL;
+}
+
+int ssc_flush(struct ssdcache *c)
+{
+    return member_sync(&c->dev);
+}
+
+int ssc_drain(struct ssdcache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->flushing++;
+    c->error = 0;
+    c->retry_at = 0;
+    pthread_cond_broadcast(&c->work);
+    while ((c->rec_count > 0 || c->destaging) && c->error == 0 && c->started)
+        pthread_cond_wait(&c->destaged, &c->lock);
+    c->flushing--;
+    int err = c->error;
+    c->error = 0;
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+void ssc_report(struct ssdcache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    double secs = (now_ns() - c->started_ns) / 1e9;
+    uint64_t reads = c->read_hits + c->read_partial + c->read_misses;
+    fprintf(stderr, "ssd cache: %lu of %lu KiB of log in use, %lu KiB dirty\n", (c->head - c->tail) * SSC_BLOCK >> 10,
+            c->nslots * SSC_BLOCK >> 10, c->dirty_blocks * SSC_BLOCK >> 10);
+    fprintf(stderr, "ssd cache: reads %lu hit, %lu partial, %lu miss (%.1f%% hit), %lu KiB promoted\n", c->read_hits,
+            c->read_partial, c->read_misses, reads ? 100.0 * c->read_hits / reads : 0.0,
+            c->promoted * SSC_BLOCK >> 10);
+    fprintf(stderr, "ssd cache: %lu writes logged, %lu KiB\n", c->writes, c->written_bytes >> 10);
+    fprintf(stderr, "ssd cache: destaged %lu KiB in %lu batches of %.1f writes, %.1f MiB/s\n",
+            c->destaged_bytes >> 10, c->destage_batches,
+            c->destage_batches ? (double)c->destage_writes / c->destage_batches : 0.0,
+            secs > 0 ? c->destaged_bytes / secs / (1 << 20) : 0.0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void ssc_destroy(struct ssdcache *c)
+{
+    ssc_drain(c);
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->lock);
+    if (c->started)
+        pthread_join(c->thread, NULL);
+    member_close(&c->dev);
+    free(c->index);
+    free(c->slot_lba);
+    free(c->recs);
+    free(c->wbuf);
+    free(c->sbuf);
+    free(c);
+}
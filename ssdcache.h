@@ -0,0 +1,59 @@
+/*
+ * ssdcache - persistent log-structured cache tier for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef SSDCACHE_H_INCLUDED
+#define SSDCACHE_H_INCLUDED
+
+#include <stdint.h>
+
+/* The engine's uncached I/O path. `write` and `sync` are called from the
+ * destage thread, concurrently with `read` from the request path; all return
+ * 0 or -errno. `sync` makes what was written durable. */
+struct ssc_ops
+{
+    int (*read)(void *buf, uint32_t len, uint64_t offset, void *ctx);
+    int (*write)(const void *buf, uint32_t len, uint64_t offset, uint32_t flags, void *ctx);
+    int (*sync)(void *ctx);
+};
+
+struct ssdcache;
+
+/* Cache an array of `size` bytes (a multiple of 4 KiB) on the device or file
+ * `path`, opened with MEMBER_* `flags`. Writes are appended to a log on it in
+ * 4 KiB blocks and destaged to the array in sorted batches once more than
+ * `dirty_pct` percent of the log is in use, or the oldest write has waited
+ * half a minute. A cache already set up for an array of this size is
+ * replayed, so what was not destaged before a crash is not lost; anything
+ * else is formatted. Returns NULL with a message on stderr on failure. */
+struct ssdcache *ssc_create(const char *path, int flags, uint64_t size, int dirty_pct,
+                            const struct ssc_ops *ops, void *ctx);
+
+/* Request path; safe to call from several threads at once, though the
+ * outcome of overlapping requests in flight together is undefined. Each
+ * returns 0 or -errno, and takes its log record buffer from the calling
+ * thread's arena (arena.h). A write with BUSE_WRITE_FUA is durable on the
+ * cache device when it returns. */
+int ssc_read(struct ssdcache *c, void *buf, uint32_t len, uint64_t offset);
+int ssc_write(struct ssdcache *c, const void *buf, uint32_t len, uint64_t offset, uint32_t flags);
+
+/* Make every write acknowledged so far durable on the cache device. Returns
+ * 0 or -errno. */
+int ssc_flush(struct ssdcache *c);
+
+/* Destage everything and wait for it, so the array can be used without the
+ * cache afterwards. Returns 0, or -errno if destaging fails. */
+int ssc_drain(struct ssdcache *c);
+
+/* Print log usage, hit rates and destage throughput to stderr. */
+void ssc_report(struct ssdcache *c);
+
+/* Drain, stop the destage thread and free the cache. */
+void ssc_destroy(struct ssdcache *c);
+
+#endif /* SSDCACHE_H_INCLUDED */
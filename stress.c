@@ -0,0 +1,633 @@
+/*
+ * stress - randomized multi-threaded correctness and throughput test of a
+ * BUSE program over NBD
+ *
+ * Starts the program serving NBD on one end of a socket pair ("fd:N" in
+ * place of the device, as nbdbench does) and drives it from several
+ * threads at once with a random mix of reads, writes (some with FUA),
+ * flushes, trims and zeroing writes. Every thread owns its own interleaved
+ * regions of the device, so requests of different threads share stripes but
+ * never bytes, and an in-memory copy of what the device should hold checks
+ * every read. Trimmed bytes may read back as anything until rewritten. At
+ * the end the whole span is flushed and read back once more.
+ *
+ *     stress [-v] [-t THREADS] [-o OPS] [-s MB] [-r KB] [-m R,W,F,T,Z] [-S SEED]
+ *            [-f PATH@PERCENT] [-N NAME [-b FILE [-p PERCENT] [-u]]] PROGRAM ARG...
+ *
+ * In ARG..., NBD is replaced by the socket, e.g.
+ *
+ *     stress -f d1@30 ./raid4 -k --max-errors=1 --spare=d4 65536 NBD d0 d1 d2 d3
+ *
+ * -f truncates the member file PATH once PERCENT of the operations have
+ * been issued, so the program sees it fail under load (and rebuilds onto a
+ * spare, if it has one) while its results are still being checked.
+ *
+ * The throughput of the run is reported as NAME; with -b it is compared
+ * with NAME's line in the baseline FILE, and the run fails if it is more
+ * than PERCENT (default 20) lower. -u records it as the new baseline.
+ *
+ * Exits 0 if all went well, 1 on a wrong read or failed request and 2 if
+ * the data was right but throughput fell below the baseline.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/nbd.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef NBD_CMD_WRITE_ZEROES
+#define NBD_CMD_WRITE_ZEROES 6
+#endif
+#ifndef NBD_CMD_FLAG_FUA
+#define NBD_CMD_FLAG_FUA (1 << 16)
+#endif
+
+#define SERVER_FD 3 // where the program finds its end of the socket
+#define MAX_THREADS 64
+#define MAX_ARGS 64
+#define MAX_REPORTS 10 // wrong reads reported in full
+
+enum op
+{
+    OP_READ,
+    OP_WRITE,
+    OP_FLUSH,
+    OP_TRIM,
+    OP_ZERO,
+    OP_KINDS
+};
+
+static const char *const op_name[OP_KINDS] = {"read", "write", "flush", "trim", "zero"};
+
+/* A thread's request in flight; the handle of a request is its thread's
+ * index, so the receiver knows where a reply belongs. */
+struct slot
+{
+    pthread_cond_t cond;
+    char *buf; // where a read's data goes
+    uint32_t len;
+    bool read;
+    bool done;
+    uint32_t error;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    char *buf;
+    uint64_t ops[OP_KINDS];
+    uint64_t bytes;
+};
+
+static bool verbose;
+static int sk; // our end of the socket
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slot slots[MAX_THREADS];
+static bool dead; // the connection is gone
+
+// the workload
+static int nthreads = 4;
+static uint64_t total_ops = 20000;
+static uint64_t span = 64 << 20;
+static uint32_t max_req = 128 << 10;
+static unsigned int mix[OP_KINDS] = {60, 30, 2, 4, 4};
+static unsigned int mix_total;
+static uint64_t issued;      // operations handed out so far, across threads
+static bool zero_supported = true;
+
+// what the device should hold: model[] where known[] is set, one flag per sector
+static char *model;
+static uint8_t *known;
+static uint64_t wrong; // reads that didn't match
+static uint64_t failed; // requests that returned an error
+
+static const char *fail_path;
+static uint64_t fail_at = UINT64_MAX;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+    // xorshift64*
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* Hand replies to the threads waiting for them, until the socket closes. */
+static void *receiver(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        struct nbd_reply reply;
+        uint64_t id;
+        if (read_all(sk, &reply, sizeof(reply)) != 0 || ntohl(reply.magic) != NBD_REPLY_MAGIC)
+            break;
+        memcpy(&id, reply.handle, sizeof(id));
+        if (id >= (uint64_t)nthreads)
+            break;
+        struct slot *s = &slots[id];
+        if (s->read && reply.error == 0 && read_all(sk, s->buf, s->len) != 0)
+            break;
+        pthread_mutex_lock(&reply_lock);
+        s->error = ntohl(reply.error);
+        s->done = true;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&reply_lock);
+    }
+    pthread_mutex_lock(&reply_lock);
+    dead = true;
+    for (int i = 0; i < nthreads; i++)
+        pthread_cond_signal(&slots[i].cond);
+    pthread_mutex_unlock(&reply_lock);
+    return NULL;
+}
+
+/* Send a request as thread `id` and wait for its reply. Returns the NBD
+ * error, or -1 if the connection has gone. */
+static int submit(int id, uint32_t type, uint64_t from, uint32_t len, const void *data, char *rbuf)
+{
+    struct slot *s = &slots[id];
+    struct nbd_request req;
+    uint64_t handle = id;
+
+    pthread_mutex_lock(&reply_lock);
+    s->buf = rbuf;
+    s->len = len;
+    s->read = rbuf != NULL;
+    s->done = false;
+    pthread_mutex_unlock(&reply_lock);
+
+    req.magic = htonl(NBD_REQUEST_MAGIC);
+    req.type = htonl(type);
+    memcpy(req.handle, &handle, sizeof(req.handle));
+    req.from = htobe64(from);
+    req.len = htonl(len);
+    pthread_mutex_lock(&send_lock);
+    int r = write_all(sk, &req, sizeof(req));
+    if (r == 0 && data != NULL)
+        r = write_all(sk, data, len);
+    pthread_mutex_unlock(&send_lock);
+
+    pthread_mutex_lock(&reply_lock);
+    while (r == 0 && !s->done && !dead)
+        pthread_cond_wait(&s->cond, &reply_lock);
+    r = r != 0 || !s->done ? -1 : (int)s->error;
+    pthread_mutex_unlock(&reply_lock);
+    return r;
+}
+
+/* Compare what a read returned with the model, sector by sector. */
+static void verify(int id, const char *buf, uint64_t from, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i += 512)
+    {
+        uint64_t sector = (from + i) / 512;
+        if (!known[sector] || memcmp(buf + i, model + from + i, 512) == 0)
+            continue;
+        uint64_t n = __atomic_fetch_add(&wrong, 1, __ATOMIC_RELAXED);
+        if (n < MAX_REPORTS)
+        {
+            size_t at = 0;
+            while (buf[i + at] == model[from + i + at])
+                at++;
+            fprintf(stderr, "thread %d: wrong data at offset %lu (read of %u at %lu): byte %zu is %02x, expected %02x\n",
+                    id, from + i + at, len, from, at, (uint8_t)buf[i + at], (uint8_t)model[from + i + at]);
+        }
+    }
+}
+
+static void request_failed(int id, enum op op, uint64_t from, uint32_t len, int err)
+{
+    if (__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED) < MAX_REPORTS)
+        fprintf(stderr, "thread %d: %s of %u at %lu failed: %s\n", id, op_name[op], len, from,
+                err < 0 ? "connection lost" : strerror(err));
+}
+
+static enum op pick_op(uint64_t *rng)
+{
+    unsigned int r = next_rand(rng) % mix_total;
+    int op = 0;
+    while (r >= mix[op])
+        r -= mix[op++];
+    return op;
+}
+
+/* Run one operation as worker `w`, in one of its own regions. */
+static void run_op(struct worker *w, enum op op)
+{
+    uint64_t regions = span / max_req;
+    uint64_t mine = (regions - w->id + nthreads - 1) / nthreads;
+    uint64_t region = w->id + next_rand(&w->rng) % mine * nthreads;
+    uint32_t sectors = max_req / 512;
+    uint32_t len = 512 * (1 + next_rand(&w->rng) % sectors);
+    uint64_t from = region * max_req + 512 * (next_rand(&w->rng) % (sectors - len / 512 + 1));
+    int err;
+
+    switch (op)
+    {
+    case OP_READ:
+        err = submit(w->id, NBD_CMD_READ, from, len, NULL, w->buf);
+        if (err == 0)
+            verify(w->id, w->buf, from, len);
+        break;
+    case OP_WRITE:
+        for (uint32_t i = 0; i < len; i += 8)
+        {
+            uint64_t v = next_rand(&w->rng);
+            memcpy(w->buf + i, &v, sizeof(v));
+        }
+        err = submit(w->id, NBD_CMD_WRITE | (next_rand(&w->rng) % 8 == 0 ? NBD_CMD_FLAG_FUA : 0), from, len, w->buf,
+                     NULL);
+        memcpy(model + from, w->buf, len);
+        memset(known + from / 512, err == 0, len / 512);
+        break;
+    case OP_FLUSH:
+        from = len = 0;
+        err = submit(w->id, NBD_CMD_FLUSH, 0, 0, NULL, NULL);
+        break;
+    case OP_TRIM:
+        err = submit(w->id, NBD_CMD_TRIM, from, len, NULL, NULL);
+        memset(known + from / 512, 0, len / 512);
+        break;
+    case OP_ZERO:
+        if (!__atomic_load_n(&zero_supported, __ATOMIC_RELAXED))
+        {
+            run_op(w, OP_WRITE);
+            return;
+        }
+        err = submit(w->id, NBD_CMD_WRITE_ZEROES, from, len, NULL, NULL);
+        if (err == EPERM || err == EOPNOTSUPP)
+        {
+            // the program has no write_zeroes; nothing was written
+            __atomic_store_n(&zero_supported, false, __ATOMIC_RELAXED);
+            run_op(w, OP_WRITE);
+            return;
+        }
+        memset(model + from, 0, len);
+        memset(known + from / 512, err == 0, len / 512);
+        break;
+    default:
+        return;
+    }
+    if (err != 0)
+        request_failed(w->id, op, from, len, err);
+    w->ops[op]++;
+    if (op != OP_FLUSH)
+        w->bytes += len;
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    for (;;)
+    {
+        uint64_t n = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+        if (n >= total_ops || __atomic_load_n(&dead, __ATOMIC_RELAXED))
+            break;
+        if (n == fail_at)
+        {
+            if (truncate(fail_path, 0) != 0)
+                fprintf(stderr, "%s: %s\n", fail_path, strerror(errno));
+            else if (verbose)
+                fprintf(stderr, "truncated %s after %lu operations\n", fail_path, n);
+        }
+        run_op(w, pick_op(&w->rng));
+    }
+    return NULL;
+}
+
+/* Flush, then read the whole span back and check it. */
+static void verify_all(struct worker *w)
+{
+    int err = submit(w->id, NBD_CMD_FLUSH, 0, 0, NULL, NULL);
+    if (err != 0)
+        request_failed(w->id, OP_FLUSH, 0, 0, err);
+    for (uint64_t from = 0; from < span && !dead; from += max_req)
+    {
+        err = submit(w->id, NBD_CMD_READ, from, max_req, NULL, w->buf);
+        if (err != 0)
+            request_failed(w->id, OP_READ, from, max_req, err);
+        else
+            verify(w->id, w->buf, from, max_req);
+    }
+}
+
+/* Start the program on our socket pair. */
+static pid_t start(char **args, int nargs)
+{
+    char nbd_arg[16];
+    char *argv[MAX_ARGS + 1];
+    int sp[2];
+
+    snprintf(nbd_arg, sizeof(nbd_arg), "fd:%d", SERVER_FD);
+    for (int i = 0; i < nargs; i++)
+        argv[i] = strcmp(args[i], "NBD") == 0 ? nbd_arg : args[i];
+    argv[nargs] = NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        close(sp[0]);
+        dup2(sp[1], SERVER_FD);
+        if (null >= 0 && !verbose)
+        {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(sp[1]);
+    if (pid < 0)
+        close(sp[0]);
+    sk = sp[0];
+    return pid;
+}
+
+/* The baseline MB/s recorded for `name` in `path`, or a negative value. */
+static double baseline_get(const char *path, const char *name)
+{
+    FILE *f = fopen(path, "r");
+    char line[256], key[128];
+    double mbs = -1, v;
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "%127s %lf", key, &v) == 2 && strcmp(key, name) == 0)
+            mbs = v;
+    }
+    fclose(f);
+    return mbs;
+}
+
+/* Record `mbs` as the baseline for `name`, keeping the other lines. */
+static int baseline_put(const char *path, const char *name, double mbs)
+{
+    char tmp[4096], line[256], key[128];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *in = fopen(path, "r");
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+    {
+        if (in != NULL)
+            fclose(in);
+        return -1;
+    }
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL)
+    {
+        if (sscanf(line, "%127s", key) != 1 || strcmp(key, name) != 0)
+            fputs(line, out);
+    }
+    if (in != NULL)
+        fclose(in);
+    fprintf(out, "%s %.1f\n", name, mbs);
+    if (fclose(out) != 0)
+        return -1;
+    return rename(tmp, path);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = NULL, *baseline = NULL;
+    double tolerance = 20;
+    bool update = false;
+    uint64_t seed = 1;
+    int fail_pct = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+vt:o:s:r:m:S:f:N:b:p:u")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = true;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'o':
+            total_ops = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            span = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'r':
+            max_req = strtoul(optarg, NULL, 10) << 10;
+            break;
+        case 'm':
+        {
+            int n = 0;
+            for (char *c = strtok(optarg, ","); c != NULL && n < OP_KINDS; c = strtok(NULL, ","))
+                mix[n++] = strtoul(c, NULL, 10);
+            while (n < OP_KINDS)
+                mix[n++] = 0;
+            break;
+        }
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+        {
+            char *at = strrchr(optarg, '@');
+            if (at != NULL)
+            {
+                *at = '\0';
+                fail_path = optarg;
+                fail_pct = atoi(at + 1);
+            }
+            break;
+        }
+        case 'N':
+            name = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'p':
+            tolerance = atof(optarg);
+            break;
+        case 'u':
+            update = true;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    for (int i = 0; i < OP_KINDS; i++)
+        mix_total += mix[i];
+    if (optind >= argc || argc - optind > MAX_ARGS || nthreads < 1 || nthreads > MAX_THREADS || max_req == 0 ||
+        max_req % 512 != 0 || max_req > (32U << 20) || span / max_req < (uint64_t)nthreads || mix_total == 0 ||
+        (fail_path != NULL && (fail_pct < 0 || fail_pct > 100)) || (baseline != NULL && name == NULL))
+    {
+        fprintf(stderr,
+                "usage: %s [-v] [-t THREADS] [-o OPS] [-s MB] [-r KB] [-m R,W,F,T,Z] [-S SEED]\n"
+                "          [-f PATH@PERCENT] [-N NAME [-b FILE [-p PERCENT] [-u]]] PROGRAM ARG...\n"
+                "  ARG... may use NBD for the device\n",
+                argv[0]);
+        return 1;
+    }
+    span = span / max_req * max_req;
+    if (fail_path != NULL)
+        fail_at = total_ops * fail_pct / 100;
+    if (name == NULL)
+        name = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+
+    model = malloc(span);
+    known = calloc(span / 512, 1);
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    if (model == NULL || known == NULL || w == NULL)
+    {
+        fprintf(stderr, "can't allocate a model of %lu MiB\n", span >> 20);
+        return 1;
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        w[i].id = i;
+        w[i].rng = (seed + 1) * 0x9e3779b97f4a7c15ULL + i;
+        w[i].buf = malloc(max_req);
+        pthread_cond_init(&slots[i].cond, NULL);
+        if (w[i].buf == NULL)
+            return 1;
+    }
+
+    pid_t pid = start(argv + optind, argc - optind);
+    if (pid < 0)
+    {
+        fprintf(stderr, "can't start %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    pthread_t rx;
+    pthread_create(&rx, NULL, receiver, NULL);
+
+    // a first read returns once the program is serving, whatever it did at startup
+    double secs = 0;
+    if (submit(0, NBD_CMD_READ, 0, 512, NULL, w[0].buf) != 0)
+        fprintf(stderr, "%s didn't start serving\n", argv[optind]);
+    else
+    {
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < nthreads; i++)
+            pthread_create(&w[i].thread, NULL, work, &w[i]);
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(w[i].thread, NULL);
+        secs = (now_ns() - t0) / 1e9;
+        verify_all(&w[0]);
+    }
+
+    pthread_mutex_lock(&send_lock);
+    struct nbd_request req = {.magic = htonl(NBD_REQUEST_MAGIC), .type = htonl(NBD_CMD_DISC)};
+    write_all(sk, &req, sizeof(req));
+    pthread_mutex_unlock(&send_lock);
+    shutdown(sk, SHUT_WR);
+    pthread_join(rx, NULL);
+    close(sk);
+    int status;
+    waitpid(pid, &status, 0);
+    bool exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!exited)
+        fprintf(stderr, "%s exited with status %d\n", argv[optind], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+
+    uint64_t ops[OP_KINDS] = {0}, bytes = 0, all = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        for (int op = 0; op < OP_KINDS; op++)
+            ops[op] += w[i].ops[op];
+        bytes += w[i].bytes;
+    }
+    for (int op = 0; op < OP_KINDS; op++)
+        all += ops[op];
+    if (secs == 0 || !exited || wrong > 0 || failed > 0 || all < total_ops)
+    {
+        fprintf(stderr, "%s: FAILED: %lu of %lu operations done, %lu wrong reads, %lu failed requests\n", name, all,
+                total_ops, wrong, failed);
+        return 1;
+    }
+
+    double mbs = bytes / 1e6 / secs;
+    printf("%s: %lu ops (%lu read, %lu write, %lu flush, %lu trim, %lu zero) from %d threads, %.0f ops/s, %.1f MB/s\n",
+           name, all, ops[OP_READ], ops[OP_WRITE], ops[OP_FLUSH], ops[OP_TRIM], ops[OP_ZERO], nthreads, all / secs, mbs);
+    if (baseline == NULL)
+        return 0;
+    double base = baseline_get(baseline, name);
+    if (update)
+    {
+        if (baseline_put(baseline, name, mbs) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", baseline, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    if (base <= 0)
+    {
+        printf("%s: no baseline in %s yet\n", name, baseline);
+        return 0;
+    }
+    double change = (mbs - base) / base * 100;
+    if (change < -tolerance)
+    {
+        printf("%s: REGRESSION: %.1f MB/s is %.0f%% below the baseline of %.1f MB/s\n", name, mbs, -change, base);
+        return 2;
+    }
+    printf("%s: %+.0f%% against the baseline of %.1f MB/s\n", name, change, base);
+    return 0;
+}
@@ -0,0 +1,156 @@
+#!/usr/bin/env bash
+# Run the standard benchmark suite with nbdbench over every engine, on
+# member files in tmpfs, and write the results with a description of the
+# host to a JSON file. Needs neither root nor nbd.
+#
+#   test/bench.sh [OUTPUT]    (default bench.json)
+#
+# Each engine is measured healthy and, where it has redundancy, degraded,
+# with 4 KiB random and 1 MiB sequential writes then reads, plus the time
+# taken to initialize parity (-i) and to rebuild a device ('+') at startup.
+# BENCH_DIR, BENCH_MEMBER_MB, BENCH_SEQ_MB, BENCH_RAND_MB and BENCH_CHUNK
+# change where and how much.
+set -e -o pipefail
+
+OUT=${1:-bench.json}
+DIR=${BENCH_DIR:-/dev/shm/buse-bench}
+MEMBER_MB=${BENCH_MEMBER_MB:-128}
+SEQ_MB=${BENCH_SEQ_MB:-128}
+RAND_MB=${BENCH_RAND_MB:-32}
+CHUNK=${BENCH_CHUNK:-65536}
+
+mkdir -p "$DIR"
+function cleanup () {
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+D0=$DIR/d0 D1=$DIR/d1 D2=$DIR/d2 D3=$DIR/d3 D4=$DIR/d4 D5=$DIR/d5
+
+# fresh member files; all zeros, so parity is consistent even without -i
+function members () {
+	rm -f "$DIR"/d*
+	for d in "$D0" "$D1" "$D2" "$D3" "$D4" "$D5"; do
+		truncate -s "${MEMBER_MB}M" "$d"
+	done
+}
+
+function json_string () {
+	printf '"%s"' "$(printf '%s' "$1" | sed 's/\\/\\\\/g; s/"/\\"/g')"
+}
+
+RESULTS=()
+FAILED=0
+
+# bench NBDBENCH-OPTION... -- PROGRAM ARG...
+# Prints the result line: chunk, write MB/s, read MB/s, startup seconds.
+function bench () {
+	local opts=()
+	while [ "$1" != "--" ]; do
+		opts+=("$1")
+		shift
+	done
+	shift
+	members
+	nbdbench -c "$CHUNK" "${opts[@]}" "$@" | tail -n 1
+}
+
+# io ENGINE STATE PROGRAM ARG...: random 4 KiB and sequential 1 MiB passes
+function io () {
+	local engine=$1 state=$2
+	shift 2
+	local line
+	for workload in rand4k seq1m; do
+		if [ $workload = rand4k ]; then
+			line=$(bench -R -s "$RAND_MB" -r 4 -q 16 -- "$@") || line=""
+		else
+			line=$(bench -s "$SEQ_MB" -r 1024 -q 4 -- "$@") || line=""
+		fi
+		if [ -z "$line" ]; then
+			echo "$engine $state $workload: FAILED" >&2
+			FAILED=1
+			continue
+		fi
+		read -r _ wr rd _ <<< "$line"
+		echo "$engine $state $workload: write $wr MB/s, read $rd MB/s" >&2
+		local size=1048576
+		[ $workload = rand4k ] && size=4096
+		RESULTS+=("$(awk -v e="$engine" -v s="$state" -v w="$workload" -v wr="$wr" -v rd="$rd" -v size=$size 'BEGIN {
+			printf "{\"engine\": \"%s\", \"state\": \"%s\", \"workload\": \"%s\", \"write_mbs\": %s, \"read_mbs\": %s, \"write_iops\": %.0f, \"read_iops\": %.0f}",
+				e, s, w, wr, rd, wr * 1e6 / size, rd * 1e6 / size }')")
+	done
+}
+
+# startup ENGINE WORKLOAD BYTES PROGRAM ARG...: MB/s of the BYTES written
+# before the program starts serving
+function startup () {
+	local engine=$1 workload=$2 bytes=$3
+	shift 3
+	local line
+	line=$(bench -s 1 -r 1024 -q 1 -- "$@") || line=""
+	if [ -z "$line" ]; then
+		echo "$engine $workload: FAILED" >&2
+		FAILED=1
+		return
+	fi
+	read -r _ _ _ secs <<< "$line"
+	local mbs
+	mbs=$(awk -v b="$bytes" -v s="$secs" 'BEGIN { printf "%.0f", b / 1e6 / s }')
+	echo "$engine $workload: $secs s, $mbs MB/s" >&2
+	RESULTS+=("$(printf '{"engine": "%s", "state": "healthy", "workload": "%s", "seconds": %s, "mbs": %s}' \
+		"$engine" "$workload" "$secs" "$mbs")")
+}
+
+MEMBER=$((MEMBER_MB << 20))
+
+io busexmp healthy busexmp "${MEMBER_MB}M" NBD
+io loopback healthy loopback "$D0" NBD
+io raid0 healthy raid0 CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+io raid1 healthy raid1 4096 NBD "$D0" "$D1"
+io raid1 degraded raid1 4096 NBD "$D0" MISSING
+startup raid1 rebuild $MEMBER raid1 4096 NBD "$D0" "+$D1"
+io raid4 healthy raid4 CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+io raid4 degraded raid4 CHUNK NBD "$D0" MISSING "$D2" "$D3"
+startup raid4 init $((MEMBER * 4)) raid4 -i CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+startup raid4 rebuild $MEMBER raid4 CHUNK NBD "$D0" "+$D1" "$D2" "$D3"
+io raidec healthy raidec CHUNK NBD "$D0" "$D1" "$D2" "$D3" "$D4" "$D5"
+io raidec degraded raidec CHUNK NBD "$D0" MISSING "$D2" "$D3" MISSING "$D5"
+startup raidec init $((MEMBER * 6)) raidec -i CHUNK NBD "$D0" "$D1" "$D2" "$D3" "$D4" "$D5"
+startup raidec rebuild $MEMBER raidec CHUNK NBD "$D0" "+$D1" "$D2" "$D3" "$D4" "$D5"
+
+COMMIT=$(git rev-parse HEAD 2> /dev/null || echo unknown)
+DIRTY=false
+[ -n "$(git status --porcelain --untracked-files=no 2> /dev/null)" ] && DIRTY=true
+CPU=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo | head -n 1)
+MEMORY_KB=$(sed -n 's/^MemTotal:[[:space:]]*\([0-9]*\) kB/\1/p' /proc/meminfo)
+GOVERNOR=$(cat /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor 2> /dev/null || echo unknown)
+
+{
+	echo "{"
+	echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+	echo "  \"commit\": \"$COMMIT\","
+	echo "  \"dirty\": $DIRTY,"
+	echo "  \"host\": {"
+	echo "    \"hostname\": $(json_string "$(uname -n)"),"
+	echo "    \"kernel\": $(json_string "$(uname -sr)"),"
+	echo "    \"arch\": $(json_string "$(uname -m)"),"
+	echo "    \"cpu\": $(json_string "${CPU:-unknown}"),"
+	echo "    \"cpus\": $(nproc),"
+	echo "    \"numa_nodes\": $(ls -d /sys/devices/system/node/node[0-9]* 2> /dev/null | wc -l),"
+	echo "    \"governor\": $(json_string "$GOVERNOR"),"
+	echo "    \"memory_kb\": ${MEMORY_KB:-0},"
+	echo "    \"compiler\": $(json_string "$(${CC:-cc} --version 2> /dev/null | head -n 1)")"
+	echo "  },"
+	echo "  \"config\": {\"member_mb\": $MEMBER_MB, \"seq_mb\": $SEQ_MB, \"rand_mb\": $RAND_MB, \"chunk\": $CHUNK, \"dir\": $(json_string "$DIR")},"
+	echo "  \"results\": ["
+	for i in "${!RESULTS[@]}"; do
+		sep=,
+		[ "$i" -eq $((${#RESULTS[@]} - 1)) ] && sep=
+		echo "    ${RESULTS[$i]}$sep"
+	done
+	echo "  ]"
+	echo "}"
+} > "$OUT"
+echo "results written to $OUT" >&2
+
+exit $FAILED
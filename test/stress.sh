@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+# Run the stress tester over every engine, healthy, degraded and losing a
+# device under load, on member files in tmpfs. Needs neither root nor nbd.
+#
+#   test/stress.sh [STRESS-OPTION...]
+#
+# Options are passed on to stress, e.g. -u to record this machine's
+# throughput as the baseline, or -p 10 to fail on a 10% drop (the default
+# here is 30%, as a run is short and tmpfs noisy). The baseline
+# lives in $STRESS_BASELINE (default stress-baseline.txt).
+set -e
+
+DIR=${STRESS_DIR:-/dev/shm/buse-stress}
+BASELINE=${STRESS_BASELINE:-stress-baseline.txt}
+SIZE=80M
+CHUNK=65536
+
+mkdir -p "$DIR"
+function cleanup () {
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+D0=$DIR/d0 D1=$DIR/d1 D2=$DIR/d2 D3=$DIR/d3 D4=$DIR/d4 D5=$DIR/d5
+
+# fresh member files; all zeros, so parity is consistent even without -i
+function members () {
+	rm -f "$DIR"/d*
+	for d in "$D0" "$D1" "$D2" "$D3" "$D4" "$D5"; do
+		truncate -s "$SIZE" "$d"
+	done
+}
+
+FAILED=0
+# run NAME [STRESS-OPTION...] -- PROGRAM ARG...
+function run () {
+	local name=$1
+	shift
+	local opts=()
+	while [ "$1" != "--" ]; do
+		opts+=("$1")
+		shift
+	done
+	shift
+	members
+	set +e
+	timeout 600 stress -N "$name" -b "$BASELINE" -p 30 "${opts[@]}" "${STRESS_OPTS[@]}" "$@"
+	local status=$?
+	set -e
+	if [ $status -ne 0 ]; then
+		echo "$name: exit status $status"
+		FAILED=1
+	fi
+}
+
+STRESS_OPTS=("$@")
+
+run busexmp -- busexmp 64M NBD
+run loopback -- loopback "$D0" NBD
+run raid0 -t 8 -- raid0 $CHUNK NBD "$D0" "$D1" "$D2"
+run raid1 -- raid1 4096 NBD "$D0" "$D1"
+run raid1-degraded -- raid1 4096 NBD "$D0" MISSING
+# a device is lost under load and rebuilt onto the spare while the load goes
+# on; a truncated file reads back zeros, so only checksums can catch it
+run raid1-rebuild -f "$D1@30" -- raid1 -k --format-checksums --max-errors=1 --spare="$D2" 4096 NBD "$D0" "$D1"
+run raid4 -- raid4 -i $CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+run raid4-degraded -- raid4 $CHUNK NBD "$D0" MISSING "$D2" "$D3"
+run raid4-rebuild -f "$D1@30" -- raid4 -i -k --max-errors=1 --spare="$D4" $CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+run raidec -- raidec -i $CHUNK NBD "$D0" "$D1" "$D2" "$D3" "$D4" "$D5"
+run raidec-degraded -- raidec $CHUNK NBD "$D0" MISSING "$D2" "$D3" MISSING "$D5"
+# requests served by several threads at once
+run raid0-workers -t 8 -- raid0 --workers=4 $CHUNK NBD "$D0" "$D1" "$D2"
+run raid1-workers -t 8 -- raid1 --workers=4 4096 NBD "$D0" "$D1"
+# 1K regions: threads read checksum units other threads are writing
+run raid1-csum-workers -t 8 -r 1 -- raid1 -k --format-checksums --workers=4 4096 NBD "$D0" "$D1"
+run raid4-workers -t 8 -- raid4 -i --workers=4 $CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+run raid4-workers-rebuild -t 8 -f "$D1@30" -- raid4 -i -k --workers=4 --max-errors=1 --spare="$D4" $CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+run raidec-workers -t 8 -- raidec -i --workers=4 $CHUNK NBD "$D0" "$D1" "$D2" "$D3" "$D4" "$D5"
+# a small write-back cache, so lines are destaged and evicted under the readers
+run raid0-cache-workers -t 8 -- raid0 -c 2 --workers=4 $CHUNK NBD "$D0" "$D1" "$D2"
+run raid4-cache-workers -t 8 -- raid4 -i -c 2 --workers=4 $CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+run raid4-ssd-workers -t 8 -- raid4 -i --workers=4 --ssd-cache="$D5" $CHUNK NBD "$D0" "$D1" "$D2" "$D3"
+
+exit $FAILED
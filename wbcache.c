@@ -0,0 +1,672 @@
+/*
+ * wbcache - bounded write-back stripe cache for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "affinity.h"
+#include "buse.h"
+#include "member.h"
+#include "wbcache.h"
+
+#define SECTOR 512
+#define WBC_EXPIRE_NS (5ULL * 1000000000) // destage lines dirty for longer than this
+#define WBC_MAX_THREADS 16
+
+enum
+{
+    LINE_FREE,
+    LINE_CLEAN,     // on the LRU list; may be evicted
+    LINE_DIRTY,     // on the dirty list, oldest first
+    LINE_DESTAGING, // being written by a destage thread; on no list
+};
+
+/* One cached stripe. Only sectors marked valid hold data; dirty ones have not
+ * been written to the members yet. A pinned line is not evicted, and a busy
+ * one is being filled or written through by a writer that dropped the lock,
+ * so other writers wait for it. */
+struct wbc_line
+{
+    uint64_t stripe;
+    char *buf;
+    uint64_t *valid;
+    uint64_t *dirty;
+    uint32_t ndirty;  // dirty sectors
+    int state;
+    uint32_t pins;    // readers between their overlays
+    bool busy;
+    uint64_t dirtied; // when the line last went from clean to dirty
+    struct wbc_line *hnext;
+    struct wbc_line *prev;
+    struct wbc_line *next;
+};
+
+struct wbc_list
+{
+    struct wbc_line *first;
+    struct wbc_line *last;
+};
+
+struct wbcache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // destage threads wait here
+    pthread_cond_t destaged; // writers and flushers wait here
+    pthread_t threads[WBC_MAX_THREADS];
+    int nthreads;
+    bool stop;
+
+    uint64_t stripe_size;
+    uint64_t nstripes;
+    uint32_t nsect;  // sectors per line
+    uint32_t nwords; // bitmap words per line
+    size_t high;     // start destaging above this many dirty bytes...
+    size_t low;      // ...and keep going down to this many
+    struct wbc_ops ops;
+    void *ctx;
+
+    struct wbc_line *lines;
+    uint32_t nlines;
+    struct wbc_line **hash;
+    uint64_t hmask;
+    struct wbc_line *free;
+    struct wbc_list lru;
+    struct wbc_list dirty;
+    size_t dirty_bytes;
+    uint32_t used;      // lines holding data
+    int destaging;      // lines being written
+    int flushing;       // flushers waiting for the dirty list to drain
+    int starved;        // writers waiting for a line
+    bool draining;      // above the high watermark, not yet back to low
+    int error;          // first destage error since the last flush
+
+    uint64_t started;
+    uint64_t write_hits; // writes absorbed into a line already cached
+    uint64_t write_misses;
+    uint64_t read_hits;  // reads served entirely from the cache
+    uint64_t read_partial;
+    uint64_t read_misses;
+    uint64_t destage_writes;
+    uint64_t destage_full; // of which covered a whole stripe
+    uint64_t destaged_bytes;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline bool bit_test(const uint64_t *map, uint32_t i)
+{
+    return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t *map, uint32_t i)
+{
+    map[i / 64] |= 1ULL << (i % 64);
+}
+
+static void list_remove(struct wbc_list *l, struct wbc_line *line)
+{
+    if (line->prev != NULL)
+        line->prev->next = line->next;
+    else
+        l->first = line->next;
+    if (line->next != NULL)
+        line->next->prev = line->prev;
+    else
+        l->last = line->prev;
+    line->prev = line->next = NULL;
+}
+
+static void list_append(struct wbc_list *l, struct wbc_line *line)
+{
+    line->next = NULL;
+    line->prev = l->last;
+    if (l->last != NULL)
+        l->last->next = line;
+    else
+        l->first = line;
+    l->last = line;
+}
+
+static struct wbc_line *lookup(struct wbcache *c, uint64_t stripe)
+{
+    struct wbc_line *line = c->hash[stripe & c->hmask];
+    while (line != NULL && line->stripe != stripe)
+        line = line->hnext;
+    return line;
+}
+
+static void unhash(struct wbcache *c, struct wbc_line *line)
+{
+    struct wbc_line **p = &c->hash[line->stripe & c->hmask];
+    while (*p != line)
+        p = &(*p)->hnext;
+    *p = line->hnext;
+}
+
+static bool need_destage(struct wbcache *c)
+{
+    struct wbc_line *oldest = c->dirty.first;
+    if (oldest == NULL)
+        return false;
+    return c->flushing > 0 || c->starved > 0 || c->draining || now_ns() - oldest->dirtied > WBC_EXPIRE_NS;
+}
+
+/* Write the dirty sectors of the oldest dirty line, one member write per run
+ * of adjacent sectors. Called with the lock held; drops it around the I/O. */
+static void destage_one(struct wbcache *c, uint64_t *snap)
+{
+    struct wbc_line *line = c->dirty.first;
+    list_remove(&c->dirty, line);
+    line->state = LINE_DESTAGING;
+    memcpy(snap, line->dirty, c->nwords * sizeof(*snap));
+    memset(line->dirty, 0, c->nwords * sizeof(*snap));
+    c->dirty_bytes -= (size_t)line->ndirty * SECTOR;
+    line->ndirty = 0;
+    if (c->dirty_bytes <= c->low)
+        c->draining = false;
+    c->destaging++;
+    pthread_mutex_unlock(&c->lock);
+
+    uint64_t base = line->stripe * c->stripe_size;
+    uint64_t writes = 0, bytes = 0, full = 0;
+    int err = 0;
+    uint32_t s = 0;
+    while (s < c->nsect && err == 0)
+    {
+        if (!bit_test(snap, s))
+        {
+            s++;
+            continue;
+        }
+        uint32_t e = s;
+        while (e < c->nsect && bit_test(snap, e))
+            e++;
+        uint32_t len = (e - s) * SECTOR;
+        err = c->ops.write(line->buf + (uint64_t)s * SECTOR, len, base + (uint64_t)s * SECTOR, 0, c->ctx);
+        writes++;
+        bytes += len;
+        if (s == 0 && e == c->nsect)
+            full++;
+        s = e;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (err != 0)
+    {
+        fprintf(stderr, "wbcache: destage of stripe %lu failed: %s\n", line->stripe, strerror(-err));
+        if (c->error == 0)
+            c->error = err;
+    }
+    c->destage_writes += writes;
+    c->destage_full += full;
+    c->destaged_bytes += bytes;
+    c->destaging--;
+    line->state = LINE_CLEAN;
+    list_append(&c->lru, line);
+    pthread_cond_broadcast(&c->destaged);
+}
+
+static void *destage_thread(void *arg)
+{
+    struct wbcache *c = arg;
+    uint64_t *snap = malloc(c->nwords * sizeof(*snap));
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop)
+    {
+        if (snap != NULL && need_destage(c))
+        {
+            destage_one(c, snap);
+            continue;
+        }
+        // wake up now and then to notice lines that have aged out
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&c->work, &c->lock, &ts);
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(snap);
+    return NULL;
+}
+
+struct wbcache *wbc_create(uint64_t stripe_size, uint64_t nstripes, size_t capacity,
+                           int dirty_pct, int nthreads, const struct wbc_ops *ops, void *ctx)
+{
+    if (stripe_size == 0 || stripe_size % SECTOR != 0 || nthreads < 1)
+        return NULL;
+    struct wbcache *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    c->stripe_size = stripe_size;
+    c->nstripes = nstripes;
+    c->nsect = stripe_size / SECTOR;
+    c->nwords = (c->nsect + 63) / 64;
+    c->ops = *ops;
+    c->ctx = ctx;
+    c->nlines = capacity / stripe_size > 0 ? capacity / stripe_size : 1;
+    c->high = (size_t)c->nlines * stripe_size / 100 * dirty_pct;
+    c->low = c->high / 2;
+    c->started = now_ns();
+
+    uint64_t nbuckets = 1;
+    while (nbuckets < (uint64_t)c->nlines * 2)
+        nbuckets <<= 1;
+    c->hmask = nbuckets - 1;
+    c->hash = calloc(nbuckets, sizeof(*c->hash));
+    c->lines = calloc(c->nlines, sizeof(*c->lines));
+    if (c->hash == NULL || c->lines == NULL)
+        goto fail;
+    for (uint32_t i = 0; i < c->nlines; i++)
+    {
+        // buffers are allocated on first use
+        c->lines[i].next = c->free;
+        c->free = &c->lines[i];
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, &attr);
+    pthread_cond_init(&c->destaged, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if (nthreads > WBC_MAX_THREADS)
+        nthreads = WBC_MAX_THREADS;
+    for (; c->nthreads < nthreads; c->nthreads++)
+    {
+        if (affinity_background_thread(&c->threads[c->nthreads], "wbcache destage", destage_thread, c) != 0)
+        {
+            wbc_destroy(c);
+            return NULL;
+        }
+    }
+    return c;
+
+fail:
+    free(c->hash);
+    free(c->lines);
+    free(c);
+    return NULL;
+}
+
+/* The least recently used clean line no reader or writer holds on to. */
+static struct wbc_line *evictable(struct wbcache *c)
+{
+    struct wbc_line *line = c->lru.first;
+    while (line != NULL && (line->pins > 0 || line->busy))
+        line = line->next;
+    return line;
+}
+
+/* Find or make the line for `stripe`, waiting out a destage in progress and,
+ * if the cache is full of dirty data, for a line to become clean. Called
+ * with the lock held. */
+static struct wbc_line *line_get(struct wbcache *c, uint64_t stripe)
+{
+    for (;;)
+    {
+        struct wbc_line *line = lookup(c, stripe);
+        if (line != NULL && (line->state == LINE_DESTAGING || line->busy))
+        {
+            pthread_cond_wait(&c->destaged, &c->lock);
+            continue;
+        }
+        if (line != NULL)
+        {
+            c->write_hits++;
+            return line;
+        }
+
+        line = c->free;
+        if (line != NULL)
+        {
+            if (line->buf == NULL)
+            {
+                line->buf = member_alloc(c->stripe_size);
+                line->valid = malloc(2 * c->nwords * sizeof(uint64_t));
+                if (line->buf == NULL || line->valid == NULL)
+                {
+                    free(line->buf);
+                    free(line->valid);
+                    line->buf = NULL;
+                    line->valid = NULL;
+                    return NULL;
+                }
+                line->dirty = line->valid + c->nwords;
+            }
+            c->free = line->next;
+            c->used++;
+        }
+        else if ((line = evictable(c)) != NULL)
+        {
+            list_remove(&c->lru, line);
+            unhash(c, line);
+        }
+        else
+        {
+            c->starved++;
+            pthread_cond_broadcast(&c->work);
+            pthread_cond_wait(&c->destaged, &c->lock);
+            c->starved--;
+            continue;
+        }
+
+        line->stripe = stripe;
+        line->state = LINE_CLEAN;
+        line->ndirty = 0;
+        line->pins = 0;
+        line->busy = false;
+        memset(line->valid, 0, 2 * c->nwords * sizeof(uint64_t));
+        line->hnext = c->hash[stripe & c->hmask];
+        c->hash[stripe & c->hmask] = line;
+        list_append(&c->lru, line);
+        c->write_misses++;
+        return line;
+    }
+}
+
+/* After a write-through, the sectors it fully covered are clean again unless
+ * a destage has them. Called with the lock held. */
+static void mark_clean(struct wbcache *c, uint32_t len, uint64_t offset)
+{
+    uint32_t done = 0;
+    while (done < len)
+    {
+        uint64_t pos = offset + done;
+        uint32_t in = pos % c->stripe_size;
+        uint32_t n = len - done < c->stripe_size - in ? len - done : c->stripe_size - in;
+        struct wbc_line *line = lookup(c, pos / c->stripe_size);
+        if (line != NULL && line->state == LINE_DIRTY)
+        {
+            for (uint32_t s = (in + SECTOR - 1) / SECTOR; (s + 1) * SECTOR <= in + n; s++)
+            {
+                if (bit_test(line->dirty, s))
+                {
+                    line->dirty[s / 64] &= ~(1ULL << (s % 64));
+                    line->ndirty--;
+                    c->dirty_bytes -= SECTOR;
+                }
+            }
+            if (line->ndirty == 0)
+            {
+                list_remove(&c->dirty, line);
+                list_append(&c->lru, line);
+                line->state = LINE_CLEAN;
+            }
+        }
+        done += n;
+    }
+}
+
+/* Mark `line` busy and drop the lock, so a writer can do I/O for it while
+ * other writers of its stripe wait and it can't be evicted. */
+static void line_hold(struct wbcache *c, struct wbc_line *line)
+{
+    line->busy = true;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void line_release(struct wbcache *c, struct wbc_line *line)
+{
+    pthread_mutex_lock(&c->lock);
+    line->busy = false;
+    pthread_cond_broadcast(&c->destaged);
+}
+
+int wbc_write(struct wbcache *c, const void *buf, uint32_t len, uint64_t offset, uint32_t flags)
+{
+    int err = 0;
+    uint32_t done = 0;
+
+    pthread_mutex_lock(&c->lock);
+    while (done < len && err == 0)
+    {
+        uint64_t pos = offset + done;
+        uint64_t stripe = pos / c->stripe_size;
+        uint32_t in = pos % c->stripe_size;
+        uint32_t n = len - done < c->stripe_size - in ? len - done : c->stripe_size - in;
+        struct wbc_line *line = line_get(c, stripe);
+        if (line == NULL)
+        {
+            err = -ENOMEM;
+            break;
+        }
+
+        // sectors the write only partly covers must be read in first; an
+        // invalid sector is neither read from the cache nor destaged, so
+        // it can be filled without the lock
+        uint32_t first = in / SECTOR;
+        uint32_t last = (in + n - 1) / SECTOR;
+        uint32_t edges[2] = {first, last};
+        for (int k = 0; k < 2 && err == 0; k++)
+        {
+            uint32_t s = edges[k];
+            bool covered = in <= s * SECTOR && in + n >= (s + 1) * SECTOR;
+            if (!covered && !bit_test(line->valid, s))
+            {
+                line_hold(c, line);
+                err = c->ops.read(line->buf + (uint64_t)s * SECTOR, SECTOR,
+                                  stripe * c->stripe_size + (uint64_t)s * SECTOR, c->ctx);
+                line_release(c, line);
+                if (err == 0)
+                    bit_set(line->valid, s);
+            }
+        }
+        if (err != 0)
+            break;
+
+        memcpy(line->buf + in, (const char *)buf + done, n);
+        for (uint32_t s = first; s <= last; s++)
+        {
+            bit_set(line->valid, s);
+            if (!bit_test(line->dirty, s))
+            {
+                bit_set(line->dirty, s);
+                line->ndirty++;
+                c->dirty_bytes += SECTOR;
+            }
+        }
+        if (line->state == LINE_CLEAN)
+        {
+            list_remove(&c->lru, line);
+            list_append(&c->dirty, line);
+            line->state = LINE_DIRTY;
+            line->dirtied = now_ns();
+        }
+        if (flags & BUSE_WRITE_FUA)
+        {
+            // write through, one stripe at a time so no writer holds more
+            // than one line; the cached copy stays for reads, and no other
+            // write can land in it before its sectors are marked clean
+            line_hold(c, line);
+            err = c->ops.write((const char *)buf + done, n, pos, flags, c->ctx);
+            line_release(c, line);
+            if (err == 0)
+                mark_clean(c, n, pos);
+        }
+        done += n;
+    }
+    if (c->dirty_bytes > c->high && !c->draining)
+    {
+        c->draining = true;
+        pthread_cond_broadcast(&c->work);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+/* Copy the valid sectors of `line` within [in, in + n) to `out`; returns the
+ * number of bytes that were valid. Called with the lock held. */
+static uint32_t copy_valid(struct wbc_line *line, char *out, uint32_t in, uint32_t n)
+{
+    uint32_t copied = 0;
+    for (uint32_t s = in / SECTOR; s <= (in + n - 1) / SECTOR; s++)
+    {
+        if (!bit_test(line->valid, s))
+            continue;
+        uint32_t lo = s * SECTOR > in ? s * SECTOR : in;
+        uint32_t hi = (s + 1) * SECTOR < in + n ? (s + 1) * SECTOR : in + n;
+        memcpy(out + (lo - in), line->buf + lo, hi - lo);
+        copied += hi - lo;
+    }
+    return copied;
+}
+
+/* Overlay cached data on `buf`. Returns how many bytes came from the cache. */
+static uint64_t overlay(struct wbcache *c, char *buf, uint32_t len, uint64_t offset)
+{
+    uint64_t copied = 0;
+    uint32_t done = 0;
+    while (done < len)
+    {
+        uint64_t pos = offset + done;
+        uint32_t in = pos % c->stripe_size;
+        uint32_t n = len - done < c->stripe_size - in ? len - done : c->stripe_size - in;
+        struct wbc_line *line = lookup(c, pos / c->stripe_size);
+        if (line != NULL)
+        {
+            copied += copy_valid(line, buf + done, in, n);
+            if (line->state == LINE_CLEAN)
+            {
+                list_remove(&c->lru, line);
+                list_append(&c->lru, line);
+            }
+        }
+        done += n;
+    }
+    return copied;
+}
+
+/* Pin the lines cached in [offset, offset + len) and note them in `held`;
+ * returns how many. Called with the lock held. */
+static uint32_t pin_lines(struct wbcache *c, struct wbc_line **held, uint32_t len, uint64_t offset)
+{
+    uint32_t nheld = 0;
+    for (uint64_t s = offset / c->stripe_size; s <= (offset + len - 1) / c->stripe_size; s++)
+    {
+        struct wbc_line *line = lookup(c, s);
+        if (line != NULL)
+        {
+            line->pins++;
+            held[nheld++] = line;
+        }
+    }
+    return nheld;
+}
+
+static void unpin_lines(struct wbcache *c, struct wbc_line **held, uint32_t nheld)
+{
+    for (uint32_t i = 0; i < nheld; i++)
+        held[i]->pins--;
+    if (nheld > 0 && c->starved > 0)
+        pthread_cond_broadcast(&c->destaged);
+}
+
+int wbc_read(struct wbcache *c, void *buf, uint32_t len, uint64_t offset)
+{
+    if (len == 0)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    if (overlay(c, buf, len, offset) == len)
+    {
+        c->read_hits++;
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    // Lines cached now are pinned until the uncached read below has been
+    // overlaid, so a destage can't write one back and have it evicted in
+    // between, leaving us with what the members held before.
+    uint64_t nstripes = (offset + len - 1) / c->stripe_size - offset / c->stripe_size + 1;
+    struct wbc_line **held = malloc(nstripes * sizeof(*held));
+    if (held == NULL)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return -ENOMEM;
+    }
+    uint32_t nheld = pin_lines(c, held, len, offset);
+    pthread_mutex_unlock(&c->lock);
+
+    int err = c->ops.read(buf, len, offset, c->ctx);
+
+    pthread_mutex_lock(&c->lock);
+    if (err == 0 && overlay(c, buf, len, offset) > 0)
+        c->read_partial++;
+    else if (err == 0)
+        c->read_misses++;
+    unpin_lines(c, held, nheld);
+    pthread_mutex_unlock(&c->lock);
+    free(held);
+    return err;
+}
+
+int wbc_flush(struct wbcache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->flushing++;
+    pthread_cond_broadcast(&c->work);
+    while (c->dirty.first != NULL || c->destaging > 0)
+        pthread_cond_wait(&c->destaged, &c->lock);
+    c->flushing--;
+    int err = c->error;
+    c->error = 0;
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+void wbc_report(struct wbcache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    double secs = (now_ns() - c->started) / 1e9;
+    uint64_t writes = c->write_hits + c->write_misses;
+    uint64_t reads = c->read_hits + c->read_partial + c->read_misses;
+    fprintf(stderr, "write-back cache: %lu of %lu KiB used, %zu KiB dirty\n",
+            (uint64_t)c->used * c->stripe_size >> 10, (uint64_t)c->nlines * c->stripe_size >> 10, c->dirty_bytes >> 10);
+    fprintf(stderr, "write-back cache: writes %lu absorbed into cached stripes, %lu new (%.1f%% hit)\n",
+            c->write_hits, c->write_misses, writes ? 100.0 * c->write_hits / writes : 0.0);
+    fprintf(stderr, "write-back cache: reads %lu hit, %lu partial, %lu miss (%.1f%% hit)\n",
+            c->read_hits, c->read_partial, c->read_misses, reads ? 100.0 * c->read_hits / reads : 0.0);
+    fprintf(stderr, "write-back cache: destaged %lu KiB in %lu writes (%lu full stripes), %.1f MiB/s\n",
+            c->destaged_bytes >> 10, c->destage_writes, c->destage_full,
+            secs > 0 ? c->destaged_bytes / secs / (1 << 20) : 0.0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void wbc_destroy(struct wbcache *c)
+{
+    wbc_flush(c);
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->lock);
+    for (int i = 0; i < c->nthreads; i++)
+        pthread_join(c->threads[i], NULL);
+    for (uint32_t i = 0; i < c->nlines; i++)
+    {
+        free(c->lines[i].buf);
+        free(c->lines[i].valid);
+    }
+    free(c->hash);
+    free(c->lines);
+    free(c);
+}
@@ -0,0 +1,51 @@
+/*
+ * wbcache - bounded write-back stripe cache for BUSE RAIDs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef WBCACHE_H_INCLUDED
+#define WBCACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The engine's uncached I/O path. `write` is called from the destage threads,
+ * concurrently with `read` from the request path; both return 0 or -errno.
+ * `flags` are BUSE_WRITE_* flags. */
+struct wbc_ops
+{
+    int (*read)(void *buf, uint32_t len, uint64_t offset, void *ctx);
+    int (*write)(const void *buf, uint32_t len, uint64_t offset, uint32_t flags, void *ctx);
+};
+
+struct wbcache;
+
+/* Cache writes to an array of `nstripes` stripes of `stripe_size` bytes (a
+ * multiple of 512) in at most `capacity` bytes. Destaging starts once more
+ * than `dirty_pct` percent of the capacity is dirty, or a line has been dirty
+ * for a few seconds. Returns NULL on failure. */
+struct wbcache *wbc_create(uint64_t stripe_size, uint64_t nstripes, size_t capacity,
+                           int dirty_pct, int nthreads, const struct wbc_ops *ops, void *ctx);
+
+/* Request path; safe to call from several threads at once, though the
+ * outcome of overlapping requests in flight together is undefined. Each
+ * returns 0 or -errno. A write with BUSE_WRITE_FUA is cached and also written
+ * through, a stripe at a time, before returning. */
+int wbc_read(struct wbcache *c, void *buf, uint32_t len, uint64_t offset);
+int wbc_write(struct wbcache *c, const void *buf, uint32_t len, uint64_t offset, uint32_t flags);
+
+/* Destage everything dirty and wait for it. Returns 0, or the first destage
+ * error since the previous flush. */
+int wbc_flush(struct wbcache *c);
+
+/* Print occupancy, hit rates and destage throughput to stderr. */
+void wbc_report(struct wbcache *c);
+
+/* Flush, stop the destage threads and free the cache. */
+void wbc_destroy(struct wbcache *c);
+
+#endif /* WBCACHE_H_INCLUDED */
@@ -0,0 +1,28 @@
+/*
+ * xor - vectorized XOR helpers for parity RAID
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#ifndef XOR_H_INCLUDED
+#define XOR_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* dst ^= src over `len` bytes. Buffers may have any alignment. */
+void xor_into(void *dst, const void *src, size_t len);
+
+/* dst = src[0] ^ src[1] ^ ... ^ src[n - 1] over `len` bytes, n >= 1, reading
+ * every source in the same pass so dst is written only once: rebuilding a
+ * chunk from the rest of its stripe. dst must not overlap a source. */
+void xor_gather(void *dst, const void *const *src, int n, size_t len);
+
+/* True if all `len` bytes of `buf` are zero: after XORing every member of a
+ * stripe together, whether its parity is consistent. */
+bool xor_is_zero(const void *buf, size_t len);
+
+#endif /* XOR_H_INCLUDED */